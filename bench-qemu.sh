@@ -0,0 +1,191 @@
+#!/bin/bash
+# Headless boot latency benchmark
+# Boots the loader in qemu N times (with and without KVM) with the fixture config in bench/ and a test kernel,
+# and reports the median and p95 of every boot phase
+# The loader prints "@@thatloader phase=<name> us=<time>" lines to the serial port (make bench-efi) with the time
+# on its own clock, which is lined up with the time the line with the "entry" phase was read here (since qemu was started)
+# The test kernel loads the initrd like the EFI stub of linux, prints the last line and powers the VM off
+# The initrd is either served from memory by the loader (LoadFile2) or read by the kernel from the initrd= files
+# ("kernelinitrd: yes"), -m picks the mode that is measured
+
+usage()
+{
+    echo "Usage: $0 [-n iterations] [-a kvm|tcg|both] [-m memory|kernel|both] [-k kernel size in MiB] [-i initrd size in MiB]" \
+        "[-w] [-o raw output]"
+    echo "  -m  the initrd is served from memory by the loader, or read from its file by the kernel"
+    echo "  -w  keep the image between iterations (config.bin and the log stay, like on real hardware)"
+    exit 1
+}
+
+ITERATIONS=10
+ACCELS=both
+INITRD_MODES=both
+KERNEL_MIB=8
+INITRD_MIB=32
+WARM=0
+RAW_OUTPUT=""
+RUN_TIMEOUT=120 # seconds, a boot that takes longer is counted as failed
+
+while getopts "n:a:m:k:i:wo:h" opt; do
+    case $opt in
+        n) ITERATIONS=$OPTARG ;;
+        a) ACCELS=$OPTARG ;;
+        m) INITRD_MODES=$OPTARG ;;
+        k) KERNEL_MIB=$OPTARG ;;
+        i) INITRD_MIB=$OPTARG ;;
+        w) WARM=1 ;;
+        o) RAW_OUTPUT=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+
+case $ACCELS in
+    both) ACCELS="kvm tcg" ;;
+    kvm|tcg) ;;
+    *) usage ;;
+esac
+
+case $INITRD_MODES in
+    both) INITRD_MODES="memory kernel" ;;
+    memory|kernel) ;;
+    *) usage ;;
+esac
+
+# The phases that are reported: "<name> <begin marker> <end marker>"
+# "qemu" is the launch of qemu, so "firmware" is the time until the loader was started
+PHASES=(
+    "firmware qemu entry"
+    "logger-init logger-init-begin logger-init-end"
+    "console-size console-size-begin console-size-end"
+    "init entry console-size-end"
+    "config-parse config-begin config-end"
+    "menu-ready entry menu-ready"
+    "image-read read-begin read-end"
+    "load-image load-begin load-end"
+    "initrd-read initrd-begin initrd-end"
+    "start-image entry start-begin"
+    "kernel-initrd payload-initrd-begin payload-initrd-end"
+    "total qemu payload-done"
+)
+
+WORK_DIR=bench-run
+IMAGE=$WORK_DIR/fat.img # the image of the initrd mode that is measured
+RUN_IMAGE=$WORK_DIR/run.img
+
+fail()
+{
+    echo "$1"
+    exit 1
+}
+
+# Build the loader with phase markers and the test kernel
+make bench-efi >/dev/null || fail "Failed to build the loader and the test kernel (make bench-efi)"
+
+# Create the FAT image, sized for the kernel and the initrd
+rm -rf $WORK_DIR
+mkdir $WORK_DIR
+
+# The test kernel is padded up to the kernel size, the padding is ignored by the PE loader
+cp bench/payload.efi $WORK_DIR/payload.efi
+truncate -s ${KERNEL_MIB}M $WORK_DIR/payload.efi
+head -c ${INITRD_MIB}M /dev/urandom > $WORK_DIR/initrd.img
+
+IMAGE_MIB=$((KERNEL_MIB + INITRD_MIB + 16))
+dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGE_MIB status=none
+mformat -i $IMAGE -T $((IMAGE_MIB * 2048)) -h 64 -s 32 :: || fail "Failed to format the image"
+mmd -i $IMAGE ::/EFI
+mmd -i $IMAGE ::/EFI/BOOT
+mmd -i $IMAGE ::/EFI/thatloader
+mcopy -i $IMAGE bench/thatloader_x64.efi ::/EFI/BOOT/bootx64.efi
+mcopy -i $IMAGE $WORK_DIR/payload.efi $WORK_DIR/initrd.img ::/EFI/thatloader
+mv $IMAGE $WORK_DIR/base.img
+
+# The config of an initrd mode, the kernel reads the initrd of the first entry itself in "kernel" mode
+ModeConfig()
+{
+    if [ "$1" = kernel ]; then
+        awk '{ print } /^initrd:/ && !done { print "kernelinitrd: yes"; done = 1 }' bench/config.cfg
+    else
+        cat bench/config.cfg
+    fi
+}
+
+[ -n "$RAW_OUTPUT" ] && : > "$RAW_OUTPUT"
+
+# Boot once and print "<marker> <milliseconds since qemu was started>" for every phase marker
+# (the first time each marker is seen, a file is read more than once)
+RunOnce()
+{
+    local accelArgs=$1
+    local start=${EPOCHREALTIME/./}
+    echo "qemu 0"
+    timeout $RUN_TIMEOUT qemu-system-x86_64 $accelArgs -bios ovmf/OVMF.fd -m 256M -net none \
+        -drive file=$RUN_IMAGE,format=raw,if=ide -display none -monitor none -serial stdio -no-reboot 2>/dev/null |
+    while IFS= read -r line; do
+        local now=${EPOCHREALTIME/./}
+        if [[ $line =~ @@thatloader\ phase=([a-z-]+)(\ us=([0-9]+))? ]]; then
+            echo "${BASH_REMATCH[1]} $(( (now - start) / 1000 )) ${BASH_REMATCH[3]}"
+        fi
+    done | awk '!seen[$1]++ {
+        if ($3 == "") { print $1, $2; next }
+        if (entryMs == "") entryMs = $2 - $3 / 1000
+        printf "%s %.3f\n", $1, entryMs + $3 / 1000
+    }'
+}
+
+# Print the median and the p95 (nearest rank) of the numbers on stdin
+Stats()
+{
+    sort -n | awk '{ v[NR] = $1 } END {
+        if (NR == 0) { printf "%10s %10s", "-", "-"; exit }
+        p95 = int((NR * 95 + 99) / 100)
+        median = (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2
+        printf "%10.1f %10.1f", median, v[p95]
+    }'
+}
+
+for mode in $INITRD_MODES; do
+    cp $WORK_DIR/base.img $IMAGE
+    ModeConfig $mode > $WORK_DIR/config.cfg
+    mcopy -i $IMAGE $WORK_DIR/config.cfg ::/EFI/thatloader
+
+    for accel in $ACCELS; do
+        if [ "$accel" = kvm ]; then
+            if [ ! -w /dev/kvm ]; then
+                echo "Skipping KVM, /dev/kvm is not accessible"
+                continue
+            fi
+            accelArgs="-enable-kvm -cpu host"
+        else
+            accelArgs="-accel tcg -cpu qemu64"
+        fi
+
+        results=$WORK_DIR/results-$mode-$accel
+        : > $results
+        failed=0
+        cp $IMAGE $RUN_IMAGE
+        for ((i = 1; i <= ITERATIONS; i++)); do
+            [ $WARM -eq 0 ] && cp $IMAGE $RUN_IMAGE
+            run=$(RunOnce "$accelArgs")
+            if ! grep -q '^payload-done ' <<< "$run"; then
+                failed=$((failed + 1))
+                echo "$accel ($mode) run $i: the test kernel wasn't started"
+                continue
+            fi
+            sed "s/^/$i /" <<< "$run" >> $results
+            [ -n "$RAW_OUTPUT" ] && sed "s/^/$mode $accel $i /" <<< "$run" >> "$RAW_OUTPUT"
+        done
+
+        echo
+        echo "$accel, initrd from $mode: $ITERATIONS iterations ($failed failed), kernel ${KERNEL_MIB} MiB, initrd ${INITRD_MIB} MiB"
+        printf "%-14s %10s %10s\n" "phase (ms)" "median" "p95"
+        for phase in "${PHASES[@]}"; do
+            read -r name begin end <<< "$phase"
+            printf "%-14s " "$name"
+            awk -v b=$begin -v e=$end '
+                { t[$1, $2] = $3; runs[$1] = 1 }
+                END { for (r in runs) if ((r, b) in t && (r, e) in t) print t[r, e] - t[r, b] }' $results | Stats
+            echo
+        done
+    done
+done
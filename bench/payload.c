@@ -0,0 +1,115 @@
+// Test kernel for bench-qemu.sh
+// It tells the harness that it was started, loads the initrd the way the EFI stub of linux does
+// and powers the VM off, which ends the run
+#include <uefi.h>
+
+#define MARKER_PREFIX ("@@thatloader")
+
+#define LINUX_EFI_INITRD_MEDIA_GUID { 0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} }
+#define EFI_LOAD_FILE2_PROTOCOL_GUID { 0x4006c0c1, 0xfcb3, 0x403e, {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d} }
+#define INITRD_ARG_PREFIX ("initrd=")
+
+typedef efi_status_t (EFIAPI *efi_load_file2_t)(void* this, efi_device_path_t* filePath, boolean_t bootPolicy,
+    uintn_t* bufferSize, void* buffer);
+
+static FILE* serial = NULL;
+
+static void PrintMarker(const char_t* phase)
+{
+    if(serial != NULL)
+    {
+        fprintf(serial, "\r\n%s phase=%s\r\n", MARKER_PREFIX, phase);
+    }
+}
+
+/*
+* Load the initrd through LoadFile2 on the initrd media device path (the stub of Linux 5.8 and later)
+* returns the size of the initrd, 0 if no one serves it
+*/
+static uint64_t LoadInitrdFromMemory(void)
+{
+    uint8_t devPath[sizeof(efi_device_path_t) + sizeof(efi_guid_t) + END_DEVICE_PATH_LENGTH];
+    efi_device_path_t* vendorNode = (efi_device_path_t*)devPath;
+    vendorNode->Type = 0x04; // media
+    vendorNode->SubType = 0x03; // vendor
+    SetDevicePathNodeLength(vendorNode, sizeof(efi_device_path_t) + sizeof(efi_guid_t));
+    efi_guid_t initrdMediaGuid = LINUX_EFI_INITRD_MEDIA_GUID;
+    memcpy(vendorNode + 1, &initrdMediaGuid, sizeof(efi_guid_t));
+    efi_device_path_t* endNode = NextDevicePathNode(vendorNode);
+    SetDevicePathEndNode(endNode);
+
+    efi_guid_t loadFile2Guid = EFI_LOAD_FILE2_PROTOCOL_GUID;
+    efi_device_path_t* remainingPath = vendorNode;
+    efi_handle_t handle = NULL;
+    efi_load_file2_t* loadFile2 = NULL;
+    if(EFI_ERROR(BS->LocateDevicePath(&loadFile2Guid, &remainingPath, &handle)) || !IsDevicePathEnd(remainingPath) ||
+        EFI_ERROR(BS->HandleProtocol(handle, &loadFile2Guid, (void**)&loadFile2)))
+    {
+        return 0;
+    }
+    uintn_t size = 0;
+    if((*loadFile2)(loadFile2, remainingPath, 0, &size, NULL) != EFI_BUFFER_TOO_SMALL)
+    {
+        return 0;
+    }
+    void* initrd = malloc(size);
+    if(initrd == NULL || EFI_ERROR((*loadFile2)(loadFile2, remainingPath, 0, &size, initrd)))
+    {
+        size = 0;
+    }
+    free(initrd);
+    return size;
+}
+
+// Read the initrd= files from our own volume (what the stub does without LoadFile2), returns their size
+static uint64_t LoadInitrdFiles(int argc, char** argv)
+{
+    uint64_t totalSize = 0;
+    size_t prefixLen = strlen(INITRD_ARG_PREFIX);
+    for(int i = 0; i < argc; i++)
+    {
+        if(strncmp(argv[i], INITRD_ARG_PREFIX, prefixLen) != 0)
+        {
+            continue;
+        }
+        FILE* file = fopen(argv[i] + prefixLen, "r");
+        if(file == NULL)
+        {
+            continue;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        void* initrd = malloc(size);
+        if(initrd != NULL)
+        {
+            totalSize += fread(initrd, 1, size, file);
+            free(initrd);
+        }
+        fclose(file);
+    }
+    return totalSize;
+}
+
+int main(int argc, char **argv)
+{
+    serial = fopen("/dev/serial", "w");
+    PrintMarker("payload");
+
+    PrintMarker("payload-initrd-begin");
+    uint64_t initrdSize = LoadInitrdFromMemory();
+    boolean_t fromMemory = (initrdSize != 0);
+    if(!fromMemory)
+    {
+        initrdSize = LoadInitrdFiles(argc, argv);
+    }
+    PrintMarker("payload-initrd-end");
+    if(serial != NULL)
+    {
+        fprintf(serial, "\r\ninitrd: %d bytes from %s\r\n", initrdSize, fromMemory ? "memory" : "files");
+    }
+    PrintMarker("payload-done");
+
+    RT->ResetSystem(EfiResetShutdown, EFI_SUCCESS, 0, NULL);
+    return 0;
+}
@@ -0,0 +1,798 @@
+// Native benchmark of the config parser, the path/string utilities, the image decompression, the file views,
+// the block cache, the image cache, the SHA-256 of image verification and the console output of the menu
+// usage: thatloader_bench [esp directory] [max config entries]
+// The esp directory is created if needed, the config (and its cache) are generated in it
+#include <uefi.h>
+#include "hostio.h"
+#include "configfile.h"
+#include "shellutils.h"
+#include "shell.h"
+#include "bootutils.h"
+#include "logs.h"
+#include "clock.h"
+#include "decompress.h"
+#include "blockcache.h"
+#include "sha256.h"
+#include "fileview.h"
+#include "imagecache.h"
+#include "console.h"
+#include "display.h"
+
+#define BENCH_DEFAULT_ESP ("bench-esp")
+#define BENCH_DEFAULT_MAX_ENTRIES (100000)
+
+// Every measurement goes through about this many items (config entries, path components...)
+#define BENCH_ITEMS_PER_RUN (200000)
+
+#define BENCH_CONFIG_PATH ("\\EFI\\thatloader\\config.cfg")
+#define BENCH_CACHE_PATH ("\\EFI\\thatloader\\config.bin")
+
+#define BENCH_PATH_COMPONENT_LEN (8) // "\dir123" and some room
+
+#define BENCH_IMAGE_PATH ("\\EFI\\bench\\image")
+#define BENCH_IMAGE_SIZE (16 * 1024 * 1024)
+#define BENCH_IMAGE_READS (4)
+#define BENCH_COMMAND_LEN (1024)
+
+#define BENCH_DISK_SIZE (64 * 1024 * 1024)
+#define BENCH_DISK_SECTOR_SIZE (512)
+#define BENCH_DISK_READS (100000)
+
+#define BENCH_VIEW_READS (100000)
+
+#define BENCH_CACHE_BOOTS (1000)
+
+#define BENCH_SHA256_SIZE (64 * 1024 * 1024)
+
+#define BENCH_MENU_ENTRIES (24)
+#define BENCH_MENU_REDRAWS (1000)
+#define BENCH_MENU_COLUMNS (100)
+
+static const int32_t configSizes[] = { 10, 100, 1000, 10000, 100000 };
+static const int32_t pathDepths[] = { 8, 64, 512, 4096 };
+
+// The compressors the kernel build uses, with the file suffix and the command that makes it (%s: image path)
+typedef struct bench_compressor_s{
+    const char_t* name;
+    const char_t* tool;
+    const char_t* suffix;
+    const char_t* command;
+} bench_compressor_s;
+
+// Access patterns of the ext4 driver on a disk, the reads are spread over a region of it
+typedef struct bench_disk_pattern_s{
+    const char_t* name;
+    uint32_t readSize;
+    uint32_t region;
+    boolean_t sequential;
+} bench_disk_pattern_s;
+
+static const bench_disk_pattern_s diskPatterns[] = {
+    { "directory blocks", 1024, 16 * 1024 * 1024, TRUE },
+    { "inode table", 256, 512 * 1024, FALSE },
+    { "scattered blocks", 4096, BENCH_DISK_SIZE, FALSE },
+};
+static uint8_t* diskData = NULL; // the memory disk
+static uint64_t diskReads = 0; // ReadBlocks calls
+static uint64_t consoleCalls = 0; // the calls the menu redraws made to the console
+
+static const bench_compressor_s compressors[] = {
+    { "gzip -1", "gzip", ".gz1", "gzip -1 -n -c '%s' > '%s.gz1'" },
+    { "gzip -9", "gzip", ".gz9", "gzip -9 -n -c '%s' > '%s.gz9'" },
+    { "zstd -3", "zstd", ".zst3", "zstd -q -f -3 '%s' -o '%s.zst3'" },
+    { "zstd -19", "zstd", ".zst19", "zstd -q -f -19 '%s' -o '%s.zst19'" },
+    { "lz4 -1", "lz4", ".lz41", "lz4 -q -f -1 '%s' '%s.lz41'" },
+    { "lz4 -l -9 (legacy)", "lz4", ".lz4l", "lz4 -q -f -l -9 '%s' '%s.lz4l'" },
+};
+
+static boolean_t WriteConfig(int32_t numOfEntries);
+static void BenchParseConfig(int32_t numOfEntries);
+static void BenchNormalizePath(int32_t depth);
+static void BenchStringUtils(void);
+static void BenchParseArgs(void);
+static void BenchDecompress(const char_t* espDir);
+static boolean_t WriteImage(void);
+static void BenchFileView(void);
+static void BenchBlockCache(void);
+static void BenchImageCache(void);
+static void BenchSha256(void);
+static void BenchConsole(void);
+static void DrawMenuWithPrintf(int32_t selected);
+static void DrawMenuWithFrame(int32_t selected);
+static void UefiPrintf(const char_t* format, ...);
+static efi_status_t EFIAPI CountOutputString(void* this, wchar_t* string);
+static efi_status_t EFIAPI CountSetAttribute(void* this, uintn_t attribute);
+static efi_status_t EFIAPI CountSetCursor(void* this, uintn_t column, uintn_t row);
+static efi_status_t EFIAPI ReadMemoryDisk(void* this, uint32_t mediaId, efi_lba_t lba, uintn_t size, void* buffer);
+static uint64_t TimeImageRead(const char_t* path, const char_t* image, uint64_t* size);
+static void PrintResult(const char_t* name, int32_t size, uint64_t totalNs, int32_t ops, int32_t itemsPerOp);
+static inline int32_t OpsFor(int32_t itemsPerOp);
+
+int main(int argc, char** argv)
+{
+    const char_t* espDir = (argc > 1) ? argv[1] : BENCH_DEFAULT_ESP;
+    int32_t maxEntries = (argc > 2) ? atoi(argv[2]) : BENCH_DEFAULT_MAX_ENTRIES;
+
+    HostOsMkdir(espDir);
+    HostSetRoot(espDir);
+    HostInitFirmware(FALSE);
+    InitClock();
+    mkdir("\\EFI", 0);
+    mkdir("\\EFI\\thatloader", 0);
+    InitLogger();
+
+    printf("%-24s %8s %8s %14s %12s\n", "benchmark", "size", "ops", "ns/op", "ns/item");
+    for (size_t i = 0; i < sizeof(configSizes) / sizeof(configSizes[0]); i++)
+    {
+        if (configSizes[i] > maxEntries)
+        {
+            break;
+        }
+        BenchParseConfig(configSizes[i]);
+    }
+    for (size_t i = 0; i < sizeof(pathDepths) / sizeof(pathDepths[0]); i++)
+    {
+        BenchNormalizePath(pathDepths[i]);
+    }
+    BenchStringUtils();
+    BenchParseArgs();
+    BenchDecompress(espDir);
+    BenchFileView();
+    BenchBlockCache();
+    BenchImageCache();
+    BenchSha256();
+    BenchConsole();
+    FlushLog();
+    return 0;
+}
+
+/*
+* Time a full parse (the cache is deleted before each one, so it is written again every time),
+* a parse that hits the cache, and a reload that finds the config unchanged
+*/
+static void BenchParseConfig(int32_t numOfEntries)
+{
+    if (!WriteConfig(numOfEntries))
+    {
+        printf("Failed to write a config with %d entries\n", numOfEntries);
+        return;
+    }
+
+    int32_t ops = OpsFor(numOfEntries);
+    uint64_t parseNs = 0;
+    uint64_t cachedNs = 0;
+    uint64_t reloadNs = 0;
+    for (int32_t i = 0; i < ops; i++)
+    {
+        remove(BENCH_CACHE_PATH);
+        uint64_t start = HostOsNowNs();
+        boot_entry_array_s entryArr = ParseConfig();
+        parseNs += HostOsNowNs() - start;
+        if (entryArr.numOfEntries != numOfEntries)
+        {
+            printf("Parsed %d entries out of %d\n", entryArr.numOfEntries, numOfEntries);
+        }
+        FreeConfigEntries(&entryArr);
+
+        start = HostOsNowNs();
+        entryArr = ParseConfig();
+        cachedNs += HostOsNowNs() - start;
+
+        start = HostOsNowNs();
+        ReloadConfig(&entryArr, TRUE);
+        reloadNs += HostOsNowNs() - start;
+        FreeConfigEntries(&entryArr);
+    }
+    PrintResult("ParseConfig", numOfEntries, parseNs, ops, numOfEntries);
+    PrintResult("ParseConfig (cached)", numOfEntries, cachedNs, ops, numOfEntries);
+    PrintResult("ReloadConfig (same)", numOfEntries, reloadNs, ops, numOfEntries);
+}
+
+// Entries that use most of the keys, so every part of the parser is hit
+static boolean_t WriteConfig(int32_t numOfEntries)
+{
+    FILE* configFile = fopen(BENCH_CONFIG_PATH, "w");
+    if (configFile == NULL)
+    {
+        return FALSE;
+    }
+    fprintf(configFile, "# generated by thatloader_bench\ntimeout: 5\n");
+    for (int32_t i = 0; i < numOfEntries; i++)
+    {
+        fprintf(configFile, "\nname: Linux %d\n"
+            "path: \\EFI\\linux\\vmlinuz-6.%d\n"
+            "args: root=/dev/nvme0n1p%d rw quiet loglevel=3\n"
+            "initrd: \\EFI\\linux\\initramfs-6.%d.img\n", i, i, i % 8, i);
+    }
+    fclose(configFile);
+    return TRUE;
+}
+
+// A path that goes depth directories deep, with "." and ".." in between
+static void BenchNormalizePath(int32_t depth)
+{
+    size_t pathSize = depth * BENCH_PATH_COMPONENT_LEN * 2 + 1;
+    char_t* deepPath = malloc(pathSize);
+    char_t* path = malloc(pathSize);
+    if (deepPath == NULL || path == NULL)
+    {
+        free(deepPath);
+        free(path);
+        return;
+    }
+    size_t len = 0;
+    for (int32_t i = 0; i < depth; i++)
+    {
+        const char_t* extra = (i % 3 == 0) ? "\\." : ((i % 3 == 1) ? "\\x\\.." : "");
+        len += snprintf(deepPath + len, pathSize - len, "\\d%d%s", i, extra);
+    }
+
+    int32_t ops = OpsFor(depth);
+    uint64_t totalNs = 0;
+    for (int32_t i = 0; i < ops; i++)
+    {
+        memcpy(path, deepPath, len + 1);
+        uint64_t start = HostOsNowNs();
+        NormalizePath(&path);
+        totalNs += HostOsNowNs() - start;
+    }
+    PrintResult("NormalizePath", depth, totalNs, ops, depth);
+    free(deepPath);
+    free(path);
+}
+
+static void BenchStringUtils(void)
+{
+    const char_t* args = "root=/dev/sda1 initrd=\\boot\\initrd-%v.img module=%v rw quiet";
+    const char_t* spaces = "        name: some entry name with spaces        ";
+    char_t buffer[128];
+
+    int32_t ops = OpsFor(1);
+    uint64_t concatNs = 0;
+    uint64_t replaceNs = 0;
+    uint64_t trimNs = 0;
+    for (int32_t i = 0; i < ops; i++)
+    {
+        uint64_t start = HostOsNowNs();
+        char_t* fullPath = ConcatPaths("\\EFI\\linux\\kernels", "vmlinuz-6.10.1-arch1");
+        concatNs += HostOsNowNs() - start;
+        free(fullPath);
+
+        start = HostOsNowNs();
+        char_t* replaced = StringReplace(args, "%v", "6.10.1-arch1");
+        replaceNs += HostOsNowNs() - start;
+        free(replaced);
+
+        strncpy(buffer, spaces, sizeof(buffer) - 1);
+        start = HostOsNowNs();
+        TrimSpaces(buffer);
+        trimNs += HostOsNowNs() - start;
+    }
+    PrintResult("ConcatPaths", 1, concatNs, ops, 1);
+    PrintResult("StringReplace", 1, replaceNs, ops, 1);
+    PrintResult("TrimSpaces", 1, trimNs, ops, 1);
+}
+
+// A command line as long as the shell takes
+static void BenchParseArgs(void)
+{
+    const char_t* input = "-r \"\\EFI\\some dir\\with spaces\" \\EFI\\dest -f a b c d e f g h \"quoted arg\" last";
+    char_t buffer[128];
+    int32_t numOfArgs = 0;
+
+    int32_t ops = OpsFor(1);
+    uint64_t totalNs = 0;
+    for (int32_t i = 0; i < ops; i++)
+    {
+        strncpy(buffer, input, sizeof(buffer) - 1);
+        cmd_args_s* args = NULL;
+        uint64_t start = HostOsNowNs();
+        ParseArgs(buffer, &args);
+        totalNs += HostOsNowNs() - start;
+
+        numOfArgs = 0;
+        for (cmd_args_s* arg = args; arg != NULL; arg = arg->next)
+        {
+            numOfArgs++;
+        }
+        FreeArgs(args);
+    }
+    PrintResult("ParseArgs", numOfArgs, totalNs, ops, numOfArgs);
+}
+
+/*
+* Read a 16 MiB image as it is and compressed by each of the compressors that are installed
+* The time the decoder adds (the compressed read minus reading that many raw bytes) gives the break-even
+* speed of the media: on a disk slower than that, reading less and decompressing it is faster
+*/
+static void BenchDecompress(const char_t* espDir)
+{
+    mkdir("\\EFI\\bench", 0);
+    if (!WriteImage())
+    {
+        printf("Failed to write the %d bytes test image\n", BENCH_IMAGE_SIZE);
+        return;
+    }
+    char_t* image = GetFileContent(BENCH_IMAGE_PATH, NULL);
+    uint64_t rawSize = 0;
+    uint64_t rawNs = TimeImageRead(BENCH_IMAGE_PATH, image, &rawSize);
+
+    printf("\n%-24s %8s %8s %10s %10s %12s\n", "read image", "KiB", "size %", "ms", "decode MB/s", "break-even");
+    printf("%-24s %8d %8d %10llu %10s %12s\n", "raw", BENCH_IMAGE_SIZE / 1024, 100, rawNs / 1000000, "-", "-");
+
+    char_t hostImage[BENCH_COMMAND_LEN];
+    char_t command[BENCH_COMMAND_LEN];
+    snprintf(hostImage, sizeof(hostImage), "%s/EFI/bench/image", espDir);
+    for (size_t i = 0; i < sizeof(compressors) / sizeof(compressors[0]); i++)
+    {
+        const bench_compressor_s* compressor = &compressors[i];
+        snprintf(command, sizeof(command), "command -v %s > /dev/null 2>&1", compressor->tool);
+        if (HostOsRun(command) != 0)
+        {
+            printf("%-24s (%s isn't installed)\n", compressor->name, compressor->tool);
+            continue;
+        }
+        snprintf(command, sizeof(command), compressor->command, hostImage, hostImage);
+        char_t path[BENCH_COMMAND_LEN];
+        snprintf(path, sizeof(path), "%s%s", BENCH_IMAGE_PATH, compressor->suffix);
+        if (HostOsRun(command) != 0)
+        {
+            printf("%-24s (failed to compress the image)\n", compressor->name);
+            continue;
+        }
+
+        uint64_t compressedSize = 0;
+        FILE* file = fopen(path, "r");
+        if (file != NULL)
+        {
+            compressedSize = GetFileSize(file);
+            fclose(file);
+        }
+        uint64_t size = 0;
+        uint64_t ns = TimeImageRead(path, image, &size);
+        if (size != rawSize || ns == 0)
+        {
+            printf("%-24s (the image didn't decompress)\n", compressor->name);
+            continue;
+        }
+        // the decoder's share of the read, and the media speed that saving (raw - compressed) bytes pays it off
+        uint64_t readNs = rawNs * compressedSize / rawSize;
+        uint64_t decodeNs = (ns > readNs) ? ns - readNs : 1;
+        uint64_t decodeMBs = rawSize * 1000 / decodeNs;
+        uint64_t breakEvenMBs = (rawSize - compressedSize) * 1000 / decodeNs;
+        printf("%-24s %8llu %8llu %10llu %10llu %9llu MB/s\n", compressor->name, compressedSize / 1024,
+            compressedSize * 100 / rawSize, ns / 1000000, decodeMBs, breakEvenMBs);
+    }
+    FreeFileBuffer(image);
+}
+
+// Text-like data (a few thousand words, with random numbers in between), gzip gets it to about half
+static boolean_t WriteImage(void)
+{
+    FILE* imageFile = fopen(BENCH_IMAGE_PATH, "w");
+    if (imageFile == NULL)
+    {
+        return FALSE;
+    }
+    char_t* image = malloc(BENCH_IMAGE_SIZE);
+    if (image == NULL)
+    {
+        fclose(imageFile);
+        return FALSE;
+    }
+    uint32_t seed = 12345;
+    size_t len = 0;
+    while (len < BENCH_IMAGE_SIZE)
+    {
+        seed = seed * 1103515245 + 12345;
+        uint32_t word = (seed >> 8) % 4096;
+        char_t part[32];
+        int32_t partLen = (seed >> 30 == 0) ? snprintf(part, sizeof(part), "%x ", seed)
+            : snprintf(part, sizeof(part), "w%d%c", word, (word % 7 == 0) ? '\n' : ' ');
+        for (int32_t i = 0; i < partLen && len < BENCH_IMAGE_SIZE; i++)
+        {
+            image[len++] = part[i];
+        }
+    }
+    boolean_t written = fwrite(image, 1, BENCH_IMAGE_SIZE, imageFile) == BENCH_IMAGE_SIZE;
+    free(image);
+    fclose(imageFile);
+    return written;
+}
+
+/*
+* Read the test image through a file view, front to back like cat and at random offsets,
+* the view never holds more than its windows of the file (GetFileContent would hold all of it)
+*/
+static void BenchFileView(void)
+{
+    static const uint32_t readSizes[] = { 4096, 256 };
+    char_t buffer[4096];
+    printf("\n%-24s %8s %8s %12s %10s %10s\n", "file view", "bytes", "reads", "window reads", "ns/read", "peak KiB");
+    uint32_t seed = 12345;
+    for (int32_t random = 0; random < 2; random++)
+    {
+        file_view_s view;
+        if (!OpenFileView(&view, BENCH_IMAGE_PATH))
+        {
+            printf("Failed to open the test image\n");
+            return;
+        }
+        uint32_t readSize = readSizes[random];
+        int32_t reads = random ? BENCH_VIEW_READS : (int32_t)(view.fileSize / readSize);
+        uint64_t start = HostOsNowNs();
+        for (int32_t read = 0; read < reads; read++)
+        {
+            uint64_t offset = (uint64_t)read * readSize;
+            if (random)
+            {
+                seed = seed * 1103515245 + 12345;
+                offset = (uint64_t)(seed >> 4) % (view.fileSize - readSize);
+            }
+            ReadFileView(&view, offset, buffer, readSize);
+        }
+        uint64_t ns = HostOsNowNs() - start;
+        int32_t windows = 0;
+        for (int32_t i = 0; i < FILE_VIEW_MAX_WINDOWS; i++)
+        {
+            windows += (view.windows[i].data != NULL);
+        }
+        printf("%-24s %8u %8d %12llu %10llu %10d\n", random ? "random" : "sequential (cat)", readSize, reads,
+            view.windowReads, ns / reads, windows * FILE_VIEW_WINDOW_SIZE / 1024);
+        CloseFileView(&view);
+    }
+}
+
+/*
+* Read a memory disk through the block cache with the access patterns of the ext4 driver, each one starts cold
+* (the media id changes), the disk reads are what the firmware would have to do, compared to one per read without it
+*/
+static void BenchBlockCache(void)
+{
+    diskData = malloc(BENCH_DISK_SIZE);
+    uint8_t* buffer = malloc(BLOCK_CACHE_BLOCK_SIZE);
+    if (diskData == NULL || buffer == NULL)
+    {
+        free(diskData);
+        free(buffer);
+        return;
+    }
+    uint32_t seed = 12345;
+    for (uint32_t i = 0; i < BENCH_DISK_SIZE; i += 4)
+    {
+        seed = seed * 1103515245 + 12345;
+        memcpy(diskData + i, &seed, 4);
+    }
+    efi_block_io_media_t media = { 0 };
+    media.MediaPresent = TRUE;
+    media.BlockSize = BENCH_DISK_SECTOR_SIZE;
+    media.LastBlock = BENCH_DISK_SIZE / BENCH_DISK_SECTOR_SIZE - 1;
+    efi_block_io_t blockIo = { 0 };
+    blockIo.Media = &media;
+    blockIo.ReadBlocks = ReadMemoryDisk;
+
+    printf("\n%-24s %8s %8s %10s %10s %10s\n", "block cache", "bytes", "reads", "disk reads", "hit %", "ns/read");
+    for (size_t i = 0; i < sizeof(diskPatterns) / sizeof(diskPatterns[0]); i++)
+    {
+        const bench_disk_pattern_s* pattern = &diskPatterns[i];
+        media.MediaId++;
+        diskReads = 0;
+        block_cache_stats_s before;
+        GetBlockCacheStats(&before);
+        boolean_t same = TRUE;
+        uint64_t totalNs = 0;
+        for (int32_t read = 0; read < BENCH_DISK_READS; read++)
+        {
+            uint64_t offset = 0;
+            if (pattern->sequential)
+            {
+                offset = (uint64_t)read * pattern->readSize % pattern->region;
+            }
+            else
+            {
+                seed = seed * 1103515245 + 12345;
+                offset = (uint64_t)(seed >> 4) % (pattern->region / pattern->readSize) * pattern->readSize;
+            }
+            uint64_t start = HostOsNowNs();
+            efi_status_t status = ReadCachedBlocks(&blockIo, offset, pattern->readSize, buffer);
+            totalNs += HostOsNowNs() - start;
+            same = same && !EFI_ERROR(status) && memcmp(buffer, diskData + offset, pattern->readSize) == 0;
+        }
+        block_cache_stats_s after;
+        GetBlockCacheStats(&after);
+        if (!same)
+        {
+            printf("%-24s (the cache returned wrong data)\n", pattern->name);
+            continue;
+        }
+        uint64_t hits = after.hits - before.hits;
+        uint64_t lookups = hits + after.misses - before.misses;
+        printf("%-24s %8u %8d %10llu %10llu %10llu\n", pattern->name, pattern->readSize, BENCH_DISK_READS, diskReads,
+            hits * 100 / lookups, totalNs / BENCH_DISK_READS);
+    }
+    free(diskData);
+    free(buffer);
+    diskData = NULL;
+}
+
+/*
+* Boot the test image again after a first boot read it (an entry with the same kernel and other args), the image
+* is looked up by its size and modification time on the volume instead of being read, compared to reading it again
+*/
+static void BenchImageCache(void)
+{
+    // the host firmware has no file system protocol for OpenVolumeFile, the file is opened like FindCachedImage does
+    FILE* file = fopen(BENCH_IMAGE_PATH, "r");
+    efi_file_info_t info;
+    if (file == NULL || EFI_ERROR(GetFileInfo(file, &info)))
+    {
+        printf("Failed to open the test image\n");
+        return;
+    }
+    image_key_s key;
+    SetImageKey(&key, LIP->DeviceHandle, BENCH_IMAGE_PATH, &info, NULL);
+    uint64_t size = 0;
+    uint64_t start = HostOsNowNs();
+    char_t* image = ReadImageFile(file, LIP->DeviceHandle, info.FileSize, &size, BENCH_IMAGE_PATH, NULL);
+    uint64_t readNs = HostOsNowNs() - start;
+    fclose(file);
+    CacheImage(&key, image, size);
+    ReleaseImage(image);
+
+    image_cache_stats_s before;
+    GetImageCacheStats(&before);
+    boolean_t same = image != NULL;
+    start = HostOsNowNs();
+    for (int32_t boot = 0; boot < BENCH_CACHE_BOOTS && same; boot++)
+    {
+        file = fopen(BENCH_IMAGE_PATH, "r");
+        same = file != NULL && !EFI_ERROR(GetFileInfo(file, &info));
+        if (file != NULL)
+        {
+            fclose(file);
+        }
+        SetImageKey(&key, LIP->DeviceHandle, BENCH_IMAGE_PATH, &info, NULL);
+        uint64_t cachedSize = 0;
+        char_t* cached = AcquireCachedImage(&key, &cachedSize);
+        same = same && cached == image && cachedSize == size;
+        ReleaseImage(cached);
+    }
+    uint64_t hitNs = (HostOsNowNs() - start) / BENCH_CACHE_BOOTS;
+    image_cache_stats_s after;
+    GetImageCacheStats(&after);
+    TrimImageCache();
+    if (!same)
+    {
+        printf("\n%-24s (the cache didn't give back the image)\n", "image cache");
+        return;
+    }
+    printf("\n%-24s %8s %8s %10s %10s %12s\n", "image cache", "KiB", "boots", "hits", "ns/boot", "read ns");
+    printf("%-24s %8llu %8d %10llu %10llu %12llu\n", "second boot", size / 1024, BENCH_CACHE_BOOTS,
+        after.hits - before.hits, hitNs, readNs);
+}
+
+// Hash a buffer in one piece and in the chunk sizes of the image reads, with the implementation the CPU selects
+static void BenchSha256(void)
+{
+    static const uint32_t pieceSizes[] = { BENCH_SHA256_SIZE, 64 * 1024, 4096 };
+    uint8_t* data = malloc(BENCH_SHA256_SIZE);
+    if (data == NULL)
+    {
+        return;
+    }
+    uint32_t seed = 12345;
+    for (uint32_t i = 0; i < BENCH_SHA256_SIZE; i += 4)
+    {
+        seed = seed * 1103515245 + 12345;
+        memcpy(data + i, &seed, 4);
+    }
+    printf("\n%-24s %8s %8s %10s %10s\n", "sha256", "piece", "MiB", "ms", "MB/s");
+    for (size_t i = 0; i < sizeof(pieceSizes) / sizeof(pieceSizes[0]); i++)
+    {
+        sha256_s sha;
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        uint64_t start = HostOsNowNs();
+        Sha256Init(&sha);
+        for (uint64_t offset = 0; offset < BENCH_SHA256_SIZE; offset += pieceSizes[i])
+        {
+            Sha256Update(&sha, data + offset, pieceSizes[i]);
+        }
+        Sha256Final(&sha, digest);
+        uint64_t ns = HostOsNowNs() - start;
+        printf("%-24s %8u %8d %10llu %10llu\n", GetSha256Implementation(), pieceSizes[i],
+            BENCH_SHA256_SIZE / (1024 * 1024), ns / 1000000, (uint64_t)BENCH_SHA256_SIZE * 1000 / (ns + 1));
+    }
+    free(data);
+}
+
+/*
+* Redraw a menu of BENCH_MENU_ENTRIES entries the way it was drawn with printf (a call for every string and padding,
+* and two attribute changes around the highlighted entry) and in a console frame, the calls go to counting stubs
+* (on a serial console each of them is what takes the time)
+*/
+static void BenchConsole(void)
+{
+    simple_text_output_interface_t conOut = *ST->ConOut;
+    uintn_t cols = screenCols;
+    boolean_t modeSet = screenModeSet;
+    ST->ConOut->OutputString = CountOutputString;
+    ST->ConOut->SetAttribute = CountSetAttribute;
+    ST->ConOut->SetCursorPosition = CountSetCursor;
+    screenCols = BENCH_MENU_COLUMNS;
+    screenModeSet = TRUE;
+
+    uint64_t calls[2] = { 0 };
+    uint64_t ns[2] = { 0 };
+    for (int32_t framed = 0; framed < 2; framed++)
+    {
+        consoleCalls = 0;
+        uint64_t start = HostOsNowNs();
+        for (int32_t redraw = 0; redraw < BENCH_MENU_REDRAWS; redraw++)
+        {
+            if (framed)
+            {
+                DrawMenuWithFrame(redraw % BENCH_MENU_ENTRIES);
+            }
+            else
+            {
+                DrawMenuWithPrintf(redraw % BENCH_MENU_ENTRIES);
+            }
+        }
+        ns[framed] = (HostOsNowNs() - start) / BENCH_MENU_REDRAWS;
+        calls[framed] = consoleCalls / BENCH_MENU_REDRAWS;
+    }
+    *ST->ConOut = conOut;
+    screenCols = cols;
+    screenModeSet = modeSet;
+
+    printf("\n%-24s %8s %8s %10s %10s\n", "menu redraw", "entries", "redraws", "calls", "ns/redraw");
+    for (int32_t framed = 0; framed < 2; framed++)
+    {
+        printf("%-24s %8d %8d %10llu %10llu\n", framed ? "console frame" : "printf", BENCH_MENU_ENTRIES,
+            BENCH_MENU_REDRAWS, calls[framed], ns[framed]);
+    }
+}
+
+// The menu as PrintBootMenu drew it with printf, the rows padded with a string of spaces from malloc
+// (UefiPrintf is the printf of the firmware build, the one of the host doesn't go to the console)
+static void DrawMenuWithPrintf(int32_t selected)
+{
+    char_t line[BENCH_MENU_COLUMNS + 1];
+    ST->ConOut->SetCursorPosition(ST->ConOut, 0, 0);
+    ST->ConOut->SetCursorPosition(ST->ConOut, BENCH_MENU_COLUMNS / 2, 0);
+    ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_WHITE, EFI_BLACK));
+    UefiPrintf("That-Loader - 1.2\n");
+    for (int32_t i = -1; i <= BENCH_MENU_ENTRIES; i++)
+    {
+        int32_t length = 0;
+        if (i == selected)
+        {
+            ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_BLACK, EFI_LIGHTGRAY));
+            length = snprintf(line, sizeof(line), "* %d) Linux %d (recovery mode)", i + 1, i);
+            UefiPrintf("%s", line);
+            ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
+        }
+        else if (i >= 0 && i < BENCH_MENU_ENTRIES)
+        {
+            length = snprintf(line, sizeof(line), " %d) Linux %d (recovery mode)", i + 1, i);
+            UefiPrintf("%s", line);
+        }
+        char_t* pad = malloc(BENCH_MENU_COLUMNS - length + 1);
+        memset(pad, ' ', BENCH_MENU_COLUMNS - length);
+        pad[BENCH_MENU_COLUMNS - length] = CHAR_NULL;
+        UefiPrintf("%s", pad);
+        free(pad);
+    }
+    UefiPrintf("\nUse the arrow keys to select which entry is highlighted.\n");
+    ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_DARKGRAY, EFI_BLACK));
+    UefiPrintf("\nThe highlighted entry will boot automatically in %d seconds.", 10);
+    ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
+    UefiPrintf("%s", "                                      ");
+}
+
+// The same menu in a console frame
+static void DrawMenuWithFrame(int32_t selected)
+{
+    BeginConsoleFrame();
+    ConsoleSetCursor(BENCH_MENU_COLUMNS / 2, 0);
+    ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_WHITE, EFI_BLACK));
+    ConsolePrintf("That-Loader - 1.2\n");
+    for (int32_t i = -1; i <= BENCH_MENU_ENTRIES; i++)
+    {
+        if (i == selected)
+        {
+            ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_BLACK, EFI_LIGHTGRAY));
+            ConsolePrintf("* %d) Linux %d (recovery mode)", i + 1, i);
+            ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
+        }
+        else if (i >= 0 && i < BENCH_MENU_ENTRIES)
+        {
+            ConsolePrintf(" %d) Linux %d (recovery mode)", i + 1, i);
+        }
+        ConsolePadRow();
+    }
+    ConsolePrintf("\nUse the arrow keys to select which entry is highlighted.\n");
+    ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_DARKGRAY, EFI_BLACK));
+    ConsolePrintf("\nThe highlighted entry will boot automatically in %d seconds.", 10);
+    ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
+    ConsolePadRow();
+    EndConsoleFrame();
+}
+
+// Like printf of libuefi: format into a buffer on the stack, convert it and output it
+static void UefiPrintf(const char_t* format, ...)
+{
+    char_t text[BUFSIZ];
+    wchar_t wideText[BUFSIZ];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, BUFSIZ, format, args);
+    va_end(args);
+    mbstowcs(wideText, text, BUFSIZ - 1);
+    ST->ConOut->OutputString(ST->ConOut, wideText);
+}
+
+static efi_status_t EFIAPI CountOutputString(void* this, wchar_t* string)
+{
+    consoleCalls++;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI CountSetAttribute(void* this, uintn_t attribute)
+{
+    consoleCalls++;
+    ST->ConOut->Mode->Attribute = attribute;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI CountSetCursor(void* this, uintn_t column, uintn_t row)
+{
+    consoleCalls++;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI ReadMemoryDisk(void* this, uint32_t mediaId, efi_lba_t lba, uintn_t size, void* buffer)
+{
+    diskReads++;
+    memcpy(buffer, diskData + lba * BENCH_DISK_SECTOR_SIZE, size);
+    return EFI_SUCCESS;
+}
+
+// The average time ReadImageFile takes on the file, 0 if it doesn't give back the image
+static uint64_t TimeImageRead(const char_t* path, const char_t* image, uint64_t* size)
+{
+    uint64_t totalNs = 0;
+    for (int32_t i = 0; i < BENCH_IMAGE_READS; i++)
+    {
+        FILE* file = fopen(path, "r");
+        if (file == NULL)
+        {
+            return 0;
+        }
+        uint64_t start = HostOsNowNs();
+        char_t* buffer = ReadImageFile(file, LIP->DeviceHandle, GetFileSize(file), size, path, NULL);
+        totalNs += HostOsNowNs() - start;
+        fclose(file);
+        boolean_t same = buffer != NULL && image != NULL && *size == BENCH_IMAGE_SIZE &&
+            memcmp(buffer, image, BENCH_IMAGE_SIZE) == 0;
+        FreeFileBuffer(buffer);
+        if (!same)
+        {
+            return 0;
+        }
+    }
+    return totalNs / BENCH_IMAGE_READS;
+}
+
+static void PrintResult(const char_t* name, int32_t size, uint64_t totalNs, int32_t ops, int32_t itemsPerOp)
+{
+    uint64_t nsPerOp = totalNs / ops;
+    uint64_t nsPerItem = (itemsPerOp > 0) ? nsPerOp / itemsPerOp : nsPerOp;
+    printf("%-24s %8d %8d %14llu %12llu\n", name, size, ops, nsPerOp, nsPerItem);
+}
+
+static inline int32_t OpsFor(int32_t itemsPerOp)
+{
+    int32_t ops = BENCH_ITEMS_PER_RUN / itemsPerOp;
+    return (ops > 0) ? ops : 1;
+}
@@ -0,0 +1,12 @@
+// The command table is not part of the native build (the commands talk to the firmware directly),
+// shell.c only needs it to link, the benchmark uses the arg parser and not the commands
+#include "commands.h"
+
+const shell_cmd_s commands[] = {
+    { "", NULL, NULL, NULL } // Has to be here in order to terminate the command counter
+};
+
+uint8_t CommandCount(void)
+{
+    return 0;
+}
@@ -0,0 +1,204 @@
+// Thin wrappers around the host libc, kept in their own translation unit because
+// the libc headers and uefi.h can't be included together (FILE, struct stat, errno...)
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hostio.h"
+
+int HostOsOpen(const char* path, int flags)
+{
+    int osFlags = 0;
+    if ((flags & HOST_OPEN_WRITE) != 0)
+    {
+        osFlags |= O_RDWR;
+    }
+    else
+    {
+        osFlags |= O_RDONLY;
+    }
+    if ((flags & HOST_OPEN_CREATE) != 0)
+    {
+        osFlags |= O_CREAT;
+    }
+    if ((flags & HOST_OPEN_TRUNCATE) != 0)
+    {
+        osFlags |= O_TRUNC;
+    }
+    return open(path, osFlags, 0644);
+}
+
+int HostOsMkdir(const char* path)
+{
+    return mkdir(path, 0755);
+}
+
+int HostOsClose(int fd)
+{
+    return close(fd);
+}
+
+int64_t HostOsRead(int fd, void* buffer, uint64_t size)
+{
+    uint64_t total = 0;
+    while (total < size)
+    {
+        ssize_t res = read(fd, (char*)buffer + total, size - total);
+        if (res < 0)
+        {
+            return -1;
+        }
+        if (res == 0)
+        {
+            break;
+        }
+        total += res;
+    }
+    return total;
+}
+
+int64_t HostOsWrite(int fd, const void* buffer, uint64_t size)
+{
+    return write(fd, buffer, size);
+}
+
+int64_t HostOsSeek(int fd, int64_t offset, int whence)
+{
+    return lseek(fd, offset, whence == HOST_SEEK_END ? SEEK_END : (whence == HOST_SEEK_CUR ? SEEK_CUR : SEEK_SET));
+}
+
+int HostOsTruncate(int fd, uint64_t size)
+{
+    return ftruncate(fd, size);
+}
+
+int HostOsRemove(const char* path)
+{
+    return remove(path);
+}
+
+static void FillInfo(const struct stat* st, host_os_info_s* info)
+{
+    struct tm tm;
+    gmtime_r(&st->st_mtim.tv_sec, &tm);
+    info->size = st->st_size;
+    info->isDirectory = S_ISDIR(st->st_mode);
+    info->year = tm.tm_year + 1900;
+    info->month = tm.tm_mon + 1;
+    info->day = tm.tm_mday;
+    info->hour = tm.tm_hour;
+    info->minute = tm.tm_min;
+    info->second = tm.tm_sec;
+    info->nanosecond = st->st_mtim.tv_nsec;
+    info->mtime = st->st_mtim.tv_sec;
+}
+
+int HostOsFileInfo(int fd, host_os_info_s* info)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return -1;
+    }
+    FillInfo(&st, info);
+    return 0;
+}
+
+int HostOsPathInfo(const char* path, host_os_info_s* info)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return -1;
+    }
+    FillInfo(&st, info);
+    return 0;
+}
+
+void* HostOsOpendir(const char* path)
+{
+    return opendir(path);
+}
+
+const char* HostOsReaddir(void* dir, int* isDirectory)
+{
+    struct dirent* de;
+    while ((de = readdir((DIR*)dir)) != NULL)
+    {
+        *isDirectory = (de->d_type == DT_DIR);
+        return de->d_name;
+    }
+    return NULL;
+}
+
+void HostOsRewinddir(void* dir)
+{
+    rewinddir((DIR*)dir);
+}
+
+void HostOsClosedir(void* dir)
+{
+    closedir((DIR*)dir);
+}
+
+void* HostOsAllocPages(uint64_t size)
+{
+    void* mem = NULL;
+    if (posix_memalign(&mem, HOST_PAGE_SIZE, size) != 0)
+    {
+        return NULL;
+    }
+    return mem;
+}
+
+void HostOsFreePages(void* mem)
+{
+    free(mem);
+}
+
+uint64_t HostOsNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void HostOsSleepUs(uint64_t microseconds)
+{
+    usleep(microseconds);
+}
+
+void HostOsWallClock(host_os_info_s* info)
+{
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    info->year = tm.tm_year + 1900;
+    info->month = tm.tm_mon + 1;
+    info->day = tm.tm_mday;
+    info->hour = tm.tm_hour;
+    info->minute = tm.tm_min;
+    info->second = tm.tm_sec;
+    info->nanosecond = ts.tv_nsec;
+    info->mtime = ts.tv_sec;
+}
+
+int HostOsErrno(void)
+{
+    return errno;
+}
+
+// Run a command of the host shell, its exit status (the bench compresses its test images with it)
+int HostOsRun(const char* command)
+{
+    return system(command);
+}
@@ -0,0 +1,46 @@
+#pragma once
+// Interface between the hosted uefi shim and the host libc (see hostio.c)
+// Only fixed size integer types are used here, so both sides can include it
+
+#define HOST_OPEN_WRITE     (1)
+#define HOST_OPEN_CREATE    (2)
+#define HOST_OPEN_TRUNCATE  (4)
+
+#define HOST_SEEK_SET (0)
+#define HOST_SEEK_CUR (1)
+#define HOST_SEEK_END (2)
+
+#define HOST_PAGE_SIZE (4096)
+
+typedef struct host_os_info_s{
+    uint64_t size;
+    int isDirectory;
+    int year, month, day, hour, minute, second;
+    uint32_t nanosecond;
+    int64_t mtime;
+} host_os_info_s;
+
+int HostOsOpen(const char* path, int flags);
+int HostOsMkdir(const char* path);
+int HostOsClose(int fd);
+int64_t HostOsRead(int fd, void* buffer, uint64_t size);
+int64_t HostOsWrite(int fd, const void* buffer, uint64_t size);
+int64_t HostOsSeek(int fd, int64_t offset, int whence);
+int HostOsTruncate(int fd, uint64_t size);
+int HostOsRemove(const char* path);
+int HostOsFileInfo(int fd, host_os_info_s* info);
+int HostOsPathInfo(const char* path, host_os_info_s* info);
+
+void* HostOsOpendir(const char* path);
+const char* HostOsReaddir(void* dir, int* isDirectory);
+void HostOsRewinddir(void* dir);
+void HostOsClosedir(void* dir);
+
+void* HostOsAllocPages(uint64_t size);
+void HostOsFreePages(void* mem);
+
+uint64_t HostOsNowNs(void);
+void HostOsSleepUs(uint64_t microseconds);
+void HostOsWallClock(host_os_info_s* info);
+int HostOsErrno(void);
+int HostOsRun(const char* command);
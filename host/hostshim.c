@@ -0,0 +1,769 @@
+// Hosted implementation of the parts of libuefi and the firmware tables the loader uses
+// Files are served from a host directory (HostSetRoot) that stands in for the ESP,
+// backslashes in the loader paths are turned into slashes
+#include <uefi.h>
+#include "hostio.h"
+#include "bootutils.h"
+
+extern int vsnprintf(char_t* s, size_t maxlen, const char_t* format, __builtin_va_list arg);
+
+#define HOST_MAX_PATH (4096)
+
+typedef struct host_file_s{
+    efi_file_handle_t handle; // has to be first, this is what the loader gets as FILE/DIR
+    int fd;
+    void* dir;
+    uint64_t position;
+    struct dirent entry;
+} host_file_s;
+
+int HostErrno = 0;
+efi_system_table_t* ST = NULL;
+efi_boot_services_t* BS = NULL;
+efi_runtime_services_t* RT = NULL;
+efi_loaded_image_protocol_t* LIP = NULL;
+efi_handle_t IM = NULL;
+
+static char_t hostRoot[HOST_MAX_PATH] = ".";
+static boolean_t hostPrintConsole = FALSE;
+
+static efi_system_table_t hostSystemTable;
+static efi_boot_services_t hostBootServices;
+static efi_runtime_services_t hostRuntimeServices;
+static efi_loaded_image_protocol_t hostLoadedImage;
+static simple_text_output_interface_t hostConOut;
+static simple_text_output_mode_t hostConOutMode;
+static simple_input_interface_t hostConIn;
+static uint64_t hostMonotonicCount = 0;
+
+void HostSetRoot(const char_t* rootDir)
+{
+    strncpy(hostRoot, rootDir, HOST_MAX_PATH - 1);
+}
+
+// Turn a loader path ("\EFI\thatloader\config.cfg") into a host path
+static void HostPath(const char_t* path, char_t* out)
+{
+    size_t rootLen = strlen(hostRoot);
+    memcpy(out, hostRoot, rootLen);
+    size_t at = rootLen;
+    if (path[0] != '\\' && path[0] != '/')
+    {
+        out[at++] = '/';
+    }
+    for (; *path != CHAR_NULL && at < HOST_MAX_PATH - 1; path++)
+    {
+        out[at++] = (*path == '\\') ? '/' : *path;
+    }
+    out[at] = CHAR_NULL;
+}
+
+static void HostSetErrno(void)
+{
+    HostErrno = HostOsErrno();
+}
+
+/* EFI_FILE_PROTOCOL on top of host file descriptors */
+
+static efi_status_t HostFileClose(efi_file_handle_t* file)
+{
+    host_file_s* hf = (host_file_s*)file;
+    if (hf->dir != NULL)
+    {
+        HostOsClosedir(hf->dir);
+    }
+    if (hf->fd >= 0)
+    {
+        HostOsClose(hf->fd);
+    }
+    return EFI_SUCCESS;
+}
+
+static efi_status_t HostFileRead(efi_file_handle_t* file, uintn_t* bufferSize, void* buffer)
+{
+    host_file_s* hf = (host_file_s*)file;
+    int64_t res = HostOsRead(hf->fd, buffer, *bufferSize);
+    if (res < 0)
+    {
+        *bufferSize = 0;
+        return EFI_DEVICE_ERROR;
+    }
+    *bufferSize = res;
+    hf->position += res;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t HostFileWrite(efi_file_handle_t* file, uintn_t* bufferSize, void* buffer)
+{
+    host_file_s* hf = (host_file_s*)file;
+    int64_t res = HostOsWrite(hf->fd, buffer, *bufferSize);
+    if (res < 0)
+    {
+        *bufferSize = 0;
+        return EFI_DEVICE_ERROR;
+    }
+    *bufferSize = res;
+    hf->position += res;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t HostFileGetPosition(efi_file_handle_t* file, uint64_t* position)
+{
+    *position = ((host_file_s*)file)->position;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t HostFileSetPosition(efi_file_handle_t* file, uint64_t position)
+{
+    host_file_s* hf = (host_file_s*)file;
+    int64_t res = (position == 0xFFFFFFFFFFFFFFFFULL) ? HostOsSeek(hf->fd, 0, HOST_SEEK_END) :
+        HostOsSeek(hf->fd, position, HOST_SEEK_SET);
+    if (res < 0)
+    {
+        return EFI_DEVICE_ERROR;
+    }
+    hf->position = res;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t HostFileGetInfo(efi_file_handle_t* file, efi_guid_t* infoType, uintn_t* bufferSize, void* buffer)
+{
+    host_file_s* hf = (host_file_s*)file;
+    host_os_info_s osInfo;
+    if (hf->fd < 0 || HostOsFileInfo(hf->fd, &osInfo) != 0)
+    {
+        return EFI_DEVICE_ERROR;
+    }
+    if (*bufferSize < sizeof(efi_file_info_t))
+    {
+        *bufferSize = sizeof(efi_file_info_t);
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    efi_file_info_t* info = buffer;
+    memset(info, 0, sizeof(efi_file_info_t));
+    info->Size = sizeof(efi_file_info_t);
+    info->FileSize = osInfo.size;
+    info->PhysicalSize = osInfo.size;
+    info->ModificationTime.Year = osInfo.year;
+    info->ModificationTime.Month = osInfo.month;
+    info->ModificationTime.Day = osInfo.day;
+    info->ModificationTime.Hour = osInfo.hour;
+    info->ModificationTime.Minute = osInfo.minute;
+    info->ModificationTime.Second = osInfo.second;
+    info->ModificationTime.Nanosecond = osInfo.nanosecond;
+    info->CreateTime = info->ModificationTime;
+    info->LastAccessTime = info->ModificationTime;
+    info->Attribute = osInfo.isDirectory ? EFI_FILE_DIRECTORY : 0;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t HostFileSetInfo(efi_file_handle_t* file, efi_guid_t* infoType, uintn_t bufferSize, void* buffer)
+{
+    host_file_s* hf = (host_file_s*)file;
+    efi_file_info_t* info = buffer;
+    return HostOsTruncate(hf->fd, info->FileSize) == 0 ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+}
+
+static efi_status_t HostFileFlush(efi_file_handle_t* file)
+{
+    return EFI_SUCCESS;
+}
+
+static host_file_s* HostNewFile(int fd, void* dir)
+{
+    host_file_s* hf = calloc(1, sizeof(host_file_s));
+    if (hf == NULL)
+    {
+        return NULL;
+    }
+    hf->handle.Revision = EFI_FILE_PROTOCOL_REVISION;
+    hf->handle.Close = HostFileClose;
+    hf->handle.Read = HostFileRead;
+    hf->handle.Write = HostFileWrite;
+    hf->handle.GetPosition = HostFileGetPosition;
+    hf->handle.SetPosition = HostFileSetPosition;
+    hf->handle.GetInfo = HostFileGetInfo;
+    hf->handle.SetInfo = HostFileSetInfo;
+    hf->handle.Flush = HostFileFlush;
+    hf->fd = fd;
+    hf->dir = dir;
+    return hf;
+}
+
+/* string.h, same semantics as libuefi */
+
+size_t HostStrlen(const char_t* s)
+{
+    size_t len = 0;
+    if (s != NULL)
+    {
+        while (s[len] != CHAR_NULL)
+        {
+            len++;
+        }
+    }
+    return len;
+}
+
+char_t* HostStrncpy(char_t* dst, const char_t* src, size_t n)
+{
+    char_t* s = dst;
+    if (src != NULL && dst != NULL && n > 0)
+    {
+        for (; *src != CHAR_NULL && n > 0; n--)
+        {
+            *dst++ = *src++;
+        }
+        *dst = CHAR_NULL;
+    }
+    return s;
+}
+
+char_t* HostStrdup(const char_t* s)
+{
+    size_t len = HostStrlen(s) + 1;
+    char_t* copy = malloc(len);
+    if (copy != NULL)
+    {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+/* stdio.h */
+
+FILE* HostFopen(const char_t* filename, const char_t* modes)
+{
+    char_t path[HOST_MAX_PATH];
+    HostErrno = 0;
+    if (filename == NULL || *filename == CHAR_NULL || modes == NULL)
+    {
+        HostErrno = EINVAL;
+        return NULL;
+    }
+    HostPath(filename, path);
+
+    if (modes[1] == 'd')
+    {
+        host_os_info_s info;
+        if (HostOsPathInfo(path, &info) != 0)
+        {
+            if (modes[0] != 'w' || HostOsMkdir(path) != 0)
+            {
+                HostSetErrno();
+                return NULL;
+            }
+        }
+        else if (!info.isDirectory)
+        {
+            HostErrno = ENOTDIR;
+            return NULL;
+        }
+        int fd = HostOsOpen(path, 0);
+        return (FILE*)HostNewFile(fd, NULL);
+    }
+
+    int flags = 0;
+    if (modes[0] == 'w')
+    {
+        flags = HOST_OPEN_WRITE | HOST_OPEN_CREATE | HOST_OPEN_TRUNCATE;
+    }
+    else if (modes[0] == 'a')
+    {
+        flags = HOST_OPEN_WRITE | HOST_OPEN_CREATE;
+    }
+    else if (modes[0] == '*' || modes[1] == '+')
+    {
+        flags = HOST_OPEN_WRITE;
+    }
+
+    host_os_info_s info;
+    if (HostOsPathInfo(path, &info) == 0 && info.isDirectory)
+    {
+        HostErrno = EISDIR;
+        return NULL;
+    }
+    int fd = HostOsOpen(path, flags);
+    if (fd < 0)
+    {
+        HostSetErrno();
+        return NULL;
+    }
+    host_file_s* hf = HostNewFile(fd, NULL);
+    if (hf != NULL && modes[0] == 'a')
+    {
+        hf->position = HostOsSeek(fd, 0, HOST_SEEK_END);
+    }
+    return (FILE*)hf;
+}
+
+int HostFclose(FILE* stream)
+{
+    if (stream == NULL)
+    {
+        HostErrno = EINVAL;
+        return 0;
+    }
+    stream->Close(stream);
+    free(stream);
+    return 1;
+}
+
+int HostFflush(FILE* stream)
+{
+    return 1;
+}
+
+size_t HostFread(void* ptr, size_t size, size_t n, FILE* stream)
+{
+    uintn_t bs = size * n;
+    if (ptr == NULL || size < 1 || n < 1 || stream == NULL)
+    {
+        HostErrno = EINVAL;
+        return 0;
+    }
+    if (EFI_ERROR(stream->Read(stream, &bs, ptr)))
+    {
+        HostErrno = EIO;
+        return 0;
+    }
+    return bs / size;
+}
+
+size_t HostFwrite(const void* ptr, size_t size, size_t n, FILE* stream)
+{
+    uintn_t bs = size * n;
+    if (ptr == NULL || size < 1 || n < 1 || stream == NULL)
+    {
+        HostErrno = EINVAL;
+        return 0;
+    }
+    if (EFI_ERROR(stream->Write(stream, &bs, (void*)ptr)))
+    {
+        HostErrno = EIO;
+        return 0;
+    }
+    return bs / size;
+}
+
+int HostFseek(FILE* stream, long int off, int whence)
+{
+    host_file_s* hf = (host_file_s*)stream;
+    int64_t res = HostOsSeek(hf->fd, off, whence);
+    if (res < 0)
+    {
+        HostErrno = EINVAL;
+        return -1;
+    }
+    hf->position = res;
+    return 0;
+}
+
+long int HostFtell(FILE* stream)
+{
+    return ((host_file_s*)stream)->position;
+}
+
+int HostFeof(FILE* stream)
+{
+    host_os_info_s info;
+    host_file_s* hf = (host_file_s*)stream;
+    return HostOsFileInfo(hf->fd, &info) == 0 && hf->position >= info.size;
+}
+
+int HostVfprintf(FILE* stream, const char_t* format, __builtin_va_list args)
+{
+    char_t buffer[BUFSIZ];
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (len < 0)
+    {
+        return len;
+    }
+    if (len >= (int)sizeof(buffer))
+    {
+        len = sizeof(buffer) - 1;
+    }
+    HostFwrite(buffer, 1, len, stream);
+    return len;
+}
+
+int HostFprintf(FILE* stream, const char_t* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = HostVfprintf(stream, format, args);
+    va_end(args);
+    return len;
+}
+
+int HostRemove(const char_t* filename)
+{
+    char_t path[HOST_MAX_PATH];
+    HostPath(filename, path);
+    if (HostOsRemove(path) != 0)
+    {
+        HostSetErrno();
+        return -1;
+    }
+    return 0;
+}
+
+/* dirent.h */
+
+DIR* HostOpendir(const char_t* name)
+{
+    char_t path[HOST_MAX_PATH];
+    HostPath(name, path);
+    void* dir = HostOsOpendir(path);
+    if (dir == NULL)
+    {
+        HostSetErrno();
+        return NULL;
+    }
+    return (DIR*)HostNewFile(-1, dir);
+}
+
+struct dirent* HostReaddir(DIR* dirp)
+{
+    host_file_s* hf = (host_file_s*)dirp;
+    int isDirectory = 0;
+    const char_t* name = HostOsReaddir(hf->dir, &isDirectory);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    strncpy(hf->entry.d_name, name, FILENAME_MAX - 1);
+    hf->entry.d_type = isDirectory ? DT_DIR : DT_REG;
+    hf->entry.d_reclen = sizeof(struct dirent);
+    return &hf->entry;
+}
+
+void HostRewinddir(DIR* dirp)
+{
+    HostOsRewinddir(((host_file_s*)dirp)->dir);
+}
+
+int HostClosedir(DIR* dirp)
+{
+    return HostFclose(dirp) ? 0 : -1;
+}
+
+/* sys/stat.h */
+
+int HostFstat(FILE* f, struct HostStat* buf)
+{
+    host_os_info_s info;
+    host_file_s* hf = (host_file_s*)f;
+    memset(buf, 0, sizeof(struct HostStat));
+    if (hf->fd < 0 || HostOsFileInfo(hf->fd, &info) != 0)
+    {
+        HostErrno = EBADF;
+        return -1;
+    }
+    buf->st_mode = S_IREAD | S_IWRITE | (info.isDirectory ? S_IFDIR : S_IFREG);
+    buf->st_size = info.size;
+    buf->st_mtime = info.mtime;
+    return 0;
+}
+
+int HostStat(const char_t* file, struct HostStat* buf)
+{
+    char_t path[HOST_MAX_PATH];
+    host_os_info_s info;
+    memset(buf, 0, sizeof(struct HostStat));
+    HostPath(file, path);
+    if (HostOsPathInfo(path, &info) != 0)
+    {
+        HostSetErrno();
+        return -1;
+    }
+    buf->st_mode = S_IREAD | S_IWRITE | (info.isDirectory ? S_IFDIR : S_IFREG);
+    buf->st_size = info.size;
+    buf->st_mtime = info.mtime;
+    return 0;
+}
+
+int HostMkdir(const char_t* path, mode_t mode)
+{
+    FILE* f = HostFopen(path, "wd");
+    if (f == NULL)
+    {
+        return -1;
+    }
+    HostFclose(f);
+    return 0;
+}
+
+/* stdlib.h */
+
+size_t HostMbstowcs(wchar_t* pwcs, const char* s, size_t n)
+{
+    size_t i = 0;
+    for (; i < n && s[i] != CHAR_NULL; i++)
+    {
+        pwcs[i] = (uint8_t)s[i];
+    }
+    if (i < n)
+    {
+        pwcs[i] = 0;
+    }
+    return i;
+}
+
+size_t HostWcstombs(char* s, const wchar_t* pwcs, size_t n)
+{
+    size_t i = 0;
+    for (; i < n && pwcs[i] != 0; i++)
+    {
+        s[i] = (char)pwcs[i];
+    }
+    if (i < n)
+    {
+        s[i] = CHAR_NULL;
+    }
+    return i;
+}
+
+/* Firmware tables */
+
+static efi_status_t EFIAPI HostOutputString(void* This, wchar_t* string)
+{
+    char_t buffer[BUFSIZ];
+    size_t len = HostWcstombs(buffer, string, sizeof(buffer) - 1);
+    if (hostPrintConsole)
+    {
+        HostOsWrite(1, buffer, len);
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        hostConOutMode.CursorColumn = (buffer[i] == '\n' || buffer[i] == '\r') ? 0 : hostConOutMode.CursorColumn + 1;
+    }
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextStub(void* This)
+{
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextReset(void* This, boolean_t extendedVerification)
+{
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextSetAttribute(void* This, uintn_t attribute)
+{
+    hostConOutMode.Attribute = attribute;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextSetCursor(void* This, uintn_t column, uintn_t row)
+{
+    hostConOutMode.CursorColumn = column;
+    hostConOutMode.CursorRow = row;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextEnableCursor(void* This, boolean_t enable)
+{
+    hostConOutMode.CursorVisible = enable;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextQueryMode(void* This, uintn_t modeNumber, uintn_t* columns, uintn_t* rows)
+{
+    *columns = 80;
+    *rows = 25;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostTextSetMode(void* This, uintn_t modeNumber)
+{
+    hostConOutMode.Mode = modeNumber;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostReadKeyStroke(void* This, efi_input_key_t* key)
+{
+    return EFI_NOT_READY;
+}
+
+static efi_status_t EFIAPI HostAllocatePages(efi_allocate_type_t type, efi_memory_type_t memoryType, uintn_t pages,
+    efi_physical_address_t* memory)
+{
+    void* mem = HostOsAllocPages(pages * EFI_PAGE_SIZE);
+    if (mem == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    *memory = (efi_physical_address_t)(uintptr_t)mem;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostFreePages(efi_physical_address_t memory, uintn_t pages)
+{
+    HostOsFreePages((void*)(uintptr_t)memory);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostAllocatePool(efi_memory_type_t poolType, uintn_t size, void** buffer)
+{
+    *buffer = malloc(size);
+    return (*buffer == NULL) ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostFreePool(void* buffer)
+{
+    free(buffer);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostCreateEvent(uint32_t type, efi_tpl_t notifyTpl, efi_event_notify_t notifyFunction,
+    void* context, efi_event_t* event)
+{
+    *event = malloc(sizeof(uint64_t));
+    return (*event == NULL) ? EFI_OUT_OF_RESOURCES : EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostSetTimer(efi_event_t event, efi_timer_delay_t type, uint64_t triggerTime)
+{
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostWaitForEvent(uintn_t numberOfEvents, efi_event_t* event, uintn_t* index)
+{
+    *index = 0;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostCloseEvent(efi_event_t event)
+{
+    free(event);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostCheckEvent(efi_event_t event)
+{
+    return EFI_NOT_READY;
+}
+
+static efi_status_t EFIAPI HostHandleProtocol(efi_handle_t handle, efi_guid_t* protocol, void** interface)
+{
+    return EFI_UNSUPPORTED;
+}
+
+static efi_status_t EFIAPI HostLocateHandle(efi_locate_search_type_t searchType, efi_guid_t* protocol,
+    void* searchKey, uintn_t* bufferSize, efi_handle_t* buffer)
+{
+    return EFI_NOT_FOUND;
+}
+
+static efi_status_t EFIAPI HostLocateProtocol(efi_guid_t* protocol, void* registration, void** interface)
+{
+    return EFI_NOT_FOUND;
+}
+
+static efi_status_t EFIAPI HostLoadImage(boolean_t bootPolicy, efi_handle_t parentImageHandle, efi_device_path_t* filePath,
+    void* sourceBuffer, uintn_t sourceSize, efi_handle_t* imageHandle)
+{
+    return EFI_UNSUPPORTED;
+}
+
+static efi_status_t EFIAPI HostStartImage(efi_handle_t imageHandle, uintn_t* exitDataSize, wchar_t** exitData)
+{
+    return EFI_UNSUPPORTED;
+}
+
+static efi_status_t EFIAPI HostGetNextMonotonicCount(uint64_t* count)
+{
+    *count = ++hostMonotonicCount;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostStall(uintn_t microseconds)
+{
+    HostOsSleepUs(microseconds);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostSetWatchdogTimer(uintn_t timeout, uint64_t watchdogCode, uintn_t dataSize,
+    wchar_t* watchdogData)
+{
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostGetTime(efi_time_t* time, efi_time_capabilities_t* capabilities)
+{
+    host_os_info_s now;
+    HostOsWallClock(&now);
+    memset(time, 0, sizeof(efi_time_t));
+    time->Year = now.year;
+    time->Month = now.month;
+    time->Day = now.day;
+    time->Hour = now.hour;
+    time->Minute = now.minute;
+    time->Second = now.second;
+    time->Nanosecond = now.nanosecond;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI HostResetSystem(efi_reset_type_t resetType, efi_status_t resetStatus, uintn_t dataSize,
+    wchar_t* resetData)
+{
+    return EFI_UNSUPPORTED;
+}
+
+void HostInitFirmware(boolean_t printConsole)
+{
+    hostPrintConsole = printConsole;
+
+    hostConOutMode.MaxMode = 1;
+    hostConOut.Reset = HostTextReset;
+    hostConOut.OutputString = HostOutputString;
+    hostConOut.QueryMode = HostTextQueryMode;
+    hostConOut.SetMode = HostTextSetMode;
+    hostConOut.SetAttribute = HostTextSetAttribute;
+    hostConOut.ClearScreen = HostTextStub;
+    hostConOut.SetCursorPosition = HostTextSetCursor;
+    hostConOut.EnableCursor = HostTextEnableCursor;
+    hostConOut.Mode = &hostConOutMode;
+
+    hostConIn.Reset = HostTextReset;
+    hostConIn.ReadKeyStroke = HostReadKeyStroke;
+
+    hostBootServices.AllocatePages = HostAllocatePages;
+    hostBootServices.FreePages = HostFreePages;
+    hostBootServices.AllocatePool = HostAllocatePool;
+    hostBootServices.FreePool = HostFreePool;
+    hostBootServices.CreateEvent = HostCreateEvent;
+    hostBootServices.SetTimer = HostSetTimer;
+    hostBootServices.WaitForEvent = HostWaitForEvent;
+    hostBootServices.CloseEvent = HostCloseEvent;
+    hostBootServices.CheckEvent = HostCheckEvent;
+    hostBootServices.HandleProtocol = HostHandleProtocol;
+    hostBootServices.LocateHandle = HostLocateHandle;
+    hostBootServices.LocateProtocol = HostLocateProtocol;
+    hostBootServices.LoadImage = HostLoadImage;
+    hostBootServices.StartImage = HostStartImage;
+    hostBootServices.GetNextHighMonotonicCount = HostGetNextMonotonicCount;
+    hostBootServices.Stall = HostStall;
+    hostBootServices.SetWatchdogTimer = HostSetWatchdogTimer;
+
+    hostRuntimeServices.GetTime = HostGetTime;
+    hostRuntimeServices.ResetSystem = HostResetSystem;
+
+    hostSystemTable.ConOut = &hostConOut;
+    hostSystemTable.ConIn = &hostConIn;
+    hostSystemTable.BootServices = &hostBootServices;
+    hostSystemTable.RuntimeServices = &hostRuntimeServices;
+
+    hostLoadedImage.ImageDataType = EfiLoaderData;
+    // the root directory is the one volume, the handle is only compared (the chunk size is tuned per volume)
+    hostLoadedImage.DeviceHandle = &hostLoadedImage;
+
+    ST = &hostSystemTable;
+    BS = &hostBootServices;
+    RT = &hostRuntimeServices;
+    LIP = &hostLoadedImage;
+    IM = &hostLoadedImage;
+}
@@ -0,0 +1,555 @@
+// Native tests of the config parser and its cache, the kernel index, the decoders, SHA-256 and the menu reload
+// usage: thatloader_tests [esp directory]
+// The esp directory is created if needed, the tests write their configs and kernel directories in it
+// Prints every check that failed, returns 1 if any did
+#include <uefi.h>
+#include "hostio.h"
+#include "configfile.h"
+#include "kernelindex.h"
+#include "bootmenu.h"
+#include "bootutils.h"
+#include "logs.h"
+#include "clock.h"
+#include "decoders.h"
+#include "sha256.h"
+
+#define TEST_DEFAULT_ESP ("test-esp")
+
+#define TEST_CONFIG_PATH ("\\EFI\\thatloader\\config.cfg")
+#define TEST_CACHE_PATH ("\\EFI\\thatloader\\config.bin")
+
+#define TEST_COMMAND_LEN (1024)
+#define TEST_MILLION_A_CHUNK (1000)
+
+#define CHECK(condition) CheckCondition((condition), #condition, __LINE__)
+
+// The text of the decoder vectors below (8 lines of "entry N: vmlinuz-6.N initrd-6.N.img root=/dev/sdaM quiet")
+static const char_t decodedText[] =
+    "entry 0: vmlinuz-6.0 initrd-6.0.img root=/dev/sda0 quiet\n"
+    "entry 1: vmlinuz-6.1 initrd-6.1.img root=/dev/sda1 quiet\n"
+    "entry 2: vmlinuz-6.2 initrd-6.2.img root=/dev/sda2 quiet\n"
+    "entry 3: vmlinuz-6.3 initrd-6.3.img root=/dev/sda3 quiet\n"
+    "entry 4: vmlinuz-6.4 initrd-6.4.img root=/dev/sda0 quiet\n"
+    "entry 5: vmlinuz-6.5 initrd-6.5.img root=/dev/sda1 quiet\n"
+    "entry 6: vmlinuz-6.6 initrd-6.6.img root=/dev/sda2 quiet\n"
+    "entry 7: vmlinuz-6.7 initrd-6.7.img root=/dev/sda3 quiet\n";
+
+// gzip -9 -n
+static const uint8_t gzipVector[] = {
+    0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x85, 0xCF, 0x4D, 0x0A, 0x83, 0x30,
+    0x10, 0x40, 0xE1, 0xBD, 0xA7, 0x98, 0x0B, 0xA8, 0xF9, 0x0F, 0x14, 0x3C, 0x4C, 0x21, 0xA1, 0x0C,
+    0xD4, 0x48, 0xD3, 0x28, 0xE8, 0xE9, 0x4B, 0xBB, 0x99, 0x09, 0xA1, 0x64, 0xF7, 0x36, 0xDF, 0xE2,
+    0xC5, 0x54, 0xF2, 0x09, 0xE2, 0x06, 0xC7, 0xFA, 0xC4, 0xB4, 0x5F, 0xA3, 0x9B, 0x04, 0x60, 0xC2,
+    0x92, 0xC3, 0x37, 0x27, 0x5C, 0x1F, 0x90, 0xB7, 0xAD, 0x2C, 0x73, 0x88, 0xC7, 0xFC, 0x0E, 0x77,
+    0x01, 0xAF, 0x1D, 0x63, 0x19, 0xE2, 0x0F, 0x4A, 0x0E, 0x25, 0x41, 0xD9, 0x42, 0x59, 0x41, 0xC5,
+    0xA1, 0x22, 0xA8, 0x5A, 0xA8, 0x2A, 0xA8, 0x39, 0xD4, 0x04, 0x75, 0x0B, 0x75, 0x05, 0x0D, 0x87,
+    0x86, 0xA0, 0xE9, 0x3D, 0x5A, 0x0E, 0x2D, 0x41, 0xDB, 0x7B, 0x74, 0x1C, 0x3A, 0x82, 0xAE, 0xF7,
+    0xE8, 0x39, 0xF4, 0x04, 0xFD, 0xFF, 0xC7, 0x0F, 0xBA, 0x2F, 0x0B, 0x51, 0xC8, 0x01, 0x00, 0x00,
+};
+
+// zstd -19 --no-check
+static const uint8_t zstdVector[] = {
+    0x28, 0xB5, 0x2F, 0xFD, 0x60, 0xC8, 0x00, 0x8D, 0x03, 0x00, 0x12, 0x45, 0x12, 0x17, 0x80, 0xD9,
+    0x01, 0x40, 0xD6, 0xF0, 0x8E, 0x5F, 0x1C, 0x7F, 0x33, 0xC0, 0x95, 0x5B, 0xB7, 0x25, 0x15, 0x43,
+    0xCE, 0x51, 0x23, 0x83, 0x01, 0x66, 0xAD, 0xD5, 0x4A, 0x29, 0x4E, 0x29, 0x2D, 0x42, 0xC8, 0xDD,
+    0xBD, 0xBB, 0x9B, 0x99, 0x19, 0x90, 0xED, 0xE7, 0xA1, 0x4B, 0x30, 0xE4, 0x24, 0x8D, 0x9D, 0x41,
+    0x42, 0x18, 0xB5, 0x70, 0x6F, 0x58, 0x94, 0xFF, 0x5E, 0xD7, 0xA8, 0x60, 0x99, 0xEF, 0x0D, 0x97,
+    0xA8, 0xB0, 0xAA, 0x44, 0xF9, 0x5A, 0x1D, 0xA8, 0x10, 0xF0, 0xEC, 0xFF, 0x06, 0xE0, 0x95, 0x61,
+    0x0C, 0x10, 0x10, 0x01, 0x11, 0x5C, 0x01, 0x5E, 0xE6, 0xDA, 0x01, 0xE7, 0x76, 0xA0, 0x6C, 0x5E,
+    0x2F, 0x14, 0xCF, 0x29, 0x5E, 0x28, 0x97, 0x37, 0x37, 0xD8, 0x29,
+};
+
+// lz4 -9 (frame format)
+static const uint8_t lz4Vector[] = {
+    0x04, 0x22, 0x4D, 0x18, 0x60, 0x40, 0x82, 0xA7, 0x00, 0x00, 0x00, 0xF0, 0x0C, 0x65, 0x6E, 0x74,
+    0x72, 0x79, 0x20, 0x30, 0x3A, 0x20, 0x76, 0x6D, 0x6C, 0x69, 0x6E, 0x75, 0x7A, 0x2D, 0x36, 0x2E,
+    0x30, 0x20, 0x69, 0x6E, 0x69, 0x74, 0x72, 0x64, 0x0B, 0x00, 0xF2, 0x0B, 0x2E, 0x69, 0x6D, 0x67,
+    0x20, 0x72, 0x6F, 0x6F, 0x74, 0x3D, 0x2F, 0x64, 0x65, 0x76, 0x2F, 0x73, 0x64, 0x61, 0x30, 0x20,
+    0x71, 0x75, 0x69, 0x65, 0x74, 0x0A, 0x39, 0x00, 0x18, 0x31, 0x39, 0x00, 0x16, 0x31, 0x39, 0x00,
+    0x1E, 0x31, 0x39, 0x00, 0x19, 0x31, 0x39, 0x00, 0x18, 0x32, 0x39, 0x00, 0x16, 0x32, 0x39, 0x00,
+    0x1E, 0x32, 0x39, 0x00, 0x19, 0x32, 0x39, 0x00, 0x18, 0x33, 0x39, 0x00, 0x16, 0x33, 0x39, 0x00,
+    0x1E, 0x33, 0x39, 0x00, 0x19, 0x33, 0x39, 0x00, 0x18, 0x34, 0x39, 0x00, 0x16, 0x34, 0x39, 0x00,
+    0x1F, 0x34, 0xE4, 0x00, 0x0D, 0x18, 0x35, 0x39, 0x00, 0x16, 0x35, 0x39, 0x00, 0x1F, 0x35, 0xE4,
+    0x00, 0x0D, 0x18, 0x36, 0x39, 0x00, 0x16, 0x36, 0x39, 0x00, 0x1F, 0x36, 0xE4, 0x00, 0x0D, 0x18,
+    0x37, 0x39, 0x00, 0x16, 0x37, 0x39, 0x00, 0x1F, 0x37, 0xE4, 0x00, 0x02, 0x50, 0x75, 0x69, 0x65,
+    0x74, 0x0A, 0x00, 0x00, 0x00, 0x00,
+};
+
+// lz4 -l -9 (the legacy format of the kernel)
+static const uint8_t lz4LegacyVector[] = {
+    0x02, 0x21, 0x4C, 0x18, 0xA7, 0x00, 0x00, 0x00, 0xF0, 0x0C, 0x65, 0x6E, 0x74, 0x72, 0x79, 0x20,
+    0x30, 0x3A, 0x20, 0x76, 0x6D, 0x6C, 0x69, 0x6E, 0x75, 0x7A, 0x2D, 0x36, 0x2E, 0x30, 0x20, 0x69,
+    0x6E, 0x69, 0x74, 0x72, 0x64, 0x0B, 0x00, 0xF2, 0x0B, 0x2E, 0x69, 0x6D, 0x67, 0x20, 0x72, 0x6F,
+    0x6F, 0x74, 0x3D, 0x2F, 0x64, 0x65, 0x76, 0x2F, 0x73, 0x64, 0x61, 0x30, 0x20, 0x71, 0x75, 0x69,
+    0x65, 0x74, 0x0A, 0x39, 0x00, 0x18, 0x31, 0x39, 0x00, 0x16, 0x31, 0x39, 0x00, 0x1E, 0x31, 0x39,
+    0x00, 0x19, 0x31, 0x39, 0x00, 0x18, 0x32, 0x39, 0x00, 0x16, 0x32, 0x39, 0x00, 0x1E, 0x32, 0x39,
+    0x00, 0x19, 0x32, 0x39, 0x00, 0x18, 0x33, 0x39, 0x00, 0x16, 0x33, 0x39, 0x00, 0x1E, 0x33, 0x39,
+    0x00, 0x19, 0x33, 0x39, 0x00, 0x18, 0x34, 0x39, 0x00, 0x16, 0x34, 0x39, 0x00, 0x1F, 0x34, 0xE4,
+    0x00, 0x0D, 0x18, 0x35, 0x39, 0x00, 0x16, 0x35, 0x39, 0x00, 0x1F, 0x35, 0xE4, 0x00, 0x0D, 0x18,
+    0x36, 0x39, 0x00, 0x16, 0x36, 0x39, 0x00, 0x1F, 0x36, 0xE4, 0x00, 0x0D, 0x18, 0x37, 0x39, 0x00,
+    0x16, 0x37, 0x39, 0x00, 0x1F, 0x37, 0xE4, 0x00, 0x02, 0x50, 0x75, 0x69, 0x65, 0x74, 0x0A,
+};
+
+typedef enum test_format_t{
+    TEST_GZIP,
+    TEST_ZSTD,
+    TEST_LZ4
+} test_format_t;
+
+// FIPS 180-4 examples and the NIST long message
+typedef struct test_sha256_vector_s{
+    const char_t* message;
+    const char_t* digest;
+} test_sha256_vector_s;
+
+static const test_sha256_vector_s sha256Vectors[] = {
+    { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+};
+#define SHA256_MILLION_A_DIGEST ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0")
+
+static const char_t* espDir = TEST_DEFAULT_ESP;
+static int32_t numOfChecks = 0;
+static int32_t numOfFailures = 0;
+
+static void TestConfigTokenizing(void);
+static void TestConfigCache(void);
+static void TestCompareVersions(void);
+static void TestKernelIndex(void);
+static void TestDecoders(void);
+static void TestSha256(void);
+static void TestReloadSelection(void);
+static boolean_t DecodeVector(test_format_t format, const uint8_t* input, uint64_t inputSize, boolean_t byteByByte);
+static boolean_t Sha256Matches(const void* data, uint64_t size, uint64_t pieceSize, const char_t* hex);
+static boolean_t WriteTextFile(const char_t* path, const char_t* text);
+static void SetModificationTime(const char_t* path, int64_t seconds);
+static boolean_t HasEntry(const boot_entry_array_s* entryArr, const char_t* name, const char_t* path);
+static inline void CheckCondition(boolean_t passed, const char_t* condition, int32_t line);
+
+int main(int argc, char** argv)
+{
+    espDir = (argc > 1) ? argv[1] : TEST_DEFAULT_ESP;
+
+    // start from an empty esp, the kernel indexes and the config cache are kept between runs otherwise
+    char_t command[TEST_COMMAND_LEN];
+    snprintf(command, sizeof(command), "rm -rf '%s/EFI/thatloader' '%s/tests'", espDir, espDir);
+    HostOsMkdir(espDir);
+    HostOsRun(command);
+    HostSetRoot(espDir);
+    HostInitFirmware(FALSE);
+    InitClock();
+    mkdir("\\EFI", 0);
+    mkdir("\\EFI\\thatloader", 0);
+    mkdir("\\tests", 0);
+    InitLogger();
+
+    TestConfigTokenizing();
+    TestConfigCache();
+    TestCompareVersions();
+    TestKernelIndex();
+    TestDecoders();
+    TestSha256();
+    TestReloadSelection();
+    FlushLog();
+
+    printf("%d checks, %d failed\n", numOfChecks, numOfFailures);
+    return (numOfFailures == 0) ? 0 : 1;
+}
+
+/*
+* Entries end at a blank line, a line with only whitespace (or a CR of a CRLF file) is blank too
+* A path can start with the label of its volume, which is split off into the volume of the entry
+*/
+static void TestConfigTokenizing(void)
+{
+    WriteTextFile("\\tests\\a.efi", "");
+    WriteTextFile(TEST_CONFIG_PATH,
+        "# comment\r\n"
+        "timeout:5\r\n"
+        "\r\n"
+        "name:First\r\n"
+        "path:\\tests\\a.efi\r\n"
+        "args:quiet\r\n"
+        "  \t\r\n"
+        "name:Second\n"
+        "path:rootfs:\\boot\\vmlinuz\n"
+        "\n"
+        "\n"
+        "name:Third\n"
+        "path:\\tests\\a.efi\n");
+    remove(TEST_CACHE_PATH);
+
+    // the second parse is read from the cache the first one saved
+    for (int32_t pass = 0; pass < 2; pass++)
+    {
+        boot_entry_array_s entryArr = ParseConfig();
+        CHECK(entryArr.numOfEntries == 3);
+        if (entryArr.numOfEntries == 3)
+        {
+            boot_entry_s* entries = entryArr.entryArray;
+            CHECK(strcmp(entries[0].name, "First") == 0);
+            CHECK(strcmp(entries[0].imageToLoad, "\\tests\\a.efi") == 0);
+            CHECK(entries[0].imageArgs != NULL && strstr(entries[0].imageArgs, "quiet") != NULL);
+            CHECK(entries[0].imageArgs != NULL && strchr(entries[0].imageArgs, '\r') == NULL);
+            CHECK(entries[0].volume == NULL);
+            CHECK(strcmp(entries[1].name, "Second") == 0);
+            CHECK(strcmp(entries[1].imageToLoad, "\\boot\\vmlinuz") == 0);
+            CHECK(entries[1].volume != NULL && strcmp(entries[1].volume, "rootfs") == 0);
+            CHECK(strcmp(entries[2].name, "Third") == 0);
+        }
+        FreeConfigEntries(&entryArr);
+    }
+}
+
+/*
+* The cache is used while the config and the kerneldirs are unchanged (a kernel that is added behind the
+* back of the directory's modification time isn't seen), and dropped once either of them changes
+*/
+static void TestConfigCache(void)
+{
+    mkdir("\\tests\\cache", 0);
+    WriteTextFile("\\tests\\cache\\vmlinuz-6.1", "");
+    SetModificationTime("tests/cache", 1000000000);
+    WriteTextFile(TEST_CONFIG_PATH,
+        "name:Linux\n"
+        "kerneldir:\\tests\\cache\\\n"
+        "\n"
+        "name:Tool\n"
+        "path:\\tests\\a.efi\n");
+    remove(TEST_CACHE_PATH);
+
+    boot_entry_array_s entryArr = ParseConfig();
+    CHECK(entryArr.numOfEntries == 2);
+    CHECK(HasEntry(&entryArr, "Linux", "\\tests\\cache\\vmlinuz-6.1"));
+    FreeConfigEntries(&entryArr);
+
+    FILE* cacheFile = fopen(TEST_CACHE_PATH, "r");
+    CHECK(cacheFile != NULL);
+    if (cacheFile != NULL)
+    {
+        fclose(cacheFile);
+    }
+
+    // the directory looks unchanged, so the cached entry is kept
+    WriteTextFile("\\tests\\cache\\vmlinuz-6.2", "");
+    SetModificationTime("tests/cache", 1000000000);
+    entryArr = ParseConfig();
+    CHECK(HasEntry(&entryArr, "Linux", "\\tests\\cache\\vmlinuz-6.1"));
+    FreeConfigEntries(&entryArr);
+
+    SetModificationTime("tests/cache", 1000000100);
+    entryArr = ParseConfig();
+    CHECK(HasEntry(&entryArr, "Linux", "\\tests\\cache\\vmlinuz-6.2"));
+    FreeConfigEntries(&entryArr);
+
+    // same size, other content
+    WriteTextFile(TEST_CONFIG_PATH,
+        "name:Linux\n"
+        "kerneldir:\\tests\\cache\\\n"
+        "\n"
+        "name:Tail\n"
+        "path:\\tests\\a.efi\n");
+    entryArr = ParseConfig();
+    CHECK(entryArr.numOfEntries == 2);
+    CHECK(HasEntry(&entryArr, "Tail", "\\tests\\a.efi"));
+    CHECK(!HasEntry(&entryArr, "Tool", "\\tests\\a.efi"));
+    FreeConfigEntries(&entryArr);
+
+    // a corrupted cache is ignored
+    cacheFile = fopen(TEST_CACHE_PATH, "r+");
+    CHECK(cacheFile != NULL);
+    if (cacheFile != NULL)
+    {
+        fseek(cacheFile, -1, SEEK_END);
+        fwrite("?", 1, 1, cacheFile);
+        fclose(cacheFile);
+    }
+    entryArr = ParseConfig();
+    CHECK(entryArr.numOfEntries == 2);
+    CHECK(HasEntry(&entryArr, "Linux", "\\tests\\cache\\vmlinuz-6.2"));
+    CHECK(HasEntry(&entryArr, "Tail", "\\tests\\a.efi"));
+    FreeConfigEntries(&entryArr);
+}
+
+static void TestCompareVersions(void)
+{
+    CHECK(CompareVersions("6.10.1", "6.9.12") > 0);
+    CHECK(CompareVersions("6.9.12", "6.10.1") < 0);
+    CHECK(CompareVersions("6.5.2", "6.5.2") == 0);
+    CHECK(CompareVersions("6.05", "6.5") == 0);
+    CHECK(CompareVersions("6.1.1", "6.1") > 0);
+    CHECK(CompareVersions("6.1-arch2", "6.1-arch1") > 0);
+    CHECK(CompareVersions("10", "9") > 0);
+    CHECK(CompareVersions(NULL, "1") < 0);
+    CHECK(CompareVersions("1", NULL) > 0);
+    CHECK(CompareVersions(NULL, NULL) == 0);
+}
+
+/*
+* The kernels are sorted newest first and get the initrd of their release, which has to be a whole part of
+* the initrd's name, the shortest one wins when a few match (the fallback initramfs)
+*/
+static void TestKernelIndex(void)
+{
+    mkdir("\\tests\\index", 0);
+    WriteTextFile("\\tests\\index\\vmlinuz-6.5.2-arch1", "");
+    WriteTextFile("\\tests\\index\\vmlinuz-6.5.21", "");
+    WriteTextFile("\\tests\\index\\vmlinuz-6.6", "");
+    WriteTextFile("\\tests\\index\\initramfs-6.5.2-arch1-fallback.img", "");
+    WriteTextFile("\\tests\\index\\initramfs-6.5.2-arch1.img", "");
+    WriteTextFile("\\tests\\index\\initrd-6.5.21.img", "");
+    WriteTextFile("\\tests\\index\\initrd-6.6.1.img", "");
+
+    const kernel_index_s* index = GetKernelIndex("\\tests\\index\\");
+    CHECK(index != NULL);
+    if (index == NULL)
+    {
+        return;
+    }
+    CHECK(index->numOfKernels == 3);
+    if (index->numOfKernels != 3)
+    {
+        return;
+    }
+    const kernel_image_s* kernels = index->kernels;
+    CHECK(strcmp(kernels[0].fileName, "vmlinuz-6.6") == 0);
+    CHECK(kernels[0].initrdName == NULL);
+    CHECK(strcmp(kernels[1].fileName, "vmlinuz-6.5.21") == 0);
+    CHECK(kernels[1].initrdName != NULL && strcmp(kernels[1].initrdName, "initrd-6.5.21.img") == 0);
+    CHECK(strcmp(kernels[2].fileName, "vmlinuz-6.5.2-arch1") == 0);
+    CHECK(strcmp(kernels[2].version, "6.5.2") == 0);
+    CHECK(kernels[2].initrdName != NULL && strcmp(kernels[2].initrdName, "initramfs-6.5.2-arch1.img") == 0);
+}
+
+// Every vector as a whole, and fed a byte at a time (every block waits for its input)
+static void TestDecoders(void)
+{
+    CHECK(DecodeVector(TEST_GZIP, gzipVector, sizeof(gzipVector), FALSE));
+    CHECK(DecodeVector(TEST_GZIP, gzipVector, sizeof(gzipVector), TRUE));
+    CHECK(DecodeVector(TEST_ZSTD, zstdVector, sizeof(zstdVector), FALSE));
+    CHECK(DecodeVector(TEST_ZSTD, zstdVector, sizeof(zstdVector), TRUE));
+    CHECK(DecodeVector(TEST_LZ4, lz4Vector, sizeof(lz4Vector), FALSE));
+    CHECK(DecodeVector(TEST_LZ4, lz4Vector, sizeof(lz4Vector), TRUE));
+    CHECK(DecodeVector(TEST_LZ4, lz4LegacyVector, sizeof(lz4LegacyVector), FALSE));
+    CHECK(GetZstdSize(zstdVector, sizeof(zstdVector)) == sizeof(decodedText) - 1);
+
+    // a stream that ends early is an error and not a wait
+    CHECK(!DecodeVector(TEST_GZIP, gzipVector, sizeof(gzipVector) / 2, FALSE));
+    CHECK(!DecodeVector(TEST_ZSTD, zstdVector, sizeof(zstdVector) / 2, FALSE));
+}
+
+static void TestSha256(void)
+{
+    for (size_t i = 0; i < sizeof(sha256Vectors) / sizeof(sha256Vectors[0]); i++)
+    {
+        const test_sha256_vector_s* vector = sha256Vectors + i;
+        uint64_t size = strlen(vector->message);
+        CHECK(Sha256Matches(vector->message, size, (size > 0) ? size : 1, vector->digest));
+        CHECK(Sha256Matches(vector->message, size, 1, vector->digest));
+    }
+
+    char_t* million = malloc(1000000);
+    CHECK(million != NULL);
+    if (million != NULL)
+    {
+        memset(million, 'a', 1000000);
+        CHECK(Sha256Matches(million, 1000000, 1000000, SHA256_MILLION_A_DIGEST));
+        CHECK(Sha256Matches(million, 1000000, TEST_MILLION_A_CHUNK + 7, SHA256_MILLION_A_DIGEST));
+        free(million);
+    }
+}
+
+/*
+* The highlighted entry stays highlighted when the config is reloaded, also when its name is as long as a
+* name can be and only its last character tells it apart, or it is the name of an older kernel of a kerneldir
+*/
+static void TestReloadSelection(void)
+{
+    mkdir("\\tests\\reload", 0);
+    WriteTextFile("\\tests\\reload\\vmlinuz-6.1", "");
+    WriteTextFile("\\tests\\reload\\vmlinuz-6.2", "");
+    SetModificationTime("tests/reload", 1000000000);
+
+    char_t longName[MAX_ENTRY_NAME_LEN + 1];
+    memset(longName, 'n', MAX_ENTRY_NAME_LEN);
+    longName[MAX_ENTRY_NAME_LEN] = CHAR_NULL;
+    char_t config[TEST_COMMAND_LEN];
+    snprintf(config, sizeof(config),
+        "name:%.*sA\npath:\\tests\\a.efi\n\n"
+        "name:%.*sB\npath:\\tests\\a.efi\n\n"
+        "name:%s\nkerneldir:\\tests\\reload\\\nallkernels:true\n",
+        MAX_ENTRY_NAME_LEN - 1, longName, MAX_ENTRY_NAME_LEN - 1, longName, longName);
+    WriteTextFile(TEST_CONFIG_PATH, config);
+
+    boot_entry_array_s entryArr = ParseConfig();
+    CHECK(entryArr.numOfEntries == 4);
+    if (entryArr.numOfEntries != 4)
+    {
+        FreeConfigEntries(&entryArr);
+        return;
+    }
+    bmcfg.maxEntriesOnScreen = DEFAULT_CONSOLE_ROWS;
+
+    // the B entry moves down, since an entry is added before it
+    bmcfg.selectedEntryIndex = 1;
+    char_t selectedName[MAX_ENTRY_NAME_LEN + 1];
+    strcpy(selectedName, entryArr.entryArray[1].name);
+    snprintf(config, sizeof(config),
+        "name:Added\npath:\\tests\\a.efi\n\n"
+        "name:%.*sA\npath:\\tests\\a.efi\n\n"
+        "name:%.*sB\npath:\\tests\\a.efi\n\n"
+        "name:%s\nkerneldir:\\tests\\reload\\\nallkernels:true\n",
+        MAX_ENTRY_NAME_LEN - 1, longName, MAX_ENTRY_NAME_LEN - 1, longName, longName);
+    WriteTextFile(TEST_CONFIG_PATH, config);
+    CHECK(ReloadEntries(&entryArr, TRUE));
+    CHECK(bmcfg.selectedEntryIndex == 2);
+    CHECK(strcmp(entryArr.entryArray[bmcfg.selectedEntryIndex].name, selectedName) == 0);
+
+    // the name of the older kernel is cut to MAX_ENTRY_NAME_LEN, and found again after the reload
+    int32_t olderKernel = entryArr.numOfEntries - 1;
+    bmcfg.selectedEntryIndex = olderKernel;
+    strcpy(selectedName, entryArr.entryArray[olderKernel].name);
+    CHECK(strlen(selectedName) == MAX_ENTRY_NAME_LEN);
+    CHECK(strstr(selectedName, " (6.1)") != NULL);
+    WriteTextFile(TEST_CONFIG_PATH, strstr(config, "\n\n") + 2);
+    CHECK(ReloadEntries(&entryArr, TRUE));
+    CHECK(bmcfg.selectedEntryIndex == olderKernel - 1);
+    CHECK(strcmp(entryArr.entryArray[bmcfg.selectedEntryIndex].name, selectedName) == 0);
+
+    // the highlighted entry was removed, the first one is highlighted
+    WriteTextFile(TEST_CONFIG_PATH, "name:Only\npath:\\tests\\a.efi\n");
+    CHECK(ReloadEntries(&entryArr, TRUE));
+    CHECK(entryArr.numOfEntries == 1);
+    CHECK(bmcfg.selectedEntryIndex == 0);
+    FreeConfigEntries(&entryArr);
+}
+
+// Decode a vector into a buffer of exactly the size of the text, TRUE if it decodes to the text
+static boolean_t DecodeVector(test_format_t format, const uint8_t* input, uint64_t inputSize, boolean_t byteByByte)
+{
+    uint64_t textSize = sizeof(decodedText) - 1;
+    uint8_t* output = malloc(textSize);
+    if (output == NULL)
+    {
+        return FALSE;
+    }
+    inflate_state_s gzip;
+    zstd_state_s zstd;
+    lz4_state_s lz4;
+    if (format == TEST_GZIP)
+    {
+        InitInflate(&gzip);
+    }
+    else if (format == TEST_ZSTD && !InitZstd(&zstd))
+    {
+        free(output);
+        return FALSE;
+    }
+    else if (format == TEST_LZ4)
+    {
+        InitLz4(&lz4);
+    }
+
+    decode_stream_s stream = { input, byteByByte ? 0 : inputSize, !byteByByte, 0, output, textSize, 0 };
+    decode_status_t status = DECODE_NEED_INPUT;
+    while (TRUE)
+    {
+        switch (format)
+        {
+        case TEST_GZIP:
+            status = GzipDecode(&gzip, &stream);
+            break;
+        case TEST_ZSTD:
+            status = ZstdDecode(&zstd, &stream);
+            break;
+        case TEST_LZ4:
+            status = Lz4Decode(&lz4, &stream);
+            break;
+        }
+        if (status != DECODE_NEED_INPUT || stream.inputComplete)
+        {
+            break;
+        }
+        stream.inputSize++;
+        stream.inputComplete = stream.inputSize == inputSize;
+    }
+    if (format == TEST_ZSTD)
+    {
+        FreeZstd(&zstd);
+    }
+
+    boolean_t decoded = status == DECODE_DONE && stream.outputPos == textSize &&
+        memcmp(output, decodedText, textSize) == 0;
+    free(output);
+    return decoded;
+}
+
+// Hash the data in pieces of pieceSize bytes (the last one is shorter) and compare it to the hex digest
+static boolean_t Sha256Matches(const void* data, uint64_t size, uint64_t pieceSize, const char_t* hex)
+{
+    uint8_t expected[SHA256_DIGEST_SIZE];
+    if (!ParseSha256(hex, expected))
+    {
+        return FALSE;
+    }
+    sha256_s sha;
+    Sha256Init(&sha);
+    for (uint64_t offset = 0; offset < size; offset += pieceSize)
+    {
+        uint64_t length = (size - offset < pieceSize) ? size - offset : pieceSize;
+        Sha256Update(&sha, (const uint8_t*)data + offset, length);
+    }
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    Sha256Final(&sha, digest);
+    return memcmp(digest, expected, SHA256_DIGEST_SIZE) == 0;
+}
+
+static boolean_t WriteTextFile(const char_t* path, const char_t* text)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("Failed to write '%s'\n", path);
+        return FALSE;
+    }
+    size_t size = strlen(text);
+    boolean_t written = fwrite(text, 1, size, file) == size;
+    fclose(file);
+    return written;
+}
+
+// Set the modification time of a directory of the esp (a host path relative to it), in seconds since 1970
+static void SetModificationTime(const char_t* path, int64_t seconds)
+{
+    char_t command[TEST_COMMAND_LEN];
+    snprintf(command, sizeof(command), "touch -d @%lld '%s/%s'", (long long)seconds, espDir, path);
+    if (HostOsRun(command) != 0)
+    {
+        printf("Failed to set the modification time of '%s'\n", path);
+    }
+}
+
+static boolean_t HasEntry(const boot_entry_array_s* entryArr, const char_t* name, const char_t* path)
+{
+    for (int32_t i = 0; i < entryArr->numOfEntries; i++)
+    {
+        const boot_entry_s* entry = entryArr->entryArray + i;
+        if (strcmp(entry->name, name) == 0 && strcmp(entry->imageToLoad, path) == 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static inline void CheckCondition(boolean_t passed, const char_t* condition, int32_t line)
+{
+    numOfChecks++;
+    if (!passed)
+    {
+        numOfFailures++;
+        printf("FAILED (line %d): %s\n", line, condition);
+    }
+}
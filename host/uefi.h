@@ -0,0 +1,48 @@
+#pragma once
+// Hosted (Linux) stand-in for <uefi.h>, used by the native benchmark build
+// The libuefi functions that clash with the host libc are renamed to Host* functions
+// (implemented in hostshim.c), the rest (malloc, string functions, printf) come from the host libc
+// except for the string functions the loader relies on the libuefi behaviour of
+// (strlen(NULL) is 0, strncpy always terminates the destination)
+// The types and the firmware tables are taken from the real uefi.h
+
+#define fopen       HostFopen
+#define fclose      HostFclose
+#define fflush      HostFflush
+#define fread       HostFread
+#define fwrite      HostFwrite
+#define fseek       HostFseek
+#define ftell       HostFtell
+#define feof        HostFeof
+#define fprintf     HostFprintf
+#define vfprintf    HostVfprintf
+#define remove      HostRemove
+#define opendir     HostOpendir
+#define readdir     HostReaddir
+#define rewinddir   HostRewinddir
+#define closedir    HostClosedir
+#define stat        HostStat
+#define fstat       HostFstat
+#define mkdir       HostMkdir
+#define unlink      HostUnlink
+#define rmdir       HostRmdir
+#define errno       HostErrno
+#define getenv      HostGetenv
+#define setenv      HostSetenv
+#define time        HostTime
+#define localtime   HostLocaltime
+#define mktime      HostMktime
+#define mbstowcs    HostMbstowcs
+#define wcstombs    HostWcstombs
+#define exit_bs     HostExitBs
+#define getchar_ifany HostGetcharIfAny
+#define strlen      HostStrlen
+#define strncpy     HostStrncpy
+#define strdup      HostStrdup
+
+#include "../uefi/uefi.h"
+
+// Directory of the host filesystem that stands in for the root of the ESP
+void HostSetRoot(const char_t* rootDir);
+// Initialize the fake ST/BS/RT tables, console output is discarded unless printConsole is set
+void HostInitFirmware(boolean_t printConsole);
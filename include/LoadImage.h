@@ -1,4 +1,5 @@
 #pragma once
 #include <uefi.h>
 
-void ChainloadImage(char_t* path, char_t* args);
+void ChainloadImage(char_t* path, char_t* args, const char_t* volume, boolean_t bufferedLoad, boolean_t kernelInitrd,
+    const char_t* sha256);
@@ -0,0 +1,34 @@
+#pragma once
+#include <uefi.h>
+
+// Bump allocator on top of BS->AllocatePages
+// Everything allocated from an arena is released at once with ArenaFree
+// (memory from the arena isn't tracked by libuefi's malloc)
+
+typedef struct arena_block_s{
+    struct arena_block_s* next; // older block
+    uintn_t pages;
+    // data follows the header
+} arena_block_s;
+
+typedef struct arena_s{
+    arena_block_s* blocks; // newest block first, allocations are taken from it
+    uint8_t* top; // next free byte of the newest block
+    uint8_t* end;
+} arena_s;
+
+// Position in the arena, everything allocated after it can be dropped with ArenaRewind
+typedef struct arena_mark_s{
+    arena_block_s* block;
+    uint8_t* top;
+} arena_mark_s;
+
+#define ARENA_INIT { NULL, NULL, NULL }
+
+boolean_t ArenaReserve(arena_s* arena, size_t size);
+void* ArenaAlloc(arena_s* arena, size_t size);
+boolean_t ArenaExtend(arena_s* arena, void* ptr, size_t oldSize, size_t newSize);
+char_t* ArenaStoreString(arena_s* arena, const char_t* str, size_t len);
+arena_mark_s ArenaMark(arena_s* arena);
+void ArenaRewind(arena_s* arena, arena_mark_s mark);
+void ArenaFree(arena_s* arena);
@@ -0,0 +1,74 @@
+#pragma once
+#include <uefi.h>
+
+// Reads files in chunks that are requested without waiting, using ReadEx of the revision 2 file protocol
+// The firmware can then overlap the reads of a few files (and the caller can work meanwhile) instead of
+// doing them one by one
+// A file has one chunk in flight at a time: ReadEx reads from the position of the handle, and the spec
+// doesn't say that the position is taken when the chunk is requested, so a handle is never moved under a chunk
+// Files whose protocol is revision 1 are read chunk by chunk with Read
+// The chunk size is tuned per volume: the first large file read from a volume starts with a chunk of every
+// ASYNC_READ_PROBE_SIZES, each read and timed on its own, and the fastest one is used from then on
+// Every read is timed, so slow media can be told apart from slow firmware (see LogAsyncRead)
+
+#define EFI_FILE_PROTOCOL_REVISION2 (0x00020000)
+
+#define ASYNC_READ_CHUNK_SIZE (1024 * 1024) // until the volume is tuned
+#define ASYNC_READ_MAX_IN_FLIGHT (1) // per file handle, see above
+#define ASYNC_READ_PROBE_SIZES { 64 * 1024, 256 * 1024, 1024 * 1024, 2048 * 1024 }
+#define ASYNC_READ_NUM_PROBES (4)
+#define ASYNC_READ_MAX_VOLUMES (16) // the volumes that get tuned, the others use ASYNC_READ_CHUNK_SIZE
+#define ASYNC_READ_PROGRESS_WIDTH (40) // of the progress bar
+#define ASYNC_READ_PROGRESS_INTERVAL_US (100000) // between two draws of the progress bar
+
+// EFI_FILE_IO_TOKEN (UEFI spec 13.5.17)
+typedef struct efi_file_io_token_s{
+    efi_event_t Event;
+    efi_status_t Status;
+    uintn_t BufferSize;
+    void* Buffer;
+} efi_file_io_token_t;
+
+typedef struct async_read_chunk_s{
+    efi_file_io_token_t token;
+    uint64_t offset;
+    boolean_t inFlight;
+} async_read_chunk_s;
+
+// The chunk size of a volume, 0 until it is measured
+typedef struct async_read_volume_s{
+    efi_handle_t handle;
+    uint64_t chunkSize;
+    boolean_t probing; // a read is measuring it, the others keep ASYNC_READ_CHUNK_SIZE meanwhile
+} async_read_volume_s;
+
+// A file that is being read into a buffer
+typedef struct async_read_s{
+    efi_file_handle_t* file;
+    uint64_t fileOffset; // where the read starts in the file, the offsets below are relative to it
+    char_t* buffer;
+    uint64_t size;
+    uint64_t nextOffset; // the first byte that wasn't requested yet
+    uint64_t bytesRead;
+    efi_status_t status; // the first error, the read stops on it
+    boolean_t overlapped; // FALSE if the file has no ReadEx (or it failed), then the chunks are read with Read
+    uint64_t chunkSize;
+    async_read_volume_s* probeVolume; // the volume the first chunks of the read measure, NULL once they were read
+    int32_t probe; // the next probe chunk
+    uint64_t probeBestRate; // bytes per second of the fastest probe chunk
+    uint64_t startTicks;
+    uint64_t endTicks; // 0 until the whole file was read
+    async_read_chunk_s chunks[ASYNC_READ_MAX_IN_FLIGHT];
+} async_read_s;
+
+void BeginAsyncRead(async_read_s* read, efi_file_handle_t* file, char_t* buffer, uint64_t size);
+void BeginAsyncReadAt(async_read_s* read, efi_file_handle_t* file, uint64_t fileOffset, char_t* buffer, uint64_t size);
+void SetAsyncReadVolume(async_read_s* read, efi_handle_t volume);
+boolean_t PollAsyncRead(async_read_s* read);
+boolean_t WaitAsyncRead(async_read_s* read);
+uint64_t GetAsyncReadPrefix(const async_read_s* read);
+efi_status_t FinishAsyncRead(async_read_s* read);
+efi_status_t FinishAsyncReads(async_read_s* const* reads, int32_t numOfReads);
+void CancelAsyncRead(async_read_s* read);
+void LogAsyncRead(const async_read_s* read, const char_t* path);
+void ShowAsyncReadProgress(boolean_t show);
@@ -0,0 +1,28 @@
+#pragma once
+#include <uefi.h>
+
+// LRU cache of disk blocks for the parsers that read raw disks (the ext4 driver) through EFI_BLOCK_IO_PROTOCOL
+// The blocks are keyed by their device and LBA, a fixed pool of slots is shared by every device and the least
+// recently used slot is taken when it is full
+// A miss reads ahead the blocks that follow it on the disk in the same transfer, up to the first one that is cached
+// (group descriptors, inode tables and directories are mostly read in order)
+// The hits and misses are counted, they are shown on the info screen and logged before the boot
+
+#define BLOCK_CACHE_BLOCK_SIZE (4096) // the unit of the cache, whole sectors of the device
+#define BLOCK_CACHE_SLOTS (256) // 1 MiB
+#define BLOCK_CACHE_READAHEAD (8) // blocks a miss reads
+#define BLOCK_CACHE_HASH_SIZE (512) // buckets, a power of 2
+#define BLOCK_CACHE_MAX_READ (64 * 1024) // larger reads (file data) should go straight to the buffer of the caller
+
+typedef struct block_cache_stats_s{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readAheadHits; // hits on blocks a miss read ahead
+    uint64_t deviceReads; // transfers the misses made
+    uint64_t evictions;
+} block_cache_stats_s;
+
+efi_status_t ReadCachedBlocks(efi_block_io_t* blockIo, uint64_t offset, uint64_t size, void* buffer);
+void GetBlockCacheStats(block_cache_stats_s* stats);
+void PrintBlockCacheStats(void);
+void LogBlockCacheStats(void);
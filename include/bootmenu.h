@@ -1,5 +1,6 @@
 #pragma once
 #include <uefi.h>
+#include "configfile.h"
 
 // while there is no actual defualt, I just eyeballed it
 #define DEFAULT_CONSOLE_COLUMNS (80)
@@ -16,12 +17,14 @@ typedef struct boot_menu_cfg_s
     int32_t timeoutSeconds;
     boolean_t timeoutCancelled;
     boolean_t bootImmediately;
+    boolean_t showProgress; // a progress bar of the reads while an entry boots
 } boot_menu_cfg_s;
 
 
 extern boot_menu_cfg_s bmcfg;
 
 void StartBootManager(void);
+boolean_t ReloadEntries(boot_entry_array_s* entryArr, boolean_t checkContent);
 
 void ShowLogFile(void);
 
@@ -0,0 +1,22 @@
+#pragma once
+#include <uefi.h>
+
+// Boot phase timeline: named begin/end pairs (and instant marks) timed with the monotonic clock
+// The timeline can be printed (info screen) and written to the log
+//
+// With BOOT_PHASE_MARKERS (make PHASE_MARKERS=1) every begin/end/mark is also written to the serial port
+// for the QEMU benchmark (bench-qemu.sh), as a line of "@@thatloader phase=<name>[-begin|-end] us=<time>"
+
+#define BOOT_PHASE_MAX_PHASES (48) // later phases are counted but not recorded
+#define BOOT_PHASE_NAME_LEN (48) // name and detail, longer ones are truncated
+
+#define BOOT_PHASE_INVALID (-1)
+
+typedef int32_t boot_phase_t;
+
+boot_phase_t BeginBootPhase(const char_t* name, const char_t* detail);
+void EndBootPhase(boot_phase_t phase);
+void MarkBootPhase(const char_t* name);
+
+void PrintBootTimeline(int32_t maxPhases);
+void LogBootTimeline(void);
@@ -14,15 +14,23 @@
 
 wchar_t* StringToWideString(char_t* str);
 
-efi_handle_t GetFileDeviceHandle(char_t* path);
+efi_handle_t GetFileDeviceHandle(char_t* path, const char_t* volumeName);
 efi_status_t ReadFile(efi_file_handle_t* fileHandle, uintn_t fileSize, char_t** buffer);
 efi_status_t GetFileInfo(efi_file_handle_t* fileHandle, efi_file_info_t* fileInfo);
 char_t* GetFileContent(char_t* path, uint64_t* outFileSize);
+char_t* ReadFileContent(FILE* file, uint64_t fileSize, uint64_t reserve);
+char_t* AllocateFileBuffer(uint64_t size);
+char_t* ResizeFileBuffer(char_t* buffer, uint64_t usedSize, uint64_t size);
+void FreeFileBuffer(void* buffer);
 uint64_t GetFileSize(FILE* file);
 
 //efi_status_t RebootDevice(boolean_t rebootToFirmware);
 int32_t WaitForInput(uint32_t timeout);
 
+// Work done in small steps while WaitForInput waits (like prefetching), returns FALSE when there is nothing left to do
+typedef boolean_t (*idle_handler_t)(void);
+void SetIdleHandler(idle_handler_t handler);
+
 // watchdog timer makes sure that the app doesnt go to a complete freeze, if it does - it resets the system
 void EnableWatchdogTimer(uintn_t seconds);
 void DisableWatchdogTimer(void);
@@ -0,0 +1,14 @@
+#pragma once
+#include <uefi.h>
+
+// Monotonic clock on top of the CPU counter (TSC on x86, CNTVCT on aarch64)
+// The counter frequency is calibrated once against BS->Stall by InitClock, before it the clock reads 0
+// On other architectures the clock falls back to RT->GetTime (one second resolution)
+
+#define CLOCK_CALIBRATION_US (2000) // how long InitClock stalls to measure the counter frequency
+
+void InitClock(void);
+uint64_t GetClockTicks(void);
+uint64_t GetClockFrequency(void); // ticks per second
+uint64_t TicksToMicroseconds(uint64_t ticks);
+uint64_t GetMicrosecondsSinceInit(void);
@@ -0,0 +1,18 @@
+#pragma once
+#include <uefi.h>
+#include "configfile.h"
+
+// Max amount of runtime keys (timeout...) that are stored in the cache
+#define CFG_CACHE_MAX_RUNTIME_KEYS (16)
+
+// Runtime keys are not part of the entries, they are replayed when the cache is loaded
+typedef struct cfg_runtime_key_s{
+    const char_t* key;
+    const char_t* value;
+} cfg_runtime_key_s;
+
+boolean_t StampConfigFile(FILE* configFile, const char_t* configData, cfg_file_stamp_s* stamp);
+boolean_t LoadConfigCache(const cfg_file_stamp_s* stamp, boot_entry_array_s* entryArr,
+    cfg_runtime_key_s* runtimeKeys, int32_t* numOfRuntimeKeys);
+void SaveConfigCache(const cfg_file_stamp_s* stamp, const boot_entry_array_s* entryArr,
+    const cfg_runtime_key_s* runtimeKeys, int32_t numOfRuntimeKeys);
@@ -1,28 +1,62 @@
 #pragma once
 #include <uefi.h>
+#include "arena.h"
+
+#define MAX_ENTRY_NAME_LEN (70)
 
 
 typedef struct kernel_scan_info_s{
     char_t* kernelDirectory; // path to dir of the kernel
-    char_t* kernelVersionString; 
+    char_t* kernelVersionString;
 } kernel_scan_info_s;
 
 typedef struct boot_entry_s{
     char_t* name; // name of image (for the menu printing)
     char_t* imageToLoad; // Holds the path to the image to load
     char_t* imageArgs; // Holds the arguments for the image (if needed)
+    char_t* volume; // label or partition GUID of the volume of the image, NULL to search every volume
 
     boolean_t isDirectoryToKernel; // checks if imageToLoad is a dir or path to an image
     // without it we wont know if to scan a dir or simply load the image
     kernel_scan_info_s* kernelScanInfo;
+    boolean_t expandKernels; // kerneldir: an entry for every kernel of the directory
+    boolean_t bufferedLoad; // read the image into memory before LoadImage instead of letting the firmware read it
+    boolean_t kernelInitrd; // the kernel reads the initrd= files itself instead of getting them from memory
+    boolean_t linuxBoot; // imageToLoad is a bzImage that is booted with the linux boot protocol (no LoadImage)
+    char_t* sha256; // the digest the image has to have (64 lowercase hex digits), NULL if it isn't pinned
 } boot_entry_s;
 
+// Identifies the version of config.cfg that was parsed
+typedef struct cfg_file_stamp_s{
+    boolean_t isValid;
+    uint64_t configSize;
+    time_t configModificationTime;
+    uint64_t configHash; // hash of the config text
+} cfg_file_stamp_s;
+
+// A kerneldir the config names, with the modification time it had when it was scanned
+typedef struct kernel_dir_stamp_s{
+    char_t* directory;
+    uint64_t modificationTime; // 0 if it isn't known (the directory is missing or has no modification time)
+    struct kernel_dir_stamp_s* next;
+} kernel_dir_stamp_s;
 
 typedef struct boot_entry_array_s{
     boot_entry_s* entryArray;
     int32_t numOfEntries;
+    int32_t capacity; // amount of entries entryArray has room for
+    arena_s arena; // owns the entries, their strings and the config text they point into
+    cfg_file_stamp_s stamp; // the config the entries were parsed from
+    kernel_dir_stamp_s* kernelDirs; // every kerneldir of the config, whether it had kernels or not
 } boot_entry_array_s;
 
+typedef enum cfg_reload_status_t{
+    CFG_RELOAD_UNCHANGED, // the entries were kept
+    CFG_RELOAD_UPDATED, // the entries were replaced
+    CFG_RELOAD_FAILED // the config changed but has no valid entries, the old entries were kept
+} cfg_reload_status_t;
+
 boot_entry_array_s ParseConfig(void);
+cfg_reload_status_t ReloadConfig(boot_entry_array_s* entryArr, boolean_t checkContent);
 boolean_t ParseKeyValuePair(char_t* token, const char_t delimiter, char_t** key, char_t** value);
-void FreeConfigEntries(boot_entry_array_s* entryArr);
\ No newline at end of file
+void FreeConfigEntries(boot_entry_array_s* entryArr);
@@ -0,0 +1,34 @@
+#pragma once
+#include <uefi.h>
+
+// Batched output to the text console, instead of a firmware call for every printf or putchar
+// The text is converted to UCS-2 into a frame, with the attribute changes and cursor moves in between, and given
+// to the firmware when the frame ends (or it is full): one OutputString for each run of text in one attribute,
+// a SetAttribute only where the attribute changes, and only the last of the cursor moves that have no text between
+// Every call is slow on a console redirected to a serial port, a redraw of the menu is a few calls instead of
+// a few for each row
+// The column of the cursor is followed in the frame, so the rows are padded without asking the firmware
+// Outside of a frame the output of a call is given to the firmware when it returns, so the functions can be mixed
+// with printf, inside of one they can't (the frame would come out after the printf)
+
+#define CONSOLE_FRAME_LEN (4096) // UCS-2 characters, a full frame is flushed
+#define CONSOLE_FORMAT_LEN (1024) // the bytes one ConsolePrintf formats, the rest is cut off
+
+typedef struct console_frame_stats_s{
+    uint32_t outputStrings;
+    uint32_t setAttributes;
+    uint32_t setCursors;
+    uint32_t characters;
+} console_frame_stats_s;
+
+void BeginConsoleFrame(void);
+void EndConsoleFrame(void);
+void ConsolePrintf(const char_t* format, ...);
+void ConsoleWrite(const char_t* data, uint64_t size);
+void ConsoleSetAttribute(uintn_t attribute);
+void ConsoleSetCursor(uintn_t column, uintn_t row);
+void ConsolePadRow(void);
+void ConsoleEmptyLine(void);
+void GetConsoleFrameStats(console_frame_stats_s* stats);
+void PrintConsoleFrameStats(void);
+void LogConsoleFrameStats(const char_t* frame);
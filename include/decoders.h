@@ -0,0 +1,123 @@
+#pragma once
+#include <uefi.h>
+
+// The decoders of the compressed formats decompress.c understands (gzip, LZ4 frame and legacy, zstd)
+// They decode one block at a time into a flat output buffer, so the history of a match is just the output
+// before it. A block is only taken once all of it is in the input and its output fits, otherwise the decoder
+// returns without changing its state, and is called again once the input or the output grew
+// The checksums of the formats aren't verified (the image is checked by LoadImage or by the boot protocol)
+
+typedef enum decode_status_t{
+    DECODE_DONE, // the end of the stream was decoded
+    DECODE_NEED_INPUT, // the next block isn't all in the input yet
+    DECODE_NEED_OUTPUT, // the next block doesn't fit in the output
+    DECODE_ERROR // the stream is corrupt (or uses something that isn't supported)
+} decode_status_t;
+
+typedef struct decode_stream_s{
+    const uint8_t* input;
+    uint64_t inputSize; // the bytes of the input that are there so far
+    boolean_t inputComplete; // inputSize is the whole stream, a block past it is an error and not a wait
+    uint64_t inputPos; // the first byte of the next block
+    uint8_t* output;
+    uint64_t outputSize;
+    uint64_t outputPos;
+} decode_stream_s;
+
+// Copy a match from distance bytes back, the match can repeat the bytes it writes (distance < length)
+static inline void CopyMatch(uint8_t* to, uint64_t distance, uint64_t length)
+{
+    const uint8_t* from = to - distance;
+    while(length > 0)
+    {
+        // the bytes that are copied are already there, and every copy doubles how far back they can come from
+        uint64_t size = (length < distance) ? length : distance;
+        memcpy(to, from, size);
+        to += size;
+        length -= size;
+        distance += size;
+    }
+}
+
+/* gzip (RFC 1952) around deflate (RFC 1951), see inflate.c */
+#define INFLATE_FAST_BITS (10) // codes up to this length are decoded with one table lookup
+#define INFLATE_MAX_CODE_LEN (15)
+#define INFLATE_NUM_LITLEN_SYMBOLS (288)
+#define INFLATE_NUM_DIST_SYMBOLS (32)
+
+typedef struct inflate_huffman_s{
+    uint16_t fast[1 << INFLATE_FAST_BITS]; // length << 9 | symbol, 0 for the longer codes
+    uint16_t firstCode[INFLATE_MAX_CODE_LEN + 1];
+    uint32_t maxCode[INFLATE_MAX_CODE_LEN + 2]; // shifted to 16 bits, for the longer codes
+    uint16_t firstSymbol[INFLATE_MAX_CODE_LEN + 1];
+    uint8_t size[INFLATE_NUM_LITLEN_SYMBOLS];
+    uint16_t value[INFLATE_NUM_LITLEN_SYMBOLS];
+} inflate_huffman_s;
+
+typedef struct inflate_state_s{
+    boolean_t headerRead;
+    boolean_t lastBlock; // the final block was decoded, the trailer is next
+    uint64_t bitBuffer;
+    int32_t bitCount;
+    int32_t padBits; // zero bits past the end of the input, more input is needed if they were read
+    inflate_huffman_s litlen;
+    inflate_huffman_s dist;
+} inflate_state_s;
+
+void InitInflate(inflate_state_s* state);
+decode_status_t GzipDecode(inflate_state_s* state, decode_stream_s* stream);
+
+/* LZ4 frame format, and the legacy format of the kernel (lz4 -l), see lz4frame.c */
+typedef struct lz4_state_s{
+    boolean_t headerRead;
+    boolean_t legacy;
+    boolean_t blockChecksums;
+    boolean_t contentChecksum;
+    uint64_t contentSize; // 0 if the frame doesn't tell
+} lz4_state_s;
+
+void InitLz4(lz4_state_s* state);
+decode_status_t Lz4Decode(lz4_state_s* state, decode_stream_s* stream);
+uint64_t GetLz4Size(const uint8_t* input, uint64_t inputSize); // 0 if the header doesn't tell
+
+/* zstd frames (RFC 8878), without dictionaries, see zstd.c */
+#define ZSTD_BLOCK_MAX_SIZE (128 * 1024)
+#define ZSTD_MAX_HUFFMAN_BITS (11)
+#define ZSTD_LITLEN_MAX_LOG (9)
+#define ZSTD_MATCHLEN_MAX_LOG (9)
+#define ZSTD_OFFSET_MAX_LOG (8)
+
+typedef struct zstd_fse_entry_s{
+    uint16_t newState;
+    uint8_t symbol;
+    uint8_t numOfBits;
+} zstd_fse_entry_s;
+
+typedef struct zstd_fse_table_s{
+    zstd_fse_entry_s entries[1 << ZSTD_LITLEN_MAX_LOG];
+    int32_t accuracyLog;
+} zstd_fse_table_s;
+
+typedef struct zstd_state_s{
+    boolean_t inFrame; // the frame header was read, blocks are next
+    boolean_t lastBlock; // the last block of the frame was decoded, its checksum is next
+    boolean_t frameDecoded; // the stream can end after it
+    boolean_t contentChecksum;
+    uint64_t contentSize; // ZSTD_UNKNOWN_SIZE if the frame doesn't tell
+    uint64_t frameStart; // the output of the frame, matches can't reach before it
+    uint32_t repeatOffsets[3];
+    uint8_t* literals; // ZSTD_BLOCK_MAX_SIZE, the literals of the block
+    boolean_t hasHuffman; // for the literals of treeless blocks
+    int32_t huffmanBits;
+    uint16_t huffmanTable[1 << ZSTD_MAX_HUFFMAN_BITS]; // symbol << 8 | length
+    zstd_fse_table_s litlenTable;
+    zstd_fse_table_s offsetTable;
+    zstd_fse_table_s matchlenTable;
+} zstd_state_s;
+
+#define ZSTD_UNKNOWN_SIZE (0xFFFFFFFFFFFFFFFFULL)
+
+boolean_t InitZstd(zstd_state_s* state);
+void FreeZstd(zstd_state_s* state);
+decode_status_t ZstdDecode(zstd_state_s* state, decode_stream_s* stream);
+uint64_t GetZstdSize(const uint8_t* input, uint64_t inputSize); // 0 if the header doesn't tell
@@ -0,0 +1,50 @@
+#pragma once
+#include <uefi.h>
+#include "decoders.h"
+#include "imageverify.h"
+
+// Transparent decompression of images: gzip, zstd and LZ4 streams, and the EFI zboot images of Linux
+// (a PE stub with a compressed kernel as its payload, the payload is unpacked and loaded instead)
+// The image is decompressed while the rest of the file is still being read, into a buffer that is grown
+// as needed (it starts at the size the stream tells, if it does)
+// A file that isn't compressed is passed through as it was read, and so is one that fails to decompress
+
+#define DECOMPRESS_HEADER_SIZE (64) // the magic numbers, and the zboot header
+#define DECOMPRESS_SLACK (ZSTD_BLOCK_MAX_SIZE) // a zstd block has to fit before it is decoded
+
+typedef enum compression_t{
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_LZ4,
+    COMPRESSION_ZSTD
+} compression_t;
+
+// Where the compressed stream of a file is
+typedef struct compressed_stream_s{
+    compression_t compression;
+    boolean_t zboot;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t sizeOffset; // the decompressed size (32 bits) the file has after the stream, 0 if it doesn't
+} compressed_stream_s;
+
+typedef struct decompress_s{
+    compressed_stream_s source;
+    const uint8_t* file; // the file the stream is in, as much of it as was read
+    decode_stream_s stream;
+    decode_status_t status;
+    union{
+        inflate_state_s gzip;
+        lz4_state_s lz4;
+        zstd_state_s zstd;
+    } state;
+} decompress_s;
+
+boolean_t DetectCompression(const uint8_t* header, uint64_t headerSize, uint64_t fileSize,
+    compressed_stream_s* source);
+decompress_s* BeginDecompress(const char_t* file, uint64_t fileSize, uint64_t bytesRead);
+decode_status_t StepDecompress(decompress_s* decompress, uint64_t bytesRead);
+char_t* EndDecompress(decompress_s* decompress, char_t* file, uint64_t* size, const char_t* path);
+void CancelDecompress(decompress_s* decompress);
+char_t* ReadImageFile(efi_file_handle_t* file, efi_handle_t volume, uint64_t fileSize, uint64_t* outSize,
+    const char_t* path, image_verify_s* verify);
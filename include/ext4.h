@@ -0,0 +1,18 @@
+#pragma once
+#include <uefi.h>
+
+// Read-only ext2/ext3/ext4 driver on top of EFI_BLOCK_IO_PROTOCOL
+// Every partition with an ext file system (and no file system protocol of its own) gets the simple file system
+// protocol, so the volumes of the loader, the LoadImage of the firmware and the EFI stub of the kernel open files
+// on it like on the ESP (a config path can name it with a volume prefix, like "rootfs:\boot\vmlinuz")
+// Files are mapped with their extents (or the block map of ext2/3), and every run of contiguous blocks is read
+// with one transfer straight into the buffer of the caller
+// Directories are looked up through their htree index when they have one, symlinks are followed
+// Nothing is written, not even the journal: a volume that wasn't unmounted cleanly is read as it is on the disk
+
+#define EXT4_MAX_SYMLINKS (8) // followed while a path is opened
+#define EXT4_PATH_MAX (4096)
+#define EXT4_NAME_MAX (255)
+#define EXT4_BOUNCE_SIZE (256 * 1024) // for the reads that aren't aligned to the sectors of the disk
+
+void MountExt4Volumes(void);
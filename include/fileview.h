@@ -0,0 +1,34 @@
+#pragma once
+#include <uefi.h>
+
+// Random access to a file through a few fixed-size windows, instead of reading all of it into memory
+// A window is read when a byte in it is first asked for, the least recently used one makes room for a new one,
+// so the memory a view takes doesn't depend on the size of the file
+// For callers that only need a header, or go over a file once (cat), the config and the images are still
+// read whole (GetFileContent, ReadImageFile)
+
+#define FILE_VIEW_WINDOW_SIZE (64 * 1024) // windows start at multiples of it
+#define FILE_VIEW_MAX_WINDOWS (4)
+
+typedef struct file_view_window_s{
+    char_t* data; // a file buffer of FILE_VIEW_WINDOW_SIZE, NULL until the window is used
+    uint64_t offset; // in the file
+    uint64_t size; // the bytes of the file in it, 0 if it holds none
+    uint64_t lastUse;
+} file_view_window_s;
+
+typedef struct file_view_s{
+    efi_file_handle_t* file;
+    boolean_t ownsFile; // opened by OpenFileView, closed with the view
+    uint64_t fileSize;
+    file_view_window_s windows[FILE_VIEW_MAX_WINDOWS];
+    uint64_t uses; // stamps lastUse of the windows
+    uint64_t windowReads;
+} file_view_s;
+
+boolean_t OpenFileView(file_view_s* view, const char_t* path);
+void AttachFileView(file_view_s* view, efi_file_handle_t* file, uint64_t fileSize);
+const char_t* MapFileView(file_view_s* view, uint64_t offset, uint64_t* size);
+uint64_t ReadFileView(file_view_s* view, uint64_t offset, void* buffer, uint64_t size);
+void ReleaseFileView(file_view_s* view);
+void CloseFileView(file_view_s* view);
@@ -0,0 +1,41 @@
+#pragma once
+#include <uefi.h>
+
+// Keeps the images that were read for a boot in memory for the rest of the session
+// Entries often share a kernel and only differ in their args (recovery, single, debug...), and a boot that failed
+// is often tried again, the image is then taken from memory instead of being read (and decompressed) again
+// An image is keyed by its volume, path, size and modification time, so an image that changed is read again,
+// one that was verified against a digest is only given to an entry pinned to the same digest (or to none)
+// The images are counted by reference, the least recently used one nothing holds is dropped to make room
+// Only the images that are read into a buffer are kept (the prefetched ones, and the ones loaded from a buffer),
+// a kernel that is read straight to its address by the linux boot isn't
+
+#define IMAGE_CACHE_MAX_IMAGES (8)
+#define IMAGE_CACHE_BUDGET (256ULL * 1024 * 1024) // the bytes of the images together
+
+typedef struct image_key_s{
+    efi_handle_t volume; // NULL if the image can't be cached
+    const char_t* path;
+    uint64_t fileSize;
+    efi_time_t modificationTime;
+    const char_t* sha256; // the digest the image is pinned to (and was verified against), NULL if it isn't
+} image_key_s;
+
+typedef struct image_cache_stats_s{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytesSaved; // of the files the hits didn't read
+    uint64_t evictions;
+} image_cache_stats_s;
+
+void SetImageKey(image_key_s* key, efi_handle_t volume, const char_t* path, const efi_file_info_t* info,
+    const char_t* sha256);
+char_t* FindCachedImage(image_key_s* key, efi_handle_t volume, const char_t* path, const char_t* sha256,
+    uint64_t* outSize);
+char_t* AcquireCachedImage(const image_key_s* key, uint64_t* outSize);
+void CacheImage(const image_key_s* key, char_t* image, uint64_t size);
+void ReleaseImage(char_t* image);
+void TrimImageCache(void);
+void GetImageCacheStats(image_cache_stats_s* stats);
+void PrintImageCacheStats(void);
+void LogImageCacheStats(void);
@@ -0,0 +1,24 @@
+#pragma once
+#include <uefi.h>
+#include "fileview.h"
+#include "logs.h"
+
+// Checks the headers of an image before it is read, so a corrupted or foreign file is rejected by its first
+// bytes instead of after all of it was read (and the firmware refused it)
+// A PE image (DOS, PE and COFF headers, the optional header and the section table) has to be an EFI application
+// or driver for the machine of the loader, with its sections inside the file and the image size it declares
+// A bzImage booted with the linux boot protocol has to have a 64-bit setup header and all of its kernel in the file
+// A compressed image passes, its headers are only there once it is decompressed
+
+#define IMAGE_CHECK_REASON_LEN (128)
+#define IMAGE_CHECK_MAX_SECTIONS (96) // the PE/COFF limit
+#define IMAGE_CHECK_MAX_IMAGE_SIZE (1024ULL * 1024 * 1024) // SizeOfImage, larger is a corrupted header
+
+typedef enum image_check_t{
+    IMAGE_CHECK_PENDING, // not checked yet
+    IMAGE_CHECK_VALID,
+    IMAGE_CHECK_INVALID
+} image_check_t;
+
+boolean_t CheckImageHeaders(file_view_s* view, boolean_t linuxBoot, char_t* reason);
+image_check_t CheckImageFile(efi_handle_t volume, const char_t* path, boolean_t linuxBoot, log_level_t level);
@@ -0,0 +1,29 @@
+#pragma once
+#include <uefi.h>
+#include "sha256.h"
+
+// Verifies the image of an entry against the digest of its sha256 key
+// The file is hashed while it is read, the chunks that arrived are hashed while the next one is in flight
+// (see ReadImageFile and prefetch.c), so it isn't a second pass over the image
+// The digest is of the file as it is on the volume, a compressed image is hashed before it is decompressed
+// The images that matched are remembered in a cache on the ESP, by their volume and path, size and modification
+// time, so an image that didn't change since isn't hashed on every boot
+
+#define IMAGE_VERIFY_CACHE_PATH ("\\EFI\\thatloader\\verified.bin")
+#define IMAGE_VERIFY_CACHE_MAX_RECORDS (32) // the oldest one is dropped for a new one
+
+typedef struct image_verify_s{
+    uint8_t expected[SHA256_DIGEST_SIZE];
+    uint8_t key[SHA256_DIGEST_SIZE]; // the digest of the volume and the path of the image
+    uint64_t fileSize;
+    efi_time_t modificationTime;
+    boolean_t cached; // the cache vouches for the file, it isn't hashed
+    sha256_s sha;
+    uint64_t hashed; // the bytes of the file that were hashed so far
+    uint64_t hashTicks; // spent hashing
+} image_verify_s;
+
+boolean_t BeginImageVerify(image_verify_s* verify, const char_t* sha256, const char_t* volume, const char_t* path,
+    efi_file_handle_t* file);
+void StepImageVerify(image_verify_s* verify, const char_t* file, uint64_t bytesRead);
+boolean_t EndImageVerify(image_verify_s* verify, const char_t* file, const char_t* path);
@@ -0,0 +1,25 @@
+#pragma once
+#include <uefi.h>
+
+// Serves the initrds of an entry to the EFI stub of the kernel from memory (Linux 5.8 and later)
+// The initrd= files are read once into one page aligned buffer, which the stub loads through the LoadFile2 protocol
+// on the LINUX_EFI_INITRD_MEDIA_GUID device path (instead of reading every file itself)
+// The initrd= args stay on the command line for kernels without this, the stub ignores them when the protocol is there
+
+#define INITRD_ARG_PREFIX ("initrd=")
+#define INITRD_MAX_FILES (3) // microcode, the main initrd, and one more
+#define INITRD_ALIGNMENT (4) // the cpio archives are concatenated on 4 byte boundaries
+
+// The initrd= paths of a command line
+typedef struct initrd_list_s{
+    char_t* pathsBuffer; // the paths are stored one after the other
+    const char_t* paths[INITRD_MAX_FILES];
+    int32_t numOfPaths;
+} initrd_list_s;
+
+boolean_t GetInitrdPaths(const char_t* args, initrd_list_s* list);
+void FreeInitrdPaths(initrd_list_s* list);
+boolean_t InstallInitrd(const initrd_list_s* list, efi_handle_t volumeHandle);
+void UninstallInitrd(void);
+char_t* ReadInitrds(const initrd_list_s* list, efi_handle_t volumeHandle, efi_physical_address_t maxAddress,
+    uint64_t* size);
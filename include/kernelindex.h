@@ -0,0 +1,26 @@
+#pragma once
+#include <uefi.h>
+#include "arena.h"
+
+// A kernel found in a kerneldir directory
+typedef struct kernel_image_s{
+    char_t* fileName; // vmlinuz-6.5.2-arch1
+    char_t* version; // 6.5.2, NULL if the file name has no version
+    char_t* release; // 6.5.2-arch1 (points into fileName), kernels are sorted by it
+    char_t* initrdName; // initrd with the same version in the directory, NULL if there is none
+} kernel_image_s;
+
+// Every kernel of a directory, newest first
+// Indexes are kept between config reloads and rebuilt only when the directory is modified
+// The entries copy what they use of an index, since the old index is freed when it is rebuilt
+typedef struct kernel_index_s{
+    char_t* directory;
+    uint64_t modificationTime;
+    kernel_image_s* kernels;
+    int32_t numOfKernels;
+    arena_s arena; // owns the index and its strings
+    struct kernel_index_s* next;
+} kernel_index_s;
+
+const kernel_index_s* GetKernelIndex(const char_t* directoryPath);
+int32_t CompareVersions(const char_t* lhs, const char_t* rhs);
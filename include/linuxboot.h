@@ -0,0 +1,14 @@
+#pragma once
+#include <uefi.h>
+
+// Boots a bzImage with the 64-bit linux boot protocol (Documentation/arch/x86/boot.rst), without LoadImage
+// The protected mode kernel is read straight to its preferred address, boot_params gets the command line,
+// the initrds, the framebuffer and the memory map, and the loader jumps to the kernel after ExitBootServices
+// The kernel needs a setup header of version 2.12 or later (Linux 3.8), with a 64-bit entry point
+
+#define LINUX_SETUP_HEADER_READ_SIZE (1024) // the first two sectors, the setup header is in them
+#define LINUX_MIN_BOOT_PROTOCOL (0x020c)
+#define LINUX_BOOT_PARAMS_SIZE (4096)
+#define LINUX_E820_MAX_ENTRIES (128) // the e820 table of boot_params
+
+void BootLinux(const char_t* path, const char_t* args, const char_t* volume, const char_t* sha256);
@@ -7,8 +7,11 @@ typedef enum log_level_t{
     LL_ERROR
 }  log_level_t;
 
+#define LOG_BUFFER_SIZE (64 * 1024) // the log is kept in memory until FlushLog (the last LOG_BUFFER_SIZE bytes of it)
+
 int8_t InitLogger(void);
 void Log(log_level_t log_level, efi_status_t status, const char_t* fmtMessage, ...);
+void FlushLog(void);
 const char_t* LogLevelString(log_level_t log_level);
 const char_t* EfiErrorString(efi_status_t status);
 time_t GetSecondsSinceInit(void);
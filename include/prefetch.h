@@ -0,0 +1,16 @@
+#pragma once
+#include <uefi.h>
+
+// Reads the image and the initrds of the highlighted entry in the background while the menu waits for input
+// The chunks of the files are requested and collected between key polls (see SetIdleHandler and asyncread.h),
+// so the menu stays responsive
+
+#define PREFETCH_MAX_FILES (4) // the image and its initrds
+#define PREFETCH_DECOMPRESS_STEP (256 * 1024) // the compressed bytes of the image one step decodes
+#define PREFETCH_VERIFY_STEP (512 * 1024) // the bytes of a pinned image one step hashes
+
+void PrefetchFiles(const char_t* const* paths, int32_t numOfPaths, const char_t* volumeName,
+    const char_t* imageSha256);
+boolean_t PrefetchStep(void);
+void CancelPrefetch(void);
+char_t* TakePrefetchedFile(const char_t* path, uint64_t* outFileSize, const char_t* sha256);
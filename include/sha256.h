@@ -0,0 +1,23 @@
+#pragma once
+#include <uefi.h>
+
+// Streaming SHA-256 (FIPS 180-4), the data can be given in pieces of any size as it is read
+// The blocks are compressed with the SHA extensions of the CPU when it has them (SHA-NI on x86_64),
+// otherwise in portable C, the implementation is picked once by CPUID
+
+#define SHA256_DIGEST_SIZE (32)
+#define SHA256_BLOCK_SIZE (64)
+#define SHA256_HEX_LEN (SHA256_DIGEST_SIZE * 2)
+
+typedef struct sha256_s{
+    uint32_t state[8];
+    uint8_t block[SHA256_BLOCK_SIZE]; // the bytes of a block that isn't complete yet
+    uint32_t blockSize;
+    uint64_t length; // of the message so far, in bytes
+} sha256_s;
+
+void Sha256Init(sha256_s* sha);
+void Sha256Update(sha256_s* sha, const void* data, uint64_t size);
+void Sha256Final(sha256_s* sha, uint8_t* digest);
+const char_t* GetSha256Implementation(void);
+boolean_t ParseSha256(const char_t* hex, uint8_t* digest);
@@ -1,4 +1,9 @@
 #pragma once
 #include <uefi.h>
+#include "shelldefs.h"
 
-int8_t StartShell(void);
\ No newline at end of file
+int8_t StartShell(void);
+
+// Split the args of a command into a list (quoted args can contain spaces), free it with FreeArgs
+int8_t ParseArgs(char_t* inputArgs, cmd_args_s** outputArgs);
+void FreeArgs(cmd_args_s* args);
\ No newline at end of file
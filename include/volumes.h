@@ -0,0 +1,12 @@
+#pragma once
+#include <uefi.h>
+
+// Registry of the volumes (simple file system handles) of the machine, built once per session
+// Files are looked up on the volume of the loader first, and the volume of every path that was found is cached
+
+#define VOLUME_LABEL_LEN (64)
+#define VOLUME_PATH_CACHE_SIZE (16)
+
+efi_handle_t FindFileVolume(const char_t* path, const char_t* volumeName);
+efi_file_handle_t* OpenVolumeFile(efi_handle_t volumeHandle, const char_t* path);
+void FreeVolumes(void);
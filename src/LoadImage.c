@@ -1,14 +1,48 @@
 #include "LoadImage.h"
 #include "logs.h"
 #include "bootutils.h"
+#include "bootphase.h"
+#include "prefetch.h"
+#include "initrd.h"
+#include "decompress.h"
+#include "blockcache.h"
+#include "volumes.h"
+#include "imagecheck.h"
+#include "imagecache.h"
+
+// File path media device path node (UEFI spec 10.3.5.4)
+#define MEDIA_DEVICE_PATH_TYPE (0x04)
+#define MEDIA_FILE_PATH_SUBTYPE (0x04)
+
+// libuefi leaves BS->UnloadImage untyped
+typedef efi_status_t (EFIAPI *efi_unload_image_t)(efi_handle_t imageHandle);
+
+static efi_device_path_t* CreateFileDevicePath(efi_device_path_t* volumePath, const char_t* path);
+static uintn_t GetDevicePathSize(efi_device_path_t* devPath);
+static efi_status_t LoadImageFromBuffer(efi_device_path_t* filePath, char_t* path, const char_t* volume,
+    const char_t* sha256, efi_handle_t devHandle, const image_key_s* imageKey, char_t** imgData,
+    efi_handle_t* imgHandle);
+static void UnloadFailedImage(efi_handle_t* imgHandle);
 
 
 /*
 *   handle args and load image using Bootservices method
+*   The firmware reads the image itself from the file device path, unless bufferedLoad is set
+*   (or the firmware can't load it that way), then the image is read into a buffer first
+*   volume (optional) is the label or partition GUID of the volume the image is on
+*   The headers of the image are checked first, a broken image is rejected before any of the rest of it is read
+*   An image the menu prefetched, or one a boot read before in the session (see imagecache.h), is loaded from memory,
+*   if the firmware rejects that copy the image is loaded as if it wasn't prefetched,
+*   a compressed image is decompressed when it is read
+*   (if the firmware rejects it, the file is loaded as it is, a zboot image can unpack itself)
+*   The initrd= files are served to the kernel from memory, unless kernelInitrd is set
+*   sha256 (optional) is the digest the image is pinned to, the image is then always read by us (the firmware
+*   can't be made to hash it), and isn't loaded unless it matches
 */
-void ChainloadImage(char_t* path, char_t* args)
+void ChainloadImage(char_t* path, char_t* args, const char_t* volume, boolean_t bufferedLoad, boolean_t kernelInitrd,
+    const char_t* sha256)
 {
-    efi_handle_t devHandle = GetFileDeviceHandle(path);
+    efi_handle_t devHandle = GetFileDeviceHandle(path, volume);
     if(devHandle == NULL)
     {
         Log(LL_ERROR, 0, "Unable to find device handle in chainloading process '%s'.", path);
@@ -21,25 +55,82 @@ void ChainloadImage(char_t* path, char_t* args)
     efi_status_t status = BS->HandleProtocol(devHandle, &devPathGuid, (void**)&devPath);
     if(EFI_ERROR(status))
     {
-        Log(LL_ERROR, status, "Failed to handle device path '%s'.", devPath);
+        Log(LL_ERROR, status, "Failed to handle device path '%s'.", path);
         return;
     }
 
-    // Read the file into a buffer
-    uintn_t imgFileSize = 0;
-    char_t* imgData = GetFileContent(path, &imgFileSize);
-    if(imgData == NULL)
+    efi_device_path_t* filePath = CreateFileDevicePath(devPath, path);
+    if(filePath == NULL)
     {
-        Log(LL_ERROR, 0, "Failed to read file '%s' for chainloading.", path);
+        Log(LL_ERROR, 0, "Failed to create the device path of '%s'.", path);
         return;
     }
 
     //Load the image
-    efi_handle_t imgHandle;
-    status = BS->LoadImage(FALSE, IM, devPath, imgData, imgFileSize, &imgHandle);
-    if(EFI_ERROR(status))
+    char_t* imgData = NULL;
+    wchar_t* loadOptions = NULL;
+    efi_handle_t imgHandle = NULL;
+    boolean_t loaded = FALSE;
+    boolean_t started = FALSE; // an image that was started can't be unloaded by us
+
+    // The menu may have read the image already, or a boot of it before
+    uint64_t prefetchedSize = 0;
+    image_key_s imageKey;
+    memset(&imageKey, 0, sizeof(image_key_s));
+    imgData = TakePrefetchedFile(path, &prefetchedSize, sha256);
+    if(imgData == NULL)
+    {
+        imgData = FindCachedImage(&imageKey, devHandle, path, sha256, &prefetchedSize);
+    }
+    boolean_t prefetched = imgData != NULL;
+    if(!prefetched)
+    {
+        boot_phase_t phase = BeginBootPhase("check", path);
+        image_check_t check = CheckImageFile(devHandle, path, FALSE, LL_ERROR);
+        EndBootPhase(phase);
+        if(check != IMAGE_CHECK_VALID)
+        {
+            free(filePath);
+            goto cleanup;
+        }
+    }
+    if(prefetched)
+    {
+        boot_phase_t phase = BeginBootPhase("load", path);
+        status = BS->LoadImage(FALSE, IM, filePath, imgData, prefetchedSize, &imgHandle);
+        EndBootPhase(phase);
+        loaded = !EFI_ERROR(status);
+        if(!loaded)
+        {
+            Log(LL_WARNING, status, "The firmware failed to load the prefetched '%s'.", path);
+            UnloadFailedImage(&imgHandle);
+            ReleaseImage(imgData);
+            imgData = NULL;
+        }
+    }
+    if(!loaded && !bufferedLoad && sha256 == NULL)
     {
-        Log(LL_ERROR, 0, "Failed to load the image '%s' for chainloading.", path);
+        boot_phase_t phase = BeginBootPhase("load", path);
+        status = BS->LoadImage(FALSE, IM, filePath, NULL, 0, &imgHandle);
+        EndBootPhase(phase);
+        loaded = !EFI_ERROR(status);
+        if(!loaded)
+        {
+            Log(LL_WARNING, status, "The firmware failed to load '%s' from its device path.", path);
+            UnloadFailedImage(&imgHandle);
+        }
+    }
+    // a buffered load can't pass a security check the direct load failed
+    // (a prefetched or cached image that failed is read again, like an image that wasn't prefetched)
+    if(!loaded && status != EFI_SECURITY_VIOLATION && status != EFI_ACCESS_DENIED)
+    {
+        status = LoadImageFromBuffer(filePath, path, volume, sha256, devHandle, &imageKey, &imgData, &imgHandle);
+        loaded = !EFI_ERROR(status);
+    }
+    free(filePath);
+    if(!loaded)
+    {
+        Log(LL_ERROR, status, "Failed to load the image '%s' for chainloading.", path);
         goto cleanup;
     }
 
@@ -56,14 +147,32 @@ void ChainloadImage(char_t* path, char_t* args)
         //add args to image, if any
         if (args != NULL)
         {
-            imgProtocol->LoadOptions = StringToWideString(args);
+            loadOptions = StringToWideString(args);
+            imgProtocol->LoadOptions = loadOptions;
             imgProtocol->LoadOptionsSize = (strlen(args) + 1) * sizeof(wchar_t);
         }
         imgProtocol->DeviceHandle = devHandle;
     }
 
+    initrd_list_s initrds;
+    if(!kernelInitrd && GetInitrdPaths(args, &initrds))
+    {
+        InstallInitrd(&initrds, devHandle);
+        FreeInitrdPaths(&initrds);
+    }
+    CancelPrefetch();
+    // the other images are given back, the image stays cached in case it returns
+    TrimImageCache();
+
     Log(LL_INFO, 0, "Chainloading the image... '%s'", path);
+    LogBootTimeline();
+    LogBlockCacheStats();
+    LogImageCacheStats();
+    FlushLog();
+    boot_phase_t phase = BeginBootPhase("start", NULL);
+    started = TRUE;
     status = BS->StartImage(imgHandle, NULL, NULL);
+    EndBootPhase(phase);
     if(EFI_ERROR(status))
     {
         Log(LL_ERROR, 0, "Failed to start the image '%s'", path);
@@ -72,13 +181,124 @@ void ChainloadImage(char_t* path, char_t* args)
 cleanup:
 // if chainloading fails, we have to clean things up for the next booting
 // aaaaaaaand we gotta take care of mem leaks
-    if(args != NULL)
+    if(imgHandle != NULL && !started)
+    {
+        (*(efi_unload_image_t*)&BS->UnloadImage)(imgHandle);
+    }
+    UninstallInitrd();
+    CancelPrefetch();
+    free(loadOptions);
+    ReleaseImage(imgData);
+
+
+
+
+}
+
+/*
+* The old way, read the whole image (decompressing it) and let the firmware load it from the buffer
+* A pinned image (sha256 isn't NULL) is verified while it is read, it isn't loaded if it doesn't match
+* The file is read from devHandle, the image is kept in the image cache with imageKey (from FindCachedImage)
+* imgData gets the buffer (the caller releases it once the image is no longer needed)
+*/
+static efi_status_t LoadImageFromBuffer(efi_device_path_t* filePath, char_t* path, const char_t* volume,
+    const char_t* sha256, efi_handle_t devHandle, const image_key_s* imageKey, char_t** imgData,
+    efi_handle_t* imgHandle)
+{
+    // Read the file into a buffer
+    uint64_t imgFileSize = 0;
+    efi_file_handle_t* file = OpenVolumeFile(devHandle, path);
+    if(file != NULL)
+    {
+        image_verify_s verify;
+        if(sha256 == NULL || BeginImageVerify(&verify, sha256, volume, path, file))
+        {
+            *imgData = ReadImageFile(file, devHandle, GetFileSize(file), &imgFileSize, path,
+                (sha256 != NULL) ? &verify : NULL);
+        }
+        file->Close(file);
+    }
+    if(*imgData == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to read file '%s' for chainloading.", path);
+        return EFI_LOAD_ERROR;
+    }
+    CacheImage(imageKey, *imgData, imgFileSize);
+
+    boot_phase_t phase = BeginBootPhase("load", path);
+    efi_status_t status = BS->LoadImage(FALSE, IM, filePath, *imgData, imgFileSize, imgHandle);
+    EndBootPhase(phase);
+    return status;
+}
+
+/*
+* A LoadImage that failed a security check still returns the handle of the image (so it can be
+* started under a policy that allows it), it is unloaded before the next attempt overwrites it
+*/
+static void UnloadFailedImage(efi_handle_t* imgHandle)
+{
+    if(*imgHandle != NULL)
     {
-        free(imgProtocol->LoadOptions);
+        (*(efi_unload_image_t*)&BS->UnloadImage)(*imgHandle);
+        *imgHandle = NULL;
     }
-    free(imgData);
+}
 
+/*
+* Build the device path of a file: the device path of its volume, a file path node, and an end node
+* The path is converted to UCS-2 with backslashes, the device path must be freed by the caller
+*/
+static efi_device_path_t* CreateFileDevicePath(efi_device_path_t* volumePath, const char_t* path)
+{
+    wchar_t* wpath = StringToWideString((char_t*)path);
+    if(wpath == NULL)
+    {
+        return NULL;
+    }
+    uintn_t pathLen = 0;
+    while(wpath[pathLen] != 0)
+    {
+        pathLen++;
+    }
+    uintn_t pathSize = (pathLen + 1) * sizeof(wchar_t);
+    uintn_t volumeSize = GetDevicePathSize(volumePath);
+    uintn_t nodeSize = sizeof(efi_device_path_t) + pathSize;
 
+    uint8_t* devPath = malloc(volumeSize + nodeSize + END_DEVICE_PATH_LENGTH);
+    if(devPath == NULL)
+    {
+        free(wpath);
+        return NULL;
+    }
+    memcpy(devPath, volumePath, volumeSize);
 
+    efi_device_path_t* fileNode = (efi_device_path_t*)(devPath + volumeSize);
+    fileNode->Type = MEDIA_DEVICE_PATH_TYPE;
+    fileNode->SubType = MEDIA_FILE_PATH_SUBTYPE;
+    SetDevicePathNodeLength(fileNode, nodeSize);
+    wchar_t* nodePath = (wchar_t*)(fileNode + 1);
+    memcpy(nodePath, wpath, pathSize);
+    for(wchar_t* c = nodePath; *c != 0; c++)
+    {
+        if(*c == L'/')
+        {
+            *c = L'\\';
+        }
+    }
+    free(wpath);
 
-}
\ No newline at end of file
+    efi_device_path_t* endNode = NextDevicePathNode(fileNode);
+    SetDevicePathEndNode(endNode);
+    return (efi_device_path_t*)devPath;
+}
+
+// Size of a device path without its end node
+static uintn_t GetDevicePathSize(efi_device_path_t* devPath)
+{
+    uint8_t* start = (uint8_t*)devPath;
+    while(!IsDevicePathEnd(devPath))
+    {
+        devPath = NextDevicePathNode(devPath);
+    }
+    return (uint8_t*)devPath - start;
+}
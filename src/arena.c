@@ -0,0 +1,139 @@
+#include "arena.h"
+#include "logs.h"
+#include "bootutils.h"
+
+#define ARENA_ALIGNMENT (sizeof(void*))
+#define ARENA_MIN_BLOCK_PAGES (4)
+
+#define ALIGN_UP(value, alignment) (((value) + (alignment) - 1) & ~((uintn_t)(alignment) - 1))
+
+static boolean_t AddArenaBlock(arena_s* arena, size_t size);
+static void FreeArenaBlocks(arena_s* arena, arena_block_s* last);
+
+/*
+* Make sure the next size bytes can be allocated from the current block
+* Used before allocations that are extended later (so they stay at the top of the arena)
+*/
+boolean_t ArenaReserve(arena_s* arena, size_t size)
+{
+    uint8_t* start = (uint8_t*)ALIGN_UP((uintn_t)arena->top, ARENA_ALIGNMENT);
+    if (arena->blocks != NULL && start + size <= arena->end)
+    {
+        return TRUE;
+    }
+    return AddArenaBlock(arena, size);
+}
+
+// Allocate size bytes (aligned for any struct), NULL if out of memory
+void* ArenaAlloc(arena_s* arena, size_t size)
+{
+    if (!ArenaReserve(arena, size))
+    {
+        return NULL;
+    }
+    uint8_t* ptr = (uint8_t*)ALIGN_UP((uintn_t)arena->top, ARENA_ALIGNMENT);
+    arena->top = ptr + size;
+    return ptr;
+}
+
+/*
+* Grow the allocation at ptr in place, which is possible only if it is the last allocation
+* of the arena and the block has enough room left
+*/
+boolean_t ArenaExtend(arena_s* arena, void* ptr, size_t oldSize, size_t newSize)
+{
+    uint8_t* allocation = ptr;
+    if (allocation == NULL || allocation + oldSize != arena->top || allocation + newSize > arena->end)
+    {
+        return FALSE;
+    }
+    arena->top = allocation + newSize;
+    return TRUE;
+}
+
+// Copy a string of len chars (and a null terminator) to the arena
+char_t* ArenaStoreString(arena_s* arena, const char_t* str, size_t len)
+{
+    char_t* copy = ArenaAlloc(arena, len + 1);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = CHAR_NULL;
+    return copy;
+}
+
+arena_mark_s ArenaMark(arena_s* arena)
+{
+    arena_mark_s mark = { arena->blocks, arena->top };
+    return mark;
+}
+
+// Drop everything that was allocated after the mark was taken
+void ArenaRewind(arena_s* arena, arena_mark_s mark)
+{
+    if (mark.block == NULL)
+    {
+        ArenaFree(arena);
+        return;
+    }
+    FreeArenaBlocks(arena, mark.block);
+    arena->blocks = mark.block;
+    arena->top = mark.top;
+    arena->end = (uint8_t*)mark.block + mark.block->pages * EFI_PAGE_SIZE;
+}
+
+// Release all of the memory of the arena, usually a single page run
+void ArenaFree(arena_s* arena)
+{
+    FreeArenaBlocks(arena, NULL);
+    arena->blocks = NULL;
+    arena->top = NULL;
+    arena->end = NULL;
+}
+
+/*
+* Blocks at least double in size, so the amount of blocks stays logarithmic in the
+* size of the arena
+*/
+static boolean_t AddArenaBlock(arena_s* arena, size_t size)
+{
+    uintn_t pages = EFI_SIZE_TO_PAGES(ALIGN_UP(sizeof(arena_block_s), ARENA_ALIGNMENT) + size);
+    if (arena->blocks != NULL && pages < arena->blocks->pages * 2)
+    {
+        pages = arena->blocks->pages * 2;
+    }
+    if (pages < ARENA_MIN_BLOCK_PAGES)
+    {
+        pages = ARENA_MIN_BLOCK_PAGES;
+    }
+
+    efi_physical_address_t address = 0;
+    efi_status_t status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &address);
+    if (EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to allocate %d pages for an arena", pages);
+        return FALSE;
+    }
+
+    arena_block_s* block = (arena_block_s*)address;
+    block->next = arena->blocks;
+    block->pages = pages;
+    arena->blocks = block;
+    arena->top = (uint8_t*)block + ALIGN_UP(sizeof(arena_block_s), ARENA_ALIGNMENT);
+    arena->end = (uint8_t*)block + pages * EFI_PAGE_SIZE;
+    return TRUE;
+}
+
+// Free the blocks of the arena that are newer than last (all of them if last is NULL)
+static void FreeArenaBlocks(arena_s* arena, arena_block_s* last)
+{
+    arena_block_s* block = arena->blocks;
+    while (block != NULL && block != last)
+    {
+        arena_block_s* next = block->next;
+        BS->FreePages((efi_physical_address_t)block, block->pages);
+        block = next;
+    }
+}
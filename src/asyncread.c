@@ -0,0 +1,496 @@
+#include "asyncread.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "clock.h"
+
+typedef efi_status_t (EFIAPI *efi_file_read_ex_t)(efi_file_handle_t* file, efi_file_io_token_t* token);
+
+// The revision 2 file protocol, libuefi only has the revision 1 functions
+typedef struct efi_file_handle_rev2_s{
+    efi_file_handle_t handle;
+    void* OpenEx;
+    efi_file_read_ex_t ReadEx;
+    void* WriteEx;
+    void* FlushEx;
+} efi_file_handle_rev2_t;
+
+static async_read_volume_s tunedVolumes[ASYNC_READ_MAX_VOLUMES];
+static int32_t numOfTunedVolumes = 0;
+static boolean_t showProgress = FALSE;
+static uint64_t lastProgressTicks = 0;
+
+static async_read_volume_s* FindTunedVolume(efi_handle_t volume);
+static void ProbeChunkSize(async_read_s* read);
+static void EndProbe(async_read_s* read);
+static void DrawProgress(async_read_s* const* reads, int32_t numOfReads, boolean_t done);
+static void SubmitChunks(async_read_s* read);
+static void CompleteChunk(async_read_s* read, async_read_chunk_s* chunk);
+static void DrainChunks(async_read_s* read);
+static void ReadRange(async_read_s* read, uint64_t offset, uint64_t length);
+static async_read_chunk_s* FindChunkInFlight(async_read_s* read);
+static inline uint64_t GetChunkLength(const async_read_s* read, uint64_t offset);
+static inline boolean_t IsAsyncReadDone(async_read_s* read);
+static inline void CountBytesRead(async_read_s* read, uint64_t size);
+
+/*
+* Start reading size bytes of an open file into buffer (from the start of the file)
+* Nothing is requested until the read is polled or finished
+*/
+void BeginAsyncRead(async_read_s* read, efi_file_handle_t* file, char_t* buffer, uint64_t size)
+{
+    BeginAsyncReadAt(read, file, 0, buffer, size);
+}
+
+// Start reading size bytes of an open file into buffer, from fileOffset
+void BeginAsyncReadAt(async_read_s* read, efi_file_handle_t* file, uint64_t fileOffset, char_t* buffer, uint64_t size)
+{
+    memset(read, 0, sizeof(async_read_s));
+    read->file = file;
+    read->fileOffset = fileOffset;
+    read->buffer = buffer;
+    read->size = size;
+    read->status = EFI_SUCCESS;
+    read->overlapped = file->Revision >= EFI_FILE_PROTOCOL_REVISION2 &&
+        ((efi_file_handle_rev2_t*)file)->ReadEx != NULL;
+    read->chunkSize = ASYNC_READ_CHUNK_SIZE;
+    read->startTicks = GetClockTicks();
+}
+
+/*
+* Read in the chunk size of the volume the file is on (set before the read is polled)
+* If it wasn't measured yet and the file is large enough, the first chunks of this read measure it
+*/
+void SetAsyncReadVolume(async_read_s* read, efi_handle_t volume)
+{
+    async_read_volume_s* tuned = FindTunedVolume(volume);
+    if(tuned == NULL)
+    {
+        return;
+    }
+    if(tuned->chunkSize != 0)
+    {
+        read->chunkSize = tuned->chunkSize;
+        return;
+    }
+    static const uint64_t probeSizes[ASYNC_READ_NUM_PROBES] = ASYNC_READ_PROBE_SIZES;
+    uint64_t probeSize = 0;
+    for(int32_t i = 0; i < ASYNC_READ_NUM_PROBES; i++)
+    {
+        probeSize += probeSizes[i];
+    }
+    // the probe chunks are timed, which needs the clock
+    if(!tuned->probing && read->nextOffset == 0 && read->size >= probeSize && GetClockFrequency() != 0)
+    {
+        tuned->probing = TRUE;
+        read->probeVolume = tuned;
+    }
+}
+
+/*
+* Collect the chunks that completed and request the next ones, without waiting for the firmware
+* Without ReadEx one chunk is read each time
+* returns TRUE once the whole file was read (or the read failed)
+*/
+boolean_t PollAsyncRead(async_read_s* read)
+{
+    if(read->probeVolume != NULL)
+    {
+        ProbeChunkSize(read);
+        return IsAsyncReadDone(read);
+    }
+    for(int32_t i = 0; i < ASYNC_READ_MAX_IN_FLIGHT; i++)
+    {
+        async_read_chunk_s* chunk = read->chunks + i;
+        if(chunk->inFlight && BS->CheckEvent(chunk->token.Event) == EFI_SUCCESS)
+        {
+            CompleteChunk(read, chunk);
+        }
+    }
+    SubmitChunks(read);
+    if(!read->overlapped && FindChunkInFlight(read) == NULL && !IsAsyncReadDone(read))
+    {
+        uint64_t length = GetChunkLength(read, read->nextOffset);
+        read->nextOffset += length;
+        ReadRange(read, read->nextOffset - length, length);
+    }
+    return IsAsyncReadDone(read);
+}
+
+/*
+* Poll the read, then wait for the first chunk that is still in flight (the one the read part ends at)
+* For a caller that uses the start of the buffer while the rest is read (see GetAsyncReadPrefix)
+* returns TRUE once the whole file was read (or the read failed)
+*/
+boolean_t WaitAsyncRead(async_read_s* read)
+{
+    if(PollAsyncRead(read))
+    {
+        DrawProgress(&read, 1, TRUE);
+        return TRUE;
+    }
+    async_read_chunk_s* first = NULL;
+    for(int32_t i = 0; i < ASYNC_READ_MAX_IN_FLIGHT; i++)
+    {
+        async_read_chunk_s* chunk = read->chunks + i;
+        if(chunk->inFlight && (first == NULL || chunk->offset < first->offset))
+        {
+            first = chunk;
+        }
+    }
+    uintn_t idx = 0;
+    if(first != NULL && !EFI_ERROR(BS->WaitForEvent(1, &first->token.Event, &idx)))
+    {
+        CompleteChunk(read, first);
+    }
+    boolean_t done = IsAsyncReadDone(read);
+    DrawProgress(&read, 1, done);
+    return done;
+}
+
+// The bytes at the start of the buffer that were all read, the chunks after them may still be in flight
+uint64_t GetAsyncReadPrefix(const async_read_s* read)
+{
+    uint64_t prefix = read->nextOffset;
+    for(int32_t i = 0; i < ASYNC_READ_MAX_IN_FLIGHT; i++)
+    {
+        if(read->chunks[i].inFlight && read->chunks[i].offset < prefix)
+        {
+            prefix = read->chunks[i].offset;
+        }
+    }
+    return EFI_ERROR(read->status) ? 0 : prefix;
+}
+
+// Wait until the whole file was read, returns the status of the read
+efi_status_t FinishAsyncRead(async_read_s* read)
+{
+    return FinishAsyncReads(&read, 1);
+}
+
+/*
+* Wait until all the files were read, their chunks are in flight together
+* returns the first error of the reads, EFI_SUCCESS if all of them were read
+*/
+efi_status_t FinishAsyncReads(async_read_s* const* reads, int32_t numOfReads)
+{
+    while(TRUE)
+    {
+        boolean_t done = TRUE;
+        async_read_chunk_s* waitChunk = NULL;
+        async_read_s* waitRead = NULL;
+        for(int32_t i = 0; i < numOfReads; i++)
+        {
+            if(!PollAsyncRead(reads[i]))
+            {
+                done = FALSE;
+            }
+            if(waitChunk == NULL)
+            {
+                waitChunk = FindChunkInFlight(reads[i]);
+                waitRead = reads[i];
+            }
+        }
+        if(done)
+        {
+            break;
+        }
+        // sleep until a chunk completes, the others are collected by the next poll
+        uintn_t idx = 0;
+        if(waitChunk != NULL && !EFI_ERROR(BS->WaitForEvent(1, &waitChunk->token.Event, &idx)))
+        {
+            CompleteChunk(waitRead, waitChunk);
+        }
+        DrawProgress(reads, numOfReads, FALSE);
+    }
+    if(numOfReads > 0)
+    {
+        DrawProgress(reads, numOfReads, TRUE);
+    }
+
+    for(int32_t i = 0; i < numOfReads; i++)
+    {
+        if(EFI_ERROR(reads[i]->status))
+        {
+            return reads[i]->status;
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+* Stop requesting chunks and wait for the ones in flight (the firmware still writes to the buffer until they complete)
+* The buffer can be freed after it
+*/
+void CancelAsyncRead(async_read_s* read)
+{
+    if(read->status == EFI_SUCCESS)
+    {
+        read->status = EFI_ABORTED;
+    }
+    DrainChunks(read);
+    if(read->probeVolume != NULL)
+    {
+        EndProbe(read);
+    }
+}
+
+// Log how long the read took and how fast it was (the media and the firmware together), once it is done
+void LogAsyncRead(const async_read_s* read, const char_t* path)
+{
+    if(read->endTicks == 0)
+    {
+        return;
+    }
+    uint64_t microseconds = TicksToMicroseconds(read->endTicks - read->startTicks);
+    uint64_t kibPerSecond = (microseconds > 0) ? read->size * 1000000 / 1024 / microseconds : 0;
+    Log(LL_INFO, 0, "Read '%s': %d KiB in %d ms, %d KiB/s (%d KiB chunks%s)", path, (int32_t)(read->size / 1024),
+        (int32_t)(microseconds / 1000), (int32_t)kibPerSecond, (int32_t)(read->chunkSize / 1024),
+        read->overlapped ? ", overlapped" : "");
+}
+
+// Draw a progress bar while the reads are waited for (the reads of an entry that is being booted)
+void ShowAsyncReadProgress(boolean_t show)
+{
+    showProgress = show;
+    lastProgressTicks = 0;
+}
+
+// The volume in the table of tuned chunk sizes, it is added if it isn't there (NULL if the table is full)
+static async_read_volume_s* FindTunedVolume(efi_handle_t volume)
+{
+    if(volume == NULL)
+    {
+        return NULL;
+    }
+    for(int32_t i = 0; i < numOfTunedVolumes; i++)
+    {
+        if(tunedVolumes[i].handle == volume)
+        {
+            return tunedVolumes + i;
+        }
+    }
+    if(numOfTunedVolumes == ASYNC_READ_MAX_VOLUMES)
+    {
+        return NULL;
+    }
+    async_read_volume_s* tuned = tunedVolumes + numOfTunedVolumes++;
+    memset(tuned, 0, sizeof(async_read_volume_s));
+    tuned->handle = volume;
+    return tuned;
+}
+
+// Read the next probe chunk with Read and time it, the fastest one so far is the chunk size of the read
+static void ProbeChunkSize(async_read_s* read)
+{
+    static const uint64_t probeSizes[ASYNC_READ_NUM_PROBES] = ASYNC_READ_PROBE_SIZES;
+    uint64_t length = probeSizes[read->probe++];
+    uint64_t start = GetClockTicks();
+    ReadRange(read, read->nextOffset, length);
+    uint64_t ticks = GetClockTicks() - start;
+    read->nextOffset += length;
+
+    uint64_t rate = length * GetClockFrequency() / ((ticks > 0) ? ticks : 1);
+    if(rate > read->probeBestRate)
+    {
+        read->probeBestRate = rate;
+        read->chunkSize = length;
+    }
+    if(read->probe == ASYNC_READ_NUM_PROBES || EFI_ERROR(read->status))
+    {
+        EndProbe(read);
+    }
+}
+
+// The volume is tuned if all the probe chunks were read, otherwise the next large read measures it again
+static void EndProbe(async_read_s* read)
+{
+    async_read_volume_s* volume = read->probeVolume;
+    volume->probing = FALSE;
+    read->probeVolume = NULL;
+    if(read->probe < ASYNC_READ_NUM_PROBES || EFI_ERROR(read->status))
+    {
+        return;
+    }
+    volume->chunkSize = read->chunkSize;
+    Log(LL_INFO, 0, "Tuned the chunk size of a volume to %d KiB (measured %d KiB/s)",
+        (int32_t)(read->chunkSize / 1024), (int32_t)(read->probeBestRate / 1024));
+}
+
+/*
+* Draw the progress of the reads (all of them as one) on the line of the cursor
+* It is drawn every ASYNC_READ_PROGRESS_INTERVAL_US, the last draw once they are done ends the line
+*/
+static void DrawProgress(async_read_s* const* reads, int32_t numOfReads, boolean_t done)
+{
+    uint64_t now = GetClockTicks();
+    if(!showProgress || (!done && TicksToMicroseconds(now - lastProgressTicks) < ASYNC_READ_PROGRESS_INTERVAL_US))
+    {
+        return;
+    }
+    lastProgressTicks = now;
+    uint64_t size = 0;
+    uint64_t bytesRead = 0;
+    uint64_t startTicks = now;
+    for(int32_t i = 0; i < numOfReads; i++)
+    {
+        size += reads[i]->size;
+        bytesRead += reads[i]->bytesRead;
+        startTicks = (reads[i]->startTicks < startTicks) ? reads[i]->startTicks : startTicks;
+    }
+    if(size == 0)
+    {
+        return;
+    }
+    char_t bar[ASYNC_READ_PROGRESS_WIDTH + 1];
+    uint64_t filled = bytesRead * ASYNC_READ_PROGRESS_WIDTH / size;
+    for(uint64_t i = 0; i < ASYNC_READ_PROGRESS_WIDTH; i++)
+    {
+        bar[i] = (i < filled) ? '#' : '-';
+    }
+    bar[ASYNC_READ_PROGRESS_WIDTH] = CHAR_NULL;
+    uint64_t microseconds = TicksToMicroseconds(now - startTicks);
+    uint64_t kibPerSecond = (microseconds > 0) ? bytesRead * 1000000 / 1024 / microseconds : 0;
+    printf("\r[%s] %3d%% %d KiB/s    %s", bar, (int32_t)(bytesRead * 100 / size), (int32_t)kibPerSecond,
+        done ? "\n" : "");
+}
+
+// Request chunks with ReadEx until there are ASYNC_READ_MAX_IN_FLIGHT of them in flight
+static void SubmitChunks(async_read_s* read)
+{
+    efi_file_handle_rev2_t* file = (efi_file_handle_rev2_t*)read->file;
+    for(int32_t i = 0; i < ASYNC_READ_MAX_IN_FLIGHT; i++)
+    {
+        async_read_chunk_s* chunk = read->chunks + i;
+        if(!read->overlapped || EFI_ERROR(read->status) || read->nextOffset >= read->size)
+        {
+            return;
+        }
+        if(chunk->inFlight)
+        {
+            continue;
+        }
+
+        efi_status_t status = BS->CreateEvent(0, 0, NULL, NULL, &chunk->token.Event);
+        if(!EFI_ERROR(status))
+        {
+            chunk->offset = read->nextOffset;
+            chunk->token.Status = EFI_SUCCESS;
+            chunk->token.BufferSize = GetChunkLength(read, chunk->offset);
+            chunk->token.Buffer = read->buffer + chunk->offset;
+            // ReadEx reads from the position of the file, it is moved only while no chunk is in flight
+            status = read->file->SetPosition(read->file, read->fileOffset + chunk->offset);
+            if(!EFI_ERROR(status))
+            {
+                status = file->ReadEx(read->file, &chunk->token);
+            }
+            if(EFI_ERROR(status))
+            {
+                BS->CloseEvent(chunk->token.Event);
+            }
+        }
+        if(EFI_ERROR(status))
+        {
+            // the rest of the file is read with Read
+            Log(LL_WARNING, status, "Failed to request an overlapped read, reading the file in order");
+            read->overlapped = FALSE;
+            return;
+        }
+        chunk->inFlight = TRUE;
+        read->nextOffset += chunk->token.BufferSize;
+    }
+}
+
+static void CompleteChunk(async_read_s* read, async_read_chunk_s* chunk)
+{
+    BS->CloseEvent(chunk->token.Event);
+    chunk->inFlight = FALSE;
+    if(EFI_ERROR(chunk->token.Status))
+    {
+        if(read->status == EFI_SUCCESS)
+        {
+            read->status = chunk->token.Status;
+        }
+        return;
+    }
+    uint64_t length = GetChunkLength(read, chunk->offset);
+    CountBytesRead(read, chunk->token.BufferSize);
+    // a short read is finished in order, Read moves the position of the handle so nothing may be in flight
+    if(chunk->token.BufferSize < length)
+    {
+        DrainChunks(read);
+        ReadRange(read, chunk->offset + chunk->token.BufferSize, length - chunk->token.BufferSize);
+    }
+}
+
+// Wait for every chunk that is still in flight
+static void DrainChunks(async_read_s* read)
+{
+    async_read_chunk_s* chunk;
+    while((chunk = FindChunkInFlight(read)) != NULL)
+    {
+        uintn_t idx = 0;
+        BS->WaitForEvent(1, &chunk->token.Event, &idx);
+        CompleteChunk(read, chunk);
+    }
+}
+
+// Read a part of the file with Read
+static void ReadRange(async_read_s* read, uint64_t offset, uint64_t length)
+{
+    if(EFI_ERROR(read->status))
+    {
+        return;
+    }
+    efi_status_t status = read->file->SetPosition(read->file, read->fileOffset + offset);
+    while(!EFI_ERROR(status) && length > 0)
+    {
+        uintn_t size = length;
+        status = read->file->Read(read->file, &size, read->buffer + offset);
+        if(!EFI_ERROR(status) && size == 0)
+        {
+            status = EFI_END_OF_FILE; // the file is shorter than it was
+        }
+        offset += size;
+        length -= size;
+        CountBytesRead(read, size);
+    }
+    if(EFI_ERROR(status))
+    {
+        read->status = status;
+    }
+}
+
+static async_read_chunk_s* FindChunkInFlight(async_read_s* read)
+{
+    for(int32_t i = 0; i < ASYNC_READ_MAX_IN_FLIGHT; i++)
+    {
+        if(read->chunks[i].inFlight)
+        {
+            return read->chunks + i;
+        }
+    }
+    return NULL;
+}
+
+// The chunk that starts at offset, the last one is shorter
+static inline uint64_t GetChunkLength(const async_read_s* read, uint64_t offset)
+{
+    uint64_t left = read->size - offset;
+    return (left < read->chunkSize) ? left : read->chunkSize;
+}
+
+// Nothing is in flight, and the file was read or the read failed
+static inline boolean_t IsAsyncReadDone(async_read_s* read)
+{
+    return FindChunkInFlight(read) == NULL && (EFI_ERROR(read->status) || read->bytesRead == read->size);
+}
+
+// The read is timed until its last byte arrives
+static inline void CountBytesRead(async_read_s* read, uint64_t size)
+{
+    read->bytesRead += size;
+    if(read->bytesRead == read->size)
+    {
+        read->endTicks = GetClockTicks();
+    }
+}
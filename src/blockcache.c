@@ -0,0 +1,281 @@
+#include "blockcache.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "console.h"
+
+#define NO_SLOT (-1)
+#define BLOCK_HASH_MULTIPLIER (0x9E3779B1U)
+
+typedef struct cache_slot_s{
+    efi_block_io_t* device; // NULL while the slot is free
+    uint32_t mediaId;
+    uint64_t block; // in BLOCK_CACHE_BLOCK_SIZE units
+    int16_t hashNext;
+    int16_t older;
+    int16_t newer;
+    boolean_t readAhead; // read ahead and not used yet
+} cache_slot_s;
+
+static cache_slot_s slots[BLOCK_CACHE_SLOTS];
+static int16_t buckets[BLOCK_CACHE_HASH_SIZE];
+static int16_t newestSlot = NO_SLOT;
+static int16_t oldestSlot = NO_SLOT;
+static uint8_t* slotData = NULL; // the blocks of the slots, in pages
+static uint8_t* readBuffer = NULL; // a miss and the blocks it reads ahead
+static block_cache_stats_s cacheStats;
+
+static boolean_t InitBlockCache(void);
+static efi_status_t ReadMissedBlock(efi_block_io_t* blockIo, uint64_t block, uint64_t deviceSize, int16_t* slot);
+static int16_t FindSlot(efi_block_io_t* blockIo, uint64_t block);
+static int16_t TakeOldestSlot(void);
+static void InsertSlot(int16_t slot, efi_block_io_t* blockIo, uint64_t block);
+static void UnlinkSlot(int16_t slot);
+static void MakeNewest(int16_t slot);
+static inline uint32_t HashBlock(efi_block_io_t* blockIo, uint64_t block);
+
+/*
+* Read bytes of a device through the cache, at any offset and size
+* EFI_UNSUPPORTED if the sectors of the device don't divide BLOCK_CACHE_BLOCK_SIZE (it has to be read directly)
+*/
+efi_status_t ReadCachedBlocks(efi_block_io_t* blockIo, uint64_t offset, uint64_t size, void* buffer)
+{
+    uint32_t sectorSize = blockIo->Media->BlockSize;
+    if(sectorSize == 0 || BLOCK_CACHE_BLOCK_SIZE % sectorSize != 0)
+    {
+        return EFI_UNSUPPORTED;
+    }
+    if(!InitBlockCache())
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    uint64_t deviceSize = (blockIo->Media->LastBlock + 1) * sectorSize;
+    if(offset > deviceSize || size > deviceSize - offset)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    uint8_t* dest = buffer;
+    while(size > 0)
+    {
+        uint64_t block = offset / BLOCK_CACHE_BLOCK_SIZE;
+        uint64_t within = offset % BLOCK_CACHE_BLOCK_SIZE;
+        int16_t slot = FindSlot(blockIo, block);
+        if(slot == NO_SLOT)
+        {
+            cacheStats.misses++;
+            efi_status_t status = ReadMissedBlock(blockIo, block, deviceSize, &slot);
+            if(EFI_ERROR(status))
+            {
+                return status;
+            }
+        }
+        else
+        {
+            cacheStats.hits++;
+            if(slots[slot].readAhead)
+            {
+                cacheStats.readAheadHits++;
+                slots[slot].readAhead = FALSE;
+            }
+            MakeNewest(slot);
+        }
+        uint64_t length = BLOCK_CACHE_BLOCK_SIZE - within;
+        if(length > size)
+        {
+            length = size;
+        }
+        memcpy(dest, slotData + (uint64_t)slot * BLOCK_CACHE_BLOCK_SIZE + within, length);
+        dest += length;
+        offset += length;
+        size -= length;
+    }
+    return EFI_SUCCESS;
+}
+
+void GetBlockCacheStats(block_cache_stats_s* stats)
+{
+    *stats = cacheStats;
+}
+
+void PrintBlockCacheStats(void)
+{
+    uint64_t lookups = cacheStats.hits + cacheStats.misses;
+    if(lookups == 0)
+    {
+        return;
+    }
+    ConsolePrintf("Block cache: %d hits, %d misses (%d%% hit), %d read ahead hits, %d disk reads\n",
+        (int32_t)cacheStats.hits, (int32_t)cacheStats.misses, (int32_t)(cacheStats.hits * 100 / lookups),
+        (int32_t)cacheStats.readAheadHits, (int32_t)cacheStats.deviceReads);
+}
+
+void LogBlockCacheStats(void)
+{
+    uint64_t lookups = cacheStats.hits + cacheStats.misses;
+    if(lookups == 0)
+    {
+        return;
+    }
+    Log(LL_INFO, 0, "Block cache: %d hits, %d misses (%d%% hit), %d read ahead hits, %d disk reads, %d evictions",
+        (int32_t)cacheStats.hits, (int32_t)cacheStats.misses, (int32_t)(cacheStats.hits * 100 / lookups),
+        (int32_t)cacheStats.readAheadHits, (int32_t)cacheStats.deviceReads, (int32_t)cacheStats.evictions);
+}
+
+// The slots start free, all of them in the LRU list (a free slot is taken like the oldest one)
+static boolean_t InitBlockCache(void)
+{
+    if(slotData != NULL)
+    {
+        return TRUE;
+    }
+    slotData = (uint8_t*)AllocateFileBuffer((uint64_t)BLOCK_CACHE_SLOTS * BLOCK_CACHE_BLOCK_SIZE);
+    readBuffer = (uint8_t*)AllocateFileBuffer((uint64_t)BLOCK_CACHE_READAHEAD * BLOCK_CACHE_BLOCK_SIZE);
+    if(slotData == NULL || readBuffer == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate the block cache.");
+        FreeFileBuffer(slotData);
+        FreeFileBuffer(readBuffer);
+        slotData = NULL;
+        readBuffer = NULL;
+        return FALSE;
+    }
+    for(int32_t i = 0; i < BLOCK_CACHE_HASH_SIZE; i++)
+    {
+        buckets[i] = NO_SLOT;
+    }
+    for(int16_t i = 0; i < BLOCK_CACHE_SLOTS; i++)
+    {
+        slots[i].device = NULL;
+        slots[i].hashNext = NO_SLOT;
+        slots[i].older = (i > 0) ? i - 1 : NO_SLOT;
+        slots[i].newer = (i + 1 < BLOCK_CACHE_SLOTS) ? i + 1 : NO_SLOT;
+    }
+    oldestSlot = 0;
+    newestSlot = BLOCK_CACHE_SLOTS - 1;
+    return TRUE;
+}
+
+/*
+* Read a block that missed together with the blocks after it that aren't cached (up to BLOCK_CACHE_READAHEAD),
+* in one transfer, slot gets the block that missed
+*/
+static efi_status_t ReadMissedBlock(efi_block_io_t* blockIo, uint64_t block, uint64_t deviceSize, int16_t* slot)
+{
+    uint32_t count = 1;
+    while(count < BLOCK_CACHE_READAHEAD && (block + count + 1) * BLOCK_CACHE_BLOCK_SIZE <= deviceSize &&
+        FindSlot(blockIo, block + count) == NO_SLOT)
+    {
+        count++;
+    }
+    // the last block of a device may be partial
+    uint64_t start = block * BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t length = (uint64_t)count * BLOCK_CACHE_BLOCK_SIZE;
+    if(length > deviceSize - start)
+    {
+        length = deviceSize - start;
+        memset(readBuffer + length, 0, BLOCK_CACHE_BLOCK_SIZE - length);
+    }
+    cacheStats.deviceReads++;
+    efi_status_t status = blockIo->ReadBlocks(blockIo, blockIo->Media->MediaId, start / blockIo->Media->BlockSize,
+        length, readBuffer);
+    if(EFI_ERROR(status))
+    {
+        return status;
+    }
+
+    // the block that missed goes in last, as the newest
+    for(int32_t i = count - 1; i >= 0; i--)
+    {
+        int16_t taken = TakeOldestSlot();
+        memcpy(slotData + (uint64_t)taken * BLOCK_CACHE_BLOCK_SIZE, readBuffer + (uint64_t)i * BLOCK_CACHE_BLOCK_SIZE,
+            BLOCK_CACHE_BLOCK_SIZE);
+        InsertSlot(taken, blockIo, block + i);
+        slots[taken].readAhead = i > 0;
+        *slot = taken;
+    }
+    return EFI_SUCCESS;
+}
+
+static int16_t FindSlot(efi_block_io_t* blockIo, uint64_t block)
+{
+    uint32_t mediaId = blockIo->Media->MediaId;
+    for(int16_t slot = buckets[HashBlock(blockIo, block)]; slot != NO_SLOT; slot = slots[slot].hashNext)
+    {
+        if(slots[slot].block == block && slots[slot].device == blockIo && slots[slot].mediaId == mediaId)
+        {
+            return slot;
+        }
+    }
+    return NO_SLOT;
+}
+
+// The least recently used slot, out of its hash chain
+static int16_t TakeOldestSlot(void)
+{
+    int16_t slot = oldestSlot;
+    cache_slot_s* taken = &slots[slot];
+    if(taken->device != NULL)
+    {
+        cacheStats.evictions++;
+        int16_t* link = &buckets[HashBlock(taken->device, taken->block)];
+        while(*link != slot)
+        {
+            link = &slots[*link].hashNext;
+        }
+        *link = taken->hashNext;
+        taken->device = NULL;
+    }
+    return slot;
+}
+
+static void InsertSlot(int16_t slot, efi_block_io_t* blockIo, uint64_t block)
+{
+    cache_slot_s* inserted = &slots[slot];
+    uint32_t bucket = HashBlock(blockIo, block);
+    inserted->device = blockIo;
+    inserted->mediaId = blockIo->Media->MediaId;
+    inserted->block = block;
+    inserted->hashNext = buckets[bucket];
+    buckets[bucket] = slot;
+    MakeNewest(slot);
+}
+
+static void UnlinkSlot(int16_t slot)
+{
+    cache_slot_s* unlinked = &slots[slot];
+    if(unlinked->older != NO_SLOT)
+    {
+        slots[unlinked->older].newer = unlinked->newer;
+    }
+    else
+    {
+        oldestSlot = unlinked->newer;
+    }
+    if(unlinked->newer != NO_SLOT)
+    {
+        slots[unlinked->newer].older = unlinked->older;
+    }
+    else
+    {
+        newestSlot = unlinked->older;
+    }
+}
+
+static void MakeNewest(int16_t slot)
+{
+    if(slot == newestSlot)
+    {
+        return;
+    }
+    UnlinkSlot(slot);
+    slots[slot].older = newestSlot;
+    slots[slot].newer = NO_SLOT;
+    slots[newestSlot].newer = slot;
+    newestSlot = slot;
+}
+
+static inline uint32_t HashBlock(efi_block_io_t* blockIo, uint64_t block)
+{
+    uint32_t device = (uint32_t)((uintn_t)blockIo >> 4);
+    return ((uint32_t)block * BLOCK_HASH_MULTIPLIER ^ device) & (BLOCK_CACHE_HASH_SIZE - 1);
+}
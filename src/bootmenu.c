@@ -7,18 +7,33 @@
 #include "shell.h"
 #include "LoadImage.h"
 #include "efilibs.h"
+#include "bootphase.h"
+#include "prefetch.h"
+#include "initrd.h"
+#include "linuxboot.h"
+#include "asyncread.h"
+#include "blockcache.h"
+#include "imagecheck.h"
+#include "imagecache.h"
+#include "console.h"
 
 #define F5_KEY_SCANCODE (0x0F) // Used to refresh the menu (reparse config)
 
+// How often the config file is checked for changes while the menu waits for a key
+#define CONFIG_POLL_INTERVAL_MS (1000)
+#define COUNTDOWN_TICK_MS (1000)
+
 #define SHELL_CHAR  ('c')
 #define INFO_CHAR   ('i')
 
 #define BAD_CONFIGURATION_ERR_MSG ("An error has occurred while parsing the config file.")
 #define FAILED_BOOT_ERR_MSG ("An error has occurred during the booting process.")
+#define BROKEN_ENTRY_MARK (" (broken image)")
 
 // temp forward functions
 
 static void BootMenu(boot_entry_array_s* entryArr);
+static boolean_t WaitForKeyOrConfigChange(boot_entry_array_s* entryArr);
 static void InitBootMenuOutput(void);
 
 static void FailMenu(const char_t* errorMsg);
@@ -28,6 +43,10 @@ static inline void PrintHighlightedEntryInfo(boot_entry_array_s* entryArr);
 static void PrintBootMenu(boot_entry_array_s* entryArr);
 static inline void PrintInstructions(void);
 static void BootEntry(boot_entry_s* selectedEntry);
+static void PrefetchEntry(const boot_entry_s* entry);
+static boolean_t MenuIdleStep(void);
+static void ResetEntryChecks(boot_entry_array_s* entryArr);
+static image_check_t CheckEntry(int32_t index);
 static void PrintEntryInfo(boot_entry_s* selectedEntry);
 
 static void PrintMenuEntries(boot_entry_array_s* entryArr);
@@ -38,9 +57,18 @@ static void PrintTimeout(void);
 
 
 boot_menu_cfg_s bmcfg; // boot menu config
+static boolean_t menuReadyMarked = FALSE; // the first draw of the menu is on the boot timeline
+
+// The headers of the images of the entries are checked while the menu waits, so broken entries are marked
+static boot_entry_array_s* checkedEntries = NULL;
+static image_check_t* entryChecks = NULL; // one for every entry of checkedEntries
+static int32_t nextEntryCheck = 0;
+static boolean_t brokenEntryFound = FALSE; // since the menu was drawn
 void StartBootManager()
 {
     InitBootMenuOutput();
+    // the highlighted entry is read while the menu waits for input, and the other entries are checked
+    SetIdleHandler(MenuIdleStep);
     while(TRUE)
     {
         
@@ -54,7 +82,9 @@ void StartBootManager()
         // Config parsing is in the loop because i want the config to be updatable even when the program is running 
         SetTextPosition(0, 1);
         ST->ConOut->OutputString(ST->ConOut, L"Parsing config...\n");
+        boot_phase_t parsePhase = BeginBootPhase("config", NULL);
         boot_entry_array_s bootEntries = ParseConfig();
+        EndBootPhase(parsePhase);
         
 
 
@@ -71,6 +101,7 @@ void StartBootManager()
             BootMenu(&bootEntries);
             
         }
+        ResetEntryChecks(NULL);
 
 
         //clear up boot entries
@@ -90,6 +121,7 @@ static void FailMenu(const char_t* errorMsg)
 {
     boolean_t returnToMainMenu = FALSE;
     bmcfg.timeoutCancelled = TRUE;
+    FlushLog();
 
     while(!returnToMainMenu)
     {
@@ -132,12 +164,14 @@ static void FailMenu(const char_t* errorMsg)
                 // warm reboot
                 ClearScreen();
                 Log(LL_INFO, 0, "Warm resetting machine...");
+                FlushLog();
                 efi_status_t status = ST->RuntimeServices->ResetSystem(EfiResetWarm, EFI_SUCCESS, 0, 0);
                 Log(LL_ERROR, 0, "Failed to reboot machine");
                 break;
             case '5':
                 ClearScreen();
                 Log(LL_INFO, 0, "Shutting down machine...");
+                FlushLog();
                 // shutdown
                 ST->RuntimeServices->ResetSystem(EfiResetShutdown, EFI_SUCCESS, 0, 0);
                 Log(LL_ERROR, 0, "Failed to shutdown machine");
@@ -188,6 +222,7 @@ static void InitBootMenuOutput(void)
     bmcfg.selectedEntryIndex = 0;
     bmcfg.timeoutCancelled = FALSE;
     bmcfg.bootImmediately = FALSE;
+    bmcfg.showProgress = FALSE;
 
 }
 
@@ -221,10 +256,10 @@ static void PrintMenuEntries(boot_entry_array_s* entryArr)
     // Print hidden entries
     if (index > 0)
     {
-        printf(" . . . %d more", index);
+        ConsolePrintf(" . . . %d more", index);
     }
     else{
-        PrintEmptyLine();
+        ConsoleEmptyLine();
     }
     for(int32_t i =0; i < bmcfg.maxEntriesOnScreen; i++)
     {
@@ -236,17 +271,19 @@ static void PrintMenuEntries(boot_entry_array_s* entryArr)
 
         int32_t entryNum = index + 1;
         char_t* entryName = entryArr->entryArray[index].name;
+        boolean_t broken = entryChecks != NULL && entryChecks[index] == IMAGE_CHECK_INVALID;
+        const char_t* mark = broken ? BROKEN_ENTRY_MARK : "";
         if(index == bmcfg.selectedEntryIndex) // highlight entry
         {
-            ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_BLACK, EFI_LIGHTGRAY)); // higlight text
-            printf("* %d) %s", entryNum, entryName); // print stuff
-            ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK)); // go back to normal
+            ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_BLACK, EFI_LIGHTGRAY)); // higlight text
+            ConsolePrintf("* %d) %s%s", entryNum, entryName, mark); // print stuff
+            ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK)); // go back to normal
         }
         else // print normally
         {
-            printf(" %d) %s", entryNum, entryName);
+            ConsolePrintf(" %d) %s%s", entryNum, entryName, mark);
         }
-        PadRow();
+        ConsolePadRow();
 
         index++;
 
@@ -255,12 +292,12 @@ static void PrintMenuEntries(boot_entry_array_s* entryArr)
     // Print how many hidden entries are at the bottom of the screen
     if(index < entryArr->numOfEntries)
     {
-        printf(" . . . . %d more", entryArr->numOfEntries);
-        PadRow();
+        ConsolePrintf(" . . . . %d more", entryArr->numOfEntries);
+        ConsolePadRow();
     }
     else
     {
-        PrintEmptyLine();
+        ConsoleEmptyLine();
     }
 
 
@@ -271,7 +308,7 @@ static void PrintMenuEntries(boot_entry_array_s* entryArr)
 */
 static inline void PrintInstructions(void)
 {
-    printf("\nUse the ↑ and ↓ arrow keys to select which entry is highlighted.\n"
+    ConsolePrintf("\nUse the ↑ and ↓ arrow keys to select which entry is highlighted.\n"
     "Press enter to boot the seleted entry, press 'i' to get more info about the entry\n"
     "Press 'c' for a command-line, and 'F5' to refresh the menu.\n");
 }
@@ -283,33 +320,32 @@ static inline void PrintInstructions(void)
 */
 static void PrintTimeout(void)
 {
-    ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_DARKGRAY, EFI_BLACK));
+    ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_DARKGRAY, EFI_BLACK));
     //ST->ConOut->SetCursorPosition(ST->ConOut,0 , DEFAULT_CONSOLE_ROWS);
-    printf("\nThe highlighted entry will boot automatically in %d seconds.",bmcfg.timeoutSeconds);
-    ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
-    PadRow();
+    ConsolePrintf("\nThe highlighted entry will boot automatically in %d seconds.",bmcfg.timeoutSeconds);
+    ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_LIGHTGRAY, EFI_BLACK));
+    ConsolePadRow();
 }
 
 
 /*
 *   This function to print the boot fully. (all entries and timeouts included)
+*   The menu is drawn in one console frame (see console.h), so it takes a few firmware calls
 */
 static void PrintBootMenu(boot_entry_array_s* entryArr)
 {
-    if (screenModeSet)
-    {
-        ST->ConOut->SetCursorPosition(ST->ConOut, 0, 0);
-    }
-    else
+    if (!screenModeSet)
     {
         ST->ConOut->ClearScreen(ST->ConOut);
     }
 
-    ST->ConOut->SetCursorPosition(ST->ConOut, DEFAULT_CONSOLE_COLUMNS/2, 0);
-    ST->ConOut->SetAttribute(ST->ConOut, EFI_TEXT_ATTR(EFI_WHITE, EFI_BLACK));
-    printf("That-Loader - 1.2\n");
+    BeginConsoleFrame();
+    ConsoleSetCursor(DEFAULT_CONSOLE_COLUMNS/2, 0);
+    ConsoleSetAttribute(EFI_TEXT_ATTR(EFI_WHITE, EFI_BLACK));
+    ConsolePrintf("That-Loader - 1.2\n");
     //ST->ConOut->SetCursorPosition(ST->ConOut, 0, 0);
 
+    brokenEntryFound = FALSE;
     PrintMenuEntries(entryArr);
 
     PrintInstructions();
@@ -319,8 +355,9 @@ static void PrintBootMenu(boot_entry_array_s* entryArr)
         PrintTimeout();
     }
     else{
-        PrintEmptyLine();
+        ConsoleEmptyLine();
     }
+    EndConsoleFrame();
 
 }
 
@@ -331,9 +368,25 @@ static void PrintBootMenu(boot_entry_array_s* entryArr)
 */
 static void BootMenu(boot_entry_array_s* entryArr)
 {
+    ResetEntryChecks(entryArr);
     while(TRUE)
     {
         PrintBootMenu(entryArr);
+        if(!menuReadyMarked)
+        {
+            MarkBootPhase("menu-ready");
+            LogConsoleFrameStats("menu");
+            menuReadyMarked = TRUE;
+        }
+        // a broken image isn't read in the background
+        if(CheckEntry(bmcfg.selectedEntryIndex) == IMAGE_CHECK_INVALID)
+        {
+            CancelPrefetch();
+        }
+        else
+        {
+            PrefetchEntry(&entryArr->entryArray[bmcfg.selectedEntryIndex]);
+        }
         if(!bmcfg.timeoutCancelled)
         {
             if(bmcfg.bootImmediately)
@@ -342,7 +395,7 @@ static void BootMenu(boot_entry_array_s* entryArr)
                 return;
             }
 
-            int32_t timerStatus = WaitForInput(10000);
+            int32_t timerStatus = WaitForInput(COUNTDOWN_TICK_MS);
             if(timerStatus == INPUT_TIMER_TIMEOUT)
             {
                 bmcfg.timeoutSeconds--;
@@ -357,9 +410,14 @@ static void BootMenu(boot_entry_array_s* entryArr)
             else if(timerStatus == INPUT_TIMER_KEY)
             {
                 // Cancel the timer if a key was pressed
-                bmcfg.timeoutSeconds = TRUE;
+                bmcfg.timeoutCancelled = TRUE;
             }
         }
+        else if(!WaitForKeyOrConfigChange(entryArr))
+        {
+            // redraw the reloaded entries
+            continue;
+        }
         efi_input_key_t key = GetInputKey();
 
         switch (key.ScanCode)
@@ -383,8 +441,9 @@ static void BootMenu(boot_entry_array_s* entryArr)
             }
             break;
         case F5_KEY_SCANCODE:
-            // redo the loop - and reparse the config
-            return;
+            // reparse the config, only if it actually changed
+            ReloadEntries(entryArr, TRUE);
+            break;
 
         
         default:
@@ -407,6 +466,59 @@ static void BootMenu(boot_entry_array_s* entryArr)
     }
 }
 
+/*
+* Reload the entries if the config changed, the selected entry stays selected (by name)
+* checkContent forces comparing the content of the config and not just its size and modification time
+* Returns TRUE if the entries were replaced
+*/
+boolean_t ReloadEntries(boot_entry_array_s* entryArr, boolean_t checkContent)
+{
+    // the names are at most MAX_ENTRY_NAME_LEN long, the copy is terminated even if one isn't
+    char_t selectedName[MAX_ENTRY_NAME_LEN + 1];
+    strncpy(selectedName, entryArr->entryArray[bmcfg.selectedEntryIndex].name, MAX_ENTRY_NAME_LEN);
+    selectedName[MAX_ENTRY_NAME_LEN] = CHAR_NULL;
+
+    if(ReloadConfig(entryArr, checkContent) != CFG_RELOAD_UPDATED)
+    {
+        return FALSE;
+    }
+
+    bmcfg.selectedEntryIndex = 0;
+    for(int32_t i = 0; i < entryArr->numOfEntries; i++)
+    {
+        if(strncmp(entryArr->entryArray[i].name, selectedName, MAX_ENTRY_NAME_LEN) == 0)
+        {
+            bmcfg.selectedEntryIndex = i;
+            break;
+        }
+    }
+    bmcfg.entryOffset = 0;
+    scrollEntries();
+    ResetEntryChecks(entryArr);
+    return TRUE;
+}
+
+/*
+* Wait for a key when there is no timeout, the config is polled in the meantime
+* (size and modification time only) so changes made from the shell show up in the menu
+* Returns FALSE if the entries were reloaded (or one was found broken) and the menu has to be redrawn
+*/
+static boolean_t WaitForKeyOrConfigChange(boot_entry_array_s* entryArr)
+{
+    while(TRUE)
+    {
+        if(WaitForInput(CONFIG_POLL_INTERVAL_MS) != INPUT_TIMER_TIMEOUT)
+        {
+            // a key is waiting (or the timer failed and GetInputKey will simply block)
+            return TRUE;
+        }
+        if(ReloadEntries(entryArr, FALSE) || brokenEntryFound)
+        {
+            return FALSE;
+        }
+    }
+}
+
 /*
 * This function prints the selected entry's additional info, taken from the config file
 * such as path, arguments and name
@@ -415,19 +527,38 @@ static void BootMenu(boot_entry_array_s* entryArr)
 static void PrintEntryInfo(boot_entry_s* selectedEntry)
 {
     ClearScreen();
-    SetTextPosition(0, 0);
-    printf("Entry indexed at: %d\n\n", bmcfg.selectedEntryIndex + 1);
-    printf("Name: %s\n"
+    BeginConsoleFrame();
+    ConsoleSetCursor(0, 0);
+    ConsolePrintf("Entry indexed at: %d\n\n", bmcfg.selectedEntryIndex + 1);
+    ConsolePrintf("Name: %s\n"
     "Path: %s\n"
     "Args: %s\n",
     selectedEntry->name, selectedEntry->imageToLoad, selectedEntry->imageArgs);
+    if (selectedEntry->volume != NULL)
+    {
+        ConsolePrintf("Volume: %s\n", selectedEntry->volume);
+    }
+    if (selectedEntry->sha256 != NULL)
+    {
+        ConsolePrintf("SHA-256: %s\n", selectedEntry->sha256);
+    }
+    if (entryChecks != NULL && entryChecks[bmcfg.selectedEntryIndex] == IMAGE_CHECK_INVALID)
+    {
+        ConsolePrintf("The headers of the image are broken, see the log\n");
+    }
 
     if (selectedEntry->isDirectoryToKernel)
     {
-        printf("\nKernel directory: %s\n", selectedEntry->kernelScanInfo->kernelDirectory);
-        printf("Kernel version string: %s\n", selectedEntry->kernelScanInfo->kernelVersionString);
+        ConsolePrintf("\nKernel directory: %s\n", selectedEntry->kernelScanInfo->kernelDirectory);
+        ConsolePrintf("Kernel version string: %s\n", selectedEntry->kernelScanInfo->kernelVersionString);
     }
-    printf("Press any key to return...");
+    ConsolePrintf("\n");
+    PrintBootTimeline(bmcfg.maxEntriesOnScreen);
+    PrintBlockCacheStats();
+    PrintImageCacheStats();
+    PrintConsoleFrameStats();
+    ConsolePrintf("Press any key to return...");
+    EndConsoleFrame();
     GetInputKey();
     ClearScreen();
 }
@@ -453,7 +584,17 @@ static void BootEntry(boot_entry_s* selectedEntry)
     "Image path: '%s'\n", selectedEntry->name, selectedEntry->imageArgs, selectedEntry->imageToLoad);
 
 
-    ChainloadImage(selectedEntry->imageToLoad, selectedEntry->imageArgs);
+    ShowAsyncReadProgress(bmcfg.showProgress);
+    if(selectedEntry->linuxBoot)
+    {
+        BootLinux(selectedEntry->imageToLoad, selectedEntry->imageArgs, selectedEntry->volume, selectedEntry->sha256);
+    }
+    else
+    {
+        ChainloadImage(selectedEntry->imageToLoad, selectedEntry->imageArgs, selectedEntry->volume,
+            selectedEntry->bufferedLoad, selectedEntry->kernelInitrd, selectedEntry->sha256);
+    }
+    ShowAsyncReadProgress(FALSE);
 
     printf("\nFailed to boot.\n"
     "Press any key to return to menu...");
@@ -468,7 +609,83 @@ static inline void BootHighlightedEntry(boot_entry_array_s* entryArr)
     FailMenu(FAILED_BOOT_ERR_MSG);
 }
 
+// Read the image of the entry and the initrds that are served from memory while the menu waits
+static void PrefetchEntry(const boot_entry_s* entry)
+{
+    if(entry->imageToLoad == NULL)
+    {
+        return;
+    }
+    const char_t* paths[PREFETCH_MAX_FILES] = { entry->imageToLoad };
+    int32_t numOfPaths = 1;
+    initrd_list_s initrds;
+    // the linux boot protocol always reads the initrds itself
+    boolean_t hasInitrds = (!entry->kernelInitrd || entry->linuxBoot) && GetInitrdPaths(entry->imageArgs, &initrds);
+    for(int32_t i = 0; hasInitrds && i < initrds.numOfPaths && numOfPaths < PREFETCH_MAX_FILES; i++)
+    {
+        paths[numOfPaths++] = initrds.paths[i];
+    }
+    PrefetchFiles(paths, numOfPaths, entry->volume, entry->sha256);
+    if(hasInitrds)
+    {
+        FreeInitrdPaths(&initrds);
+    }
+}
 
+// Prefetch the highlighted entry, then check the headers of the entries one at a time
+static boolean_t MenuIdleStep(void)
+{
+    if(PrefetchStep())
+    {
+        return TRUE;
+    }
+    if(checkedEntries == NULL || nextEntryCheck >= checkedEntries->numOfEntries)
+    {
+        return FALSE;
+    }
+    if(CheckEntry(nextEntryCheck++) == IMAGE_CHECK_INVALID)
+    {
+        brokenEntryFound = TRUE;
+    }
+    return TRUE;
+}
 
+// Start checking the entries over (entryArr is NULL once they are freed)
+static void ResetEntryChecks(boot_entry_array_s* entryArr)
+{
+    free(entryChecks);
+    entryChecks = NULL;
+    checkedEntries = NULL;
+    nextEntryCheck = 0;
+    brokenEntryFound = FALSE;
+    if(entryArr == NULL || entryArr->numOfEntries == 0)
+    {
+        return;
+    }
+    // IMAGE_CHECK_PENDING is 0
+    entryChecks = calloc(entryArr->numOfEntries, sizeof(image_check_t));
+    if(entryChecks != NULL)
+    {
+        checkedEntries = entryArr;
+    }
+}
 
-
+// Check the headers of the image of an entry, if they weren't checked yet
+static image_check_t CheckEntry(int32_t index)
+{
+    if(entryChecks == NULL)
+    {
+        return IMAGE_CHECK_PENDING;
+    }
+    const boot_entry_s* entry = &checkedEntries->entryArray[index];
+    if(entryChecks[index] == IMAGE_CHECK_PENDING)
+    {
+        entryChecks[index] = IMAGE_CHECK_VALID;
+        if(entry->imageToLoad != NULL)
+        {
+            efi_handle_t volume = GetFileDeviceHandle(entry->imageToLoad, entry->volume);
+            entryChecks[index] = CheckImageFile(volume, entry->imageToLoad, entry->linuxBoot, LL_WARNING);
+        }
+    }
+    return entryChecks[index];
+}
@@ -0,0 +1,181 @@
+#include "bootphase.h"
+#include "bootutils.h"
+#include "clock.h"
+#include "logs.h"
+#include "console.h"
+
+#define BOOT_PHASE_SERIAL_DEVICE ("/dev/serial")
+#define BOOT_PHASE_MARKER_PREFIX ("@@thatloader")
+
+#define BOOT_PHASE_OPEN (0xFFFFFFFFFFFFFFFFULL) // end of a phase that didn't end yet
+
+// Fill the end and duration columns of the timeline (libuefi's printf doesn't pad strings)
+#define BOOT_PHASE_NO_END   ("                         ")
+#define BOOT_PHASE_RUNNING  ("(running)              ")
+
+typedef struct boot_phase_s{
+    char_t name[BOOT_PHASE_NAME_LEN]; // "<name>" or "<name> <detail>"
+    uint64_t beginUs;
+    uint64_t endUs;
+    boolean_t isMark; // a point in time, endUs is beginUs
+    int32_t nameLen; // length of the name without the detail, for the serial markers
+} boot_phase_s;
+
+static boot_phase_s timeline[BOOT_PHASE_MAX_PHASES];
+static int32_t numOfPhases = 0;
+static int32_t numOfDroppedPhases = 0;
+
+static boot_phase_t AddBootPhase(const char_t* name, const char_t* detail, uint64_t now);
+static void FormatBootPhase(const boot_phase_s* phase, char_t* line, size_t lineSize);
+
+#ifdef BOOT_PHASE_MARKERS
+static void WritePhaseMarker(const boot_phase_s* phase, const char_t* suffix, uint64_t timeUs);
+#else
+#define WritePhaseMarker(phase, suffix, timeUs)
+#endif
+
+/*
+* Start a phase of the timeline, detail (can be NULL) tells apart phases with the same name (like the file that is read)
+* returns the phase for EndBootPhase (BOOT_PHASE_INVALID when the timeline is full, which EndBootPhase ignores)
+*/
+boot_phase_t BeginBootPhase(const char_t* name, const char_t* detail)
+{
+    uint64_t now = GetMicrosecondsSinceInit();
+    boot_phase_t phase = AddBootPhase(name, detail, now);
+    if(phase != BOOT_PHASE_INVALID)
+    {
+        timeline[phase].endUs = BOOT_PHASE_OPEN;
+        WritePhaseMarker(&timeline[phase], "-begin", now);
+    }
+    return phase;
+}
+
+void EndBootPhase(boot_phase_t phase)
+{
+    if(phase < 0 || phase >= numOfPhases)
+    {
+        return;
+    }
+    timeline[phase].endUs = GetMicrosecondsSinceInit();
+    WritePhaseMarker(&timeline[phase], "-end", timeline[phase].endUs);
+}
+
+// A point in time of the timeline (a phase without a duration)
+void MarkBootPhase(const char_t* name)
+{
+    uint64_t now = GetMicrosecondsSinceInit();
+    boot_phase_t phase = AddBootPhase(name, NULL, now);
+    if(phase != BOOT_PHASE_INVALID)
+    {
+        timeline[phase].isMark = TRUE;
+        WritePhaseMarker(&timeline[phase], "", now);
+    }
+}
+
+// Print the last maxPhases phases of the timeline (all of them if maxPhases is 0 or less)
+void PrintBootTimeline(int32_t maxPhases)
+{
+    char_t line[BOOT_PHASE_NAME_LEN + 64];
+    int32_t first = 0;
+    if(maxPhases > 0 && numOfPhases > maxPhases)
+    {
+        first = numOfPhases - maxPhases;
+    }
+    ConsolePrintf("Boot timeline (ms since start):\n");
+    for (int32_t i = first; i < numOfPhases; i++)
+    {
+        FormatBootPhase(&timeline[i], line, sizeof(line));
+        ConsolePrintf("%s\n", line);
+    }
+    if(first > 0 || numOfDroppedPhases > 0)
+    {
+        ConsolePrintf("(%d phases not shown)\n", first + numOfDroppedPhases);
+    }
+}
+
+void LogBootTimeline(void)
+{
+    char_t line[BOOT_PHASE_NAME_LEN + 64];
+    Log(LL_INFO, 0, "Boot timeline (ms since start), %d phases (%d dropped):", numOfPhases, numOfDroppedPhases);
+    for (int32_t i = 0; i < numOfPhases; i++)
+    {
+        FormatBootPhase(&timeline[i], line, sizeof(line));
+        Log(LL_INFO, 0, "%s", line);
+    }
+}
+
+static boot_phase_t AddBootPhase(const char_t* name, const char_t* detail, uint64_t now)
+{
+    if(numOfPhases == BOOT_PHASE_MAX_PHASES)
+    {
+        numOfDroppedPhases++;
+        return BOOT_PHASE_INVALID;
+    }
+    boot_phase_s* phase = &timeline[numOfPhases];
+    if(detail != NULL)
+    {
+        snprintf(phase->name, BOOT_PHASE_NAME_LEN, "%s %s", name, detail);
+    }
+    else
+    {
+        snprintf(phase->name, BOOT_PHASE_NAME_LEN, "%s", name);
+    }
+    phase->nameLen = strlen(name);
+    if(phase->nameLen >= BOOT_PHASE_NAME_LEN)
+    {
+        phase->nameLen = BOOT_PHASE_NAME_LEN - 1;
+    }
+    phase->beginUs = now;
+    phase->endUs = now;
+    phase->isMark = FALSE;
+    return numOfPhases++;
+}
+
+// "<begin> - <end> (<duration>) <name>", marks only have the begin time
+static void FormatBootPhase(const boot_phase_s* phase, char_t* line, size_t lineSize)
+{
+    uint32_t beginMs = phase->beginUs / 1000;
+    uint32_t beginFrac = phase->beginUs % 1000;
+    if(phase->isMark)
+    {
+        snprintf(line, lineSize, "%6d.%03d %s%s", beginMs, beginFrac, BOOT_PHASE_NO_END, phase->name);
+    }
+    else if(phase->endUs == BOOT_PHASE_OPEN)
+    {
+        snprintf(line, lineSize, "%6d.%03d - %s%s", beginMs, beginFrac, BOOT_PHASE_RUNNING, phase->name);
+    }
+    else
+    {
+        uint64_t durationUs = phase->endUs - phase->beginUs;
+        snprintf(line, lineSize, "%6d.%03d - %6d.%03d (%5d.%03d) %s", beginMs, beginFrac,
+            (uint32_t)(phase->endUs / 1000), (uint32_t)(phase->endUs % 1000),
+            (uint32_t)(durationUs / 1000), (uint32_t)(durationUs % 1000), phase->name);
+    }
+}
+
+#ifdef BOOT_PHASE_MARKERS
+
+static FILE* phaseSerial = NULL;
+static boolean_t phaseSerialFailed = FALSE;
+
+/*
+* Write a phase marker to the serial port (the name without the detail)
+* The marker is on a line of its own, since the firmware mirrors the console to the same port
+*/
+static void WritePhaseMarker(const boot_phase_s* phase, const char_t* suffix, uint64_t timeUs)
+{
+    if(phaseSerial == NULL && !phaseSerialFailed)
+    {
+        phaseSerial = fopen(BOOT_PHASE_SERIAL_DEVICE, "w");
+        phaseSerialFailed = (phaseSerial == NULL);
+    }
+    if(phaseSerial != NULL)
+    {
+        char_t name[BOOT_PHASE_NAME_LEN];
+        memcpy(name, phase->name, phase->nameLen);
+        name[phase->nameLen] = CHAR_NULL;
+        fprintf(phaseSerial, "\r\n%s phase=%s%s us=%d\r\n", BOOT_PHASE_MARKER_PREFIX, name, suffix, (uint32_t)timeUs);
+    }
+}
+
+#endif
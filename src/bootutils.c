@@ -1,6 +1,10 @@
 #include "bootutils.h"
 #include "logs.h"
+#include "bootphase.h"
+#include "volumes.h"
+#include "asyncread.h"
 
+static idle_handler_t idleHandler = NULL;
 
 
 
@@ -13,16 +17,17 @@ wchar_t* StringToWideString(char_t* str)
 {
     // The size has to be multiplied by the size of wchar_t
     // because wchar_t is 2 bytes, while char_t is 1 byte
-    const size_t size = strlen(str) * sizeof(wchar_t);
-    wchar_t* wpath = malloc(size + 1);
+    const size_t len = strlen(str);
+    wchar_t* wpath = malloc((len + 1) * sizeof(wchar_t));
     if (wpath == NULL)
     {
         Log(LL_ERROR, 0, "Failed to allocate memory for wide string");
         return NULL;
     }
 
-    wpath[size] = 0;
-    mbstowcs(wpath, str, size);
+    // mbstowcs terminates the string, unless it is empty
+    wpath[0] = 0;
+    mbstowcs(wpath, str, len + 1);
     return wpath;
 
 }
@@ -30,103 +35,11 @@ wchar_t* StringToWideString(char_t* str)
 /*
 *   Get a file device handler
 *   Used when loading a filesystem (to acsses file in the filesystem)
+*   volumeName (optional) is the label or partition GUID of the volume, otherwise the volumes are searched
 */
-efi_handle_t GetFileDeviceHandle(char_t* path)
+efi_handle_t GetFileDeviceHandle(char_t* path, const char_t* volumeName)
 {
-    // Get all the simple file system protocol handles
-    efi_guid_t sfsGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
-    uintn_t bufSize = 0;
-    efi_handle_t* handles = NULL;
-
-    efi_status_t status = BS->LocateHandle(ByProtocol, &sfsGuid, NULL, &bufSize, handles);
-    if(status == EFI_BUFFER_TOO_SMALL)
-    {
-        Log(LL_ERROR, status, "Inital location of the simple file system protocol handle failed");
-        return NULL;
-    }
-
-    handles = malloc(bufSize);
-    if(handles == NULL)
-    {
-        Log(LL_ERROR, status, "Failed to allocate memory for handles");
-        return NULL;
-    }
-
-    // load all handles to handles
-    status = BS->LocateHandle(ByProtocol, &sfsGuid, NULL, &bufSize, handles);
-    if(EFI_ERROR(status))
-    {
-        Log(LL_ERROR, status, "Unable to locate the simple file system protocol handles");
-        return NULL;
-    }
-    uintn_t numHandles = bufSize / sizeof(efi_handle_t);
-    efi_simple_file_system_protocol_t* sfsProt = NULL;
-    efi_guid_t devGuid = EFI_DEVICE_PATH_PROTOCOL_GUID;
-
-    efi_device_path_t* devPath = NULL;
-    efi_file_handle_t* rootDir = NULL;
-    efi_file_handle_t* fileHandle = NULL;
-
-    //Find the right protocols
-    efi_handle_t devHandle = NULL;
-    for(uintn_t i = 0; i < numHandles; i++)
-    {
-        efi_handle_t handle = handles[i];
-
-
-        // find the fs protocol (fat/NTFS blabla)
-        status = BS->HandleProtocol(handle, &sfsGuid, (void**)&sfsProt);
-        if (EFI_ERROR(status))
-        {
-            if(i+1 == numHandles)
-            {
-                Log(LL_ERROR, status, "Failed to obtain the simple file system protocols");
-                return NULL;
-            }
-            continue;
-        }
-        // Find the device path protocol - help our program to identify the hardware the device represents
-        status = BS->HandleProtocol(handle,&devGuid, (void**)&devPath);
-        if (EFI_ERROR(status))
-        {
-            if (i+1 == numHandles)
-            {
-                Log(LL_ERROR, status, "Failed to obtain the device path protocol");
-                return NULL;
-            }
-            continue;
-        }
-        // Check if were accsesing the right FAT volume
-        // if a file with the same name exists on 2 diffrent voulumes
-        // boot manager will load the first instance
-
-        // open root volume
-        status = sfsProt->OpenVolume(sfsProt, &rootDir);
-        if(EFI_ERROR(status))
-        {
-            continue;
-        }  
-        // check if file exists
-        wchar_t* wpath = StringToWideString(path);
-        status = rootDir->Open(rootDir, &fileHandle, wpath, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
-
-        rootDir->Close(rootDir);
-        free(wpath);
-        if(!EFI_ERROR(status))
-        {
-            // Break if file not found
-            devHandle = handle;
-            break;
-        }
-    }
-    free(handles);
-    if (fileHandle == NULL)
-    {
-        Log(LL_ERROR,0, "Unable to find the file '%s' on the machine.", path);
-        return NULL;
-    }
-    return devHandle;
-
+    return FindFileVolume(path, volumeName);
 }
 
 
@@ -144,12 +57,13 @@ void EnableWatchdogTimer(uintn_t seconds)
 }
 
 
-// The function reads the file content into a dynamically allocated buffer (null terminated)
-// The buffer must be freed by the user
+// The function reads the file content into a file buffer (null terminated)
+// The buffer must be freed by the user with FreeFileBuffer
 // outFileSize is an optional parameter, it will contain the file size
 char_t* GetFileContent(char_t* path, uint64_t* outFileSize)
 {
     char_t* buffer = NULL;
+    boot_phase_t phase = BeginBootPhase("read", path);
     FILE* file = fopen(path, "r");
     if (file != NULL)
     {
@@ -160,21 +74,87 @@ char_t* GetFileContent(char_t* path, uint64_t* outFileSize)
             *outFileSize = fileSize;
         }
 
-        buffer = malloc(fileSize + 1);
-        if (buffer != NULL)
-        {
-            fread(buffer, 1, fileSize, file);
-            buffer[fileSize] = CHAR_NULL;
-        }
-        else
-        {
-            Log(LL_ERROR, 0, "Failed to create buffer to read file.");
-        }
+        buffer = ReadFileContent(file, fileSize, 0);
         fclose(file);
     }
+    EndBootPhase(phase);
+    return buffer;
+}
+
+/*
+* Reads fileSize bytes of an opened file into a file buffer (null terminated)
+* reserve is the amount of extra bytes left after the null terminator, which the caller
+* can use for its own data without allocating another buffer
+* The file is read in overlapped chunks when the firmware supports it, the file is one fopen opened
+* (it is on the volume of the loader, which tunes the chunk size)
+* The buffer must be freed by the user with FreeFileBuffer
+*/
+char_t* ReadFileContent(FILE* file, uint64_t fileSize, uint64_t reserve)
+{
+    char_t* buffer = AllocateFileBuffer(fileSize + 1 + reserve);
+    if (buffer == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to create buffer to read file.");
+        return NULL;
+    }
+    async_read_s read;
+    BeginAsyncRead(&read, file, buffer, fileSize);
+    SetAsyncReadVolume(&read, (LIP != NULL) ? LIP->DeviceHandle : NULL);
+    efi_status_t status = FinishAsyncRead(&read);
+    if (EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to read file content.");
+        FreeFileBuffer(buffer);
+        return NULL;
+    }
+    buffer[fileSize] = CHAR_NULL;
     return buffer;
 }
 
+/*
+* Allocate a buffer for the content of a file in EfiLoaderData pages, it is page aligned so the firmware can
+* read into it directly (and LoadImage copies the image out of whole pages)
+* The page in front of the buffer holds the number of pages, the buffer is freed with FreeFileBuffer
+*/
+char_t* AllocateFileBuffer(uint64_t size)
+{
+    uint64_t pages = EFI_SIZE_TO_PAGES(size) + 1;
+    efi_physical_address_t address = 0;
+    efi_status_t status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &address);
+    if (EFI_ERROR(status))
+    {
+        return NULL;
+    }
+    *(uint64_t*)(uintn_t)address = pages;
+    return (char_t*)(uintn_t)(address + EFI_PAGE_SIZE);
+}
+
+// Move the content of a file buffer (up to usedSize) to a new one of size bytes, NULL (and buffer is kept) if it fails
+char_t* ResizeFileBuffer(char_t* buffer, uint64_t usedSize, uint64_t size)
+{
+    char_t* resized = AllocateFileBuffer(size);
+    if (resized == NULL)
+    {
+        return NULL;
+    }
+    if (buffer != NULL)
+    {
+        memcpy(resized, buffer, (usedSize < size) ? usedSize : size);
+        FreeFileBuffer(buffer);
+    }
+    return resized;
+}
+
+void FreeFileBuffer(void* buffer)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    efi_physical_address_t address = (efi_physical_address_t)(uintn_t)buffer - EFI_PAGE_SIZE;
+    BS->FreePages(address, *(uint64_t*)(uintn_t)address);
+}
+
 
 /*
 * This Function recieves a file handle a file info handle,
@@ -204,6 +184,12 @@ uint64_t GetFileSize(FILE* file)
 
 }
 
+// Set the work WaitForInput does while it waits (NULL for none)
+void SetIdleHandler(idle_handler_t handler)
+{
+    idleHandler = handler;
+}
+
 /*
 * Waits a certain number of ms (timeoutms) before returning
 * or returning on key press
@@ -232,6 +218,25 @@ int32_t WaitForInput(uint32_t timeout)
         Log(LL_ERROR, status, "Failed to set timer event (for %d milliseconds).", timeout);
         return INPUT_TIMER_ERROR;
     }
+
+    // Do the idle work between polls until it is done, a key is pressed or the time is up
+    while(idleHandler != NULL)
+    {
+        if(BS->CheckEvent(events[1]) == EFI_SUCCESS)
+        {
+            BS->CloseEvent(*timerEvent);
+            return INPUT_TIMER_KEY;
+        }
+        if(BS->CheckEvent(*timerEvent) == EFI_SUCCESS)
+        {
+            BS->CloseEvent(*timerEvent);
+            return INPUT_TIMER_TIMEOUT;
+        }
+        if(!idleHandler())
+        {
+            break;
+        }
+    }
     // wait for input event
     status = BS->WaitForEvent(2, events, &idx);
     BS->CloseEvent(*timerEvent);
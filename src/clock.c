@@ -0,0 +1,114 @@
+#include "clock.h"
+
+#define MICROSECONDS_IN_SECOND (1000000ULL)
+
+#define SECONDS_IN_DAY (86400)
+#define SECONDS_IN_HOUR (3600)
+#define SECONDS_IN_MINUTE (60)
+
+static uint64_t clockFrequency = 0;
+static uint64_t clockStartTicks = 0;
+
+static inline uint64_t ReadCounter(void);
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+static uint64_t SecondsSinceEpoch(const efi_time_t* time);
+#endif
+
+/*
+* Calibrate the counter and make the current time the zero of GetMicrosecondsSinceInit
+* The frequency is measured over a CLOCK_CALIBRATION_US stall (aarch64 uses CNTFRQ if the firmware set it)
+*/
+void InitClock(void)
+{
+#if defined(__aarch64__)
+    uint64_t frequency = 0;
+    __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r" (frequency));
+    if(frequency != 0)
+    {
+        clockFrequency = frequency;
+        clockStartTicks = ReadCounter();
+        return;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+    uint64_t before = ReadCounter();
+    BS->Stall(CLOCK_CALIBRATION_US);
+    uint64_t after = ReadCounter();
+    clockFrequency = (after - before) * MICROSECONDS_IN_SECOND / CLOCK_CALIBRATION_US;
+#else
+    clockFrequency = 1;
+#endif
+    if(clockFrequency == 0)
+    {
+        clockFrequency = 1; // a broken counter reads as a stopped clock rather than dividing by zero
+    }
+    clockStartTicks = ReadCounter();
+}
+
+uint64_t GetClockTicks(void)
+{
+    return ReadCounter();
+}
+
+uint64_t GetClockFrequency(void)
+{
+    return clockFrequency;
+}
+
+// Split in seconds and the remainder so that the multiplication doesn't overflow for long uptimes
+uint64_t TicksToMicroseconds(uint64_t ticks)
+{
+    if(clockFrequency == 0)
+    {
+        return 0;
+    }
+    uint64_t seconds = ticks / clockFrequency;
+    uint64_t remainder = ticks % clockFrequency;
+    return seconds * MICROSECONDS_IN_SECOND + remainder * MICROSECONDS_IN_SECOND / clockFrequency;
+}
+
+uint64_t GetMicrosecondsSinceInit(void)
+{
+    if(clockFrequency == 0)
+    {
+        return 0;
+    }
+    return TicksToMicroseconds(ReadCounter() - clockStartTicks);
+}
+
+static inline uint64_t ReadCounter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t low = 0;
+    uint32_t high = 0;
+    __asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+#elif defined(__aarch64__)
+    uint64_t counter = 0;
+    __asm__ __volatile__ ("isb; mrs %0, cntvct_el0" : "=r" (counter) : : "memory");
+    return counter;
+#else
+    efi_time_t currTime = {0};
+    if(EFI_ERROR(RT->GetTime(&currTime, NULL)))
+    {
+        return 0;
+    }
+    return SecondsSinceEpoch(&currTime);
+#endif
+}
+
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+// Days are counted with the civil calendar, so the fallback clock doesn't jump at month boundaries
+static uint64_t SecondsSinceEpoch(const efi_time_t* time)
+{
+    int64_t year = time->Year;
+    int64_t month = time->Month;
+    if(month <= 2)
+    {
+        year--;
+        month += 12;
+    }
+    int64_t days = 365 * year + year / 4 - year / 100 + year / 400 + (153 * (month - 3) + 2) / 5 + time->Day;
+    return (uint64_t)days * SECONDS_IN_DAY + time->Hour * SECONDS_IN_HOUR + time->Minute * SECONDS_IN_MINUTE + time->Second;
+}
+#endif
@@ -0,0 +1,430 @@
+#include "configcache.h"
+#include "logs.h"
+#include "bootutils.h"
+
+/*
+* Binary snapshot of the parsed config, saved next to config.cfg
+* Holds the resolved entries (kernel paths and version strings of kerneldir entries, substituted args),
+* the runtime keys and the modification time of every kerneldir the config names (also of the ones that
+* had no kernels, a kernel installed there invalidates the cache), so while config.cfg and the kernel
+* directories are unchanged
+* the config doesn't have to be parsed and the kernel directories dont have to be scanned
+*
+* Layout of the file:
+*   cfg_cache_header_s
+*   cfg_cache_kernel_dir_s[numOfKernelDirs]
+*   cfg_cache_entry_s[numOfEntries]
+*   cfg_cache_runtime_key_s[numOfRuntimeKeys]
+*   strings (null terminated, referenced by their offset)
+* The sizes of the header, the kernel dirs and the entries are multiples of 8, so every uint64_t
+* (and the scan info written over an entry record) stays aligned
+*/
+
+#define CFG_CACHE_PATH ("\\EFI\\thatloader\\config.bin")
+
+#define CFG_CACHE_MAGIC (0x4E4942474643544CULL) // "LTCFGBIN"
+#define CFG_CACHE_VERSION (8)
+
+#define CFG_CACHE_NO_STRING (0xFFFFFFFF) // offset of a NULL string
+
+#define FNV_OFFSET_BASIS (0xCBF29CE484222325ULL)
+#define FNV_PRIME (0x100000001B3ULL)
+
+typedef struct cfg_cache_header_s{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t numOfEntries;
+    uint32_t numOfRuntimeKeys;
+    uint32_t numOfKernelDirs;
+    uint32_t stringsSize;
+    uint64_t configSize;
+    uint64_t configModificationTime;
+    uint64_t configHash;
+    uint64_t payloadHash; // hash of everything after the header, catches partially written caches
+} cfg_cache_header_s;
+
+typedef struct cfg_cache_entry_s{
+    uint32_t name;
+    uint32_t imageToLoad;
+    uint32_t imageArgs;
+    uint32_t volume;
+    uint32_t kernelDirectory;
+    uint32_t kernelVersionString;
+    uint32_t isDirectoryToKernel;
+    uint32_t bufferedLoad;
+    uint32_t kernelInitrd;
+    uint32_t linuxBoot;
+    uint32_t sha256;
+    uint32_t reserved; // keeps the next record aligned
+} cfg_cache_entry_s;
+
+typedef struct cfg_cache_runtime_key_s{
+    uint32_t key;
+    uint32_t value;
+} cfg_cache_runtime_key_s;
+
+typedef struct cfg_cache_kernel_dir_s{
+    uint64_t modificationTime;
+    uint32_t directory;
+    uint32_t reserved;
+} cfg_cache_kernel_dir_s;
+
+// Used when saving, the strings are written one after another
+typedef struct cfg_cache_writer_s{
+    char_t* strings;
+    uint32_t stringsSize;
+} cfg_cache_writer_s;
+
+static uint64_t HashData(const void* data, uint64_t size);
+static boolean_t GetModificationTime(const char_t* path, uint64_t* modificationTime);
+static const char_t* CacheString(const char_t* strings, uint32_t stringsSize, uint32_t offset, boolean_t* valid);
+static uint32_t WriteCacheString(cfg_cache_writer_s* writer, const char_t* str);
+static uint32_t CacheStringSize(const char_t* str);
+
+/*
+* Fill the stamp of the config file (size, modification time and hash of the text)
+* configData is the text of the opened configFile, if it is NULL only the size and
+* modification time are filled (cheap, no read)
+*/
+boolean_t StampConfigFile(FILE* configFile, const char_t* configData, cfg_file_stamp_s* stamp)
+{
+    struct stat st;
+    stamp->isValid = FALSE;
+    if (fstat(configFile, &st) != 0)
+    {
+        return FALSE;
+    }
+    stamp->configSize = st.st_size;
+    stamp->configModificationTime = st.st_mtime;
+    stamp->configHash = (configData == NULL) ? 0 : HashData(configData, st.st_size);
+    stamp->isValid = (configData != NULL);
+    return TRUE;
+}
+
+/*
+* Load the entries from the cache, if it was made from the same config (same stamp)
+* and the kernel directories didnt change since
+* The cache is read into the arena of the entry array and the strings of the entries point into it
+* The runtime keys are returned to the caller, since it is the one that knows how to apply them
+*/
+boolean_t LoadConfigCache(const cfg_file_stamp_s* stamp, boot_entry_array_s* entryArr,
+    cfg_runtime_key_s* runtimeKeys, int32_t* numOfRuntimeKeys)
+{
+    FILE* cacheFile = fopen(CFG_CACHE_PATH, "r");
+    if (cacheFile == NULL)
+    {
+        return FALSE;
+    }
+    uint64_t cacheSize = GetFileSize(cacheFile);
+    if (cacheSize < sizeof(cfg_cache_header_s))
+    {
+        fclose(cacheFile);
+        return FALSE;
+    }
+    // Drop the cache from the arena if it can't be used
+    arena_mark_s mark = ArenaMark(&entryArr->arena);
+    char_t* cacheData = ArenaAlloc(&entryArr->arena, cacheSize);
+    if (cacheData == NULL || fread(cacheData, 1, cacheSize, cacheFile) != cacheSize)
+    {
+        fclose(cacheFile);
+        ArenaRewind(&entryArr->arena, mark);
+        return FALSE;
+    }
+    fclose(cacheFile);
+
+    cfg_cache_header_s* header = (cfg_cache_header_s*)cacheData;
+    uint64_t tablesSize = (uint64_t)header->numOfKernelDirs * sizeof(cfg_cache_kernel_dir_s) +
+        (uint64_t)header->numOfEntries * sizeof(cfg_cache_entry_s) +
+        header->numOfRuntimeKeys * sizeof(cfg_cache_runtime_key_s);
+    if (header->magic != CFG_CACHE_MAGIC || header->version != CFG_CACHE_VERSION ||
+        header->numOfRuntimeKeys > CFG_CACHE_MAX_RUNTIME_KEYS ||
+        cacheSize != sizeof(cfg_cache_header_s) + tablesSize + header->stringsSize)
+    {
+        Log(LL_INFO, 0, "Config cache is not valid, ignoring it");
+        ArenaRewind(&entryArr->arena, mark);
+        return FALSE;
+    }
+    if (header->configSize != stamp->configSize || header->configModificationTime != stamp->configModificationTime ||
+        header->configHash != stamp->configHash)
+    {
+        Log(LL_INFO, 0, "Config file changed, the config cache is outdated");
+        ArenaRewind(&entryArr->arena, mark);
+        return FALSE;
+    }
+
+    cfg_cache_kernel_dir_s* cacheDirs = (cfg_cache_kernel_dir_s*)(header + 1);
+    cfg_cache_entry_s* cacheEntries = (cfg_cache_entry_s*)(cacheDirs + header->numOfKernelDirs);
+    cfg_cache_runtime_key_s* cacheKeys = (cfg_cache_runtime_key_s*)(cacheEntries + header->numOfEntries);
+    const char_t* strings = (const char_t*)(cacheKeys + header->numOfRuntimeKeys);
+
+    // With the last string terminated, every offset inside of the section is a terminated string
+    if (header->payloadHash != HashData(header + 1, cacheSize - sizeof(cfg_cache_header_s)) ||
+        (header->stringsSize != 0 && strings[header->stringsSize - 1] != CHAR_NULL))
+    {
+        Log(LL_WARNING, 0, "Config cache is corrupted, ignoring it");
+        ArenaRewind(&entryArr->arena, mark);
+        return FALSE;
+    }
+
+    boot_entry_s* entries = ArenaAlloc(&entryArr->arena, sizeof(boot_entry_s) * header->numOfEntries);
+    if (entries == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the cached config entries");
+        ArenaRewind(&entryArr->arena, mark);
+        return FALSE;
+    }
+
+    boolean_t valid = TRUE;
+    for (uint32_t i = 0; i < header->numOfEntries && valid; i++)
+    {
+        // Copy the record before anything is written over it
+        cfg_cache_entry_s record = cacheEntries[i];
+        boot_entry_s* entry = entries + i;
+
+        entry->name = (char_t*)CacheString(strings, header->stringsSize, record.name, &valid);
+        entry->imageToLoad = (char_t*)CacheString(strings, header->stringsSize, record.imageToLoad, &valid);
+        entry->imageArgs = (char_t*)CacheString(strings, header->stringsSize, record.imageArgs, &valid);
+        entry->volume = (char_t*)CacheString(strings, header->stringsSize, record.volume, &valid);
+        entry->isDirectoryToKernel = (record.isDirectoryToKernel != 0);
+        entry->expandKernels = FALSE;
+        entry->bufferedLoad = (record.bufferedLoad != 0);
+        entry->kernelInitrd = (record.kernelInitrd != 0);
+        entry->linuxBoot = (record.linuxBoot != 0);
+        entry->sha256 = (char_t*)CacheString(strings, header->stringsSize, record.sha256, &valid);
+        entry->kernelScanInfo = NULL;
+        if (!entry->isDirectoryToKernel)
+        {
+            continue;
+        }
+
+        // The scan info is smaller than the record, so it is kept in the memory of the record
+        kernel_scan_info_s* scanInfo = (kernel_scan_info_s*)(cacheEntries + i);
+        scanInfo->kernelDirectory = (char_t*)CacheString(strings, header->stringsSize, record.kernelDirectory, &valid);
+        scanInfo->kernelVersionString = (char_t*)CacheString(strings, header->stringsSize,
+            record.kernelVersionString, &valid);
+        entry->kernelScanInfo = scanInfo;
+    }
+    // The stamps are handed to the entries, so the reload can notice a new kernel too
+    kernel_dir_stamp_s* kernelDirs = NULL;
+    for (uint32_t i = 0; i < header->numOfKernelDirs && valid; i++)
+    {
+        kernel_dir_stamp_s* dirStamp = ArenaAlloc(&entryArr->arena, sizeof(kernel_dir_stamp_s));
+        if (dirStamp == NULL)
+        {
+            valid = FALSE;
+            break;
+        }
+        dirStamp->directory = (char_t*)CacheString(strings, header->stringsSize, cacheDirs[i].directory, &valid);
+        dirStamp->modificationTime = cacheDirs[i].modificationTime;
+        dirStamp->next = kernelDirs;
+        kernelDirs = dirStamp;
+
+        uint64_t dirModificationTime = 0;
+        if (valid && (!GetModificationTime(dirStamp->directory, &dirModificationTime) ||
+            dirModificationTime != dirStamp->modificationTime))
+        {
+            Log(LL_INFO, 0, "Kernel directory '%s' changed, the config cache is outdated", dirStamp->directory);
+            valid = FALSE;
+        }
+    }
+    for (uint32_t i = 0; i < header->numOfRuntimeKeys && valid; i++)
+    {
+        runtimeKeys[i].key = CacheString(strings, header->stringsSize, cacheKeys[i].key, &valid);
+        runtimeKeys[i].value = CacheString(strings, header->stringsSize, cacheKeys[i].value, &valid);
+    }
+    if (!valid)
+    {
+        ArenaRewind(&entryArr->arena, mark);
+        return FALSE;
+    }
+
+    *numOfRuntimeKeys = header->numOfRuntimeKeys;
+    entryArr->kernelDirs = kernelDirs;
+    entryArr->entryArray = entries;
+    entryArr->numOfEntries = header->numOfEntries;
+    entryArr->capacity = header->numOfEntries;
+    Log(LL_INFO, 0, "Loaded %d entries from the config cache", entryArr->numOfEntries);
+    return TRUE;
+}
+
+/*
+* Save the parsed entries and runtime keys to the cache
+* the whole cache is built in memory and written with a single write
+*/
+void SaveConfigCache(const cfg_file_stamp_s* stamp, const boot_entry_array_s* entryArr,
+    const cfg_runtime_key_s* runtimeKeys, int32_t numOfRuntimeKeys)
+{
+    if (numOfRuntimeKeys > CFG_CACHE_MAX_RUNTIME_KEYS)
+    {
+        Log(LL_WARNING, 0, "Too many runtime keys in the config, not saving the config cache");
+        return;
+    }
+
+    // Get the size of the strings section first, so the cache is allocated once
+    uint64_t stringsSize = 0;
+    for (int32_t i = 0; i < entryArr->numOfEntries; i++)
+    {
+        boot_entry_s* entry = entryArr->entryArray + i;
+        stringsSize += CacheStringSize(entry->name) + CacheStringSize(entry->imageToLoad) +
+            CacheStringSize(entry->imageArgs) + CacheStringSize(entry->volume) + CacheStringSize(entry->sha256);
+        if (entry->isDirectoryToKernel)
+        {
+            stringsSize += CacheStringSize(entry->kernelScanInfo->kernelDirectory) +
+                CacheStringSize(entry->kernelScanInfo->kernelVersionString);
+        }
+    }
+    for (int32_t i = 0; i < numOfRuntimeKeys; i++)
+    {
+        stringsSize += CacheStringSize(runtimeKeys[i].key) + CacheStringSize(runtimeKeys[i].value);
+    }
+    uint32_t numOfKernelDirs = 0;
+    for (const kernel_dir_stamp_s* dirStamp = entryArr->kernelDirs; dirStamp != NULL; dirStamp = dirStamp->next)
+    {
+        if (dirStamp->modificationTime == 0)
+        {
+            // the cache could never be validated
+            return;
+        }
+        stringsSize += CacheStringSize(dirStamp->directory);
+        numOfKernelDirs++;
+    }
+    if (stringsSize >= CFG_CACHE_NO_STRING)
+    {
+        return;
+    }
+
+    uint64_t tablesSize = numOfKernelDirs * sizeof(cfg_cache_kernel_dir_s) +
+        entryArr->numOfEntries * sizeof(cfg_cache_entry_s) + numOfRuntimeKeys * sizeof(cfg_cache_runtime_key_s);
+    uint64_t cacheSize = sizeof(cfg_cache_header_s) + tablesSize + stringsSize;
+    char_t* cacheData = malloc(cacheSize);
+    if (cacheData == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the config cache");
+        return;
+    }
+
+    cfg_cache_header_s* header = (cfg_cache_header_s*)cacheData;
+    cfg_cache_kernel_dir_s* cacheDirs = (cfg_cache_kernel_dir_s*)(header + 1);
+    cfg_cache_entry_s* cacheEntries = (cfg_cache_entry_s*)(cacheDirs + numOfKernelDirs);
+    cfg_cache_runtime_key_s* cacheKeys = (cfg_cache_runtime_key_s*)(cacheEntries + entryArr->numOfEntries);
+    cfg_cache_writer_s writer = { (char_t*)(cacheKeys + numOfRuntimeKeys), 0 };
+
+    for (int32_t i = 0; i < entryArr->numOfEntries; i++)
+    {
+        boot_entry_s* entry = entryArr->entryArray + i;
+        cfg_cache_entry_s* record = cacheEntries + i;
+        record->name = WriteCacheString(&writer, entry->name);
+        record->imageToLoad = WriteCacheString(&writer, entry->imageToLoad);
+        record->imageArgs = WriteCacheString(&writer, entry->imageArgs);
+        record->volume = WriteCacheString(&writer, entry->volume);
+        record->isDirectoryToKernel = entry->isDirectoryToKernel;
+        record->bufferedLoad = entry->bufferedLoad;
+        record->kernelInitrd = entry->kernelInitrd;
+        record->linuxBoot = entry->linuxBoot;
+        record->sha256 = WriteCacheString(&writer, entry->sha256);
+        record->reserved = 0;
+        record->kernelDirectory = CFG_CACHE_NO_STRING;
+        record->kernelVersionString = CFG_CACHE_NO_STRING;
+        if (entry->isDirectoryToKernel)
+        {
+            record->kernelDirectory = WriteCacheString(&writer, entry->kernelScanInfo->kernelDirectory);
+            record->kernelVersionString = WriteCacheString(&writer, entry->kernelScanInfo->kernelVersionString);
+        }
+    }
+    for (int32_t i = 0; i < numOfRuntimeKeys; i++)
+    {
+        cacheKeys[i].key = WriteCacheString(&writer, runtimeKeys[i].key);
+        cacheKeys[i].value = WriteCacheString(&writer, runtimeKeys[i].value);
+    }
+    // The time the directory had when it was scanned, not now, so a kernel installed since isn't missed
+    cfg_cache_kernel_dir_s* cacheDir = cacheDirs;
+    for (const kernel_dir_stamp_s* dirStamp = entryArr->kernelDirs; dirStamp != NULL; dirStamp = dirStamp->next)
+    {
+        cacheDir->modificationTime = dirStamp->modificationTime;
+        cacheDir->directory = WriteCacheString(&writer, dirStamp->directory);
+        cacheDir->reserved = 0;
+        cacheDir++;
+    }
+
+    header->magic = CFG_CACHE_MAGIC;
+    header->version = CFG_CACHE_VERSION;
+    header->numOfEntries = entryArr->numOfEntries;
+    header->numOfRuntimeKeys = numOfRuntimeKeys;
+    header->numOfKernelDirs = numOfKernelDirs;
+    header->stringsSize = writer.stringsSize;
+    header->configSize = stamp->configSize;
+    header->configModificationTime = stamp->configModificationTime;
+    header->configHash = stamp->configHash;
+    header->payloadHash = HashData(header + 1, cacheSize - sizeof(cfg_cache_header_s));
+
+    FILE* cacheFile = fopen(CFG_CACHE_PATH, "w");
+    if (cacheFile == NULL)
+    {
+        Log(LL_WARNING, 0, "Failed to create the config cache file");
+        free(cacheData);
+        return;
+    }
+    if (fwrite(cacheData, 1, cacheSize, cacheFile) != cacheSize)
+    {
+        Log(LL_WARNING, 0, "Failed to write the config cache file");
+    }
+    fclose(cacheFile);
+    free(cacheData);
+}
+
+// FNV-1a, only used to notice changes so it doesn't have to be cryptographic
+static uint64_t HashData(const void* data, uint64_t size)
+{
+    const uint8_t* bytes = data;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (uint64_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static boolean_t GetModificationTime(const char_t* path, uint64_t* modificationTime)
+{
+    struct stat st;
+    if (path == NULL || stat(path, &st) != 0)
+    {
+        return FALSE;
+    }
+    *modificationTime = st.st_mtime;
+    return TRUE;
+}
+
+// Get a string by its offset, valid is set to FALSE if the offset is out of the strings section
+static const char_t* CacheString(const char_t* strings, uint32_t stringsSize, uint32_t offset, boolean_t* valid)
+{
+    if (offset == CFG_CACHE_NO_STRING)
+    {
+        return NULL;
+    }
+    if (offset >= stringsSize)
+    {
+        *valid = FALSE;
+        return NULL;
+    }
+    return strings + offset;
+}
+
+static uint32_t WriteCacheString(cfg_cache_writer_s* writer, const char_t* str)
+{
+    if (str == NULL)
+    {
+        return CFG_CACHE_NO_STRING;
+    }
+    uint32_t offset = writer->stringsSize;
+    uint32_t size = strlen(str) + 1;
+    memcpy(writer->strings + offset, str, size);
+    writer->stringsSize += size;
+    return offset;
+}
+
+static uint32_t CacheStringSize(const char_t* str)
+{
+    return (str == NULL) ? 0 : strlen(str) + 1;
+}
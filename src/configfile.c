@@ -4,164 +4,487 @@
 #include "shellutils.h"
 #include "bootmenu.h"
 #include "ErrorCodes.h"
+#include "configcache.h"
+#include "kernelindex.h"
+#include "volumes.h"
+#include "sha256.h"
 
 // config file path
 #define CFG_PATH ("\\EFI\\thatloader\\config.cfg")
 
-#define MAX_ENTRY_NAME_LEN (70)
-
-#define LINUX_KERNEL_IDENTIFIER_STR ("vmlinuz")
 #define STR_TO_SUBSTITUTE_WITH_VERSION ("%v")
+#define STR_TO_SUBSTITUTE_WITH_INITRD ("%i") // path of the initrd that matches the kernel version
 
-#define CFG_LINE_DELIMITER      ("\n")
-#define CFG_ENTRY_DELIMITER     ("\n\n")
+#define CFG_LINE_DELIMITER      ('\n')
 #define CFG_KEY_VALUE_DELIMITER (':')
 #define CFG_COMMENT_CHAR        ('#')
 
-#define BOOT_ENTRY_INIT { NULL, NULL, NULL, FALSE, NULL }
-#define BOOT_ENTRY_ARR_INIT { NULL, 0 }
+#define BOOT_ENTRY_INIT { NULL, NULL, NULL, NULL, FALSE, NULL, FALSE, FALSE, FALSE, FALSE, NULL }
+#define BOOT_ENTRY_ARR_INIT { NULL, 0, 0, ARENA_INIT, { FALSE, 0, 0, 0 }, NULL }
+
+// Joined args are never longer than the config lines they were taken from
+// so reserving the size of the file after the config text is enough for them
+// (and a bit more for the entry array and kernel scan info), which keeps a parse in a single page run
+#define CFG_ARENA_RESERVE(fileSize) ((fileSize) + 1 + CFG_ARENA_HEADROOM)
+#define CFG_ARENA_HEADROOM (EFI_PAGE_SIZE)
+
+#define CFG_MIN_ENTRY_CAPACITY (8)
 
 // initial ramdisk
 #define INITRD_ARG_STR ("initrd=")
 
+typedef enum cfg_token_type_t{
+    CFG_TOKEN_PAIR, // a key-value pair of the current entry
+    CFG_TOKEN_ENTRY_END, // a blank line (or the end of the file) closed the current entry
+    CFG_TOKEN_EOF
+} cfg_token_type_t;
+
+typedef struct cfg_tokenizer_s{
+    char_t* cursor; // start of the next line
+    char_t* end; // end of the config text
+    boolean_t inEntry;
+} cfg_tokenizer_s;
+
+typedef enum cfg_key_scope_t{
+    CFG_SCOPE_ENTRY, // sets a field of the entry that is being parsed
+    CFG_SCOPE_RUNTIME // sets a field of bmcfg, can be anywhere in the config
+} cfg_key_scope_t;
+
+typedef enum cfg_value_type_t{
+    CFG_VALUE_STRING, // the value itself (it stays in the arena)
+    CFG_VALUE_INT,
+    CFG_VALUE_BOOL, // yes/true/1 or no/false/0
+    CFG_VALUE_KERNEL_DIR, // a string that goes to the kernel scan info, and makes the entry a kerneldir entry
+    CFG_VALUE_LINUX_IMAGE // a string (the image), and the entry boots it with the linux boot protocol
+} cfg_value_type_t;
+
+typedef enum cfg_key_multiplicity_t{
+    CFG_KEY_SINGLE, // a redefinition in the same entry is ignored
+    CFG_KEY_APPEND, // every value is appended to the field (space seperated)
+    CFG_KEY_OVERRIDE // the last value wins
+} cfg_key_multiplicity_t;
+
+typedef struct cfg_key_s cfg_key_s;
+
+// Validators can reject a value (FALSE) or modify it in place, entry is NULL for runtime keys
+typedef boolean_t (*cfg_key_validator_t)(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry);
+// Called after a runtime key was assigned
+typedef void (*cfg_key_applied_t)(void);
+
+struct cfg_key_s{
+    const char_t* name;
+    cfg_key_scope_t scope;
+    cfg_value_type_t type;
+    cfg_key_multiplicity_t multiplicity;
+    size_t fieldOffset; // in boot_entry_s or boot_menu_cfg_s (by scope)
+    const char_t* appendPrefix; // put before every appended value
+    cfg_key_validator_t validator; // optional
+    cfg_key_applied_t applied; // optional
+};
+
+/*
+* The keys are found by a perfect hash of their length, first char and (twice) their last char
+* The slot of every key is set with a designated initializer, so two keys in the same slot
+* are reported by the compiler (-Woverride-init, part of -Wextra)
+*/
+#define CFG_KEY_TABLE_SIZE (32)
+#define CFG_KEY_SLOT(len, first, last) (((len) + (uint8_t)(first) + 2 * (uint8_t)(last)) & (CFG_KEY_TABLE_SIZE - 1))
+#define CFG_FIELD(type, member) (__builtin_offsetof(type, member))
+
+static boolean_t ValidateEntryName(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry);
+static boolean_t ValidateImagePath(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry);
+static boolean_t SplitVolumePrefix(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry);
+static boolean_t ValidateSha256(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry);
+static boolean_t ValidateTimeout(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry);
+static void ApplyTimeout(void);
+
+static const cfg_key_s configKeys[CFG_KEY_TABLE_SIZE] = {
+    // name of image (for the menu printing)
+    [CFG_KEY_SLOT(4, 'n', 'e')] = { "name", CFG_SCOPE_ENTRY, CFG_VALUE_STRING, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, name), NULL, ValidateEntryName, NULL },
+    // path to kernel image
+    [CFG_KEY_SLOT(4, 'p', 'h')] = { "path", CFG_SCOPE_ENTRY, CFG_VALUE_STRING, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, imageToLoad), NULL, ValidateImagePath, NULL },
+    // path to a bzImage that is booted by the loader itself (instead of the EFI stub of the kernel)
+    [CFG_KEY_SLOT(5, 'l', 'x')] = { "linux", CFG_SCOPE_ENTRY, CFG_VALUE_LINUX_IMAGE, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, imageToLoad), NULL, ValidateImagePath, NULL },
+    // path to kernel directory
+    [CFG_KEY_SLOT(9, 'k', 'r')] = { "kerneldir", CFG_SCOPE_ENTRY, CFG_VALUE_KERNEL_DIR, CFG_KEY_SINGLE,
+        0, NULL, ValidateImagePath, NULL },
+    // kerneldir: a menu entry for every kernel in the directory instead of just the newest
+    [CFG_KEY_SLOT(10, 'a', 's')] = { "allkernels", CFG_SCOPE_ENTRY, CFG_VALUE_BOOL, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, expandKernels), NULL, NULL, NULL },
+    // label or partition GUID of the volume the image is on (no volume is probed for it)
+    [CFG_KEY_SLOT(6, 'v', 'e')] = { "volume", CFG_SCOPE_ENTRY, CFG_VALUE_STRING, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, volume), NULL, NULL, NULL },
+    // read the image into memory and load it from there (the firmware reads the file itself otherwise)
+    [CFG_KEY_SLOT(8, 'b', 'd')] = { "buffered", CFG_SCOPE_ENTRY, CFG_VALUE_BOOL, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, bufferedLoad), NULL, NULL, NULL },
+    // add args to kernel loading args
+    [CFG_KEY_SLOT(4, 'a', 's')] = { "args", CFG_SCOPE_ENTRY, CFG_VALUE_STRING, CFG_KEY_APPEND,
+        CFG_FIELD(boot_entry_s, imageArgs), "", NULL, NULL },
+    // This key simplifies the configuration but it just takes the value and adds it to the args
+    [CFG_KEY_SLOT(6, 'i', 'd')] = { "initrd", CFG_SCOPE_ENTRY, CFG_VALUE_STRING, CFG_KEY_APPEND,
+        CFG_FIELD(boot_entry_s, imageArgs), INITRD_ARG_STR, NULL, NULL },
+    // let the kernel read the initrd= files itself (they are read by the loader and served from memory otherwise)
+    [CFG_KEY_SLOT(12, 'k', 'd')] = { "kernelinitrd", CFG_SCOPE_ENTRY, CFG_VALUE_BOOL, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, kernelInitrd), NULL, NULL, NULL },
+    // the SHA-256 of the image file (hex), an image with another digest isn't booted
+    [CFG_KEY_SLOT(6, 's', '6')] = { "sha256", CFG_SCOPE_ENTRY, CFG_VALUE_STRING, CFG_KEY_SINGLE,
+        CFG_FIELD(boot_entry_s, sha256), NULL, ValidateSha256, NULL },
+    // seconds until the highlighted entry is booted (-1 waits forever, 0 boots immediately)
+    [CFG_KEY_SLOT(7, 't', 't')] = { "timeout", CFG_SCOPE_RUNTIME, CFG_VALUE_INT, CFG_KEY_OVERRIDE,
+        CFG_FIELD(boot_menu_cfg_s, timeoutSeconds), NULL, ValidateTimeout, ApplyTimeout },
+    // draw a progress bar (and the read speed) while the files of the booted entry are read
+    [CFG_KEY_SLOT(8, 'p', 's')] = { "progress", CFG_SCOPE_RUNTIME, CFG_VALUE_BOOL, CFG_KEY_OVERRIDE,
+        CFG_FIELD(boot_menu_cfg_s, showProgress), NULL, NULL, NULL },
+};
+
 /* Basic config parser functions */
-static boolean_t AssignValueToEntry(const char_t* key, char_t* value, boot_entry_s* entry);
+static cfg_token_type_t NextConfigToken(cfg_tokenizer_s* tokenizer, char_t** key, char_t** value);
+static boolean_t AssignValueToEntry(arena_s* arena, const char_t* key, char_t* value, boot_entry_s* entry);
 static boolean_t ValidateEntry(boot_entry_s* newEntry);
 static void AppendEntry(boot_entry_array_s* bootEntryArr, boot_entry_s* entry);
-static boolean_t EditRuntimeConfig(const char_t* key, char_t* value);
+static const cfg_key_s* LookupConfigKey(const char_t* key);
+static const char_t* GetEntryKeyValue(const cfg_key_s* keyDef, const boot_entry_s* entry);
+static boolean_t ApplyRuntimeKey(const cfg_key_s* keyDef, char_t* value);
+static boolean_t ParseBoolValue(const char_t* value, boolean_t* result);
+static boolean_t LoadCachedConfig(const cfg_file_stamp_s* stamp, boot_entry_array_s* bootEntryArr);
+static char_t* ReadConfigFile(FILE* configFile, arena_s* arena, uint64_t* fileSize, cfg_file_stamp_s* stamp);
+static void ParseConfigText(boot_entry_array_s* bootEntryArr, char_t* configData, uint64_t fileSize);
+static boolean_t EntriesEqual(const boot_entry_s* lhs, const boot_entry_s* rhs);
+static boolean_t KernelDirsChanged(const boot_entry_array_s* entryArr, boolean_t checkContent);
+static void UpdateKernelDirStamps(boot_entry_array_s* entryArr, const boot_entry_array_s* newEntryArr);
+static inline boolean_t StringsEqual(const char_t* lhs, const char_t* rhs);
 
 /* Functions related to the "kerneldir" key in the config */
-static void PrepareKernelDirEntry(boot_entry_s* entry);
-static char_t* GetPathToKernel(const char_t* directoryPath);
-static char_t* GetKernelVersionString(const char_t* fullKernelFileName);
+static void AppendKernelDirEntries(boot_entry_array_s* bootEntryArr, boot_entry_s* entry);
+static void StampKernelDir(boot_entry_array_s* bootEntryArr, char_t* directory, const kernel_index_s* index);
+static void PrepareKernelDirEntry(arena_s* arena, boot_entry_s* entry, const kernel_image_s* kernel);
+static char_t* SubstituteArg(arena_s* arena, char_t* args, const char_t* pattern, const char_t* replacement);
+static char_t* StorePath(arena_s* arena, const char_t* directoryPath, const char_t* fileName);
+
+static char_t* StoreString(arena_s* arena, const char_t* str, size_t len);
 
-static void FreeConfigEntry(boot_entry_s* entry);
 static inline void LogKeyRedefinition(const char_t* key, const char_t* curr, const char_t* ignored);
 
-static void AppendToArgs(boot_entry_s* entry, char_t* value);
+static boolean_t AppendToArgs(arena_s* arena, char_t** args, const char_t* prefix, const char_t* value);
 
 static boolean_t ignoreEntryWarnings;
 
-// This Function returns a pointer to the head of the linked list of the boot entries
-// Every Pointer in the linked list was allocated dynamically
+// The runtime keys of the config that is being parsed, saved to the config cache
+static cfg_runtime_key_s runtimeKeys[CFG_CACHE_MAX_RUNTIME_KEYS];
+static int32_t numOfRuntimeKeys;
+
+// This Function returns an array of the boot entries parsed from the config file
+// The config is read once and tokenized in place, the entries and every string they point to
+// are in the arena of the array, so FreeConfigEntries only has to release the arena
 boot_entry_array_s ParseConfig(void)
 {
     Log(LL_INFO, 0, "Parsing config file...");
 
     boot_entry_array_s bootEntryArr = BOOT_ENTRY_ARR_INIT;
-    
+
+    FILE* configFile = fopen(CFG_PATH, "r");
+    if(configFile == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to read configuration file");
+        return bootEntryArr;
+    }
     uint64_t fileSize = 0;
-    char_t* configData = GetFileContent(CFG_PATH, &fileSize);
+    char_t* configData = ReadConfigFile(configFile, &bootEntryArr.arena, &fileSize, &bootEntryArr.stamp);
+    fclose(configFile);
     if(configData == NULL)
     {
         Log(LL_ERROR, 0, "Failed to read configuration file");
         return bootEntryArr;
     }
-    
-    // Tracks the pointer in the file
-    char_t* filePtr = configData;
 
+    ParseConfigText(&bootEntryArr, configData, fileSize);
+    return bootEntryArr;
+}
 
-    // Get blocks of entries in a loop - one kernel config (boot_entry_s) at a time
-    // Once (filePtr >= configData +filesize) it means we finished reading the file contents
-    while (filePtr < configData + fileSize)
+/*
+* Reparse the config only if it or one of its kernel directories changed since entryArr was parsed
+* Only the size and modification time are checked (no read) unless checkContent is set,
+* when they differ (or checkContent is set) the content hash decides, because a file
+* that was saved without changes doesn't have to be reparsed
+* A kernel directory changed if its modification time did (with checkContent, a directory that has no
+* modification time is always scanned again)
+* The entries are replaced only if at least one of them is different
+*/
+cfg_reload_status_t ReloadConfig(boot_entry_array_s* entryArr, boolean_t checkContent)
+{
+    FILE* configFile = fopen(CFG_PATH, "r");
+    if(configFile == NULL)
     {
-        boot_entry_s entry = BOOT_ENTRY_INIT;
-        ignoreEntryWarnings = FALSE;
+        return CFG_RELOAD_UNCHANGED;
+    }
+
+    cfg_file_stamp_s* stamp = &entryArr->stamp;
+    cfg_file_stamp_s current;
+    if(!checkContent && stamp->isValid && StampConfigFile(configFile, NULL, &current) &&
+        current.configSize == stamp->configSize && current.configModificationTime == stamp->configModificationTime &&
+        !KernelDirsChanged(entryArr, FALSE))
+    {
+        fclose(configFile);
+        return CFG_RELOAD_UNCHANGED;
+    }
 
-        // Get a pointer to the end of an entry 
-        char_t* configEntryEnd = strstr(filePtr, CFG_ENTRY_DELIMITER);
+    // The new config is a new generation, read into its own arena
+    boot_entry_array_s newEntryArr = BOOT_ENTRY_ARR_INIT;
+    uint64_t fileSize = 0;
+    char_t* configData = ReadConfigFile(configFile, &newEntryArr.arena, &fileSize, &current);
+    fclose(configFile);
+    if(configData == NULL)
+    {
+        FreeConfigEntries(&newEntryArr);
+        return CFG_RELOAD_UNCHANGED;
+    }
+    boolean_t configChanged = !stamp->isValid || !current.isValid || current.configSize != stamp->configSize ||
+        current.configHash != stamp->configHash;
+    if(!configChanged && !KernelDirsChanged(entryArr, checkContent))
+    {
+        // Same content, just remember the new modification time so it isn't hashed again
+        *stamp = current;
+        FreeConfigEntries(&newEntryArr);
+        return CFG_RELOAD_UNCHANGED;
+    }
 
-        size_t entryStrLen = 0;
-        size_t ptrIncrement = 0; // Used to increment filePtr
+    Log(LL_INFO, 0, configChanged ? "Config file changed, reloading entries..." :
+        "A kernel directory changed, reloading entries...");
+    newEntryArr.stamp = current;
+    ParseConfigText(&newEntryArr, configData, fileSize);
 
-        if(configEntryEnd == NULL) // if at last entry
+    cfg_reload_status_t status = CFG_RELOAD_UPDATED;
+    if(newEntryArr.numOfEntries == 0)
+    {
+        Log(LL_WARNING, 0, "The changed config has no valid entries, keeping the current entries");
+        status = CFG_RELOAD_FAILED;
+    }
+    else if(newEntryArr.numOfEntries == entryArr->numOfEntries)
+    {
+        int32_t changedEntries = 0;
+        for(int32_t i = 0; i < newEntryArr.numOfEntries; i++)
         {
-            entryStrLen = strlen(filePtr);
-            ptrIncrement = entryStrLen;
+            if(!EntriesEqual(entryArr->entryArray + i, newEntryArr.entryArray + i))
+            {
+                changedEntries++;
+            }
         }
-        else 
+        Log(LL_INFO, 0, "%d of %d entries changed", changedEntries, newEntryArr.numOfEntries);
+        if(changedEntries == 0)
         {
-            entryStrLen = configEntryEnd - filePtr;
-            ptrIncrement = entryStrLen + strlen(CFG_ENTRY_DELIMITER);
+            status = CFG_RELOAD_UNCHANGED;
         }
+    }
 
+    // Either way, the stamp of the config on disk is the new one now
+    if(status == CFG_RELOAD_UPDATED)
+    {
+        FreeConfigEntries(entryArr);
+        *entryArr = newEntryArr;
+    }
+    else
+    {
+        UpdateKernelDirStamps(entryArr, &newEntryArr);
+        FreeConfigEntries(&newEntryArr);
+        entryArr->stamp = current;
+    }
+    return status;
+}
 
-        // Increment file pointer and skip empty lines
-        if (entryStrLen ==0)
-        {
-            filePtr += ptrIncrement;
-            continue;
-        }
-
-        // Holds only the current entry block
-        char_t* strippedEnty = malloc(entryStrLen+ 1);
-        if(strippedEnty == NULL)
+// A kerneldir of the entries was modified, created or removed since it was scanned
+static boolean_t KernelDirsChanged(const boot_entry_array_s* entryArr, boolean_t checkContent)
+{
+    for(const kernel_dir_stamp_s* dirStamp = entryArr->kernelDirs; dirStamp != NULL; dirStamp = dirStamp->next)
+    {
+        struct stat st;
+        boolean_t exists = (stat(dirStamp->directory, &st) == 0);
+        uint64_t modificationTime = exists ? (uint64_t)st.st_mtime : 0;
+        if(modificationTime != dirStamp->modificationTime || (exists && modificationTime == 0 && checkContent))
         {
-            Log(LL_ERROR, 0, "Failed to allocate memory for entry block");
-            free(configData);
-            return bootEntryArr;
+            return TRUE;
         }
-        strncpy(strippedEnty, filePtr, entryStrLen); // copy the entry to strippedEnty
+    }
+    return FALSE;
+}
 
-        // Create a copy because we need to keep the original pointer to free it
-        // and strtok modifies the pointer
-        char_t* entryCopy = strippedEnty;
-        char_t* line = NULL;
-        // Gets lines from entry blocks and parses them
-        while ((line = strtok_r(entryCopy, CFG_LINE_DELIMITER, &entryCopy)) != NULL)
+// The entries were kept, but their directories were scanned again (the stamps are in the arena of the kept entries)
+static void UpdateKernelDirStamps(boot_entry_array_s* entryArr, const boot_entry_array_s* newEntryArr)
+{
+    for(kernel_dir_stamp_s* dirStamp = entryArr->kernelDirs; dirStamp != NULL; dirStamp = dirStamp->next)
+    {
+        for(const kernel_dir_stamp_s* newStamp = newEntryArr->kernelDirs; newStamp != NULL; newStamp = newStamp->next)
         {
-            // Ignore comments
-            if (line[0] == CFG_COMMENT_CHAR)
+            if(strcmp(dirStamp->directory, newStamp->directory) == 0)
             {
-                continue;
+                dirStamp->modificationTime = newStamp->modificationTime;
+                break;
             }
+        }
+    }
+}
 
-            // Get the key-value pair in the line
-            char_t* key = NULL;
-            char_t* value = NULL;
-            if(ParseKeyValuePair(line, CFG_KEY_VALUE_DELIMITER, &key, &value) == FALSE)
-            {
-                free(key);
-                free(value);
-                continue;
-            }
+/*
+* Read the config text into the arena and stamp it
+* The space the parsing needs after the text is reserved too, so the arena doesn't grow
+*/
+static char_t* ReadConfigFile(FILE* configFile, arena_s* arena, uint64_t* fileSize, cfg_file_stamp_s* stamp)
+{
+    stamp->isValid = FALSE;
+    *fileSize = GetFileSize(configFile);
+    if(!ArenaReserve(arena, *fileSize + 1 + CFG_ARENA_RESERVE(*fileSize)))
+    {
+        return NULL;
+    }
+    char_t* configData = ArenaAlloc(arena, *fileSize + 1);
+    *fileSize = fread(configData, 1, *fileSize, configFile);
+    configData[*fileSize] = CHAR_NULL;
+    StampConfigFile(configFile, configData, stamp);
+    return configData;
+}
 
-            // Trim spaces before passing into AssignValueToEntry
-            const char_t* trimmedkey = TrimSpaces(key);
-            char_t* trimmedvalue = TrimSpaces(value);
-            if(!AssignValueToEntry(trimmedkey, trimmedvalue, &entry))
-            {
-                // free the value if it wasnt assigned (key stays)
-                free(value);
-            }
-            free(key);
+/*
+* Fill bootEntryArr from the config text (which is in its arena)
+* If the stamp of bootEntryArr matches the config cache, the cached entries are used instead
+*/
+static void ParseConfigText(boot_entry_array_s* bootEntryArr, char_t* configData, uint64_t fileSize)
+{
+    // Skip the parsing (and the kernel directory scans) if the config didn't change since it was cached
+    if(bootEntryArr->stamp.isValid && LoadCachedConfig(&bootEntryArr->stamp, bootEntryArr))
+    {
+        return;
+    }
+
+    arena_s* arena = &bootEntryArr->arena;
+
+    cfg_tokenizer_s tokenizer = { configData, configData + fileSize, FALSE };
+    boot_entry_s entry = BOOT_ENTRY_INIT;
+    ignoreEntryWarnings = FALSE;
+    numOfRuntimeKeys = 0;
+
+    // Get the key-value pairs of the entries in a single pass over the file
+    // one kernel config (boot_entry_s) at a time
+    char_t* key = NULL;
+    char_t* value = NULL;
+    cfg_token_type_t token;
+    while ((token = NextConfigToken(&tokenizer, &key, &value)) != CFG_TOKEN_EOF)
+    {
+        if (token == CFG_TOKEN_PAIR)
+        {
+            AssignValueToEntry(arena, key, value, &entry);
+            continue;
         }
-        free(strippedEnty);
 
         //Fill the data, ketnel path, version and args
         if(entry.isDirectoryToKernel)
         {
-            PrepareKernelDirEntry(&entry);
+            AppendKernelDirEntries(bootEntryArr, &entry);
         }
-
         // Make sure the entry is valid, if it is, append it to array of entries
-        if(ValidateEntry(&entry))
+        // (the strings of invalid entries stay in the arena until it is freed)
+        else if(ValidateEntry(&entry))
         {
-            AppendEntry(&bootEntryArr, &entry);
+            AppendEntry(bootEntryArr, &entry);
         }
-        else // free memory of invalid entry
+
+        // Start a new entry
+        boot_entry_s emptyEntry = BOOT_ENTRY_INIT;
+        entry = emptyEntry;
+        ignoreEntryWarnings = FALSE;
+    }
+
+    if(bootEntryArr->numOfEntries ==0)
+    {
+        Log(LL_ERROR, 0, "The configuration file is has incorrect entries or is empty");
+    }
+    else if(bootEntryArr->stamp.isValid)
+    {
+        SaveConfigCache(&bootEntryArr->stamp, bootEntryArr, runtimeKeys, numOfRuntimeKeys);
+    }
+}
+
+/*
+* Load the entries from the config cache and apply the runtime keys that were saved with them
+* FALSE means the cache is missing or outdated and the config has to be parsed
+*/
+static boolean_t LoadCachedConfig(const cfg_file_stamp_s* stamp, boot_entry_array_s* bootEntryArr)
+{
+    int32_t cachedKeysAmount = 0;
+    if(!LoadConfigCache(stamp, bootEntryArr, runtimeKeys, &cachedKeysAmount))
+    {
+        return FALSE;
+    }
+    for(int32_t i = 0; i < cachedKeysAmount; i++)
+    {
+        const cfg_key_s* keyDef = LookupConfigKey(runtimeKeys[i].key);
+        if(keyDef != NULL && keyDef->scope == CFG_SCOPE_RUNTIME)
         {
-            FreeConfigEntry(&entry);
+            ApplyRuntimeKey(keyDef, (char_t*)runtimeKeys[i].value);
         }
-        filePtr += ptrIncrement; //move pointer to next block
     }
-    free(configData);
-    if(bootEntryArr.numOfEntries ==0)
+    return TRUE;
+}
+
+/*
+* Returns the next token of the config text, the lines are split in place
+* (line ends and key-value delimiters are overwritten with null chars), so key and value
+* point straight into the config buffer and nothing is allocated
+* Blank lines seperate the entries (a line of only whitespace is blank too, CR is whitespace so CRLF
+* files split the same way), comments and lines without a delimiter are skipped
+*/
+static cfg_token_type_t NextConfigToken(cfg_tokenizer_s* tokenizer, char_t** key, char_t** value)
+{
+    while (tokenizer->cursor < tokenizer->end)
     {
-        Log(LL_ERROR, 0, "The configuration file is has incorrect entries or is empty");
+        char_t* line = tokenizer->cursor;
+        char_t* lineEnd = memchr(line, CFG_LINE_DELIMITER, tokenizer->end - line);
+        if (lineEnd == NULL)
+        {
+            // last line, the buffer is already null terminated
+            lineEnd = tokenizer->end;
+            tokenizer->cursor = tokenizer->end;
+        }
+        else
+        {
+            tokenizer->cursor = lineEnd + 1;
+        }
+        *lineEnd = CHAR_NULL;
+
+        line = TrimSpaces(line);
+
+        // A blank line closes the current entry
+        if (line[0] == CHAR_NULL)
+        {
+            if (tokenizer->inEntry)
+            {
+                tokenizer->inEntry = FALSE;
+                return CFG_TOKEN_ENTRY_END;
+            }
+            continue;
+        }
+        tokenizer->inEntry = TRUE;
+
+        // Ignore comments
+        if (line[0] == CFG_COMMENT_CHAR)
+        {
+            continue;
+        }
+
+        if (ParseKeyValuePair(line, CFG_KEY_VALUE_DELIMITER, key, value))
+        {
+            return CFG_TOKEN_PAIR;
+        }
     }
-    return bootEntryArr;
+
+    // Close the last entry if the file doesn't end with a blank line
+    if (tokenizer->inEntry)
+    {
+        tokenizer->inEntry = FALSE;
+        return CFG_TOKEN_ENTRY_END;
+    }
+    return CFG_TOKEN_EOF;
 }
 
 
@@ -192,43 +515,63 @@ static boolean_t ValidateEntry(boot_entry_s* newEntry)
         }
         return FALSE;
     }
+    else if (newEntry->isDirectoryToKernel && newEntry->sha256 != NULL)
+    {
+        // the kernels of the directory change, and an entry that isn't verified mustn't be booted
+        if (!ignoreEntryWarnings)
+        {
+            Log(LL_WARNING, 0, "Ignoring entry: %s, 'sha256' can't pin a 'kerneldir'.", newEntry->name);
+        }
+        return FALSE;
+    }
     return TRUE;
 }
 
 /*
-*   This function appends a string to the entry argument
+*   This function appends a string (prefix + value) to the args (or any other appended value)
 *   Space is appended if args arent null
+*   The args of the entry that is being parsed are usually the last allocation in the arena,
+*   so they are extended in place
 */
-static void AppendToArgs(boot_entry_s* entry, char_t* value)
+static boolean_t AppendToArgs(arena_s* arena, char_t** args, const char_t* prefix, const char_t* value)
 {
-    size_t argsLen = strlen(entry->imageArgs);
+    size_t argsLen = (*args == NULL) ? 0 : strlen(*args);
+    size_t prefixLen = strlen(prefix);
     size_t valueLen = strlen(value);
+    size_t separatorLen = (argsLen == 0) ? 0 : 1;
+    size_t newSize = argsLen + separatorLen + prefixLen + valueLen + 1;
 
-    // Resize args
-    size_t newSize = argsLen + valueLen +1;
-    entry->imageArgs = realloc(entry->imageArgs, newSize);
-
-    // make sure to add a null char if there are no args yet
-    if (argsLen == 0)
+    char_t* newArgs = *args;
+    if (!ArenaExtend(arena, newArgs, argsLen + 1, newSize))
     {
-        entry->imageArgs[argsLen] = CHAR_NULL;
+        newArgs = ArenaAlloc(arena, newSize);
+        if (newArgs == NULL)
+        {
+            return FALSE;
+        }
+        memcpy(newArgs, *args, argsLen);
     }
-    else // add a space to seperate args
+
+    // add a space to seperate args
+    if (separatorLen != 0)
     {
-        entry->imageArgs[argsLen] = ' ';
-        argsLen++;
-        entry->imageArgs[argsLen] = CHAR_NULL;
+        newArgs[argsLen] = ' ';
     }
     // append new arg
-    strncpy(entry->imageArgs + argsLen, value, valueLen);
+    memcpy(newArgs + argsLen + separatorLen, prefix, prefixLen);
+    memcpy(newArgs + argsLen + separatorLen + prefixLen, value, valueLen);
+    newArgs[newSize - 1] = CHAR_NULL;
+    *args = newArgs;
+    return TRUE;
 }
 
 /*
 * This function assignes char_t* values to boot_entry_s* based on const char_t* key
-* FALSE as return value means the value wasnt assigned and needs to be freed
-* TRUE means the value was assigned, and doesnt need to be freed
+* The key is looked up in the key table, which describes where the value goes and how
+* The values are slices of the config text, so they are simply pointed at
+* FALSE as return value means the value wasnt assigned to the entry
 */
-static boolean_t AssignValueToEntry(const char_t* key, char_t* value, boot_entry_s* entry)
+static boolean_t AssignValueToEntry(arena_s* arena, const char_t* key, char_t* value, boot_entry_s* entry)
 {
     //Igonre empty values
     if(value[0] == CHAR_NULL)
@@ -237,166 +580,324 @@ static boolean_t AssignValueToEntry(const char_t* key, char_t* value, boot_entry
         return FALSE;
     }
 
-    // kernel's name
-    if(strcmp(key, "name") == 0) // if value holds the name
+    const cfg_key_s* keyDef = LookupConfigKey(key);
+    if(keyDef == NULL)
     {
-        if(entry->name != NULL)
-        {
-            LogKeyRedefinition(key, entry->name, value);
-            return FALSE;
-        }
-        // Shorten the name of it is too long
-        if(strlen(value) > MAX_ENTRY_NAME_LEN)
-        {
-            value[MAX_ENTRY_NAME_LEN] = CHAR_NULL;
-        }
-        entry->name = value;
+        Log(LL_WARNING, 0, "Unknown key '%s' in the config file", key);
+        return FALSE;
     }
 
-    // path to kernel image
-    else if (strcmp(key,"path") == 0)
+    if(keyDef->scope == CFG_SCOPE_RUNTIME)
     {
-        if(entry->isDirectoryToKernel)
+        if(ApplyRuntimeKey(keyDef, value))
         {
-            Log(LL_WARNING, 0, "'%s' and 'kerneldir' defined in the same entry. (where kerneldir=%s)",
-            key, entry->kernelScanInfo->kernelDirectory);
-            return FALSE;
+            // Remember the key for the config cache (too many keys just means no cache is saved)
+            if (numOfRuntimeKeys < CFG_CACHE_MAX_RUNTIME_KEYS)
+            {
+                runtimeKeys[numOfRuntimeKeys].key = keyDef->name;
+                runtimeKeys[numOfRuntimeKeys].value = value;
+            }
+            numOfRuntimeKeys++;
         }
-        if(entry->imageToLoad != NULL)
+        // Avoid false warnings when runtime config keys are on their own
+        ignoreEntryWarnings = TRUE;
+        return FALSE;
+    }
+
+    if(keyDef->multiplicity == CFG_KEY_SINGLE)
+    {
+        const char_t* currentValue = GetEntryKeyValue(keyDef, entry);
+        if(currentValue != NULL)
         {
-            LogKeyRedefinition(key, entry->imageToLoad, value);
+            LogKeyRedefinition(key, currentValue, value);
             return FALSE;
         }
-        entry->imageToLoad = value;
+    }
+    if(keyDef->validator != NULL && !keyDef->validator(keyDef, value, entry))
+    {
+        return FALSE;
     }
 
-    // path to kernel directory
-    else if (strcmp(key, "kerneldir") == 0)
+    char_t** field = (char_t**)((uint8_t*)entry + keyDef->fieldOffset);
+    switch (keyDef->type)
     {
-        if(entry->imageToLoad != NULL)
+    case CFG_VALUE_BOOL:
+        if(!ParseBoolValue(value, (boolean_t*)field))
         {
-            Log(LL_WARNING, 0, "'%s' and 'path' defined in the same entry. (where path=%s)",
-            key, entry->imageToLoad);
+            Log(LL_WARNING, 0, "Invalid value '%s' for '%s', expected yes or no", value, key);
             return FALSE;
-
         }
-        if(entry->isDirectoryToKernel)
+        break;
+    case CFG_VALUE_STRING:
+        if(keyDef->multiplicity == CFG_KEY_APPEND)
+        {
+            if(!AppendToArgs(arena, field, keyDef->appendPrefix, value))
+            {
+                Log(LL_ERROR, 0, "Failed to allocate memory for '%s' of '%s'", key, entry->name);
+                return FALSE;
+            }
+        }
+        else
         {
-            LogKeyRedefinition(key, entry->kernelScanInfo->kernelDirectory, value);
+            *field = value;
+        }
+        break;
+    case CFG_VALUE_KERNEL_DIR:
+        entry->kernelScanInfo = ArenaAlloc(arena, sizeof(kernel_scan_info_s));
+        if(entry->kernelScanInfo == NULL)
+        {
+            Log(LL_ERROR, 0, "Failed to allocate memory for the kernel scan info");
             return FALSE;
         }
-        
-        entry->kernelScanInfo = malloc(sizeof(kernel_scan_info_s));
         entry->kernelScanInfo->kernelDirectory = value;
+        entry->kernelScanInfo->kernelVersionString = NULL;
         entry->isDirectoryToKernel = TRUE;
+        break;
+    case CFG_VALUE_LINUX_IMAGE:
+        *field = value;
+        entry->linuxBoot = TRUE;
+        break;
+    default:
+        Log(LL_ERROR, 0, "Key '%s' has a value type that entries don't support", key);
+        return FALSE;
     }
+    return TRUE;
+}
 
-    // add args to kernel loading args
-    else if(strcmp(key, "args") == 0)
+// Find the definition of a key, NULL if the key doesnt exist
+static const cfg_key_s* LookupConfigKey(const char_t* key)
+{
+    size_t keyLen = strlen(key);
+    if(keyLen == 0)
     {
-        AppendToArgs(entry, value);
+        return NULL;
+    }
+    const cfg_key_s* keyDef = &configKeys[CFG_KEY_SLOT(keyLen, key[0], key[keyLen - 1])];
+    if(keyDef->name == NULL || strcmp(keyDef->name, key) != 0)
+    {
+        return NULL;
     }
+    return keyDef;
+}
 
-    // This key simplifies the configuration but it just takes the value and adds it to the args
-    else if (strcmp(key, "initrd") == 0)
+// The value the entry already has for an entry key (NULL if it wasnt set)
+static const char_t* GetEntryKeyValue(const cfg_key_s* keyDef, const boot_entry_s* entry)
+{
+    if(keyDef->type == CFG_VALUE_KERNEL_DIR)
     {
-        size_t initrdLen = strlen(INITRD_ARG_STR);
-        size_t valueLen = strlen(value);
-        const size_t totalLen = initrdLen + valueLen + 1;
+        return entry->isDirectoryToKernel ? entry->kernelScanInfo->kernelDirectory : NULL;
+    }
+    if(keyDef->type != CFG_VALUE_STRING && keyDef->type != CFG_VALUE_LINUX_IMAGE)
+    {
+        // only strings can tell if they were set
+        return NULL;
+    }
+    return *(char_t* const*)((const uint8_t*)entry + keyDef->fieldOffset);
+}
 
-        // Create the full arg string 'initrd=<value>'
-        char_t* argStr = (char_t*) malloc(totalLen * sizeof(char_t));
-        if(argStr == NULL)
-        {
-            Log(LL_ERROR, 0, "Failed to allocate memory for buffer");
-            return FALSE;
-        }
-        strncpy(argStr, INITRD_ARG_STR, initrdLen);
-        strncpy(argStr + initrdLen, value, valueLen);
-        AppendToArgs(entry, argStr);
-        free(argStr);
+// Special keys that control the settings of the bootmanager during runtime
+static boolean_t ApplyRuntimeKey(const cfg_key_s* keyDef, char_t* value)
+{
+    if(keyDef->validator != NULL && !keyDef->validator(keyDef, value, NULL))
+    {
+        return FALSE;
     }
-    else
+    uint8_t* field = (uint8_t*)&bmcfg + keyDef->fieldOffset;
+    switch (keyDef->type)
     {
-        boolean_t isRuntimeCfgKey = EditRuntimeConfig(key, value);
-        if (!isRuntimeCfgKey)
+    case CFG_VALUE_INT:
+        *(int32_t*)field = atoi(value);
+        break;
+    case CFG_VALUE_BOOL:
+        if(!ParseBoolValue(value, (boolean_t*)field))
         {
-            Log(LL_WARNING, 0, "Unknown key '%s' in the config file", key);
-        }
-        else 
-        {
-            // Avoid false warnings when runtime config keys are on their own
-            ignoreEntryWarnings = TRUE;
+            Log(LL_WARNING, 0, "Invalid value '%s' for '%s', expected yes or no", value, keyDef->name);
+            return FALSE;
         }
+        break;
+    default:
+        Log(LL_ERROR, 0, "Key '%s' has a value type that runtime keys don't support", keyDef->name);
         return FALSE;
     }
+    if(keyDef->applied != NULL)
+    {
+        keyDef->applied();
+    }
     return TRUE;
 }
 
-// Special keys that control the settings of the bootmanager during runtime
-static boolean_t EditRuntimeConfig(const char_t* key, char_t* value)
+static boolean_t ParseBoolValue(const char_t* value, boolean_t* result)
 {
-    if (strcmp(key, "timeout") == 0)
+    if(strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
     {
-        bmcfg.timeoutSeconds = atoi(value);
-        if(bmcfg.timeoutSeconds == -1)
-        {
-            bmcfg.timeoutCancelled = TRUE;
-        }
-        else if (bmcfg.timeoutSeconds == 0)
-        {
-            bmcfg.bootImmediately = TRUE;
-        }
+        *result = TRUE;
+        return TRUE;
+    }
+    if(strcmp(value, "no") == 0 || strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+    {
+        *result = FALSE;
         return TRUE;
     }
     return FALSE;
 }
 
+// Shorten the name if it is too long
+static boolean_t ValidateEntryName(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry)
+{
+    if(strlen(value) > MAX_ENTRY_NAME_LEN)
+    {
+        value[MAX_ENTRY_NAME_LEN] = CHAR_NULL;
+    }
+    return TRUE;
+}
+
+// An entry boots either a given image (path) or the kernel found in a directory (kerneldir)
+static boolean_t ValidateImagePath(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry)
+{
+    if(entry->isDirectoryToKernel)
+    {
+        Log(LL_WARNING, 0, "'%s' and 'kerneldir' defined in the same entry. (where kerneldir=%s)",
+        keyDef->name, entry->kernelScanInfo->kernelDirectory);
+        return FALSE;
+    }
+    if(entry->imageToLoad != NULL)
+    {
+        Log(LL_WARNING, 0, "'%s' and 'path' defined in the same entry. (where path=%s)",
+        keyDef->name, entry->imageToLoad);
+        return FALSE;
+    }
+    return SplitVolumePrefix(keyDef, value, entry);
+}
+
 /*
-* This function parses the key and value from a line in the config file
-* key and value are output parameters (we write into them)
-* FALSE means there was a failure and the caller has to free the key or value
+* A path may start with the volume it is on, like "rootfs:\boot\vmlinuz" (a label or partition GUID, a FAT path
+* can't have a ':' in it), the volume is moved behind the path in place and becomes the volume of the entry
 */
-boolean_t ParseKeyValuePair(char_t* token, const char_t delimiter, char_t** key, char_t** value)
+static boolean_t SplitVolumePrefix(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry)
 {
-    int32_t valueOffset = GetValueOffset(token, delimiter);
-    if (valueOffset == -1)
+    char_t* colon = value;
+    while(*colon != CHAR_NULL && *colon != ':' && *colon != '\\' && *colon != '/')
+    {
+        colon++;
+    }
+    if(*colon != ':')
+    {
+        return TRUE;
+    }
+    size_t labelLen = colon - value;
+    if(keyDef->type == CFG_VALUE_KERNEL_DIR)
+    {
+        Log(LL_WARNING, 0, "'%s' is scanned on the volume of the loader, it can't name a volume. (where %s=%s)",
+            keyDef->name, keyDef->name, value);
+        return FALSE;
+    }
+    if(entry->volume != NULL)
+    {
+        Log(LL_WARNING, 0, "'%s' names a volume and 'volume' is defined in the same entry. (where volume=%s)",
+            keyDef->name, entry->volume);
+        return FALSE;
+    }
+    if(labelLen == 0 || labelLen >= VOLUME_LABEL_LEN)
     {
+        Log(LL_WARNING, 0, "Invalid volume in '%s' value '%s'", keyDef->name, value);
         return FALSE;
     }
-    size_t tokenLen = strlen(token);
-    size_t valueLength = tokenLen - valueOffset;
-    // Ignore empty values or keys without a value
-    if (tokenLen ==0 || valueLength == 0)
+    char_t label[VOLUME_LABEL_LEN];
+    memcpy(label, value, labelLen);
+    label[labelLen] = CHAR_NULL;
+    size_t pathLen = strlen(colon + 1);
+    memmove(value, colon + 1, pathLen + 1);
+    memcpy(value + pathLen + 1, label, labelLen + 1);
+    entry->volume = value + pathLen + 1;
+    return TRUE;
+}
+
+/*
+* 64 hex digits, stored in lowercase
+* An invalid digest is still set, so the entry refuses to boot instead of booting an image that isn't verified
+*/
+static boolean_t ValidateSha256(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if(!ParseSha256(value, digest))
+    {
+        Log(LL_WARNING, 0, "Invalid value '%s' for '%s', expected %d hex digits (the entry won't boot)",
+            value, keyDef->name, SHA256_HEX_LEN);
+        return TRUE;
+    }
+    for(char_t* c = value; *c != CHAR_NULL; c++)
     {
+        if(*c >= 'A' && *c <= 'F')
+        {
+            *c += 'a' - 'A';
+        }
+    }
+    return TRUE;
+}
+
+static boolean_t ValidateTimeout(const cfg_key_s* keyDef, char_t* value, boot_entry_s* entry)
+{
+    if(atoi(value) < -1)
+    {
+        Log(LL_WARNING, 0, "Invalid '%s' value '%s', it has to be -1 or more", keyDef->name, value);
         return FALSE;
     }
+    return TRUE;
+}
 
-    *key = malloc(valueOffset);
-    if(*key == NULL)
+static void ApplyTimeout(void)
+{
+    if(bmcfg.timeoutSeconds == -1)
+    {
+        bmcfg.timeoutCancelled = TRUE;
+    }
+    else if (bmcfg.timeoutSeconds == 0)
     {
-        Log(LL_ERROR, 0, "Failed to allocate memory for key string");
+        bmcfg.bootImmediately = TRUE;
     }
-    *value = malloc(valueLength +1);
-    if(*value == NULL)
+}
+
+/*
+* This function parses the key and value from a line in the config file
+* key and value are output parameters (we write into them)
+* The line is split in place - the delimiter is replaced with a null char and both sides
+* are trimmed, so key and value point inside of the token
+* FALSE means the line has no delimiter
+*/
+boolean_t ParseKeyValuePair(char_t* token, const char_t delimiter, char_t** key, char_t** value)
+{
+    char_t* delimiterPtr = strchr(token, delimiter);
+    if (delimiterPtr == NULL)
     {
-        Log(LL_ERROR, 0, "Failed to allocate memory for value string");
+        return FALSE;
     }
+    *delimiterPtr = CHAR_NULL;
 
-    strncpy(*key, token, valueOffset -1);
-    strncpy(*value, token + valueOffset, valueLength);
+    *key = TrimSpaces(token);
+    *value = TrimSpaces(delimiterPtr + 1);
     return TRUE;
 }
 
 /*
 * add an entry to the end of the entries array
-* simply put: it reallocates the current boot entry array, adds a new boot entry, and copies the given
-* boot_entry_s* entry to the new entry
+* The array grows geometrically in the arena (the old array stays there until the arena is freed,
+* which is at most as much as the final array), and the given entry is copied to its end
 */
 static void AppendEntry(boot_entry_array_s* bootEntryArr, boot_entry_s* entry)
 {
-    // re-allocate memory for in the entry arrays
-    bootEntryArr->entryArray = realloc(bootEntryArr->entryArray, sizeof(boot_entry_s) * (bootEntryArr->numOfEntries + 1));
+    if (bootEntryArr->numOfEntries == bootEntryArr->capacity)
+    {
+        int32_t newCapacity = (bootEntryArr->capacity == 0) ? CFG_MIN_ENTRY_CAPACITY : bootEntryArr->capacity * 2;
+        boot_entry_s* newArray = ArenaAlloc(&bootEntryArr->arena, sizeof(boot_entry_s) * newCapacity);
+        if (newArray == NULL)
+        {
+            Log(LL_ERROR, 0, "Failed to allocate memory for the boot entries, ignoring entry '%s'", entry->name);
+            return;
+        }
+        memcpy(newArray, bootEntryArr->entryArray, sizeof(boot_entry_s) * bootEntryArr->numOfEntries);
+        bootEntryArr->entryArray = newArray;
+        bootEntryArr->capacity = newCapacity;
+    }
 
     int32_t at = bootEntryArr->numOfEntries;
     boot_entry_s* newEntry = bootEntryArr->entryArray + at;
@@ -405,7 +906,13 @@ static void AppendEntry(boot_entry_array_s* bootEntryArr, boot_entry_s* entry)
     newEntry->name = entry->name;
     newEntry->imageToLoad = entry->imageToLoad;
     newEntry->imageArgs = entry->imageArgs;
+    newEntry->volume = entry->volume;
     newEntry->isDirectoryToKernel = entry->isDirectoryToKernel;
+    newEntry->expandKernels = entry->expandKernels;
+    newEntry->bufferedLoad = entry->bufferedLoad;
+    newEntry->kernelInitrd = entry->kernelInitrd;
+    newEntry->linuxBoot = entry->linuxBoot;
+    newEntry->sha256 = entry->sha256;
 
     if(newEntry->isDirectoryToKernel)
     {
@@ -420,151 +927,226 @@ static void AppendEntry(boot_entry_array_s* bootEntryArr, boot_entry_s* entry)
 }
 
 /*
-*   Used when entry->isDirectoryToKernel is set to TRUE and we have to fill the rest of the entry data
-*   Scan the directory of the kernel and fill args and image
+*   Used when entry->isDirectoryToKernel is set to TRUE, the kernels of the directory are taken
+*   from its kernel index (newest first), the entry boots the newest kernel, or if 'allkernels' is set
+*   an entry is added for every kernel
 */
-static void PrepareKernelDirEntry(boot_entry_s* entry)
+static void AppendKernelDirEntries(boot_entry_array_s* bootEntryArr, boot_entry_s* entry)
 {
-    kernel_scan_info_s* scanInfo = entry->kernelScanInfo;
-
-    entry->imageToLoad = GetPathToKernel(scanInfo->kernelDirectory);
-    scanInfo->kernelVersionString = GetKernelVersionString(entry->imageToLoad);
+    arena_s* arena = &bootEntryArr->arena;
+    const kernel_index_s* index = GetKernelIndex(entry->kernelScanInfo->kernelDirectory);
+    StampKernelDir(bootEntryArr, entry->kernelScanInfo->kernelDirectory, index);
+    if(index == NULL || index->numOfKernels == 0)
+    {
+        if(index != NULL)
+        {
+            Log(LL_ERROR, 0, "Linx Kernel not found in directory (dir='%s')", entry->kernelScanInfo->kernelDirectory);
+        }
+        if(ValidateEntry(entry))
+        {
+            AppendEntry(bootEntryArr, entry);
+        }
+        return;
+    }
 
-    if(scanInfo->kernelVersionString != NULL)
+    int32_t numOfKernels = entry->expandKernels ? index->numOfKernels : 1;
+    for(int32_t i = 0; i < numOfKernels; i++)
     {
-        // Put the kernel version string where needed
-        char_t* newArgs = StringReplace(entry->imageArgs, STR_TO_SUBSTITUTE_WITH_VERSION,
-        scanInfo->kernelVersionString);
-        // Replace old args list with new one if replacement func succeeded
-        if (newArgs != NULL)
+        const kernel_image_s* kernel = index->kernels + i;
+        boot_entry_s kernelEntry = *entry;
+        kernelEntry.kernelScanInfo = ArenaAlloc(arena, sizeof(kernel_scan_info_s));
+        if(kernelEntry.kernelScanInfo == NULL)
         {
-            free(entry->imageArgs);
-            entry->imageArgs = newArgs;
+            Log(LL_ERROR, 0, "Failed to allocate memory for the kernel scan info");
+            return;
+        }
+        kernelEntry.kernelScanInfo->kernelDirectory = entry->kernelScanInfo->kernelDirectory;
+
+        // The newest kernel keeps the name of the entry, the older ones get their version added
+        // (within MAX_ENTRY_NAME_LEN like every name, the name of the entry is cut so the version stays)
+        if(i > 0 && entry->name != NULL)
+        {
+            const char_t* kernelName = (kernel->release != NULL) ? kernel->release : kernel->fileName;
+            size_t versionLen = strlen(kernelName) + strlen(" ()");
+            size_t baseLen = strlen(entry->name);
+            if(baseLen + versionLen > MAX_ENTRY_NAME_LEN)
+            {
+                baseLen = (versionLen < MAX_ENTRY_NAME_LEN) ? MAX_ENTRY_NAME_LEN - versionLen : 0;
+            }
+            size_t nameSize = baseLen + versionLen + 1;
+            if(nameSize > MAX_ENTRY_NAME_LEN + 1)
+            {
+                nameSize = MAX_ENTRY_NAME_LEN + 1;
+            }
+            kernelEntry.name = ArenaAlloc(arena, nameSize);
+            if(kernelEntry.name == NULL)
+            {
+                Log(LL_ERROR, 0, "Failed to allocate memory for a config string");
+                return;
+            }
+            memcpy(kernelEntry.name, entry->name, baseLen);
+            snprintf(kernelEntry.name + baseLen, nameSize - baseLen, " (%s)", kernelName);
         }
-        else{
-            Log(LL_ERROR, 0, "Failed to detect kernel version. Exiting (kerneldir=%s, kernel=%s)",
-            scanInfo->kernelDirectory, entry->imageToLoad);
+
+        PrepareKernelDirEntry(arena, &kernelEntry, kernel);
+        if(ValidateEntry(&kernelEntry))
+        {
+            AppendEntry(bootEntryArr, &kernelEntry);
         }
     }
 }
 
 /*
-* this function returns the path to a loadable image located in a given 
-* directory path (const char_t* directoryPath)
+*   Remember the modification time the directory had when it was scanned (even if it had no kernels),
+*   so a kernel that is installed later is noticed by the config cache and the reload
 */
-static char_t* GetPathToKernel(const char_t* directoryPath)
+static void StampKernelDir(boot_entry_array_s* bootEntryArr, char_t* directory, const kernel_index_s* index)
 {
-    char_t* path = NULL;
-    char_t* kernelName = NULL;
-
-    DIR* dir;
-    struct dirent* de;
-    if ((dir = opendir(directoryPath)) != NULL)
+    for(kernel_dir_stamp_s* dirStamp = bootEntryArr->kernelDirs; dirStamp != NULL; dirStamp = dirStamp->next)
     {
-        while ((de = readdir(dir)) != NULL)
-        {
-            if(strstr(de->d_name, LINUX_KERNEL_IDENTIFIER_STR) != NULL)
-            {
-                kernelName = de->d_name;
-                break;
-            }
-        }
-        if(kernelName == NULL)
+        if(strcmp(dirStamp->directory, directory) == 0)
         {
-            Log(LL_ERROR, 0, "Linx Kernel not found in directory (dir='%s')", directoryPath); 
-            closedir(dir);
-            return path;
+            return;
         }
-        // Create a full path to the kernel file
-        path = ConcatPaths(directoryPath, kernelName);
-        closedir(dir);
     }
-    else{
-        Log(LL_ERROR, 0, "Failed to open directory '%s', to kernel: '%s'", directoryPath,
-        GetCommandErrorInfo(errno));
+    kernel_dir_stamp_s* dirStamp = ArenaAlloc(&bootEntryArr->arena, sizeof(kernel_dir_stamp_s));
+    if(dirStamp == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the kernel directory stamp");
+        // without it a change of the directory can't be noticed, so the entries aren't cached
+        bootEntryArr->stamp.isValid = FALSE;
+        return;
     }
-    return path;
+    dirStamp->directory = directory;
+    dirStamp->modificationTime = (index != NULL) ? index->modificationTime : 0;
+    dirStamp->next = bootEntryArr->kernelDirs;
+    bootEntryArr->kernelDirs = dirStamp;
 }
 
 /*
-*   get the kernel version string from the full kernel name
+*   Fill the path of the kernel, its version and the args (%v is replaced with the kernel version,
+*   and %i with the path of the initrd of the kernel)
 */
-static char_t* GetKernelVersionString(const char_t* fullKernelFileName)
+static void PrepareKernelDirEntry(arena_s* arena, boot_entry_s* entry, const kernel_image_s* kernel)
 {
-    char_t* kernelFileName = strrchr(fullKernelFileName, '\\') +1;
-
-    // Skip past the kernel file name
-    kernelFileName += strlen(LINUX_KERNEL_IDENTIFIER_STR);
+    kernel_scan_info_s* scanInfo = entry->kernelScanInfo;
 
-    // next char is version delimiter
-    char_t versionDelimiter = *kernelFileName;
-    if(versionDelimiter == CHAR_NULL)
+    entry->imageToLoad = StorePath(arena, scanInfo->kernelDirectory, kernel->fileName);
+    if(entry->imageToLoad == NULL)
     {
-        return NULL;
+        return;
+    }
+    // The index is freed when the directory changes, the entry keeps its own copy of the version
+    scanInfo->kernelVersionString = NULL;
+    if(kernel->version != NULL)
+    {
+        scanInfo->kernelVersionString = StoreString(arena, kernel->version, strlen(kernel->version));
     }
-    kernelFileName++;
 
-    // Store the pointer to where the version starts for later
-    char_t* startOfVersion = kernelFileName;
+    if(entry->imageArgs == NULL)
+    {
+        return;
+    }
+    if(scanInfo->kernelVersionString != NULL)
+    {
+        // Put the kernel version string where needed
+        entry->imageArgs = SubstituteArg(arena, entry->imageArgs, STR_TO_SUBSTITUTE_WITH_VERSION,
+        scanInfo->kernelVersionString);
+    }
+    if(strstr(entry->imageArgs, STR_TO_SUBSTITUTE_WITH_INITRD) != NULL)
+    {
+        if(kernel->initrdName == NULL)
+        {
+            Log(LL_WARNING, 0, "No initrd found for '%s' in '%s'", kernel->fileName, scanInfo->kernelDirectory);
+            return;
+        }
+        char_t* initrdPath = StorePath(arena, scanInfo->kernelDirectory, kernel->initrdName);
+        if(initrdPath != NULL)
+        {
+            entry->imageArgs = SubstituteArg(arena, entry->imageArgs, STR_TO_SUBSTITUTE_WITH_INITRD, initrdPath);
+        }
+    }
+}
 
-    // Find where the version string ends
-    while(*kernelFileName != versionDelimiter && *kernelFileName != CHAR_NULL)
+// Replace every pattern in the args, the args are kept as they are if the replacement failed
+static char_t* SubstituteArg(arena_s* arena, char_t* args, const char_t* pattern, const char_t* replacement)
+{
+    char_t* newArgs = StringReplace(args, pattern, replacement);
+    if(newArgs == NULL)
     {
-        kernelFileName++;
+        Log(LL_ERROR, 0, "Failed to replace '%s' in the args '%s'", pattern, args);
+        return args;
     }
+    char_t* storedArgs = StoreString(arena, newArgs, strlen(newArgs));
+    free(newArgs);
+    return (storedArgs == NULL) ? args : storedArgs;
+}
 
-    // Store the version string in a dynamic buffer
-    int32_t versionStrLen = kernelFileName - startOfVersion;
-    char_t* versionString = malloc(versionStrLen + 1);
-    if (versionString == NULL)
+// Create a full path to a file of the directory (in the arena)
+static char_t* StorePath(arena_s* arena, const char_t* directoryPath, const char_t* fileName)
+{
+    char_t* fullPath = ConcatPaths(directoryPath, fileName);
+    if(fullPath == NULL)
     {
         return NULL;
     }
-
-    strncpy(versionString, startOfVersion, versionStrLen);
-    return versionString;
+    char_t* path = StoreString(arena, fullPath, strlen(fullPath));
+    free(fullPath);
+    return path;
 }
 
-
 static inline void LogKeyRedefinition(const char_t* key, const char_t* curr, const char_t* ignored)
 {
     Log(LL_WARNING, 0, "Ignoring '%s' redefinition in the same config entry. (current=%s, ignored=%s)", 
         key, curr, ignored);
 }
 
-/*
-* Free the memory allocated for the config entries
-*/
-static void FreeConfigEntry(boot_entry_s* entry)
+// Compare everything the menu shows and boots of two entries
+static boolean_t EntriesEqual(const boot_entry_s* lhs, const boot_entry_s* rhs)
 {
-    free(entry->name);
-    free(entry->imageToLoad);
-    free(entry->imageArgs);
-
-    if(entry->isDirectoryToKernel)
+    if (lhs->isDirectoryToKernel != rhs->isDirectoryToKernel || lhs->bufferedLoad != rhs->bufferedLoad ||
+        lhs->kernelInitrd != rhs->kernelInitrd || lhs->linuxBoot != rhs->linuxBoot || !StringsEqual(lhs->name, rhs->name) ||
+        !StringsEqual(lhs->imageToLoad, rhs->imageToLoad) || !StringsEqual(lhs->imageArgs, rhs->imageArgs) ||
+        !StringsEqual(lhs->volume, rhs->volume) || !StringsEqual(lhs->sha256, rhs->sha256))
+    {
+        return FALSE;
+    }
+    if (lhs->isDirectoryToKernel)
     {
-        // free the scan info
-        free(entry->kernelScanInfo->kernelVersionString);
-        free(entry->kernelScanInfo->kernelDirectory);
-        free(entry->kernelScanInfo);
+        return StringsEqual(lhs->kernelScanInfo->kernelDirectory, rhs->kernelScanInfo->kernelDirectory) &&
+            StringsEqual(lhs->kernelScanInfo->kernelVersionString, rhs->kernelScanInfo->kernelVersionString);
     }
+    return TRUE;
 }
-/*
-* free the config entries (in the entries linked list)
-*/
-void FreeConfigEntries(boot_entry_array_s* entryArr)
+
+static inline boolean_t StringsEqual(const char_t* lhs, const char_t* rhs)
 {
-    for(int32_t i = 0; i < entryArr->numOfEntries; i++)
+    if (lhs == NULL || rhs == NULL)
     {
-        FreeConfigEntry(&entryArr->entryArray[i]);
+        return lhs == rhs;
     }
-    free(entryArr->entryArray);
+    return strcmp(lhs, rhs) == 0;
 }
 
+// Copy a string of len chars (and a null terminator) to the arena
+static char_t* StoreString(arena_s* arena, const char_t* str, size_t len)
+{
+    char_t* copy = ArenaStoreString(arena, str, len);
+    if (copy == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for a config string");
+    }
+    return copy;
+}
 
-
-
-
-
-
-
+/*
+* free the config entries
+* everything of the parse generation is in the arena, so this is just a page free
+*/
+void FreeConfigEntries(boot_entry_array_s* entryArr)
+{
+    ArenaFree(&entryArr->arena);
+    entryArr->entryArray = NULL;
+    entryArr->numOfEntries = 0;
+    entryArr->capacity = 0;
+}
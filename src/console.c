@@ -0,0 +1,255 @@
+#include "console.h"
+#include "display.h"
+#include "logs.h"
+#include "bootutils.h"
+
+static wchar_t frameText[CONSOLE_FRAME_LEN];
+static uintn_t frameTextLen = 0;
+static char_t formatBuffer[CONSOLE_FORMAT_LEN];
+static int32_t frameDepth = 0; // the frames that are open, the calls outside of one open their own
+static uintn_t textAttribute = 0; // of the text in the frame, and the text that comes after it
+static uintn_t consoleAttribute = 0; // the attribute the firmware has
+static boolean_t cursorPending = FALSE; // a cursor move that wasn't given to the firmware, it comes before the text
+static uintn_t pendingColumn = 0;
+static uintn_t pendingRow = 0;
+static uintn_t cursorColumn = 0; // where the text of the frame ends on the screen
+static console_frame_stats_s frameStats;
+static console_frame_stats_s lastFrameStats; // of the last frame that was ended
+
+static void OpenFrame(void);
+static void CloseFrame(void);
+static void FlushFrame(boolean_t frameEnd);
+static void AppendChar(wchar_t c);
+static int32_t DecodeUtf8(const char_t* s, wchar_t* c);
+
+// Start collecting the output, until EndConsoleFrame (frames can be nested, the outer one is flushed)
+void BeginConsoleFrame(void)
+{
+    if(frameDepth == 0)
+    {
+        memset(&frameStats, 0, sizeof(console_frame_stats_s));
+    }
+    OpenFrame();
+}
+
+// Give the frame to the firmware, GetConsoleFrameStats then tells the calls it took
+void EndConsoleFrame(void)
+{
+    CloseFrame();
+    if(frameDepth == 0)
+    {
+        lastFrameStats = frameStats;
+    }
+}
+
+// Like printf, the text is UTF-8 (a line break is formatted as CR LF)
+void ConsolePrintf(const char_t* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(formatBuffer, CONSOLE_FORMAT_LEN, format, args);
+    va_end(args);
+
+    OpenFrame();
+    const char_t* s = formatBuffer;
+    while(*s != CHAR_NULL)
+    {
+        wchar_t c = 0;
+        s += DecodeUtf8(s, &c);
+        AppendChar(c);
+    }
+    CloseFrame();
+}
+
+// The bytes as they are, like putchar for each of them (a line break is written as CR LF, NUL is skipped)
+void ConsoleWrite(const char_t* data, uint64_t size)
+{
+    OpenFrame();
+    for(uint64_t i = 0; i < size; i++)
+    {
+        if(data[i] == '\n')
+        {
+            AppendChar(L'\r');
+        }
+        if(data[i] != CHAR_NULL)
+        {
+            AppendChar((wchar_t)(uint8_t)data[i]);
+        }
+    }
+    CloseFrame();
+}
+
+void ConsoleSetAttribute(uintn_t attribute)
+{
+    OpenFrame();
+    if(attribute != textAttribute && frameTextLen > 0)
+    {
+        FlushFrame(FALSE);
+    }
+    textAttribute = attribute;
+    CloseFrame();
+}
+
+void ConsoleSetCursor(uintn_t column, uintn_t row)
+{
+    OpenFrame();
+    if(frameTextLen > 0)
+    {
+        FlushFrame(FALSE);
+    }
+    cursorPending = TRUE;
+    pendingColumn = column;
+    pendingRow = row;
+    cursorColumn = column;
+    CloseFrame();
+}
+
+// Spaces to the end of the row (over the text that was there), the cursor goes to the next row
+void ConsolePadRow(void)
+{
+    OpenFrame();
+    if(!screenModeSet || cursorColumn > screenCols)
+    {
+        AppendChar(L'\r');
+        AppendChar(L'\n');
+    }
+    else
+    {
+        for(uintn_t column = cursorColumn; column < screenCols; column++)
+        {
+            AppendChar(L' ');
+        }
+    }
+    CloseFrame();
+}
+
+// A row of spaces (a line break if the size of the screen isn't known)
+void ConsoleEmptyLine(void)
+{
+    OpenFrame();
+    if(!screenModeSet)
+    {
+        AppendChar(L'\r');
+        AppendChar(L'\n');
+    }
+    else
+    {
+        for(uintn_t column = 0; column < screenCols; column++)
+        {
+            AppendChar(L' ');
+        }
+    }
+    CloseFrame();
+}
+
+void GetConsoleFrameStats(console_frame_stats_s* stats)
+{
+    *stats = lastFrameStats;
+}
+
+void PrintConsoleFrameStats(void)
+{
+    const console_frame_stats_s* stats = &lastFrameStats;
+    ConsolePrintf("Last redraw: %d firmware calls (%d strings, %d attributes, %d cursor moves) for %d characters\n",
+        (int32_t)(stats->outputStrings + stats->setAttributes + stats->setCursors), (int32_t)stats->outputStrings,
+        (int32_t)stats->setAttributes, (int32_t)stats->setCursors, (int32_t)stats->characters);
+}
+
+void LogConsoleFrameStats(const char_t* frame)
+{
+    const console_frame_stats_s* stats = &lastFrameStats;
+    Log(LL_INFO, 0, "Drew the %s with %d firmware calls (%d strings, %d attributes, %d cursor moves), %d characters",
+        frame, (int32_t)(stats->outputStrings + stats->setAttributes + stats->setCursors),
+        (int32_t)stats->outputStrings, (int32_t)stats->setAttributes, (int32_t)stats->setCursors,
+        (int32_t)stats->characters);
+}
+
+// The first frame takes the attribute and the cursor of the console as they are (printf may have moved it)
+static void OpenFrame(void)
+{
+    if(frameDepth++ > 0)
+    {
+        return;
+    }
+    frameTextLen = 0;
+    cursorPending = FALSE;
+    textAttribute = ST->ConOut->Mode->Attribute;
+    consoleAttribute = textAttribute;
+    cursorColumn = ST->ConOut->Mode->CursorColumn;
+}
+
+static void CloseFrame(void)
+{
+    if(frameDepth > 0 && --frameDepth == 0)
+    {
+        FlushFrame(TRUE);
+    }
+}
+
+/*
+* Give the firmware the cursor move, the attribute and the text of the frame
+* The attribute only goes with text, or at the end of the frame (the console is left in it)
+*/
+static void FlushFrame(boolean_t frameEnd)
+{
+    if(cursorPending)
+    {
+        ST->ConOut->SetCursorPosition(ST->ConOut, pendingColumn, pendingRow);
+        frameStats.setCursors++;
+        cursorPending = FALSE;
+    }
+    if(textAttribute != consoleAttribute && (frameTextLen > 0 || frameEnd))
+    {
+        ST->ConOut->SetAttribute(ST->ConOut, textAttribute);
+        frameStats.setAttributes++;
+        consoleAttribute = textAttribute;
+    }
+    if(frameTextLen > 0)
+    {
+        frameText[frameTextLen] = 0;
+        ST->ConOut->OutputString(ST->ConOut, frameText);
+        frameStats.outputStrings++;
+        frameStats.characters += frameTextLen;
+        frameTextLen = 0;
+    }
+}
+
+static void AppendChar(wchar_t c)
+{
+    if(frameTextLen >= CONSOLE_FRAME_LEN - 1)
+    {
+        FlushFrame(FALSE);
+    }
+    frameText[frameTextLen++] = c;
+    if(c == L'\r')
+    {
+        cursorColumn = 0;
+    }
+    else if(c != L'\n' && ++cursorColumn >= screenCols && screenModeSet)
+    {
+        cursorColumn = 0; // the firmware wraps to the next row
+    }
+}
+
+// One character of a UTF-8 string (up to 3 bytes, UCS-2 has no more), returns the bytes it took
+static int32_t DecodeUtf8(const char_t* s, wchar_t* c)
+{
+    uint8_t lead = (uint8_t)s[0];
+    int32_t length = (lead < 0x80) ? 1 : ((lead & 0xE0) == 0xC0) ? 2 : ((lead & 0xF0) == 0xE0) ? 3 : 0;
+    for(int32_t i = 1; i < length; i++)
+    {
+        if(((uint8_t)s[i] & 0xC0) != 0x80)
+        {
+            length = 0;
+            break;
+        }
+    }
+    if(length == 0)
+    {
+        *c = L'?';
+        return 1;
+    }
+    *c = (length == 1) ? lead : (length == 2) ? (wchar_t)(((lead & 0x1F) << 6) | (s[1] & 0x3F)) :
+        (wchar_t)(((lead & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F));
+    return length;
+}
@@ -0,0 +1,336 @@
+#include "decompress.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "bootphase.h"
+#include "asyncread.h"
+
+// EFI zboot header (drivers/firmware/efi/libstub/zboot-header.S), in place of the DOS header of the PE stub
+#define ZBOOT_TYPE_OFFSET (4)
+#define ZBOOT_PAYLOAD_OFFSET (8)
+#define ZBOOT_PAYLOAD_SIZE_OFFSET (12)
+#define ZBOOT_COMPRESSION_OFFSET (24)
+#define ZBOOT_COMPRESSION_MAX_LEN (8)
+
+#define DECOMPRESSED_SIZE_LEN (4)
+#define DECOMPRESS_RATIO_GUESS (4) // the output starts at this many times the stream, if it doesn't tell its size
+
+static const char_t* const compressionNames[] = { "none", "gzip", "lz4", "zstd" };
+
+static uint64_t GetSizeHint(const decompress_s* decompress, uint64_t bytesRead);
+static boolean_t GrowOutput(decompress_s* decompress, uint64_t bytesRead);
+static inline uint32_t Load32(const uint8_t* at);
+
+/*
+* Recognise a compressed image by the magic number at its start, or by the zboot header of its PE stub
+* FALSE if the file isn't compressed (source is then the whole file)
+*/
+boolean_t DetectCompression(const uint8_t* header, uint64_t headerSize, uint64_t fileSize,
+    compressed_stream_s* source)
+{
+    memset(source, 0, sizeof(compressed_stream_s));
+    source->size = fileSize;
+    if(headerSize >= ZBOOT_COMPRESSION_OFFSET + ZBOOT_COMPRESSION_MAX_LEN && memcmp(header, "MZ", 2) == 0 &&
+        memcmp(header + ZBOOT_TYPE_OFFSET, "zimg", 4) == 0)
+    {
+        uint32_t offset = Load32(header + ZBOOT_PAYLOAD_OFFSET);
+        uint32_t size = Load32(header + ZBOOT_PAYLOAD_SIZE_OFFSET);
+        const char_t* name = (const char_t*)header + ZBOOT_COMPRESSION_OFFSET;
+        for(compression_t compression = COMPRESSION_GZIP; compression <= COMPRESSION_ZSTD; compression++)
+        {
+            if(strncmp(name, compressionNames[compression], ZBOOT_COMPRESSION_MAX_LEN) == 0)
+            {
+                source->compression = compression;
+            }
+        }
+        if(source->compression == COMPRESSION_NONE || offset > fileSize || size > fileSize - offset)
+        {
+            // a zboot image is a PE the firmware can load itself
+            source->compression = COMPRESSION_NONE;
+            return FALSE;
+        }
+        source->zboot = TRUE;
+        source->offset = offset;
+        source->size = size;
+        // the kernel build appends the decompressed size to the lz4 and zstd payloads
+        if(source->compression != COMPRESSION_GZIP && fileSize - offset - size >= DECOMPRESSED_SIZE_LEN)
+        {
+            source->sizeOffset = offset + size;
+        }
+    }
+    else if(headerSize >= 4 && header[0] == 0x1f && header[1] == 0x8b && header[2] == 8)
+    {
+        source->compression = COMPRESSION_GZIP;
+    }
+    else if(headerSize >= 4 && (Load32(header) == 0x184D2204 || Load32(header) == 0x184C2102))
+    {
+        source->compression = COMPRESSION_LZ4;
+    }
+    else if(headerSize >= 4 && Load32(header) == 0xFD2FB528)
+    {
+        source->compression = COMPRESSION_ZSTD;
+    }
+    // the size of the input is the last field of the gzip trailer
+    if(source->compression == COMPRESSION_GZIP && source->size >= DECOMPRESSED_SIZE_LEN)
+    {
+        source->sizeOffset = source->offset + source->size - DECOMPRESSED_SIZE_LEN;
+    }
+    return source->compression != COMPRESSION_NONE;
+}
+
+/*
+* Start decompressing a file that is being read, bytesRead (from its start) has to cover DECOMPRESS_HEADER_SIZE
+* or the whole file
+* NULL if the file isn't compressed, or the decoder couldn't start (the file is then used as it is)
+*/
+decompress_s* BeginDecompress(const char_t* file, uint64_t fileSize, uint64_t bytesRead)
+{
+    compressed_stream_s source;
+    uint64_t headerSize = (bytesRead < DECOMPRESS_HEADER_SIZE) ? bytesRead : DECOMPRESS_HEADER_SIZE;
+    if(!DetectCompression((const uint8_t*)file, headerSize, fileSize, &source))
+    {
+        return NULL;
+    }
+    decompress_s* decompress = malloc(sizeof(decompress_s));
+    if(decompress == NULL)
+    {
+        return NULL;
+    }
+    memset(decompress, 0, sizeof(decompress_s));
+    decompress->source = source;
+    decompress->file = (const uint8_t*)file;
+    decompress->stream.input = decompress->file + source.offset;
+    decompress->stream.outputSize = GetSizeHint(decompress, bytesRead) + DECOMPRESS_SLACK;
+    decompress->stream.output = (uint8_t*)AllocateFileBuffer(decompress->stream.outputSize);
+    decompress->status = DECODE_NEED_INPUT;
+
+    boolean_t started = decompress->stream.output != NULL;
+    switch (source.compression)
+    {
+    case COMPRESSION_GZIP:
+        InitInflate(&decompress->state.gzip);
+        break;
+    case COMPRESSION_LZ4:
+        InitLz4(&decompress->state.lz4);
+        break;
+    default:
+        started = started && InitZstd(&decompress->state.zstd);
+        break;
+    }
+    if(!started)
+    {
+        Log(LL_WARNING, 0, "Failed to allocate %d bytes to decompress an image.",
+            (int32_t)decompress->stream.outputSize);
+        FreeFileBuffer(decompress->stream.output);
+        free(decompress);
+        return NULL;
+    }
+    return decompress;
+}
+
+/*
+* Decode the stream up to bytesRead (counted from the start of the file)
+* returns DECODE_NEED_INPUT until the whole stream was decoded, DECODE_ERROR if it is corrupt
+*/
+decode_status_t StepDecompress(decompress_s* decompress, uint64_t bytesRead)
+{
+    if(decompress->status != DECODE_NEED_INPUT)
+    {
+        return decompress->status;
+    }
+    decode_stream_s* stream = &decompress->stream;
+    uint64_t available = (bytesRead > decompress->source.offset) ? bytesRead - decompress->source.offset : 0;
+    stream->inputSize = (available < decompress->source.size) ? available : decompress->source.size;
+    stream->inputComplete = stream->inputSize == decompress->source.size;
+
+    decode_status_t status;
+    while(TRUE)
+    {
+        switch (decompress->source.compression)
+        {
+        case COMPRESSION_GZIP:
+            status = GzipDecode(&decompress->state.gzip, stream);
+            break;
+        case COMPRESSION_LZ4:
+            status = Lz4Decode(&decompress->state.lz4, stream);
+            break;
+        default:
+            status = ZstdDecode(&decompress->state.zstd, stream);
+            break;
+        }
+        if(status != DECODE_NEED_OUTPUT)
+        {
+            break;
+        }
+        if(!GrowOutput(decompress, bytesRead))
+        {
+            Log(LL_WARNING, 0, "Failed to grow the buffer of a decompressed image past %d bytes.",
+                (int32_t)stream->outputSize);
+            status = DECODE_ERROR;
+            break;
+        }
+    }
+    decompress->status = status;
+    return status;
+}
+
+/*
+* Swap the file for its decompressed image, size goes from the size of the file to the size of the image
+* A file that failed to decompress is kept (with a warning), so whoever loads it gets to judge it
+* decompress is freed
+*/
+char_t* EndDecompress(decompress_s* decompress, char_t* file, uint64_t* size, const char_t* path)
+{
+    char_t* image = file;
+    if(decompress->status == DECODE_DONE)
+    {
+        Log(LL_INFO, 0, "Decompressed '%s' (%s%s, %d bytes to %d bytes)", path,
+            compressionNames[decompress->source.compression], decompress->source.zboot ? " zboot" : "",
+            (int32_t)*size, (int32_t)decompress->stream.outputPos);
+        image = (char_t*)decompress->stream.output;
+        *size = decompress->stream.outputPos;
+        decompress->stream.output = NULL;
+        FreeFileBuffer(file);
+    }
+    else
+    {
+        Log(LL_WARNING, 0, "Failed to decompress '%s' (%s), using it as it is.", path,
+            compressionNames[decompress->source.compression]);
+    }
+    CancelDecompress(decompress);
+    return image;
+}
+
+// Free the decoder and its output, for a file that is dropped before it was decompressed
+void CancelDecompress(decompress_s* decompress)
+{
+    if(decompress->source.compression == COMPRESSION_ZSTD)
+    {
+        FreeZstd(&decompress->state.zstd);
+    }
+    FreeFileBuffer(decompress->stream.output);
+    free(decompress);
+}
+
+/*
+* Read an image file into a file buffer, a compressed one is decompressed while the rest of it is read
+* (the decoder works on the chunks that arrived while the next one is in flight)
+* volume is the volume the file is on (for the chunk size of the read), or NULL
+* verify is the verification of an image with a pinned digest (BeginImageVerify), or NULL, the chunks are hashed
+* as they arrive too
+* The buffer is the caller's to free with FreeFileBuffer, NULL if the file couldn't be read or didn't verify
+*/
+char_t* ReadImageFile(efi_file_handle_t* file, efi_handle_t volume, uint64_t fileSize, uint64_t* outSize,
+    const char_t* path, image_verify_s* verify)
+{
+    char_t* buffer = AllocateFileBuffer(fileSize + 1);
+    if(buffer == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to create buffer to read file.");
+        return NULL;
+    }
+    boot_phase_t phase = BeginBootPhase("read", path);
+    async_read_s read;
+    BeginAsyncRead(&read, file, buffer, fileSize);
+    SetAsyncReadVolume(&read, volume);
+    decompress_s* decompress = NULL;
+    boolean_t detected = FALSE;
+    boolean_t done = FALSE;
+    while(!done)
+    {
+        done = WaitAsyncRead(&read);
+        uint64_t bytesRead = done ? fileSize : GetAsyncReadPrefix(&read);
+        if(EFI_ERROR(read.status))
+        {
+            break;
+        }
+        if(verify != NULL)
+        {
+            StepImageVerify(verify, buffer, bytesRead);
+        }
+        if(!detected && (done || bytesRead >= DECOMPRESS_HEADER_SIZE))
+        {
+            detected = TRUE;
+            decompress = BeginDecompress(buffer, fileSize, bytesRead);
+        }
+        if(decompress != NULL)
+        {
+            StepDecompress(decompress, bytesRead);
+        }
+    }
+    EndBootPhase(phase);
+    if(EFI_ERROR(read.status))
+    {
+        Log(LL_ERROR, read.status, "Failed to read file content.");
+        if(decompress != NULL)
+        {
+            CancelDecompress(decompress);
+        }
+        FreeFileBuffer(buffer);
+        return NULL;
+    }
+    LogAsyncRead(&read, path);
+    if(verify != NULL && !EndImageVerify(verify, buffer, path))
+    {
+        if(decompress != NULL)
+        {
+            CancelDecompress(decompress);
+        }
+        FreeFileBuffer(buffer);
+        return NULL;
+    }
+    buffer[fileSize] = CHAR_NULL;
+    *outSize = fileSize;
+    if(decompress != NULL)
+    {
+        buffer = EndDecompress(decompress, buffer, outSize, path);
+    }
+    return buffer;
+}
+
+// The decompressed size the file tells, the frame header tells, or a guess
+static uint64_t GetSizeHint(const decompress_s* decompress, uint64_t bytesRead)
+{
+    const compressed_stream_s* source = &decompress->source;
+    if(source->sizeOffset != 0 && bytesRead >= source->sizeOffset + DECOMPRESSED_SIZE_LEN)
+    {
+        return Load32(decompress->file + source->sizeOffset);
+    }
+    uint64_t available = (bytesRead > source->offset) ? bytesRead - source->offset : 0;
+    uint64_t size = 0;
+    if(source->compression == COMPRESSION_ZSTD)
+    {
+        size = GetZstdSize(decompress->stream.input, available);
+    }
+    else if(source->compression == COMPRESSION_LZ4)
+    {
+        size = GetLz4Size(decompress->stream.input, available);
+    }
+    return (size != 0) ? size : source->size * DECOMPRESS_RATIO_GUESS;
+}
+
+// Double the output, or grow it to the size the file tells once that was read
+static boolean_t GrowOutput(decompress_s* decompress, uint64_t bytesRead)
+{
+    decode_stream_s* stream = &decompress->stream;
+    uint64_t size = stream->outputSize * 2;
+    uint64_t hint = GetSizeHint(decompress, bytesRead) + DECOMPRESS_SLACK;
+    if(hint > stream->outputSize && hint < size)
+    {
+        size = hint;
+    }
+    uint8_t* output = (uint8_t*)ResizeFileBuffer((char_t*)stream->output, stream->outputPos, size);
+    if(output == NULL)
+    {
+        return FALSE;
+    }
+    stream->output = output;
+    stream->outputSize = size;
+    return TRUE;
+}
+
+static inline uint32_t Load32(const uint8_t* at)
+{
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
@@ -0,0 +1,1556 @@
+#include "ext4.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "blockcache.h"
+
+// On-disk layout (Documentation/filesystems/ext4 of Linux), every field is little endian and read by offset
+#define EXT4_SUPERBLOCK_OFFSET (1024)
+#define EXT4_SUPERBLOCK_SIZE (1024)
+#define SB_INODES_COUNT (0x00)
+#define SB_BLOCKS_COUNT_LO (0x04)
+#define SB_FREE_BLOCKS_LO (0x0C)
+#define SB_FIRST_DATA_BLOCK (0x14)
+#define SB_LOG_BLOCK_SIZE (0x18)
+#define SB_INODES_PER_GROUP (0x28)
+#define SB_MAGIC (0x38)
+#define SB_REV_LEVEL (0x4C)
+#define SB_INODE_SIZE (0x58)
+#define SB_FEATURE_INCOMPAT (0x60)
+#define SB_VOLUME_NAME (0x78)
+#define SB_HASH_SEED (0xEC)
+#define SB_DESC_SIZE (0xFE)
+#define SB_BLOCKS_COUNT_HI (0x150)
+#define SB_FREE_BLOCKS_HI (0x158)
+#define SB_FLAGS (0x160)
+
+#define EXT4_MAGIC (0xEF53)
+#define EXT4_VOLUME_NAME_LEN (16)
+#define EXT4_MAX_LOG_BLOCK_SIZE (6) // 64 KiB
+#define EXT4_GOOD_OLD_INODE_SIZE (128)
+#define EXT4_DESC_SIZE (32)
+#define EXT4_DESC_SIZE_64BIT (64)
+#define SB_FLAG_UNSIGNED_HASH (0x2)
+
+#define INCOMPAT_FILETYPE (0x2)
+#define INCOMPAT_RECOVER (0x4) // the journal has to be replayed
+#define INCOMPAT_EXTENTS (0x40)
+#define INCOMPAT_64BIT (0x80)
+#define INCOMPAT_MMP (0x100)
+#define INCOMPAT_FLEX_BG (0x200)
+#define INCOMPAT_EA_INODE (0x400)
+#define INCOMPAT_CSUM_SEED (0x2000)
+#define INCOMPAT_LARGEDIR (0x4000)
+#define INCOMPAT_INLINE_DATA (0x8000)
+// the others (meta_bg, compression, encryption, casefolding...) move the data or change how it is stored
+#define INCOMPAT_SUPPORTED (INCOMPAT_FILETYPE | INCOMPAT_RECOVER | INCOMPAT_EXTENTS | INCOMPAT_64BIT | \
+    INCOMPAT_MMP | INCOMPAT_FLEX_BG | INCOMPAT_EA_INODE | INCOMPAT_CSUM_SEED | INCOMPAT_LARGEDIR | \
+    INCOMPAT_INLINE_DATA)
+
+// group descriptor
+#define BG_INODE_TABLE_LO (0x08)
+#define BG_INODE_TABLE_HI (0x28)
+
+// inode
+#define INODE_MODE (0x00)
+#define INODE_SIZE_LO (0x04)
+#define INODE_ATIME (0x08)
+#define INODE_CTIME (0x0C)
+#define INODE_MTIME (0x10)
+#define INODE_BLOCKS_LO (0x1C)
+#define INODE_FLAGS (0x20)
+#define INODE_BLOCK (0x28)
+#define INODE_BLOCK_LEN (60)
+#define INODE_SIZE_HIGH (0x6C)
+#define INODE_BLOCKS_HIGH (0x74)
+#define INODE_COPY_SIZE (EXT4_GOOD_OLD_INODE_SIZE) // the fields past it aren't used
+
+#define MODE_TYPE_MASK (0xF000)
+#define MODE_DIRECTORY (0x4000)
+#define MODE_SYMLINK (0xA000)
+
+#define INODE_FLAG_INDEX (0x1000) // htree directory
+#define INODE_FLAG_HUGE_FILE (0x40000) // i_blocks counts blocks, not sectors
+#define INODE_FLAG_EXTENTS (0x80000)
+#define INODE_FLAG_INLINE_DATA (0x10000000)
+
+#define ROOT_INODE (2)
+#define SECTOR_SIZE (512) // the unit of i_blocks
+
+// extent tree, the header and the entries are 12 bytes
+#define EXTENT_MAGIC (0xF30A)
+#define EXTENT_ENTRY_SIZE (12)
+#define EXTENT_MAX_DEPTH (5)
+#define EXTENT_INIT_MAX_LEN (32768) // a longer extent is uninitialized, it reads as zeros
+
+// block map of ext2/ext3
+#define DIRECT_BLOCKS (12)
+#define INDIRECT_LEVELS (3)
+#define MAP_MAX_LEVELS (EXTENT_MAX_DEPTH) // levels of map blocks a file keeps
+
+// directory entries, and the htree index (dx_root and dx_node) that shares their blocks
+#define DIRENT_HEADER_SIZE (8)
+#define DX_ROOT_INFO_OFFSET (24) // after the "." and ".." entries
+#define DX_ROOT_INFO_LEN (8)
+#define DX_NODE_ENTRIES_OFFSET (8) // after an empty entry that covers the block
+#define DX_ENTRY_SIZE (8)
+#define DX_BLOCK_MASK (0x0FFFFFFF)
+#define DX_MAX_LEVELS (3)
+
+#define DX_HASH_LEGACY (0)
+#define DX_HASH_HALF_MD4 (1)
+#define DX_HASH_TEA (2)
+#define DX_HASH_UNSIGNED_DELTA (3) // the unsigned variants follow the signed ones
+#define DX_HASH_TEA_UNSIGNED (DX_HASH_TEA + DX_HASH_UNSIGNED_DELTA)
+#define DX_HASH_EOF (0x7FFFFFFFU)
+
+#define NO_BLOCK (~0ULL)
+#define NO_HOLE_END (~0ULL)
+
+#define EFI_NATIVE_INTERFACE (0)
+#define OFFSET_OF(type, field) ((uintn_t)&(((type*)0)->field))
+#define EFI_UNSPECIFIED_TIMEZONE (0x07FF)
+#define EFI_FILE_SYSTEM_INFO_GUID { 0x09576e93, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+#define EFI_FILE_SYSTEM_VOLUME_LABEL_GUID { 0xdb47d7d3, 0xfe81, 0x11d3, {0x9a, 0x35, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d} }
+
+// libuefi has no EFI_FILE_SYSTEM_INFO
+typedef struct efi_file_system_info_s{
+    uint64_t Size;
+    boolean_t ReadOnly;
+    uint64_t VolumeSize;
+    uint64_t FreeSpace;
+    uint32_t BlockSize;
+    wchar_t VolumeLabel[EXT4_VOLUME_NAME_LEN + 1];
+} efi_file_system_info_t;
+
+// libuefi leaves BS->InstallProtocolInterface untyped
+typedef efi_status_t (EFIAPI *efi_install_protocol_interface_t)(efi_handle_t* handle, efi_guid_t* protocol,
+    uint32_t interfaceType, void* interface);
+
+typedef struct ext4_volume_s{
+    efi_simple_file_system_protocol_t fileSystem; // first, OpenVolume gets the volume as its This
+    efi_block_io_t* blockIo;
+    uint32_t mediaId;
+    uint32_t sectorSize;
+    uint32_t ioAlign;
+    uint32_t blockSize;
+    uint64_t numOfBlocks;
+    uint64_t freeBlocks;
+    uint32_t firstDataBlock;
+    uint32_t inodesPerGroup;
+    uint32_t inodeSize;
+    uint32_t descSize;
+    uint32_t hashSeed[4];
+    boolean_t unsignedHash;
+    char_t label[EXT4_VOLUME_NAME_LEN + 1];
+    // the last group descriptor or inode table block read, a lookup reads the same ones again
+    uint8_t* metaBlock;
+    uint64_t metaBlockNum;
+} ext4_volume_s;
+
+typedef struct ext4_file_s{
+    efi_file_handle_t handle; // first, the file functions get the file as their handle
+    ext4_volume_s* volume;
+    uint32_t inodeNumber;
+    uint8_t inode[INODE_COPY_SIZE];
+    uint64_t size;
+    uint64_t position; // of the next entry, for a directory
+    wchar_t name[EXT4_NAME_MAX + 1];
+    // the extent tree (or indirect) blocks last read on each level, so the runs of a file are mapped
+    // without reading them again
+    uint8_t* mapBlocks[MAP_MAX_LEVELS];
+    uint64_t mapBlockNums[MAP_MAX_LEVELS];
+    uint8_t* dirBlock; // the directory block Read lists
+    uint64_t dirBlockNum;
+} ext4_file_s;
+
+typedef struct ext4_dir_entry_s{
+    uint32_t inode;
+    uint32_t recordLen;
+    uint32_t nameLen;
+    const char_t* name;
+} ext4_dir_entry_s;
+
+static ext4_volume_s* MountVolume(efi_block_io_t* blockIo);
+static void FreeVolume(ext4_volume_s* volume);
+static efi_status_t ReadDisk(ext4_volume_s* volume, uint64_t offset, uint64_t size, void* buffer);
+static const uint8_t* ReadMetaBlock(ext4_volume_s* volume, uint64_t block);
+static const uint8_t* ReadMapBlock(ext4_file_s* file, int32_t level, uint64_t block);
+static ext4_file_s* NewFile(ext4_volume_s* volume);
+static efi_status_t LoadInode(ext4_file_s* file, uint32_t number);
+static efi_status_t MapFileBlock(ext4_file_s* file, uint64_t logical, uint64_t* physical, uint64_t* count);
+static efi_status_t MapExtent(ext4_file_s* file, uint64_t logical, uint64_t* physical, uint64_t* count);
+static efi_status_t MapIndirect(ext4_file_s* file, uint64_t logical, uint64_t* physical, uint64_t* count);
+static efi_status_t ReadFileData(ext4_file_s* file, uint64_t offset, uint64_t size, uint8_t* buffer);
+static boolean_t ParseDirEntry(const ext4_volume_s* volume, const uint8_t* block, uint32_t offset,
+    ext4_dir_entry_s* entry);
+static boolean_t FindInDirBlock(const ext4_volume_s* volume, const uint8_t* block, const char_t* name,
+    uint32_t nameLen, uint32_t* number);
+static efi_status_t FindDirEntry(ext4_file_s* dir, const char_t* name, uint32_t nameLen, uint32_t* number);
+static efi_status_t FindDirEntryLinear(ext4_file_s* dir, const char_t* name, uint32_t nameLen, uint32_t* number);
+static efi_status_t FindDirEntryIndexed(ext4_file_s* dir, const char_t* name, uint32_t nameLen, uint32_t* number);
+static uint32_t HashDirEntryName(const char_t* name, uint32_t nameLen, uint32_t version, const uint32_t seed[4]);
+static efi_status_t ResolvePath(const ext4_file_s* from, const char_t* path, ext4_file_s* file);
+static efi_status_t ReadSymlink(ext4_file_s* link, char_t* target);
+static efi_status_t ReadDirectory(ext4_file_s* dir, uintn_t* bufferSize, void* buffer);
+static efi_status_t FillFileInfo(ext4_file_s* file, uintn_t* bufferSize, void* buffer);
+static void UnixTimeToEfiTime(uint32_t seconds, efi_time_t* time);
+static boolean_t WideToUtf8(const wchar_t* wide, char_t* str, uint32_t strSize);
+static uint32_t Utf8ToWide(const char_t* str, uint32_t length, wchar_t* wide, uint32_t wideLen);
+static inline boolean_t IsPathSeparator(char_t c);
+static inline boolean_t IsDirectory(const ext4_file_s* file);
+static inline uint16_t Load16(const uint8_t* at);
+static inline uint32_t Load32(const uint8_t* at);
+
+static efi_status_t EFIAPI Ext4OpenVolume(void* this, efi_file_handle_t** root);
+static efi_status_t EFIAPI Ext4Open(efi_file_handle_t* handle, efi_file_handle_t** newHandle, wchar_t* fileName,
+    uint64_t openMode, uint64_t attributes);
+static efi_status_t EFIAPI Ext4Close(efi_file_handle_t* handle);
+static efi_status_t EFIAPI Ext4Delete(efi_file_handle_t* handle);
+static efi_status_t EFIAPI Ext4Read(efi_file_handle_t* handle, uintn_t* bufferSize, void* buffer);
+static efi_status_t EFIAPI Ext4Write(efi_file_handle_t* handle, uintn_t* bufferSize, void* buffer);
+static efi_status_t EFIAPI Ext4GetPosition(efi_file_handle_t* handle, uint64_t* position);
+static efi_status_t EFIAPI Ext4SetPosition(efi_file_handle_t* handle, uint64_t position);
+static efi_status_t EFIAPI Ext4GetInfo(efi_file_handle_t* handle, efi_guid_t* type, uintn_t* bufferSize,
+    void* buffer);
+static efi_status_t EFIAPI Ext4SetInfo(efi_file_handle_t* handle, efi_guid_t* type, uintn_t bufferSize,
+    void* buffer);
+static efi_status_t EFIAPI Ext4Flush(efi_file_handle_t* handle);
+
+/*
+* Give every ext2/3/4 partition the simple file system protocol, called before the volumes are scanned
+* A partition that has a file system protocol already (the ESP, or one mounted before) is left alone
+* The volumes stay mounted for the rest of the session, the kernel may open its initrd on them
+*/
+void MountExt4Volumes(void)
+{
+    efi_guid_t blockIoGuid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    efi_guid_t sfsGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    uintn_t bufSize = 0;
+    efi_status_t status = BS->LocateHandle(ByProtocol, &blockIoGuid, NULL, &bufSize, NULL);
+    if(status != EFI_BUFFER_TOO_SMALL)
+    {
+        return;
+    }
+    efi_handle_t* handles = malloc(bufSize);
+    if(handles == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the block io handles");
+        return;
+    }
+    status = BS->LocateHandle(ByProtocol, &blockIoGuid, NULL, &bufSize, handles);
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Unable to locate the block io handles");
+        free(handles);
+        return;
+    }
+
+    uintn_t numHandles = bufSize / sizeof(efi_handle_t);
+    for(uintn_t i = 0; i < numHandles; i++)
+    {
+        void* fileSystem = NULL;
+        efi_block_io_t* blockIo = NULL;
+        if(!EFI_ERROR(BS->HandleProtocol(handles[i], &sfsGuid, &fileSystem)) ||
+            EFI_ERROR(BS->HandleProtocol(handles[i], &blockIoGuid, (void**)&blockIo)) ||
+            blockIo->Media == NULL || !blockIo->Media->MediaPresent)
+        {
+            continue;
+        }
+        ext4_volume_s* volume = MountVolume(blockIo);
+        if(volume == NULL)
+        {
+            continue;
+        }
+        efi_handle_t handle = handles[i];
+        status = (*(efi_install_protocol_interface_t*)&BS->InstallProtocolInterface)(&handle, &sfsGuid,
+            EFI_NATIVE_INTERFACE, &volume->fileSystem);
+        if(EFI_ERROR(status))
+        {
+            Log(LL_WARNING, status, "Failed to install the file system protocol of the ext4 volume '%s'.",
+                volume->label);
+            FreeVolume(volume);
+            continue;
+        }
+        Log(LL_INFO, 0, "Mounted the ext4 volume '%s' (%d MiB, %d byte blocks)", volume->label,
+            (int32_t)(volume->numOfBlocks * volume->blockSize / (1024 * 1024)), (int32_t)volume->blockSize);
+    }
+    free(handles);
+}
+
+// Check the superblock of a partition, NULL if it isn't an ext file system this driver can read
+static ext4_volume_s* MountVolume(efi_block_io_t* blockIo)
+{
+    uint32_t sectorSize = blockIo->Media->BlockSize;
+    if(sectorSize == 0 || (sectorSize & (sectorSize - 1)) != 0 ||
+        (blockIo->Media->LastBlock + 1) * sectorSize < EXT4_SUPERBLOCK_OFFSET + EXT4_SUPERBLOCK_SIZE)
+    {
+        return NULL;
+    }
+    ext4_volume_s* volume = malloc(sizeof(ext4_volume_s));
+    if(volume == NULL)
+    {
+        return NULL;
+    }
+    memset(volume, 0, sizeof(ext4_volume_s));
+    volume->fileSystem.Revision = EFI_FILE_PROTOCOL_REVISION;
+    volume->fileSystem.OpenVolume = Ext4OpenVolume;
+    volume->blockIo = blockIo;
+    volume->mediaId = blockIo->Media->MediaId;
+    volume->sectorSize = sectorSize;
+    volume->ioAlign = blockIo->Media->IoAlign;
+    volume->metaBlockNum = NO_BLOCK;
+
+    uint8_t superblock[EXT4_SUPERBLOCK_SIZE];
+    if(EFI_ERROR(ReadDisk(volume, EXT4_SUPERBLOCK_OFFSET, EXT4_SUPERBLOCK_SIZE, superblock)) ||
+        Load16(superblock + SB_MAGIC) != EXT4_MAGIC)
+    {
+        free(volume);
+        return NULL;
+    }
+    memcpy(volume->label, superblock + SB_VOLUME_NAME, EXT4_VOLUME_NAME_LEN);
+    volume->label[EXT4_VOLUME_NAME_LEN] = CHAR_NULL;
+
+    uint32_t incompat = Load32(superblock + SB_FEATURE_INCOMPAT);
+    uint32_t logBlockSize = Load32(superblock + SB_LOG_BLOCK_SIZE);
+    boolean_t is64Bit = (incompat & INCOMPAT_64BIT) != 0;
+    volume->blockSize = 1024 << ((logBlockSize <= EXT4_MAX_LOG_BLOCK_SIZE) ? logBlockSize : 0);
+    volume->numOfBlocks = Load32(superblock + SB_BLOCKS_COUNT_LO) |
+        (is64Bit ? (uint64_t)Load32(superblock + SB_BLOCKS_COUNT_HI) << 32 : 0);
+    volume->freeBlocks = Load32(superblock + SB_FREE_BLOCKS_LO) |
+        (is64Bit ? (uint64_t)Load32(superblock + SB_FREE_BLOCKS_HI) << 32 : 0);
+    volume->firstDataBlock = Load32(superblock + SB_FIRST_DATA_BLOCK);
+    volume->inodesPerGroup = Load32(superblock + SB_INODES_PER_GROUP);
+    volume->inodeSize = (Load32(superblock + SB_REV_LEVEL) == 0) ? EXT4_GOOD_OLD_INODE_SIZE :
+        Load16(superblock + SB_INODE_SIZE);
+    volume->descSize = is64Bit ? Load16(superblock + SB_DESC_SIZE) : EXT4_DESC_SIZE;
+    for(int32_t i = 0; i < 4; i++)
+    {
+        volume->hashSeed[i] = Load32(superblock + SB_HASH_SEED + i * 4);
+    }
+    volume->unsignedHash = (Load32(superblock + SB_FLAGS) & SB_FLAG_UNSIGNED_HASH) != 0;
+
+    const char_t* problem = NULL;
+    if((incompat & ~INCOMPAT_SUPPORTED) != 0)
+    {
+        problem = "uses features that aren't supported";
+    }
+    else if(logBlockSize > EXT4_MAX_LOG_BLOCK_SIZE || volume->inodesPerGroup == 0 ||
+        Load32(superblock + SB_INODES_COUNT) == 0 || volume->firstDataBlock >= volume->numOfBlocks ||
+        volume->inodeSize < EXT4_GOOD_OLD_INODE_SIZE || volume->inodeSize > volume->blockSize ||
+        (volume->inodeSize & (volume->inodeSize - 1)) != 0 ||
+        volume->descSize < (is64Bit ? EXT4_DESC_SIZE_64BIT : EXT4_DESC_SIZE) ||
+        volume->descSize > volume->blockSize || (volume->descSize & (volume->descSize - 1)) != 0 ||
+        volume->numOfBlocks * volume->blockSize > (blockIo->Media->LastBlock + 1) * sectorSize)
+    {
+        problem = "has a corrupt superblock";
+    }
+    if(problem != NULL)
+    {
+        Log(LL_WARNING, 0, "The ext4 volume '%s' %s (incompatible features 0x%x), it isn't mounted.",
+            volume->label, problem, incompat);
+        free(volume);
+        return NULL;
+    }
+    if(incompat & INCOMPAT_RECOVER)
+    {
+        Log(LL_WARNING, 0, "The ext4 volume '%s' wasn't unmounted cleanly, the changes in its journal aren't read.",
+            volume->label);
+    }
+
+    volume->metaBlock = (uint8_t*)AllocateFileBuffer(volume->blockSize);
+    if(volume->metaBlock == NULL)
+    {
+        free(volume);
+        return NULL;
+    }
+    return volume;
+}
+
+static void FreeVolume(ext4_volume_s* volume)
+{
+    FreeFileBuffer(volume->metaBlock);
+    free(volume);
+}
+
+/*
+* Read bytes from the partition, the metadata and small reads through the block cache, the runs of file data
+* straight into the buffer when they are whole sectors and the buffer is aligned for the device, otherwise through
+* a bounce buffer
+*/
+static efi_status_t ReadDisk(ext4_volume_s* volume, uint64_t offset, uint64_t size, void* buffer)
+{
+    efi_block_io_t* blockIo = volume->blockIo;
+    if(size <= BLOCK_CACHE_MAX_READ)
+    {
+        efi_status_t status = ReadCachedBlocks(blockIo, offset, size, buffer);
+        if(status != EFI_UNSUPPORTED)
+        {
+            return status;
+        }
+    }
+    if(offset % volume->sectorSize == 0 && size % volume->sectorSize == 0 &&
+        (volume->ioAlign <= 1 || (uintn_t)buffer % volume->ioAlign == 0))
+    {
+        return blockIo->ReadBlocks(blockIo, volume->mediaId, offset / volume->sectorSize, size, buffer);
+    }
+
+    uint8_t* bounce = (uint8_t*)AllocateFileBuffer(EXT4_BOUNCE_SIZE);
+    if(bounce == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    uint8_t* dest = buffer;
+    efi_status_t status = EFI_SUCCESS;
+    while(size > 0 && !EFI_ERROR(status))
+    {
+        uint64_t skip = offset % volume->sectorSize;
+        uint64_t length = (skip + size + volume->sectorSize - 1) / volume->sectorSize * volume->sectorSize;
+        if(length > EXT4_BOUNCE_SIZE)
+        {
+            length = EXT4_BOUNCE_SIZE;
+        }
+        status = blockIo->ReadBlocks(blockIo, volume->mediaId, offset / volume->sectorSize, length, bounce);
+        uint64_t copied = (length - skip < size) ? length - skip : size;
+        memcpy(dest, bounce + skip, copied);
+        dest += copied;
+        offset += copied;
+        size -= copied;
+    }
+    FreeFileBuffer(bounce);
+    return status;
+}
+
+static const uint8_t* ReadMetaBlock(ext4_volume_s* volume, uint64_t block)
+{
+    if(volume->metaBlockNum == block)
+    {
+        return volume->metaBlock;
+    }
+    volume->metaBlockNum = NO_BLOCK;
+    if(block >= volume->numOfBlocks ||
+        EFI_ERROR(ReadDisk(volume, block * volume->blockSize, volume->blockSize, volume->metaBlock)))
+    {
+        return NULL;
+    }
+    volume->metaBlockNum = block;
+    return volume->metaBlock;
+}
+
+// A block of the extent tree (or of the block map) of a file, on a level below the inode
+static const uint8_t* ReadMapBlock(ext4_file_s* file, int32_t level, uint64_t block)
+{
+    ext4_volume_s* volume = file->volume;
+    if(file->mapBlockNums[level] == block)
+    {
+        return file->mapBlocks[level];
+    }
+    if(file->mapBlocks[level] == NULL)
+    {
+        file->mapBlocks[level] = (uint8_t*)AllocateFileBuffer(volume->blockSize);
+        if(file->mapBlocks[level] == NULL)
+        {
+            return NULL;
+        }
+    }
+    file->mapBlockNums[level] = NO_BLOCK;
+    if(block >= volume->numOfBlocks ||
+        EFI_ERROR(ReadDisk(volume, block * volume->blockSize, volume->blockSize, file->mapBlocks[level])))
+    {
+        return NULL;
+    }
+    file->mapBlockNums[level] = block;
+    return file->mapBlocks[level];
+}
+
+static ext4_file_s* NewFile(ext4_volume_s* volume)
+{
+    ext4_file_s* file = malloc(sizeof(ext4_file_s));
+    if(file == NULL)
+    {
+        return NULL;
+    }
+    memset(file, 0, sizeof(ext4_file_s));
+    file->handle.Revision = EFI_FILE_PROTOCOL_REVISION;
+    file->handle.Open = Ext4Open;
+    file->handle.Close = Ext4Close;
+    file->handle.Delete = Ext4Delete;
+    file->handle.Read = Ext4Read;
+    file->handle.Write = Ext4Write;
+    file->handle.GetPosition = Ext4GetPosition;
+    file->handle.SetPosition = Ext4SetPosition;
+    file->handle.GetInfo = Ext4GetInfo;
+    file->handle.SetInfo = Ext4SetInfo;
+    file->handle.Flush = Ext4Flush;
+    file->volume = volume;
+    for(int32_t i = 0; i < MAP_MAX_LEVELS; i++)
+    {
+        file->mapBlockNums[i] = NO_BLOCK;
+    }
+    file->dirBlockNum = NO_BLOCK;
+    return file;
+}
+
+// Make the file the inode, the blocks it cached for the previous one are dropped
+static efi_status_t LoadInode(ext4_file_s* file, uint32_t number)
+{
+    ext4_volume_s* volume = file->volume;
+    for(int32_t i = 0; i < MAP_MAX_LEVELS; i++)
+    {
+        file->mapBlockNums[i] = NO_BLOCK;
+    }
+    file->dirBlockNum = NO_BLOCK;
+    file->position = 0;
+    if(number == 0)
+    {
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    uint64_t group = (number - 1) / volume->inodesPerGroup;
+    uint64_t descOffset = group * volume->descSize;
+    const uint8_t* desc = ReadMetaBlock(volume, volume->firstDataBlock + 1 + descOffset / volume->blockSize);
+    if(desc == NULL)
+    {
+        return EFI_DEVICE_ERROR;
+    }
+    desc += descOffset % volume->blockSize;
+    uint64_t inodeTable = Load32(desc + BG_INODE_TABLE_LO);
+    if(volume->descSize >= EXT4_DESC_SIZE_64BIT)
+    {
+        inodeTable |= (uint64_t)Load32(desc + BG_INODE_TABLE_HI) << 32;
+    }
+
+    uint64_t inodeOffset = (uint64_t)((number - 1) % volume->inodesPerGroup) * volume->inodeSize;
+    const uint8_t* block = ReadMetaBlock(volume, inodeTable + inodeOffset / volume->blockSize);
+    if(block == NULL)
+    {
+        return EFI_DEVICE_ERROR;
+    }
+    memcpy(file->inode, block + inodeOffset % volume->blockSize, INODE_COPY_SIZE);
+    file->inodeNumber = number;
+    file->size = Load32(file->inode + INODE_SIZE_LO) | (uint64_t)Load32(file->inode + INODE_SIZE_HIGH) << 32;
+    return EFI_SUCCESS;
+}
+
+/*
+* Map a block of a file to the disk: its physical block, and how many blocks from it are contiguous on the disk
+* A hole (or an uninitialized extent) maps to block 0, count is then the length of the hole
+*/
+static efi_status_t MapFileBlock(ext4_file_s* file, uint64_t logical, uint64_t* physical, uint64_t* count)
+{
+    uint32_t flags = Load32(file->inode + INODE_FLAGS);
+    if(flags & INODE_FLAG_INLINE_DATA)
+    {
+        // the data is in the inode and its extended attributes, only tiny files and directories have it
+        return EFI_UNSUPPORTED;
+    }
+    if(flags & INODE_FLAG_EXTENTS)
+    {
+        return MapExtent(file, logical, physical, count);
+    }
+    return MapIndirect(file, logical, physical, count);
+}
+
+static efi_status_t MapExtent(ext4_file_s* file, uint64_t logical, uint64_t* physical, uint64_t* count)
+{
+    const uint8_t* node = file->inode + INODE_BLOCK;
+    uint32_t nodeSize = INODE_BLOCK_LEN;
+    uint64_t rangeEnd = NO_HOLE_END; // where the entries of this node end
+    for(int32_t level = 0; level <= EXTENT_MAX_DEPTH; level++)
+    {
+        uint32_t entries = Load16(node + 2);
+        uint32_t depth = Load16(node + 6);
+        if(Load16(node) != EXTENT_MAGIC || (entries + 1) * EXTENT_ENTRY_SIZE > nodeSize)
+        {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        // the last entry that starts at or before the block
+        const uint8_t* entry = node + EXTENT_ENTRY_SIZE;
+        int32_t low = 0;
+        int32_t high = (int32_t)entries - 1;
+        int32_t found = -1;
+        while(low <= high)
+        {
+            int32_t middle = (low + high) / 2;
+            if(Load32(entry + middle * EXTENT_ENTRY_SIZE) <= logical)
+            {
+                found = middle;
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+        if(found + 1 < (int32_t)entries)
+        {
+            rangeEnd = Load32(entry + (found + 1) * EXTENT_ENTRY_SIZE);
+        }
+
+        if(depth == 0)
+        {
+            if(found >= 0)
+            {
+                const uint8_t* extent = entry + found * EXTENT_ENTRY_SIZE;
+                uint64_t start = Load32(extent);
+                uint32_t length = Load16(extent + 4);
+                boolean_t uninitialized = length > EXTENT_INIT_MAX_LEN;
+                if(uninitialized)
+                {
+                    length -= EXTENT_INIT_MAX_LEN;
+                }
+                if(logical < start + length)
+                {
+                    *count = start + length - logical;
+                    *physical = uninitialized ? 0 :
+                        ((uint64_t)Load16(extent + 6) << 32 | Load32(extent + 8)) + logical - start;
+                    return EFI_SUCCESS;
+                }
+            }
+            *physical = 0;
+            *count = (rangeEnd == NO_HOLE_END) ? NO_HOLE_END : rangeEnd - logical;
+            return EFI_SUCCESS;
+        }
+        if(found < 0)
+        {
+            *physical = 0;
+            *count = rangeEnd - logical;
+            return EFI_SUCCESS;
+        }
+        if(level == EXTENT_MAX_DEPTH)
+        {
+            break;
+        }
+        const uint8_t* index = entry + found * EXTENT_ENTRY_SIZE;
+        node = ReadMapBlock(file, level, (uint64_t)Load16(index + 8) << 32 | Load32(index + 4));
+        if(node == NULL)
+        {
+            return EFI_DEVICE_ERROR;
+        }
+        nodeSize = file->volume->blockSize;
+    }
+    return EFI_VOLUME_CORRUPTED;
+}
+
+// The block map of ext2/ext3: 12 direct blocks, then an indirect, a double and a triple indirect block
+static efi_status_t MapIndirect(ext4_file_s* file, uint64_t logical, uint64_t* physical, uint64_t* count)
+{
+    uint64_t perBlock = file->volume->blockSize / 4;
+    const uint8_t* table = file->inode + INODE_BLOCK;
+    uint64_t tableLen = DIRECT_BLOCKS;
+    uint64_t index = logical;
+    if(logical >= DIRECT_BLOCKS)
+    {
+        // the indirection level of the block, and the blocks the pointer of that level covers
+        uint64_t rest = logical - DIRECT_BLOCKS;
+        uint64_t span = perBlock;
+        int32_t levels = 1;
+        while(rest >= span)
+        {
+            rest -= span;
+            span *= perBlock;
+            if(++levels > INDIRECT_LEVELS)
+            {
+                return EFI_VOLUME_CORRUPTED;
+            }
+        }
+        uint32_t block = Load32(table + (DIRECT_BLOCKS + levels - 1) * 4);
+        for(int32_t level = 0; level < levels; level++)
+        {
+            if(block == 0)
+            {
+                *physical = 0;
+                *count = span - rest;
+                return EFI_SUCCESS;
+            }
+            table = ReadMapBlock(file, level, block);
+            if(table == NULL)
+            {
+                return EFI_DEVICE_ERROR;
+            }
+            span /= perBlock;
+            block = Load32(table + rest / span * 4);
+            index = rest / span;
+            rest %= span;
+        }
+        tableLen = perBlock;
+    }
+
+    // the run of the blocks that follow each other in the table, or of the holes
+    uint32_t first = Load32(table + index * 4);
+    uint64_t length = 1;
+    while(index + length < tableLen &&
+        Load32(table + (index + length) * 4) == ((first == 0) ? 0 : first + length))
+    {
+        length++;
+    }
+    *physical = first;
+    *count = length;
+    return EFI_SUCCESS;
+}
+
+/*
+* Read bytes of a file, every run of contiguous blocks is read in one transfer straight into the buffer
+* (only a partial block at either end of the read goes through the bounce buffer of ReadDisk)
+*/
+static efi_status_t ReadFileData(ext4_file_s* file, uint64_t offset, uint64_t size, uint8_t* buffer)
+{
+    ext4_volume_s* volume = file->volume;
+    while(size > 0)
+    {
+        uint64_t logical = offset / volume->blockSize;
+        uint64_t within = offset % volume->blockSize;
+        uint64_t physical = 0;
+        uint64_t count = 0;
+        efi_status_t status = MapFileBlock(file, logical, &physical, &count);
+        if(EFI_ERROR(status))
+        {
+            return status;
+        }
+        uint64_t blocksLeft = (within + size + volume->blockSize - 1) / volume->blockSize;
+        if(count > blocksLeft)
+        {
+            count = blocksLeft;
+        }
+        uint64_t length = count * volume->blockSize - within;
+        if(length > size)
+        {
+            length = size;
+        }
+        // a partial last block is read on its own, so the whole blocks stay aligned
+        if(within == 0 && length >= volume->blockSize)
+        {
+            length -= length % volume->blockSize;
+        }
+
+        if(physical == 0)
+        {
+            memset(buffer, 0, length);
+        }
+        else if(physical + count > volume->numOfBlocks)
+        {
+            return EFI_VOLUME_CORRUPTED;
+        }
+        else
+        {
+            status = ReadDisk(volume, physical * volume->blockSize + within, length, buffer);
+            if(EFI_ERROR(status))
+            {
+                return status;
+            }
+        }
+        offset += length;
+        buffer += length;
+        size -= length;
+    }
+    return EFI_SUCCESS;
+}
+
+// The entry at an offset of a directory block, FALSE if it runs past the block
+static boolean_t ParseDirEntry(const ext4_volume_s* volume, const uint8_t* block, uint32_t offset,
+    ext4_dir_entry_s* entry)
+{
+    if(offset + DIRENT_HEADER_SIZE > volume->blockSize)
+    {
+        return FALSE;
+    }
+    const uint8_t* at = block + offset;
+    entry->inode = Load32(at);
+    entry->recordLen = Load16(at + 4);
+    // 64 KiB blocks store the length of an entry that covers the block in 16 bits
+    if(volume->blockSize == 65536 && (entry->recordLen == 65535 || entry->recordLen == 0))
+    {
+        entry->recordLen = 65536;
+    }
+    entry->nameLen = at[6];
+    entry->name = (const char_t*)at + DIRENT_HEADER_SIZE;
+    return entry->recordLen >= DIRENT_HEADER_SIZE && entry->recordLen % 4 == 0 &&
+        offset + entry->recordLen <= volume->blockSize && DIRENT_HEADER_SIZE + entry->nameLen <= entry->recordLen;
+}
+
+static boolean_t FindInDirBlock(const ext4_volume_s* volume, const uint8_t* block, const char_t* name,
+    uint32_t nameLen, uint32_t* number)
+{
+    ext4_dir_entry_s entry;
+    for(uint32_t offset = 0; ParseDirEntry(volume, block, offset, &entry); offset += entry.recordLen)
+    {
+        if(entry.inode != 0 && entry.nameLen == nameLen && memcmp(entry.name, name, nameLen) == 0)
+        {
+            *number = entry.inode;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+* Look a name up in a directory, through its htree index when it has one
+* The blocks are scanned one by one if the index can't be used
+*/
+static efi_status_t FindDirEntry(ext4_file_s* dir, const char_t* name, uint32_t nameLen, uint32_t* number)
+{
+    // "." and ".." are in the first block, outside of the index
+    boolean_t dotName = name[0] == '.' && (nameLen == 1 || (nameLen == 2 && name[1] == '.'));
+    if((Load32(dir->inode + INODE_FLAGS) & INODE_FLAG_INDEX) && !dotName)
+    {
+        efi_status_t status = FindDirEntryIndexed(dir, name, nameLen, number);
+        if(status != EFI_UNSUPPORTED)
+        {
+            return status;
+        }
+    }
+    return FindDirEntryLinear(dir, name, nameLen, number);
+}
+
+static efi_status_t FindDirEntryLinear(ext4_file_s* dir, const char_t* name, uint32_t nameLen, uint32_t* number)
+{
+    ext4_volume_s* volume = dir->volume;
+    uint8_t* block = (uint8_t*)AllocateFileBuffer(volume->blockSize);
+    if(block == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    efi_status_t status = EFI_NOT_FOUND;
+    uint64_t numOfBlocks = dir->size / volume->blockSize;
+    for(uint64_t i = 0; i < numOfBlocks && status == EFI_NOT_FOUND; i++)
+    {
+        efi_status_t readStatus = ReadFileData(dir, i * volume->blockSize, volume->blockSize, block);
+        if(EFI_ERROR(readStatus))
+        {
+            status = readStatus;
+        }
+        else if(FindInDirBlock(volume, block, name, nameLen, number))
+        {
+            status = EFI_SUCCESS;
+        }
+    }
+    FreeFileBuffer(block);
+    return status;
+}
+
+/*
+* Walk the htree of a directory down to the leaf block the hash of the name is in
+* EFI_UNSUPPORTED if the index is of a kind this driver doesn't know (the directory is then scanned)
+*/
+static efi_status_t FindDirEntryIndexed(ext4_file_s* dir, const char_t* name, uint32_t nameLen, uint32_t* number)
+{
+    ext4_volume_s* volume = dir->volume;
+    uint8_t* node = (uint8_t*)AllocateFileBuffer(volume->blockSize);
+    uint8_t* leaf = (uint8_t*)AllocateFileBuffer(volume->blockSize);
+    efi_status_t status = (node == NULL || leaf == NULL) ? EFI_OUT_OF_RESOURCES :
+        ReadFileData(dir, 0, volume->blockSize, node);
+    if(EFI_ERROR(status))
+    {
+        goto cleanup;
+    }
+
+    const uint8_t* info = node + DX_ROOT_INFO_OFFSET;
+    uint32_t version = info[4];
+    uint32_t levels = info[6];
+    if(Load32(info) != 0 || info[5] != DX_ROOT_INFO_LEN || levels >= DX_MAX_LEVELS || (info[7] & 1) != 0)
+    {
+        status = EFI_UNSUPPORTED;
+        goto cleanup;
+    }
+    if(version <= DX_HASH_TEA && volume->unsignedHash)
+    {
+        version += DX_HASH_UNSIGNED_DELTA;
+    }
+    if(version > DX_HASH_TEA_UNSIGNED)
+    {
+        status = EFI_UNSUPPORTED;
+        goto cleanup;
+    }
+    uint32_t hash = HashDirEntryName(name, nameLen, version, volume->hashSeed);
+
+    uint32_t entriesOffset = DX_ROOT_INFO_OFFSET + DX_ROOT_INFO_LEN;
+    for(uint32_t level = 0; ; level++)
+    {
+        // the first entry has the limit and the count in place of its hash
+        const uint8_t* entries = node + entriesOffset;
+        uint32_t limit = Load16(entries);
+        uint32_t entryCount = Load16(entries + 2);
+        if(entryCount == 0 || entryCount > limit || entriesOffset + limit * DX_ENTRY_SIZE > volume->blockSize)
+        {
+            status = EFI_UNSUPPORTED;
+            goto cleanup;
+        }
+        // the last entry whose hash is at most the hash of the name
+        uint32_t low = 1;
+        uint32_t high = entryCount - 1;
+        uint32_t found = 0;
+        while(low <= high)
+        {
+            uint32_t middle = (low + high) / 2;
+            if(Load32(entries + middle * DX_ENTRY_SIZE) <= hash)
+            {
+                found = middle;
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+
+        if(level < levels)
+        {
+            uint64_t child = Load32(entries + found * DX_ENTRY_SIZE + 4) & DX_BLOCK_MASK;
+            status = ReadFileData(dir, child * volume->blockSize, volume->blockSize, node);
+            if(EFI_ERROR(status))
+            {
+                goto cleanup;
+            }
+            entriesOffset = DX_NODE_ENTRIES_OFFSET;
+            continue;
+        }
+
+        // names with the same hash may spill into the next leaves, their hash then has the low bit set
+        while(TRUE)
+        {
+            uint64_t child = Load32(entries + found * DX_ENTRY_SIZE + 4) & DX_BLOCK_MASK;
+            status = ReadFileData(dir, child * volume->blockSize, volume->blockSize, leaf);
+            if(EFI_ERROR(status) || FindInDirBlock(volume, leaf, name, nameLen, number))
+            {
+                goto cleanup;
+            }
+            if(found + 1 >= entryCount || (Load32(entries + (found + 1) * DX_ENTRY_SIZE) & ~1U) != hash)
+            {
+                break;
+            }
+            found++;
+        }
+        status = EFI_NOT_FOUND;
+        goto cleanup;
+    }
+
+cleanup:
+    FreeFileBuffer(node);
+    FreeFileBuffer(leaf);
+    return status;
+}
+
+// The hashes of the htree (fs/ext4/hash.c of Linux)
+#define TEA_DELTA (0x9E3779B9)
+#define MD4_K2 (013240474631U)
+#define MD4_K3 (015666365641U)
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROTATE_LEFT(a, s))
+
+static void TeaTransform(uint32_t buf[4], const uint32_t in[4])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0];
+    uint32_t b1 = buf[1];
+    for(int32_t n = 0; n < 16; n++)
+    {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+static void HalfMd4Transform(uint32_t buf[4], const uint32_t in[8])
+{
+    uint32_t a = buf[0];
+    uint32_t b = buf[1];
+    uint32_t c = buf[2];
+    uint32_t d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// Pack up to num words of the name, padded with its length (the signed variant sign-extends every byte)
+static void NameToHashBuffer(const char_t* name, int32_t length, uint32_t* buf, int32_t num, boolean_t isUnsigned)
+{
+    uint32_t pad = (uint32_t)length | ((uint32_t)length << 8);
+    pad |= pad << 16;
+    uint32_t value = pad;
+    if(length > num * 4)
+    {
+        length = num * 4;
+    }
+    for(int32_t i = 0; i < length; i++)
+    {
+        int32_t c = isUnsigned ? (int32_t)(uint8_t)name[i] : (int32_t)(int8_t)name[i];
+        value = (uint32_t)c + (value << 8);
+        if(i % 4 == 3)
+        {
+            *buf++ = value;
+            value = pad;
+            num--;
+        }
+    }
+    if(--num >= 0)
+    {
+        *buf++ = value;
+    }
+    while(--num >= 0)
+    {
+        *buf++ = pad;
+    }
+}
+
+static uint32_t HashDirEntryName(const char_t* name, uint32_t nameLen, uint32_t version, const uint32_t seed[4])
+{
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    if(seed[0] != 0 || seed[1] != 0 || seed[2] != 0 || seed[3] != 0)
+    {
+        memcpy(buf, seed, sizeof(buf));
+    }
+    boolean_t isUnsigned = version >= DX_HASH_UNSIGNED_DELTA;
+    int32_t length = (int32_t)nameLen;
+    uint32_t in[8];
+    uint32_t hash = 0;
+    switch (version % DX_HASH_UNSIGNED_DELTA)
+    {
+    case DX_HASH_LEGACY:
+    {
+        uint32_t hash0 = 0x12a3fe2d;
+        uint32_t hash1 = 0x37abe8f9;
+        for(int32_t i = 0; i < length; i++)
+        {
+            int32_t c = isUnsigned ? (int32_t)(uint8_t)name[i] : (int32_t)(int8_t)name[i];
+            hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+            if(hash & 0x80000000)
+            {
+                hash -= 0x7fffffff;
+            }
+            hash1 = hash0;
+            hash0 = hash;
+        }
+        hash = hash0 << 1;
+        break;
+    }
+    case DX_HASH_HALF_MD4:
+        for(const char_t* at = name; length > 0; length -= 32, at += 32)
+        {
+            NameToHashBuffer(at, length, in, 8, isUnsigned);
+            HalfMd4Transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    default:
+        for(const char_t* at = name; length > 0; length -= 16, at += 16)
+        {
+            NameToHashBuffer(at, length, in, 4, isUnsigned);
+            TeaTransform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    }
+    hash &= ~1U;
+    if(hash == (DX_HASH_EOF << 1))
+    {
+        hash = (DX_HASH_EOF - 1) << 1;
+    }
+    return hash;
+}
+
+/*
+* Open a path from a directory (or from the root, if it starts with a separator) into file
+* "." and ".." are looked up like any other name, symlinks are followed
+*/
+static efi_status_t ResolvePath(const ext4_file_s* from, const char_t* path, ext4_file_s* file)
+{
+    char_t* buffers[2] = { malloc(EXT4_PATH_MAX), malloc(EXT4_PATH_MAX) };
+    if(buffers[0] == NULL || buffers[1] == NULL)
+    {
+        free(buffers[0]);
+        free(buffers[1]);
+        return EFI_OUT_OF_RESOURCES;
+    }
+    strcpy(buffers[0], path);
+    int32_t current = 0;
+    const char_t* rest = buffers[current];
+    efi_status_t status = LoadInode(file, IsPathSeparator(*rest) ? ROOT_INODE : from->inodeNumber);
+    if(!IsPathSeparator(*rest))
+    {
+        memcpy(file->name, from->name, sizeof(file->name));
+    }
+    int32_t links = 0;
+    while(!EFI_ERROR(status))
+    {
+        while(IsPathSeparator(*rest))
+        {
+            rest++;
+        }
+        if(*rest == CHAR_NULL)
+        {
+            break;
+        }
+        const char_t* component = rest;
+        while(*rest != CHAR_NULL && !IsPathSeparator(*rest))
+        {
+            rest++;
+        }
+        uint32_t length = rest - component;
+        if(length == 1 && component[0] == '.')
+        {
+            continue;
+        }
+        if(!IsDirectory(file) || length > EXT4_NAME_MAX)
+        {
+            status = EFI_NOT_FOUND;
+            break;
+        }
+        uint32_t parent = file->inodeNumber;
+        uint32_t number = 0;
+        status = FindDirEntry(file, component, length, &number);
+        if(!EFI_ERROR(status))
+        {
+            status = LoadInode(file, number);
+        }
+        if(EFI_ERROR(status))
+        {
+            break;
+        }
+        if((Load16(file->inode + INODE_MODE) & MODE_TYPE_MASK) != MODE_SYMLINK)
+        {
+            Utf8ToWide(component, length, file->name, EXT4_NAME_MAX + 1);
+            continue;
+        }
+
+        // the rest of the path goes after the target of the link
+        char_t* target = buffers[1 - current];
+        if(++links > EXT4_MAX_SYMLINKS || file->size + strlen(rest) >= EXT4_PATH_MAX)
+        {
+            status = EFI_NOT_FOUND;
+            break;
+        }
+        status = ReadSymlink(file, target);
+        if(EFI_ERROR(status))
+        {
+            break;
+        }
+        strcpy(target + file->size, rest);
+        current = 1 - current;
+        rest = target;
+        status = LoadInode(file, IsPathSeparator(*rest) ? ROOT_INODE : parent);
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+    return status;
+}
+
+// A short target is stored in the inode, in place of the block map
+static efi_status_t ReadSymlink(ext4_file_s* link, char_t* target)
+{
+    if(link->size < INODE_BLOCK_LEN && !(Load32(link->inode + INODE_FLAGS) & INODE_FLAG_EXTENTS))
+    {
+        memcpy(target, link->inode + INODE_BLOCK, link->size);
+        return EFI_SUCCESS;
+    }
+    return ReadFileData(link, 0, link->size, (uint8_t*)target);
+}
+
+// List the next entry of a directory as an EFI_FILE_INFO, a size of 0 marks the end
+static efi_status_t ReadDirectory(ext4_file_s* dir, uintn_t* bufferSize, void* buffer)
+{
+    ext4_volume_s* volume = dir->volume;
+    while(dir->position < dir->size)
+    {
+        uint64_t blockNum = dir->position / volume->blockSize;
+        uint32_t offset = dir->position % volume->blockSize;
+        if(dir->dirBlockNum != blockNum)
+        {
+            if(dir->dirBlock == NULL)
+            {
+                dir->dirBlock = (uint8_t*)AllocateFileBuffer(volume->blockSize);
+                if(dir->dirBlock == NULL)
+                {
+                    return EFI_OUT_OF_RESOURCES;
+                }
+            }
+            efi_status_t status = ReadFileData(dir, blockNum * volume->blockSize, volume->blockSize, dir->dirBlock);
+            if(EFI_ERROR(status))
+            {
+                return status;
+            }
+            dir->dirBlockNum = blockNum;
+        }
+        ext4_dir_entry_s entry;
+        if(!ParseDirEntry(volume, dir->dirBlock, offset, &entry))
+        {
+            // the rest of a corrupt block is skipped
+            dir->position = (blockNum + 1) * volume->blockSize;
+            continue;
+        }
+        if(entry.inode == 0)
+        {
+            dir->position += entry.recordLen;
+            continue;
+        }
+
+        ext4_file_s* file = NewFile(volume);
+        if(file == NULL)
+        {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        efi_status_t status = LoadInode(file, entry.inode);
+        if(!EFI_ERROR(status))
+        {
+            Utf8ToWide(entry.name, entry.nameLen, file->name, EXT4_NAME_MAX + 1);
+            status = FillFileInfo(file, bufferSize, buffer);
+        }
+        Ext4Close(&file->handle);
+        if(!EFI_ERROR(status))
+        {
+            dir->position += entry.recordLen;
+        }
+        return status;
+    }
+    *bufferSize = 0;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t FillFileInfo(ext4_file_s* file, uintn_t* bufferSize, void* buffer)
+{
+    uintn_t nameLen = 0;
+    while(file->name[nameLen] != 0)
+    {
+        nameLen++;
+    }
+    uintn_t size = OFFSET_OF(efi_file_info_t, FileName) + (nameLen + 1) * sizeof(wchar_t);
+    if(*bufferSize < size || buffer == NULL)
+    {
+        *bufferSize = size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    efi_file_info_t* info = buffer;
+    memset(info, 0, size);
+    info->Size = size;
+    info->FileSize = file->size;
+    uint64_t blocks = Load32(file->inode + INODE_BLOCKS_LO) | (uint64_t)Load16(file->inode + INODE_BLOCKS_HIGH) << 32;
+    info->PhysicalSize = blocks * ((Load32(file->inode + INODE_FLAGS) & INODE_FLAG_HUGE_FILE) ?
+        file->volume->blockSize : SECTOR_SIZE);
+    // ext4 keeps no creation time in the base inode, the change time stands in for it
+    UnixTimeToEfiTime(Load32(file->inode + INODE_CTIME), &info->CreateTime);
+    UnixTimeToEfiTime(Load32(file->inode + INODE_ATIME), &info->LastAccessTime);
+    UnixTimeToEfiTime(Load32(file->inode + INODE_MTIME), &info->ModificationTime);
+    info->Attribute = EFI_FILE_READ_ONLY | (IsDirectory(file) ? EFI_FILE_DIRECTORY : 0);
+    memcpy(info->FileName, file->name, (nameLen + 1) * sizeof(wchar_t));
+    *bufferSize = size;
+    return EFI_SUCCESS;
+}
+
+// Days to a civil date (the algorithm of Howard Hinnant), the times of ext4 are UTC
+static void UnixTimeToEfiTime(uint32_t seconds, efi_time_t* time)
+{
+    memset(time, 0, sizeof(efi_time_t));
+    uint32_t daySeconds = seconds % 86400;
+    time->Hour = daySeconds / 3600;
+    time->Minute = daySeconds / 60 % 60;
+    time->Second = daySeconds % 60;
+    time->TimeZone = EFI_UNSPECIFIED_TIMEZONE;
+
+    uint32_t days = seconds / 86400 + 719468; // from 0000-03-01
+    uint32_t era = days / 146097;
+    uint32_t dayOfEra = days - era * 146097;
+    uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    uint32_t monthIndex = (5 * dayOfYear + 2) / 153; // from March
+    time->Day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    time->Month = (monthIndex < 10) ? monthIndex + 3 : monthIndex - 9;
+    time->Year = yearOfEra + era * 400 + (time->Month <= 2);
+}
+
+// The UCS-2 path of the firmware as the UTF-8 the names on the disk are in, FALSE if it doesn't fit
+static boolean_t WideToUtf8(const wchar_t* wide, char_t* str, uint32_t strSize)
+{
+    uint32_t length = 0;
+    for(; *wide != 0; wide++)
+    {
+        uint32_t c = (uint16_t)*wide;
+        uint32_t bytes = (c < 0x80) ? 1 : (c < 0x800) ? 2 : 3;
+        if(length + bytes >= strSize)
+        {
+            return FALSE;
+        }
+        if(bytes == 1)
+        {
+            str[length++] = c;
+        }
+        else if(bytes == 2)
+        {
+            str[length++] = 0xC0 | (c >> 6);
+            str[length++] = 0x80 | (c & 0x3F);
+        }
+        else
+        {
+            str[length++] = 0xE0 | (c >> 12);
+            str[length++] = 0x80 | ((c >> 6) & 0x3F);
+            str[length++] = 0x80 | (c & 0x3F);
+        }
+    }
+    str[length] = CHAR_NULL;
+    return TRUE;
+}
+
+// A UTF-8 name as UCS-2 (terminated), what UCS-2 can't hold becomes '?'
+static uint32_t Utf8ToWide(const char_t* str, uint32_t length, wchar_t* wide, uint32_t wideLen)
+{
+    const uint8_t* at = (const uint8_t*)str;
+    const uint8_t* end = at + length;
+    uint32_t count = 0;
+    while(at < end && count + 1 < wideLen)
+    {
+        uint32_t c = *at++;
+        uint32_t continuation = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+        c &= (continuation == 0) ? 0xFF : (0x3F >> continuation);
+        for(; continuation > 0 && at < end && (*at & 0xC0) == 0x80; continuation--)
+        {
+            c = (c << 6) | (*at++ & 0x3F);
+        }
+        wide[count++] = (continuation != 0 || c > 0xFFFF) ? L'?' : (wchar_t)c;
+    }
+    wide[count] = 0;
+    return count;
+}
+
+static inline boolean_t IsPathSeparator(char_t c)
+{
+    return c == '\\' || c == '/';
+}
+
+static inline boolean_t IsDirectory(const ext4_file_s* file)
+{
+    return (Load16(file->inode + INODE_MODE) & MODE_TYPE_MASK) == MODE_DIRECTORY;
+}
+
+static inline uint16_t Load16(const uint8_t* at)
+{
+    uint16_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Load32(const uint8_t* at)
+{
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+// The protocol functions the firmware (or the kernel) calls
+
+static efi_status_t EFIAPI Ext4OpenVolume(void* this, efi_file_handle_t** root)
+{
+    ext4_volume_s* volume = this;
+    if(volume->blockIo->Media->MediaId != volume->mediaId || !volume->blockIo->Media->MediaPresent)
+    {
+        return EFI_MEDIA_CHANGED;
+    }
+    ext4_file_s* file = NewFile(volume);
+    if(file == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    efi_status_t status = LoadInode(file, ROOT_INODE);
+    if(EFI_ERROR(status))
+    {
+        Ext4Close(&file->handle);
+        return status;
+    }
+    *root = &file->handle;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI Ext4Open(efi_file_handle_t* handle, efi_file_handle_t** newHandle, wchar_t* fileName,
+    uint64_t openMode, uint64_t attributes)
+{
+    ext4_file_s* from = (ext4_file_s*)handle;
+    if(newHandle == NULL || fileName == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+    if(openMode != EFI_FILE_MODE_READ)
+    {
+        return EFI_WRITE_PROTECTED;
+    }
+    char_t* path = malloc(EXT4_PATH_MAX);
+    if(path == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    if(!WideToUtf8(fileName, path, EXT4_PATH_MAX))
+    {
+        free(path);
+        return EFI_NOT_FOUND;
+    }
+    ext4_file_s* file = NewFile(from->volume);
+    efi_status_t status = (file == NULL) ? EFI_OUT_OF_RESOURCES : ResolvePath(from, path, file);
+    free(path);
+    if(EFI_ERROR(status))
+    {
+        if(file != NULL)
+        {
+            Ext4Close(&file->handle);
+        }
+        return status;
+    }
+    *newHandle = &file->handle;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI Ext4Close(efi_file_handle_t* handle)
+{
+    ext4_file_s* file = (ext4_file_s*)handle;
+    for(int32_t i = 0; i < MAP_MAX_LEVELS; i++)
+    {
+        FreeFileBuffer(file->mapBlocks[i]);
+    }
+    FreeFileBuffer(file->dirBlock);
+    free(file);
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI Ext4Delete(efi_file_handle_t* handle)
+{
+    Ext4Close(handle);
+    return EFI_WARN_DELETE_FAILURE;
+}
+
+static efi_status_t EFIAPI Ext4Read(efi_file_handle_t* handle, uintn_t* bufferSize, void* buffer)
+{
+    ext4_file_s* file = (ext4_file_s*)handle;
+    if(IsDirectory(file))
+    {
+        return ReadDirectory(file, bufferSize, buffer);
+    }
+    uint64_t size = (file->position < file->size) ? file->size - file->position : 0;
+    if(size > *bufferSize)
+    {
+        size = *bufferSize;
+    }
+    efi_status_t status = ReadFileData(file, file->position, size, buffer);
+    if(EFI_ERROR(status))
+    {
+        *bufferSize = 0;
+        return status;
+    }
+    file->position += size;
+    *bufferSize = size;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI Ext4Write(efi_file_handle_t* handle, uintn_t* bufferSize, void* buffer)
+{
+    return EFI_WRITE_PROTECTED;
+}
+
+static efi_status_t EFIAPI Ext4GetPosition(efi_file_handle_t* handle, uint64_t* position)
+{
+    ext4_file_s* file = (ext4_file_s*)handle;
+    if(IsDirectory(file))
+    {
+        return EFI_UNSUPPORTED;
+    }
+    *position = file->position;
+    return EFI_SUCCESS;
+}
+
+// A directory can only be rewound, the end of a file is 0xFFFFFFFFFFFFFFFF
+static efi_status_t EFIAPI Ext4SetPosition(efi_file_handle_t* handle, uint64_t position)
+{
+    ext4_file_s* file = (ext4_file_s*)handle;
+    if(IsDirectory(file) && position != 0)
+    {
+        return EFI_UNSUPPORTED;
+    }
+    file->position = (position == ~0ULL) ? file->size : position;
+    return EFI_SUCCESS;
+}
+
+static efi_status_t EFIAPI Ext4GetInfo(efi_file_handle_t* handle, efi_guid_t* type, uintn_t* bufferSize,
+    void* buffer)
+{
+    ext4_file_s* file = (ext4_file_s*)handle;
+    ext4_volume_s* volume = file->volume;
+    efi_guid_t fileInfoGuid = EFI_FILE_INFO_GUID;
+    efi_guid_t systemInfoGuid = EFI_FILE_SYSTEM_INFO_GUID;
+    efi_guid_t labelGuid = EFI_FILE_SYSTEM_VOLUME_LABEL_GUID;
+    if(memcmp(type, &fileInfoGuid, sizeof(efi_guid_t)) == 0)
+    {
+        return FillFileInfo(file, bufferSize, buffer);
+    }
+
+    wchar_t label[EXT4_VOLUME_NAME_LEN + 1];
+    uint32_t labelLen = Utf8ToWide(volume->label, strlen(volume->label), label, EXT4_VOLUME_NAME_LEN + 1);
+    uintn_t labelSize = (labelLen + 1) * sizeof(wchar_t);
+    if(memcmp(type, &systemInfoGuid, sizeof(efi_guid_t)) == 0)
+    {
+        uintn_t size = OFFSET_OF(efi_file_system_info_t, VolumeLabel) + labelSize;
+        if(*bufferSize < size || buffer == NULL)
+        {
+            *bufferSize = size;
+            return EFI_BUFFER_TOO_SMALL;
+        }
+        efi_file_system_info_t* info = buffer;
+        info->Size = size;
+        info->ReadOnly = TRUE;
+        info->VolumeSize = volume->numOfBlocks * volume->blockSize;
+        info->FreeSpace = volume->freeBlocks * volume->blockSize;
+        info->BlockSize = volume->blockSize;
+        memcpy(info->VolumeLabel, label, labelSize);
+        *bufferSize = size;
+        return EFI_SUCCESS;
+    }
+    if(memcmp(type, &labelGuid, sizeof(efi_guid_t)) == 0)
+    {
+        if(*bufferSize < labelSize || buffer == NULL)
+        {
+            *bufferSize = labelSize;
+            return EFI_BUFFER_TOO_SMALL;
+        }
+        memcpy(buffer, label, labelSize);
+        *bufferSize = labelSize;
+        return EFI_SUCCESS;
+    }
+    return EFI_UNSUPPORTED;
+}
+
+static efi_status_t EFIAPI Ext4SetInfo(efi_file_handle_t* handle, efi_guid_t* type, uintn_t bufferSize,
+    void* buffer)
+{
+    return EFI_WRITE_PROTECTED;
+}
+
+static efi_status_t EFIAPI Ext4Flush(efi_file_handle_t* handle)
+{
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,135 @@
+#include "fileview.h"
+#include "logs.h"
+#include "bootutils.h"
+
+static file_view_window_s* LoadWindow(file_view_s* view, uint64_t offset);
+
+/*
+* Open a view of a file on the volume of the loader (like fopen)
+* FALSE if the file can't be opened, the view is closed with CloseFileView
+*/
+boolean_t OpenFileView(file_view_s* view, const char_t* path)
+{
+    memset(view, 0, sizeof(file_view_s));
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return FALSE;
+    }
+    AttachFileView(view, file, GetFileSize(file));
+    view->ownsFile = TRUE;
+    return TRUE;
+}
+
+// A view of a file that is open already, the caller keeps the file (it is closed after CloseFileView)
+void AttachFileView(file_view_s* view, efi_file_handle_t* file, uint64_t fileSize)
+{
+    memset(view, 0, sizeof(file_view_s));
+    view->file = file;
+    view->fileSize = fileSize;
+}
+
+/*
+* The bytes of the file from offset, size gets how many of them are there (up to the end of their window)
+* The pointer is valid until the next call on the view, NULL past the end of the file or if it can't be read
+*/
+const char_t* MapFileView(file_view_s* view, uint64_t offset, uint64_t* size)
+{
+    *size = 0;
+    if(offset >= view->fileSize)
+    {
+        return NULL;
+    }
+    file_view_window_s* window = LoadWindow(view, offset - offset % FILE_VIEW_WINDOW_SIZE);
+    if(window == NULL || offset - window->offset >= window->size)
+    {
+        return NULL;
+    }
+    *size = window->size - (offset - window->offset);
+    return window->data + (offset - window->offset);
+}
+
+// Copy size bytes of the file from offset, returns how many were copied (less at the end of the file)
+uint64_t ReadFileView(file_view_s* view, uint64_t offset, void* buffer, uint64_t size)
+{
+    uint64_t copied = 0;
+    while(copied < size)
+    {
+        uint64_t available = 0;
+        const char_t* data = MapFileView(view, offset + copied, &available);
+        if(data == NULL)
+        {
+            break;
+        }
+        uint64_t length = (available < size - copied) ? available : size - copied;
+        memcpy((char_t*)buffer + copied, data, length);
+        copied += length;
+    }
+    return copied;
+}
+
+// Free the windows, the view can still be used (they are read again when they are needed)
+void ReleaseFileView(file_view_s* view)
+{
+    for(int32_t i = 0; i < FILE_VIEW_MAX_WINDOWS; i++)
+    {
+        FreeFileBuffer(view->windows[i].data);
+        memset(&view->windows[i], 0, sizeof(file_view_window_s));
+    }
+}
+
+void CloseFileView(file_view_s* view)
+{
+    ReleaseFileView(view);
+    if(view->ownsFile && view->file != NULL)
+    {
+        fclose(view->file);
+    }
+    view->file = NULL;
+}
+
+// The window at offset, read into the least recently used one if it isn't there, NULL if it can't be read
+static file_view_window_s* LoadWindow(file_view_s* view, uint64_t offset)
+{
+    file_view_window_s* window = NULL;
+    for(int32_t i = 0; i < FILE_VIEW_MAX_WINDOWS; i++)
+    {
+        file_view_window_s* current = &view->windows[i];
+        if(current->size != 0 && current->offset == offset)
+        {
+            current->lastUse = ++view->uses;
+            return current;
+        }
+        if(window == NULL || current->lastUse < window->lastUse)
+        {
+            window = current;
+        }
+    }
+
+    if(window->data == NULL)
+    {
+        window->data = AllocateFileBuffer(FILE_VIEW_WINDOW_SIZE);
+        if(window->data == NULL)
+        {
+            Log(LL_ERROR, 0, "Failed to allocate a window of a file view.");
+            return NULL;
+        }
+    }
+    uintn_t size = (view->fileSize - offset < FILE_VIEW_WINDOW_SIZE) ? view->fileSize - offset : FILE_VIEW_WINDOW_SIZE;
+    efi_status_t status = view->file->SetPosition(view->file, offset);
+    if(!EFI_ERROR(status))
+    {
+        status = view->file->Read(view->file, &size, window->data);
+    }
+    view->windowReads++;
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to read the file at %d.", (int32_t)offset);
+        window->size = 0;
+        return NULL;
+    }
+    window->offset = offset;
+    window->size = size;
+    window->lastUse = ++view->uses;
+    return window;
+}
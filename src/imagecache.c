@@ -0,0 +1,250 @@
+#include "imagecache.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "volumes.h"
+#include "console.h"
+
+typedef struct cached_image_s{
+    char_t* image; // a file buffer, NULL if the slot is free
+    uint64_t size;
+    efi_handle_t volume;
+    char_t* path;
+    uint64_t fileSize;
+    efi_time_t modificationTime;
+    char_t* sha256; // NULL if the image wasn't verified
+    int32_t references; // the boots that hold the image, it can only be dropped at 0
+    uint64_t lastUse;
+} cached_image_s;
+
+static cached_image_s cachedImages[IMAGE_CACHE_MAX_IMAGES];
+static uint64_t cachedBytes = 0;
+static uint64_t cacheUses = 0; // stamps lastUse of the images
+static image_cache_stats_s cacheStats;
+
+static boolean_t IsImageOf(const cached_image_s* cached, const image_key_s* key);
+static cached_image_s* FindUnusedImage(void);
+static void DropImage(cached_image_s* cached);
+
+void SetImageKey(image_key_s* key, efi_handle_t volume, const char_t* path, const efi_file_info_t* info,
+    const char_t* sha256)
+{
+    key->volume = volume;
+    key->path = path;
+    key->fileSize = info->FileSize;
+    key->modificationTime = info->ModificationTime;
+    key->sha256 = sha256;
+}
+
+/*
+* Look up the image at path on the volume, its size and modification time are read from the volume
+* key gets the key of the image (for CacheImage once it was read), it can't be cached if the file can't be opened
+* NULL if the image isn't cached
+*/
+char_t* FindCachedImage(image_key_s* key, efi_handle_t volume, const char_t* path, const char_t* sha256,
+    uint64_t* outSize)
+{
+    memset(key, 0, sizeof(image_key_s));
+    efi_file_handle_t* file = OpenVolumeFile(volume, path);
+    if(file == NULL)
+    {
+        return NULL;
+    }
+    efi_file_info_t info;
+    efi_status_t status = GetFileInfo(file, &info);
+    file->Close(file);
+    if(EFI_ERROR(status))
+    {
+        return NULL;
+    }
+    SetImageKey(key, volume, path, &info, sha256);
+    return AcquireCachedImage(key, outSize);
+}
+
+/*
+* Get the image with the key, if it is cached, it is held until it is given to ReleaseImage
+* outSize gets the size of the image (decompressed, not the size of the file)
+*/
+char_t* AcquireCachedImage(const image_key_s* key, uint64_t* outSize)
+{
+    if(key->volume == NULL)
+    {
+        return NULL;
+    }
+    for(int32_t i = 0; i < IMAGE_CACHE_MAX_IMAGES; i++)
+    {
+        cached_image_s* cached = &cachedImages[i];
+        if(!IsImageOf(cached, key))
+        {
+            continue;
+        }
+        cached->references++;
+        cached->lastUse = ++cacheUses;
+        cacheStats.hits++;
+        cacheStats.bytesSaved += key->fileSize;
+        *outSize = cached->size;
+        return cached->image;
+    }
+    cacheStats.misses++;
+    return NULL;
+}
+
+/*
+* Keep an image that was read (the buffer is then the cache's), the caller holds it until it calls ReleaseImage
+* The images nothing holds are dropped (least recently used first) to make room, the image isn't kept
+* if that isn't enough, or if it is cached already
+* An older version of the same file is replaced
+*/
+void CacheImage(const image_key_s* key, char_t* image, uint64_t size)
+{
+    if(key->volume == NULL || image == NULL || size > IMAGE_CACHE_BUDGET)
+    {
+        return;
+    }
+    for(int32_t i = 0; i < IMAGE_CACHE_MAX_IMAGES; i++)
+    {
+        cached_image_s* cached = &cachedImages[i];
+        if(cached->image == image)
+        {
+            return;
+        }
+        if(cached->image != NULL && cached->references == 0 && cached->volume == key->volume &&
+            strcmp(cached->path, key->path) == 0)
+        {
+            DropImage(cached);
+        }
+    }
+
+    cached_image_s* slot = NULL;
+    while(TRUE)
+    {
+        for(int32_t i = 0; i < IMAGE_CACHE_MAX_IMAGES && slot == NULL; i++)
+        {
+            if(cachedImages[i].image == NULL)
+            {
+                slot = &cachedImages[i];
+            }
+        }
+        if(slot != NULL && cachedBytes + size <= IMAGE_CACHE_BUDGET)
+        {
+            break;
+        }
+        cached_image_s* unused = FindUnusedImage();
+        if(unused == NULL)
+        {
+            return;
+        }
+        DropImage(unused);
+        cacheStats.evictions++;
+    }
+
+    slot->path = strdup(key->path);
+    slot->sha256 = (key->sha256 != NULL) ? strdup(key->sha256) : NULL;
+    if(slot->path == NULL || (key->sha256 != NULL && slot->sha256 == NULL))
+    {
+        free(slot->path);
+        free(slot->sha256);
+        memset(slot, 0, sizeof(cached_image_s));
+        return;
+    }
+    slot->image = image;
+    slot->size = size;
+    slot->volume = key->volume;
+    slot->fileSize = key->fileSize;
+    slot->modificationTime = key->modificationTime;
+    slot->references = 1;
+    slot->lastUse = ++cacheUses;
+    cachedBytes += size;
+}
+
+// Let go of an image from AcquireCachedImage or CacheImage, an image that isn't cached is freed
+void ReleaseImage(char_t* image)
+{
+    if(image == NULL)
+    {
+        return;
+    }
+    for(int32_t i = 0; i < IMAGE_CACHE_MAX_IMAGES; i++)
+    {
+        if(cachedImages[i].image == image)
+        {
+            cachedImages[i].references--;
+            return;
+        }
+    }
+    FreeFileBuffer(image);
+}
+
+// Drop the images nothing holds (their memory is given back before the boot)
+void TrimImageCache(void)
+{
+    for(int32_t i = 0; i < IMAGE_CACHE_MAX_IMAGES; i++)
+    {
+        if(cachedImages[i].image != NULL && cachedImages[i].references == 0)
+        {
+            DropImage(&cachedImages[i]);
+        }
+    }
+}
+
+void GetImageCacheStats(image_cache_stats_s* stats)
+{
+    *stats = cacheStats;
+}
+
+void PrintImageCacheStats(void)
+{
+    if(cacheStats.hits + cacheStats.misses == 0)
+    {
+        return;
+    }
+    ConsolePrintf("Image cache: %d hits, %d misses, %d KiB not read again, %d KiB kept\n",
+        (int32_t)cacheStats.hits, (int32_t)cacheStats.misses, (int32_t)(cacheStats.bytesSaved / 1024),
+        (int32_t)(cachedBytes / 1024));
+}
+
+void LogImageCacheStats(void)
+{
+    if(cacheStats.hits + cacheStats.misses == 0)
+    {
+        return;
+    }
+    Log(LL_INFO, 0, "Image cache: %d hits, %d misses, %d KiB not read again, %d KiB kept, %d evictions",
+        (int32_t)cacheStats.hits, (int32_t)cacheStats.misses, (int32_t)(cacheStats.bytesSaved / 1024),
+        (int32_t)(cachedBytes / 1024), (int32_t)cacheStats.evictions);
+}
+
+// The cached image is the file of the key, as it is now, and verified against its digest if it is pinned
+static boolean_t IsImageOf(const cached_image_s* cached, const image_key_s* key)
+{
+    if(cached->image == NULL || cached->volume != key->volume || cached->fileSize != key->fileSize ||
+        memcmp(&cached->modificationTime, &key->modificationTime, sizeof(efi_time_t)) != 0 ||
+        strcmp(cached->path, key->path) != 0)
+    {
+        return FALSE;
+    }
+    return key->sha256 == NULL || (cached->sha256 != NULL && strcmp(cached->sha256, key->sha256) == 0);
+}
+
+// The least recently used image nothing holds, NULL if all of them are held
+static cached_image_s* FindUnusedImage(void)
+{
+    cached_image_s* unused = NULL;
+    for(int32_t i = 0; i < IMAGE_CACHE_MAX_IMAGES; i++)
+    {
+        cached_image_s* cached = &cachedImages[i];
+        if(cached->image != NULL && cached->references == 0 && (unused == NULL || cached->lastUse < unused->lastUse))
+        {
+            unused = cached;
+        }
+    }
+    return unused;
+}
+
+static void DropImage(cached_image_s* cached)
+{
+    cachedBytes -= cached->size;
+    FreeFileBuffer(cached->image);
+    free(cached->path);
+    free(cached->sha256);
+    memset(cached, 0, sizeof(cached_image_s));
+}
@@ -0,0 +1,323 @@
+#include "imagecheck.h"
+#include "bootutils.h"
+#include "volumes.h"
+#include "decompress.h"
+
+// DOS header
+#define DOS_MAGIC ("MZ")
+#define DOS_HEADER_SIZE (64)
+#define PE_OFFSET_OFFSET (0x3c) // e_lfanew
+
+// PE signature and COFF file header (PE format, "COFF File Header")
+#define PE_SIGNATURE ("PE\0\0")
+#define PE_SIGNATURE_SIZE (4)
+#define COFF_HEADER_SIZE (20)
+#define COFF_MACHINE_OFFSET (0)
+#define COFF_NUM_OF_SECTIONS_OFFSET (2)
+#define COFF_OPTIONAL_HEADER_SIZE_OFFSET (16)
+#define COFF_CHARACTERISTICS_OFFSET (18)
+#define COFF_EXECUTABLE_IMAGE (0x0002)
+
+// Optional header, the fields that are read are at the same offsets in PE32 and PE32+
+#define OPTIONAL_MAGIC_OFFSET (0)
+#define OPTIONAL_ENTRY_POINT_OFFSET (16)
+#define OPTIONAL_SIZE_OF_IMAGE_OFFSET (56)
+#define OPTIONAL_SIZE_OF_HEADERS_OFFSET (60)
+#define OPTIONAL_SUBSYSTEM_OFFSET (68)
+#define OPTIONAL_READ_SIZE (70) // up to the subsystem
+#define PE32_MAGIC (0x10b)
+#define PE32_PLUS_MAGIC (0x20b)
+#define PE32_MIN_OPTIONAL_SIZE (96) // without the data directories
+#define PE32_PLUS_MIN_OPTIONAL_SIZE (112)
+
+#define SUBSYSTEM_EFI_APPLICATION (10)
+#define SUBSYSTEM_EFI_RUNTIME_DRIVER (12)
+
+// Section header
+#define SECTION_HEADER_SIZE (40)
+#define SECTION_NAME_LEN (8) // at the start of the header, not terminated if it is 8 chars long
+#define SECTION_VIRTUAL_SIZE_OFFSET (8)
+#define SECTION_VIRTUAL_ADDRESS_OFFSET (12)
+#define SECTION_RAW_SIZE_OFFSET (16)
+#define SECTION_RAW_POINTER_OFFSET (20)
+
+#define MACHINE_I386 (0x014c)
+#define MACHINE_X86_64 (0x8664)
+#define MACHINE_ARM (0x01c2)
+#define MACHINE_ARMNT (0x01c4)
+#define MACHINE_AARCH64 (0xaa64)
+#define MACHINE_RISCV64 (0x5064)
+#define MACHINE_EBC (0x0ebc) // EFI byte code, run by the interpreter of the firmware
+
+#if defined(__x86_64__)
+#define MACHINE_NATIVE (MACHINE_X86_64)
+#elif defined(__aarch64__)
+#define MACHINE_NATIVE (MACHINE_AARCH64)
+#elif defined(__riscv)
+#define MACHINE_NATIVE (MACHINE_RISCV64)
+#else
+#define MACHINE_NATIVE (MACHINE_I386)
+#endif
+
+// bzImage setup header (Documentation/arch/x86/boot.rst)
+#define SETUP_SECTS_OFFSET (0x1f1)
+#define SYSSIZE_OFFSET (0x1f4) // the protected mode kernel, in 16 byte units
+#define BOOT_FLAG_OFFSET (0x1fe)
+#define HEADER_MAGIC_OFFSET (0x202)
+#define VERSION_OFFSET (0x206)
+#define XLOADFLAGS_OFFSET (0x236)
+#define SETUP_HEADER_READ_SIZE (0x238)
+#define SECTOR_SIZE (512)
+#define DEFAULT_SETUP_SECTS (4) // a setup_sects of 0 means 4
+#define BOOT_FLAG (0xAA55)
+#define HEADER_MAGIC (0x53726448) // "HdrS"
+#define MIN_BOOT_PROTOCOL (0x020c)
+#define XLF_KERNEL_64 (1 << 0)
+#define SYSSIZE_UNIT (16)
+
+typedef struct machine_name_s{
+    uint16_t machine;
+    const char_t* name;
+} machine_name_s;
+
+static const machine_name_s machineNames[] = {
+    { MACHINE_I386, "i386" }, { MACHINE_X86_64, "x86_64" }, { MACHINE_ARM, "arm" }, { MACHINE_ARMNT, "arm" },
+    { MACHINE_AARCH64, "aarch64" }, { MACHINE_RISCV64, "riscv64" }, { MACHINE_EBC, "EBC" },
+};
+
+static boolean_t CheckPeHeaders(file_view_s* view, const uint8_t* dosHeader, char_t* reason);
+static boolean_t CheckSetupHeader(file_view_s* view, boolean_t linuxBoot, char_t* reason);
+static const char_t* GetMachineName(uint16_t machine);
+static inline uint16_t Load16(const uint8_t* at);
+static inline uint32_t Load32(const uint8_t* at);
+
+/*
+* Check the headers of an image (a PE image, or a bzImage for the linux boot protocol) from the first bytes of it
+* FALSE if it can't be booted, reason (IMAGE_CHECK_REASON_LEN) then tells why
+*/
+boolean_t CheckImageHeaders(file_view_s* view, boolean_t linuxBoot, char_t* reason)
+{
+    uint8_t header[DECOMPRESS_HEADER_SIZE];
+    uint64_t size = ReadFileView(view, 0, header, DECOMPRESS_HEADER_SIZE);
+    compressed_stream_s source;
+    if(DetectCompression(header, size, view->fileSize, &source) && !source.zboot)
+    {
+        return TRUE;
+    }
+    if(linuxBoot)
+    {
+        return CheckSetupHeader(view, TRUE, reason);
+    }
+    if(size < DOS_HEADER_SIZE || memcmp(header, DOS_MAGIC, 2) != 0)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "not a PE image (no DOS header)");
+        return FALSE;
+    }
+    // the EFI stub of a bzImage is a PE image with the setup header in its DOS stub
+    return CheckPeHeaders(view, header, reason) && CheckSetupHeader(view, FALSE, reason);
+}
+
+/*
+* Check the headers of the image at path on the volume, the reason it fails is logged at level
+* (the file is opened and closed, only its headers are read)
+*/
+image_check_t CheckImageFile(efi_handle_t volume, const char_t* path, boolean_t linuxBoot, log_level_t level)
+{
+    char_t reason[IMAGE_CHECK_REASON_LEN];
+    boolean_t valid = FALSE;
+    efi_file_handle_t* file = (volume != NULL) ? OpenVolumeFile(volume, path) : NULL;
+    efi_file_info_t info;
+    if(file == NULL || EFI_ERROR(GetFileInfo(file, &info)))
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "the file can't be opened");
+    }
+    else
+    {
+        file_view_s view;
+        AttachFileView(&view, file, info.FileSize);
+        valid = CheckImageHeaders(&view, linuxBoot, reason);
+        CloseFileView(&view);
+    }
+    if(file != NULL)
+    {
+        file->Close(file);
+    }
+    if(!valid)
+    {
+        Log(level, 0, "'%s' can't be booted: %s.", path, reason);
+        return IMAGE_CHECK_INVALID;
+    }
+    return IMAGE_CHECK_VALID;
+}
+
+// The PE signature, the COFF header, the optional header and the section table
+static boolean_t CheckPeHeaders(file_view_s* view, const uint8_t* dosHeader, char_t* reason)
+{
+    uint64_t fileSize = view->fileSize;
+    uint64_t peOffset = Load32(dosHeader + PE_OFFSET_OFFSET);
+    uint8_t peHeader[PE_SIGNATURE_SIZE + COFF_HEADER_SIZE];
+    if(peOffset + sizeof(peHeader) > fileSize ||
+        ReadFileView(view, peOffset, peHeader, sizeof(peHeader)) != sizeof(peHeader) ||
+        memcmp(peHeader, PE_SIGNATURE, PE_SIGNATURE_SIZE) != 0)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "no PE header at 0x%x", (uint32_t)peOffset);
+        return FALSE;
+    }
+
+    const uint8_t* coff = peHeader + PE_SIGNATURE_SIZE;
+    uint16_t machine = Load16(coff + COFF_MACHINE_OFFSET);
+    uint16_t numOfSections = Load16(coff + COFF_NUM_OF_SECTIONS_OFFSET);
+    uint16_t optionalSize = Load16(coff + COFF_OPTIONAL_HEADER_SIZE_OFFSET);
+    if(machine != MACHINE_NATIVE && machine != MACHINE_EBC)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "it is built for %s (machine 0x%x), not for %s",
+            GetMachineName(machine), machine, GetMachineName(MACHINE_NATIVE));
+        return FALSE;
+    }
+    if(!(Load16(coff + COFF_CHARACTERISTICS_OFFSET) & COFF_EXECUTABLE_IMAGE))
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "it isn't marked as an executable image");
+        return FALSE;
+    }
+    if(numOfSections == 0 || numOfSections > IMAGE_CHECK_MAX_SECTIONS)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "it has %d sections", numOfSections);
+        return FALSE;
+    }
+
+    uint64_t optionalOffset = peOffset + sizeof(peHeader);
+    uint8_t optional[OPTIONAL_READ_SIZE];
+    if(optionalSize < OPTIONAL_READ_SIZE ||
+        ReadFileView(view, optionalOffset, optional, OPTIONAL_READ_SIZE) != OPTIONAL_READ_SIZE)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "its optional header is truncated (%d bytes)", optionalSize);
+        return FALSE;
+    }
+    uint16_t magic = Load16(optional + OPTIONAL_MAGIC_OFFSET);
+    // an image for a 64-bit machine is PE32+, an EBC image is PE32
+    uint16_t expectedMagic = (machine == MACHINE_EBC || machine == MACHINE_I386) ? PE32_MAGIC : PE32_PLUS_MAGIC;
+    uint16_t minOptionalSize = (magic == PE32_PLUS_MAGIC) ? PE32_PLUS_MIN_OPTIONAL_SIZE : PE32_MIN_OPTIONAL_SIZE;
+    if(magic != expectedMagic || optionalSize < minOptionalSize)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "its optional header isn't %s (magic 0x%x, %d bytes)",
+            (expectedMagic == PE32_PLUS_MAGIC) ? "PE32+" : "PE32", magic, optionalSize);
+        return FALSE;
+    }
+    uint16_t subsystem = Load16(optional + OPTIONAL_SUBSYSTEM_OFFSET);
+    if(subsystem < SUBSYSTEM_EFI_APPLICATION || subsystem > SUBSYSTEM_EFI_RUNTIME_DRIVER)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "subsystem %d isn't an EFI application or driver", subsystem);
+        return FALSE;
+    }
+    uint64_t imageSize = Load32(optional + OPTIONAL_SIZE_OF_IMAGE_OFFSET);
+    uint64_t headersSize = Load32(optional + OPTIONAL_SIZE_OF_HEADERS_OFFSET);
+    uint64_t sectionsOffset = optionalOffset + optionalSize;
+    uint64_t sectionsEnd = sectionsOffset + (uint64_t)numOfSections * SECTION_HEADER_SIZE;
+    if(imageSize == 0 || imageSize > IMAGE_CHECK_MAX_IMAGE_SIZE || headersSize > imageSize ||
+        headersSize > fileSize || headersSize < sectionsEnd)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "it declares an image of %d bytes with %d bytes of headers",
+            (int32_t)imageSize, (int32_t)headersSize);
+        return FALSE;
+    }
+    if(Load32(optional + OPTIONAL_ENTRY_POINT_OFFSET) >= imageSize)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "its entry point is outside of the image");
+        return FALSE;
+    }
+
+    for(uint16_t i = 0; i < numOfSections; i++)
+    {
+        uint8_t section[SECTION_HEADER_SIZE];
+        if(ReadFileView(view, sectionsOffset + (uint64_t)i * SECTION_HEADER_SIZE, section, SECTION_HEADER_SIZE) !=
+            SECTION_HEADER_SIZE)
+        {
+            snprintf(reason, IMAGE_CHECK_REASON_LEN, "its section table is truncated");
+            return FALSE;
+        }
+        char_t name[SECTION_NAME_LEN + 1];
+        memcpy(name, section, SECTION_NAME_LEN);
+        name[SECTION_NAME_LEN] = CHAR_NULL;
+        uint64_t rawSize = Load32(section + SECTION_RAW_SIZE_OFFSET);
+        uint64_t rawEnd = Load32(section + SECTION_RAW_POINTER_OFFSET) + rawSize;
+        uint64_t virtualSize = Load32(section + SECTION_VIRTUAL_SIZE_OFFSET);
+        uint64_t virtualEnd = Load32(section + SECTION_VIRTUAL_ADDRESS_OFFSET) +
+            ((virtualSize != 0) ? virtualSize : rawSize);
+        if(rawSize != 0 && rawEnd > fileSize)
+        {
+            snprintf(reason, IMAGE_CHECK_REASON_LEN, "section '%s' ends at %d, past the end of the file (%d bytes)",
+                name, (int32_t)rawEnd, (int32_t)fileSize);
+            return FALSE;
+        }
+        if(virtualEnd > imageSize)
+        {
+            snprintf(reason, IMAGE_CHECK_REASON_LEN, "section '%s' ends at 0x%x, past the image size (0x%x)",
+                name, (uint32_t)virtualEnd, (uint32_t)imageSize);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+* The setup header of a bzImage, a 64-bit one for the linux boot protocol (linuxBoot)
+* A PE image without one passes (it isn't a bzImage), the kernel of one with it has to be in the file
+*/
+static boolean_t CheckSetupHeader(file_view_s* view, boolean_t linuxBoot, char_t* reason)
+{
+    uint8_t header[SETUP_HEADER_READ_SIZE];
+    boolean_t hasHeader = ReadFileView(view, 0, header, SETUP_HEADER_READ_SIZE) == SETUP_HEADER_READ_SIZE &&
+        Load16(header + BOOT_FLAG_OFFSET) == BOOT_FLAG && Load32(header + HEADER_MAGIC_OFFSET) == HEADER_MAGIC;
+    if(!hasHeader)
+    {
+        if(linuxBoot)
+        {
+            snprintf(reason, IMAGE_CHECK_REASON_LEN, "not a bzImage (no setup header)");
+        }
+        return !linuxBoot;
+    }
+    uint16_t version = Load16(header + VERSION_OFFSET);
+    if(linuxBoot && (version < MIN_BOOT_PROTOCOL || !(Load16(header + XLOADFLAGS_OFFSET) & XLF_KERNEL_64)))
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "the bzImage has no 64-bit entry point (boot protocol 0x%x)",
+            version);
+        return FALSE;
+    }
+    uint64_t setupSects = header[SETUP_SECTS_OFFSET];
+    uint64_t setupSize = ((setupSects != 0) ? setupSects : DEFAULT_SETUP_SECTS) * SECTOR_SIZE + SECTOR_SIZE;
+    uint64_t kernelSize = (uint64_t)Load32(header + SYSSIZE_OFFSET) * SYSSIZE_UNIT;
+    // the kernel may be rounded up to the next unit
+    if(setupSize + kernelSize > view->fileSize + SYSSIZE_UNIT)
+    {
+        snprintf(reason, IMAGE_CHECK_REASON_LEN, "the bzImage is truncated (%d bytes, its header declares %d)",
+            (int32_t)view->fileSize, (int32_t)(setupSize + kernelSize));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static const char_t* GetMachineName(uint16_t machine)
+{
+    for(size_t i = 0; i < sizeof(machineNames) / sizeof(machineNames[0]); i++)
+    {
+        if(machineNames[i].machine == machine)
+        {
+            return machineNames[i].name;
+        }
+    }
+    return "an unknown machine";
+}
+
+static inline uint16_t Load16(const uint8_t* at)
+{
+    uint16_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Load32(const uint8_t* at)
+{
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
@@ -0,0 +1,229 @@
+#include "imageverify.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "clock.h"
+
+/*
+* The cache of the images that were verified, next to config.cfg
+* A record tells that the file with the key, size and modification time had the digest, the record of an image
+* is replaced when it is verified again (it changed, or its entry was pinned to a new digest)
+*
+* Layout of the file:
+*   image_verify_header_s
+*   image_verify_record_s[numOfRecords], the oldest first
+*/
+
+#define IMAGE_VERIFY_CACHE_MAGIC (0x594649524556544CULL) // "LTVERIFY"
+#define IMAGE_VERIFY_CACHE_VERSION (1)
+
+typedef struct image_verify_header_s{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t numOfRecords;
+} image_verify_header_s;
+
+typedef struct image_verify_record_s{
+    uint8_t key[SHA256_DIGEST_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t fileSize;
+    efi_time_t modificationTime;
+} image_verify_record_s;
+
+typedef struct image_verify_cache_s{
+    image_verify_header_s header;
+    image_verify_record_s records[IMAGE_VERIFY_CACHE_MAX_RECORDS];
+} image_verify_cache_s;
+
+static image_verify_cache_s* LoadVerifiedCache(void);
+static void SaveVerifiedImage(const image_verify_s* verify);
+static boolean_t IsRecordOf(const image_verify_record_s* record, const image_verify_s* verify);
+static void FormatDigest(const uint8_t* digest, char_t* hex);
+
+/*
+* Start verifying an image file against the digest of its entry (volume is the volume key of the entry, or NULL)
+* The file isn't read, only its size and modification time, it is then given to StepImageVerify as it is read
+* FALSE if the digest isn't valid or the file can't be checked, the image mustn't be booted then
+*/
+boolean_t BeginImageVerify(image_verify_s* verify, const char_t* sha256, const char_t* volume, const char_t* path,
+    efi_file_handle_t* file)
+{
+    memset(verify, 0, sizeof(image_verify_s));
+    if(!ParseSha256(sha256, verify->expected))
+    {
+        Log(LL_ERROR, 0, "The sha256 of the entry of '%s' isn't valid.", path);
+        return FALSE;
+    }
+    efi_file_info_t info;
+    efi_status_t status = GetFileInfo(file, &info);
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to get the info of '%s' to verify it.", path);
+        return FALSE;
+    }
+    verify->fileSize = info.FileSize;
+    verify->modificationTime = info.ModificationTime;
+
+    sha256_s keySha;
+    Sha256Init(&keySha);
+    const char_t* volumeName = (volume != NULL) ? volume : "";
+    Sha256Update(&keySha, volumeName, strlen(volumeName) + 1);
+    Sha256Update(&keySha, path, strlen(path));
+    Sha256Final(&keySha, verify->key);
+    Sha256Init(&verify->sha);
+
+    // without a modification time a changed image can't be told apart
+    image_verify_cache_s* cache = (verify->modificationTime.Year != 0) ? LoadVerifiedCache() : NULL;
+    if(cache != NULL)
+    {
+        for(uint32_t i = 0; i < cache->header.numOfRecords && !verify->cached; i++)
+        {
+            verify->cached = IsRecordOf(&cache->records[i], verify) &&
+                memcmp(cache->records[i].digest, verify->expected, SHA256_DIGEST_SIZE) == 0;
+        }
+        free(cache);
+    }
+    if(verify->cached)
+    {
+        Log(LL_INFO, 0, "'%s' didn't change since its sha256 was verified, it isn't hashed again", path);
+    }
+    return TRUE;
+}
+
+// Hash the bytes of the file that were read since the last step, bytesRead is counted from its start
+void StepImageVerify(image_verify_s* verify, const char_t* file, uint64_t bytesRead)
+{
+    if(bytesRead > verify->fileSize)
+    {
+        bytesRead = verify->fileSize;
+    }
+    if(verify->cached || bytesRead <= verify->hashed)
+    {
+        return;
+    }
+    uint64_t start = GetClockTicks();
+    Sha256Update(&verify->sha, file + verify->hashed, bytesRead - verify->hashed);
+    verify->hashTicks += GetClockTicks() - start;
+    verify->hashed = bytesRead;
+}
+
+/*
+* Hash the rest of the file (all of it was read) and compare the digest, a match is saved to the cache
+* FALSE if the image doesn't match its entry, it mustn't be booted then
+*/
+boolean_t EndImageVerify(image_verify_s* verify, const char_t* file, const char_t* path)
+{
+    if(verify->cached)
+    {
+        return TRUE;
+    }
+    StepImageVerify(verify, file, verify->fileSize);
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    Sha256Final(&verify->sha, digest);
+    if(memcmp(digest, verify->expected, SHA256_DIGEST_SIZE) != 0)
+    {
+        char_t hex[SHA256_HEX_LEN + 1];
+        FormatDigest(digest, hex);
+        Log(LL_ERROR, 0, "The sha256 of '%s' is %s, not the one of its entry.", path, hex);
+        return FALSE;
+    }
+    Log(LL_INFO, 0, "Verified the sha256 of '%s' (%d KiB, %d us of hashing with %s)", path,
+        (int32_t)(verify->fileSize / 1024), (int32_t)TicksToMicroseconds(verify->hashTicks),
+        GetSha256Implementation());
+    if(verify->modificationTime.Year != 0)
+    {
+        SaveVerifiedImage(verify);
+    }
+    return TRUE;
+}
+
+// The records of the cache file, none if there is no valid one (NULL only if it can't be allocated)
+static image_verify_cache_s* LoadVerifiedCache(void)
+{
+    image_verify_cache_s* cache = malloc(sizeof(image_verify_cache_s));
+    if(cache == NULL)
+    {
+        return NULL;
+    }
+    uint64_t size = 0;
+    FILE* cacheFile = fopen(IMAGE_VERIFY_CACHE_PATH, "r");
+    if(cacheFile != NULL)
+    {
+        size = fread(cache, 1, sizeof(image_verify_cache_s), cacheFile);
+        fclose(cacheFile);
+    }
+    image_verify_header_s* header = &cache->header;
+    if(size < sizeof(image_verify_header_s) || header->magic != IMAGE_VERIFY_CACHE_MAGIC ||
+        header->version != IMAGE_VERIFY_CACHE_VERSION || header->numOfRecords > IMAGE_VERIFY_CACHE_MAX_RECORDS ||
+        size != sizeof(image_verify_header_s) + header->numOfRecords * sizeof(image_verify_record_s))
+    {
+        if(size != 0)
+        {
+            Log(LL_INFO, 0, "The cache of verified images is not valid, ignoring it");
+        }
+        header->magic = IMAGE_VERIFY_CACHE_MAGIC;
+        header->version = IMAGE_VERIFY_CACHE_VERSION;
+        header->numOfRecords = 0;
+    }
+    return cache;
+}
+
+// Replace the record of the image (or make room for it by dropping the oldest one), and write the cache back
+static void SaveVerifiedImage(const image_verify_s* verify)
+{
+    image_verify_cache_s* cache = LoadVerifiedCache();
+    if(cache == NULL)
+    {
+        return;
+    }
+    uint32_t numOfRecords = 0;
+    for(uint32_t i = 0; i < cache->header.numOfRecords; i++)
+    {
+        if(memcmp(cache->records[i].key, verify->key, SHA256_DIGEST_SIZE) != 0)
+        {
+            cache->records[numOfRecords++] = cache->records[i];
+        }
+    }
+    if(numOfRecords == IMAGE_VERIFY_CACHE_MAX_RECORDS)
+    {
+        numOfRecords--;
+        memmove(cache->records, cache->records + 1, numOfRecords * sizeof(image_verify_record_s));
+    }
+    image_verify_record_s* record = &cache->records[numOfRecords++];
+    memcpy(record->key, verify->key, SHA256_DIGEST_SIZE);
+    memcpy(record->digest, verify->expected, SHA256_DIGEST_SIZE);
+    record->fileSize = verify->fileSize;
+    record->modificationTime = verify->modificationTime;
+    cache->header.numOfRecords = numOfRecords;
+
+    uint64_t size = sizeof(image_verify_header_s) + numOfRecords * sizeof(image_verify_record_s);
+    FILE* cacheFile = fopen(IMAGE_VERIFY_CACHE_PATH, "w");
+    if(cacheFile == NULL)
+    {
+        Log(LL_WARNING, 0, "Failed to create the cache of verified images");
+        free(cache);
+        return;
+    }
+    if(fwrite(cache, 1, size, cacheFile) != size)
+    {
+        Log(LL_WARNING, 0, "Failed to write the cache of verified images");
+    }
+    fclose(cacheFile);
+    free(cache);
+}
+
+static boolean_t IsRecordOf(const image_verify_record_s* record, const image_verify_s* verify)
+{
+    return memcmp(record->key, verify->key, SHA256_DIGEST_SIZE) == 0 && record->fileSize == verify->fileSize &&
+        memcmp(&record->modificationTime, &verify->modificationTime, sizeof(efi_time_t)) == 0;
+}
+
+static void FormatDigest(const uint8_t* digest, char_t* hex)
+{
+    const char_t* digits = "0123456789abcdef";
+    for(int32_t i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xF];
+    }
+    hex[SHA256_HEX_LEN] = CHAR_NULL;
+}
@@ -0,0 +1,520 @@
+#include "decoders.h"
+#include "bootutils.h"
+
+// gzip member header (RFC 1952 2.3)
+#define GZIP_HEADER_SIZE (10)
+#define GZIP_TRAILER_SIZE (8) // CRC32 and the size of the input mod 2^32
+#define GZIP_METHOD_DEFLATE (8)
+#define GZIP_FLAG_HCRC (1 << 1)
+#define GZIP_FLAG_EXTRA (1 << 2)
+#define GZIP_FLAG_NAME (1 << 3)
+#define GZIP_FLAG_COMMENT (1 << 4)
+
+#define DEFLATE_BLOCK_STORED (0)
+#define DEFLATE_BLOCK_FIXED (1)
+#define DEFLATE_BLOCK_DYNAMIC (2)
+#define DEFLATE_END_OF_BLOCK (256)
+#define DEFLATE_NUM_CODELEN_SYMBOLS (19)
+
+#define FAST_MASK ((1 << INFLATE_FAST_BITS) - 1)
+
+// Where a block starts, the decoder goes back to it when the block isn't all there
+typedef struct inflate_checkpoint_s{
+    uint64_t inputPos;
+    uint64_t outputPos;
+    uint64_t bitBuffer;
+    int32_t bitCount;
+} inflate_checkpoint_s;
+
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+    5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+    11, 11, 12, 12, 13, 13 };
+static const uint8_t codeLengthOrder[DEFLATE_NUM_CODELEN_SYMBOLS] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12,
+    3, 13, 2, 14, 1, 15 };
+
+static decode_status_t ReadGzipHeader(decode_stream_s* stream);
+static decode_status_t InflateBlock(inflate_state_s* state, decode_stream_s* stream);
+static decode_status_t ReadStoredBlock(inflate_state_s* state, decode_stream_s* stream);
+static decode_status_t ReadFixedTables(inflate_state_s* state);
+static decode_status_t ReadDynamicTables(inflate_state_s* state, decode_stream_s* stream);
+static decode_status_t DecodeSymbols(inflate_state_s* state, decode_stream_s* stream);
+static boolean_t BuildHuffman(inflate_huffman_s* huffman, const uint8_t* lengths, int32_t numOfSymbols);
+static int32_t DecodeSlow(inflate_state_s* state, const inflate_huffman_s* huffman);
+static decode_status_t Corrupt(const inflate_state_s* state, const decode_stream_s* stream);
+
+static inline void FillBits(inflate_state_s* state, decode_stream_s* stream);
+static inline uint32_t GetBits(inflate_state_s* state, decode_stream_s* stream, int32_t count);
+static inline int32_t DecodeSymbol(inflate_state_s* state, const inflate_huffman_s* huffman);
+static inline boolean_t ReadPastInput(const inflate_state_s* state);
+static inline uint32_t ReverseBits(uint32_t value, int32_t count);
+
+void InitInflate(inflate_state_s* state)
+{
+    memset(state, 0, sizeof(inflate_state_s));
+}
+
+/*
+* Decode the blocks of a gzip member that are in the input
+* Only the first member is decoded, the size in its trailer is checked against the output
+*/
+decode_status_t GzipDecode(inflate_state_s* state, decode_stream_s* stream)
+{
+    if(!state->headerRead)
+    {
+        decode_status_t status = ReadGzipHeader(stream);
+        if(status != DECODE_DONE)
+        {
+            return status;
+        }
+        state->headerRead = TRUE;
+    }
+    while(!state->lastBlock)
+    {
+        inflate_checkpoint_s checkpoint = { stream->inputPos, stream->outputPos, state->bitBuffer, state->bitCount };
+        decode_status_t status = InflateBlock(state, stream);
+        if(status != DECODE_DONE)
+        {
+            // the block is decoded again from its start, without the zero bits that were put past the input
+            stream->inputPos = checkpoint.inputPos;
+            stream->outputPos = checkpoint.outputPos;
+            state->bitBuffer = checkpoint.bitBuffer;
+            state->bitCount = checkpoint.bitCount;
+            state->padBits = 0;
+            return status;
+        }
+        // the bits that were put past the input are dropped, the next block may have more input
+        state->bitCount -= state->padBits;
+        state->padBits = 0;
+    }
+
+    // the trailer starts on the byte after the last block, the whole bytes in the bit buffer weren't used
+    uint64_t trailerPos = stream->inputPos - state->bitCount / 8;
+    if(stream->inputSize - trailerPos < GZIP_TRAILER_SIZE)
+    {
+        return stream->inputComplete ? DECODE_ERROR : DECODE_NEED_INPUT;
+    }
+    uint32_t size = 0;
+    memcpy(&size, stream->input + trailerPos + 4, sizeof(size));
+    if(size != (uint32_t)stream->outputPos)
+    {
+        return DECODE_ERROR;
+    }
+    stream->inputPos = trailerPos + GZIP_TRAILER_SIZE;
+    state->bitBuffer = 0;
+    state->bitCount = 0;
+    return DECODE_DONE;
+}
+
+// Skip the header of the member, DECODE_DONE once it was read
+static decode_status_t ReadGzipHeader(decode_stream_s* stream)
+{
+    const uint8_t* header = stream->input + stream->inputPos;
+    uint64_t available = stream->inputSize - stream->inputPos;
+    decode_status_t missing = stream->inputComplete ? DECODE_ERROR : DECODE_NEED_INPUT;
+    if(available < GZIP_HEADER_SIZE)
+    {
+        return missing;
+    }
+    if(header[0] != 0x1f || header[1] != 0x8b || header[2] != GZIP_METHOD_DEFLATE)
+    {
+        return DECODE_ERROR;
+    }
+    uint8_t flags = header[3];
+    uint64_t size = GZIP_HEADER_SIZE;
+    if(flags & GZIP_FLAG_EXTRA)
+    {
+        if(available < size + 2)
+        {
+            return missing;
+        }
+        size += 2 + (header[size] | (header[size + 1] << 8));
+    }
+    // the name and the comment end with a null
+    for(uint8_t flag = GZIP_FLAG_NAME; flag <= GZIP_FLAG_COMMENT; flag <<= 1)
+    {
+        if(!(flags & flag))
+        {
+            continue;
+        }
+        while(size < available && header[size] != 0)
+        {
+            size++;
+        }
+        size++;
+    }
+    if(flags & GZIP_FLAG_HCRC)
+    {
+        size += 2;
+    }
+    if(size > available)
+    {
+        return missing;
+    }
+    stream->inputPos += size;
+    return DECODE_DONE;
+}
+
+static decode_status_t InflateBlock(inflate_state_s* state, decode_stream_s* stream)
+{
+    uint32_t header = GetBits(state, stream, 3);
+    boolean_t lastBlock = header & 1;
+    decode_status_t status;
+    switch (header >> 1)
+    {
+    case DEFLATE_BLOCK_STORED:
+        status = ReadStoredBlock(state, stream);
+        break;
+    case DEFLATE_BLOCK_FIXED:
+        status = ReadFixedTables(state);
+        break;
+    case DEFLATE_BLOCK_DYNAMIC:
+        status = ReadDynamicTables(state, stream);
+        break;
+    default:
+        return Corrupt(state, stream);
+    }
+    if(status == DECODE_DONE && (header >> 1) != DEFLATE_BLOCK_STORED)
+    {
+        status = DecodeSymbols(state, stream);
+    }
+    if(status == DECODE_DONE && ReadPastInput(state))
+    {
+        status = Corrupt(state, stream);
+    }
+    if(status == DECODE_DONE)
+    {
+        state->lastBlock = lastBlock;
+    }
+    return status;
+}
+
+// A stored block is copied, its length is on the next byte boundary
+static decode_status_t ReadStoredBlock(inflate_state_s* state, decode_stream_s* stream)
+{
+    GetBits(state, stream, state->bitCount % 8);
+    uint32_t length = GetBits(state, stream, 16);
+    uint32_t lengthComplement = GetBits(state, stream, 16);
+    if(ReadPastInput(state) || (length ^ 0xffff) != lengthComplement)
+    {
+        return Corrupt(state, stream);
+    }
+    // the whole bytes that are still in the bit buffer come first
+    state->bitCount -= state->padBits;
+    state->padBits = 0;
+    stream->inputPos -= state->bitCount / 8;
+    state->bitBuffer = 0;
+    state->bitCount = 0;
+    if(stream->inputSize - stream->inputPos < length)
+    {
+        return stream->inputComplete ? DECODE_ERROR : DECODE_NEED_INPUT;
+    }
+    if(stream->outputSize - stream->outputPos < length)
+    {
+        return DECODE_NEED_OUTPUT;
+    }
+    memcpy(stream->output + stream->outputPos, stream->input + stream->inputPos, length);
+    stream->inputPos += length;
+    stream->outputPos += length;
+    return DECODE_DONE;
+}
+
+static decode_status_t ReadFixedTables(inflate_state_s* state)
+{
+    uint8_t lengths[INFLATE_NUM_LITLEN_SYMBOLS];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 256 - 144);
+    memset(lengths + 256, 7, 280 - 256);
+    memset(lengths + 280, 8, INFLATE_NUM_LITLEN_SYMBOLS - 280);
+    BuildHuffman(&state->litlen, lengths, INFLATE_NUM_LITLEN_SYMBOLS);
+    memset(lengths, 5, INFLATE_NUM_DIST_SYMBOLS);
+    BuildHuffman(&state->dist, lengths, INFLATE_NUM_DIST_SYMBOLS);
+    return DECODE_DONE;
+}
+
+// The code lengths of the block are themselves huffman coded, with runs of repeated lengths
+static decode_status_t ReadDynamicTables(inflate_state_s* state, decode_stream_s* stream)
+{
+    int32_t numOfLitlen = GetBits(state, stream, 5) + 257;
+    int32_t numOfDist = GetBits(state, stream, 5) + 1;
+    int32_t numOfCodeLengths = GetBits(state, stream, 4) + 4;
+
+    uint8_t codeLengthLengths[DEFLATE_NUM_CODELEN_SYMBOLS];
+    memset(codeLengthLengths, 0, sizeof(codeLengthLengths));
+    for(int32_t i = 0; i < numOfCodeLengths; i++)
+    {
+        codeLengthLengths[codeLengthOrder[i]] = GetBits(state, stream, 3);
+    }
+    if(!BuildHuffman(&state->litlen, codeLengthLengths, DEFLATE_NUM_CODELEN_SYMBOLS))
+    {
+        return Corrupt(state, stream);
+    }
+
+    uint8_t lengths[INFLATE_NUM_LITLEN_SYMBOLS + INFLATE_NUM_DIST_SYMBOLS];
+    int32_t numOfLengths = 0;
+    while(numOfLengths < numOfLitlen + numOfDist)
+    {
+        FillBits(state, stream);
+        int32_t symbol = DecodeSymbol(state, &state->litlen);
+        int32_t repeat = 1;
+        uint8_t length = 0;
+        if(symbol < 0 || ReadPastInput(state))
+        {
+            return Corrupt(state, stream);
+        }
+        if(symbol < 16)
+        {
+            length = symbol;
+        }
+        else if(symbol == 16)
+        {
+            if(numOfLengths == 0)
+            {
+                return Corrupt(state, stream);
+            }
+            length = lengths[numOfLengths - 1];
+            repeat = 3 + GetBits(state, stream, 2);
+        }
+        else if(symbol == 17)
+        {
+            repeat = 3 + GetBits(state, stream, 3);
+        }
+        else
+        {
+            repeat = 11 + GetBits(state, stream, 7);
+        }
+        if(numOfLengths + repeat > numOfLitlen + numOfDist)
+        {
+            return Corrupt(state, stream);
+        }
+        memset(lengths + numOfLengths, length, repeat);
+        numOfLengths += repeat;
+    }
+    if(lengths[DEFLATE_END_OF_BLOCK] == 0 || !BuildHuffman(&state->litlen, lengths, numOfLitlen) ||
+        !BuildHuffman(&state->dist, lengths + numOfLitlen, numOfDist))
+    {
+        return Corrupt(state, stream);
+    }
+    return DECODE_DONE;
+}
+
+/*
+* The hot loop: literals and matches until the end of the block
+* A symbol with its extra bits and the distance with its extra bits take at most 48 bits, so the bits are
+* filled once for each of them
+*/
+static decode_status_t DecodeSymbols(inflate_state_s* state, decode_stream_s* stream)
+{
+    uint8_t* output = stream->output;
+    uint64_t outputPos = stream->outputPos;
+    uint64_t outputSize = stream->outputSize;
+    decode_status_t status = DECODE_DONE;
+    while(TRUE)
+    {
+        FillBits(state, stream);
+        int32_t symbol = DecodeSymbol(state, &state->litlen);
+        if(symbol < DEFLATE_END_OF_BLOCK)
+        {
+            if(symbol < 0 || ReadPastInput(state))
+            {
+                status = Corrupt(state, stream);
+                break;
+            }
+            if(outputPos == outputSize)
+            {
+                status = DECODE_NEED_OUTPUT;
+                break;
+            }
+            output[outputPos++] = (uint8_t)symbol;
+            continue;
+        }
+        if(symbol == DEFLATE_END_OF_BLOCK)
+        {
+            break;
+        }
+
+        symbol -= 257;
+        if(symbol >= 29)
+        {
+            status = Corrupt(state, stream);
+            break;
+        }
+        uint32_t length = lengthBase[symbol] + GetBits(state, stream, lengthExtra[symbol]);
+        int32_t distSymbol = DecodeSymbol(state, &state->dist);
+        if(distSymbol < 0 || distSymbol >= 30)
+        {
+            status = Corrupt(state, stream);
+            break;
+        }
+        uint32_t dist = distBase[distSymbol] + GetBits(state, stream, distExtra[distSymbol]);
+        if(ReadPastInput(state) || dist > outputPos)
+        {
+            status = Corrupt(state, stream);
+            break;
+        }
+        if(outputSize - outputPos < length)
+        {
+            status = DECODE_NEED_OUTPUT;
+            break;
+        }
+        CopyMatch(output + outputPos, dist, length);
+        outputPos += length;
+    }
+    stream->outputPos = outputPos;
+    return status;
+}
+
+/*
+* Build the decoding tables of a canonical huffman code from its code lengths
+* The codes are stored bit reversed in the stream, the fast table is indexed by the reversed code
+* FALSE if the lengths don't make a prefix code
+*/
+static boolean_t BuildHuffman(inflate_huffman_s* huffman, const uint8_t* lengths, int32_t numOfSymbols)
+{
+    int32_t sizes[INFLATE_MAX_CODE_LEN + 1];
+    int32_t nextCode[INFLATE_MAX_CODE_LEN + 1];
+    memset(sizes, 0, sizeof(sizes));
+    memset(huffman->fast, 0, sizeof(huffman->fast));
+    for(int32_t i = 0; i < numOfSymbols; i++)
+    {
+        sizes[lengths[i]]++;
+    }
+    sizes[0] = 0;
+
+    int32_t code = 0;
+    int32_t symbolIndex = 0;
+    for(int32_t len = 1; len <= INFLATE_MAX_CODE_LEN; len++)
+    {
+        if(sizes[len] > (1 << len))
+        {
+            return FALSE;
+        }
+        nextCode[len] = code;
+        huffman->firstCode[len] = (uint16_t)code;
+        huffman->firstSymbol[len] = (uint16_t)symbolIndex;
+        code += sizes[len];
+        if(sizes[len] != 0 && code - 1 >= (1 << len))
+        {
+            return FALSE;
+        }
+        huffman->maxCode[len] = code << (16 - len);
+        code <<= 1;
+        symbolIndex += sizes[len];
+    }
+    huffman->maxCode[INFLATE_MAX_CODE_LEN + 1] = 0x10000;
+
+    for(int32_t symbol = 0; symbol < numOfSymbols; symbol++)
+    {
+        int32_t len = lengths[symbol];
+        if(len == 0)
+        {
+            continue;
+        }
+        int32_t index = nextCode[len] - huffman->firstCode[len] + huffman->firstSymbol[len];
+        huffman->size[index] = (uint8_t)len;
+        huffman->value[index] = (uint16_t)symbol;
+        if(len <= INFLATE_FAST_BITS)
+        {
+            uint16_t entry = (uint16_t)((len << 9) | symbol);
+            for(uint32_t j = ReverseBits(nextCode[len], len); j < (1 << INFLATE_FAST_BITS); j += (1 << len))
+            {
+                huffman->fast[j] = entry;
+            }
+        }
+        nextCode[len]++;
+    }
+    return TRUE;
+}
+
+// A code longer than the fast table, -1 if it isn't a code
+static int32_t DecodeSlow(inflate_state_s* state, const inflate_huffman_s* huffman)
+{
+    uint32_t code = ReverseBits((uint32_t)state->bitBuffer & 0xffff, 16);
+    int32_t len = INFLATE_FAST_BITS + 1;
+    while(code >= huffman->maxCode[len])
+    {
+        len++;
+    }
+    if(len > INFLATE_MAX_CODE_LEN)
+    {
+        return -1;
+    }
+    int32_t index = (code >> (16 - len)) - huffman->firstCode[len] + huffman->firstSymbol[len];
+    if(index >= INFLATE_NUM_LITLEN_SYMBOLS || huffman->size[index] != len)
+    {
+        return -1;
+    }
+    state->bitBuffer >>= len;
+    state->bitCount -= len;
+    return huffman->value[index];
+}
+
+// A bad block can also be a block that ran out of input (its bits past the input are zeros)
+static decode_status_t Corrupt(const inflate_state_s* state, const decode_stream_s* stream)
+{
+    return (ReadPastInput(state) && !stream->inputComplete) ? DECODE_NEED_INPUT : DECODE_ERROR;
+}
+
+// Fill the bit buffer to at least 57 bits, with zero bits once the input runs out
+static inline void FillBits(inflate_state_s* state, decode_stream_s* stream)
+{
+    while(state->bitCount <= 56)
+    {
+        if(stream->inputPos < stream->inputSize)
+        {
+            state->bitBuffer |= (uint64_t)stream->input[stream->inputPos++] << state->bitCount;
+        }
+        else
+        {
+            state->padBits += 8;
+        }
+        state->bitCount += 8;
+    }
+}
+
+static inline uint32_t GetBits(inflate_state_s* state, decode_stream_s* stream, int32_t count)
+{
+    if(state->bitCount < count)
+    {
+        FillBits(state, stream);
+    }
+    uint32_t value = (uint32_t)(state->bitBuffer & ((1ULL << count) - 1));
+    state->bitBuffer >>= count;
+    state->bitCount -= count;
+    return value;
+}
+
+// The bit buffer has to be filled, -1 if the bits aren't a code
+static inline int32_t DecodeSymbol(inflate_state_s* state, const inflate_huffman_s* huffman)
+{
+    uint16_t entry = huffman->fast[state->bitBuffer & FAST_MASK];
+    if(entry == 0)
+    {
+        return DecodeSlow(state, huffman);
+    }
+    int32_t len = entry >> 9;
+    state->bitBuffer >>= len;
+    state->bitCount -= len;
+    return entry & 511;
+}
+
+// The zero bits past the end of the input were read
+static inline boolean_t ReadPastInput(const inflate_state_s* state)
+{
+    return state->bitCount < state->padBits;
+}
+
+static inline uint32_t ReverseBits(uint32_t value, int32_t count)
+{
+    uint32_t reversed = 0;
+    for(int32_t i = 0; i < count; i++)
+    {
+        reversed = (reversed << 1) | (value & 1);
+        value >>= 1;
+    }
+    return reversed;
+}
@@ -0,0 +1,320 @@
+#include "initrd.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "bootphase.h"
+#include "volumes.h"
+#include "asyncread.h"
+#include "prefetch.h"
+#include "imagecache.h"
+
+// Vendor media device path node (UEFI spec 10.3.5.6), the header followed by the vendor GUID
+#define MEDIA_DEVICE_PATH_TYPE (0x04)
+#define MEDIA_VENDOR_SUBTYPE (0x03)
+#define VENDOR_NODE_LENGTH (sizeof(efi_device_path_t) + sizeof(efi_guid_t))
+
+#define LINUX_EFI_INITRD_MEDIA_GUID { 0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} }
+#define EFI_LOAD_FILE2_PROTOCOL_GUID { 0x4006c0c1, 0xfcb3, 0x403e, {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d} }
+
+#define EFI_NATIVE_INTERFACE (0)
+
+#define ALIGN_UP(value, alignment) (((value) + (alignment) - 1) & ~((uint64_t)(alignment) - 1))
+
+typedef struct efi_load_file2_protocol_s efi_load_file2_protocol_t;
+typedef efi_status_t (EFIAPI *efi_load_file2_t)(efi_load_file2_protocol_t* this, efi_device_path_t* filePath,
+    boolean_t bootPolicy, uintn_t* bufferSize, void* buffer);
+struct efi_load_file2_protocol_s{
+    efi_load_file2_t LoadFile;
+};
+
+// libuefi leaves these boot services untyped
+typedef efi_status_t (EFIAPI *efi_install_protocol_interface_t)(efi_handle_t* handle, efi_guid_t* protocol,
+    uint32_t interfaceType, void* interface);
+typedef efi_status_t (EFIAPI *efi_uninstall_protocol_interface_t)(efi_handle_t handle, efi_guid_t* protocol,
+    void* interface);
+
+static efi_status_t EFIAPI LoadInitrd(efi_load_file2_protocol_t* this, efi_device_path_t* filePath,
+    boolean_t bootPolicy, uintn_t* bufferSize, void* buffer);
+static boolean_t InstallInitrdProtocols(void);
+
+static uint8_t initrdDevicePath[VENDOR_NODE_LENGTH + END_DEVICE_PATH_LENGTH];
+static efi_load_file2_protocol_t initrdLoadFile = { LoadInitrd };
+static efi_handle_t initrdHandle = NULL;
+
+// The initrds one after the other, in pages
+static char_t* initrdData = NULL;
+static uint64_t initrdSize = 0;
+
+/*
+* Get the initrd= paths of a command line, FALSE if there are none
+* (or there are more than INITRD_MAX_FILES, then they are left to the kernel)
+* The list must be freed with FreeInitrdPaths
+*/
+boolean_t GetInitrdPaths(const char_t* args, initrd_list_s* list)
+{
+    memset(list, 0, sizeof(initrd_list_s));
+    if(args == NULL || strstr(args, INITRD_ARG_PREFIX) == NULL)
+    {
+        return FALSE;
+    }
+    // a path is never longer than its arg
+    list->pathsBuffer = malloc(strlen(args) + 1);
+    if(list->pathsBuffer == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the initrd paths");
+        return FALSE;
+    }
+
+    char_t* nextPath = list->pathsBuffer;
+    size_t prefixLen = strlen(INITRD_ARG_PREFIX);
+    const char_t* arg = args;
+    while(*arg != CHAR_NULL)
+    {
+        while(*arg == ' ')
+        {
+            arg++;
+        }
+        const char_t* argEnd = arg;
+        while(*argEnd != CHAR_NULL && *argEnd != ' ')
+        {
+            argEnd++;
+        }
+        size_t argLen = argEnd - arg;
+        if(argLen > prefixLen && strncmp(arg, INITRD_ARG_PREFIX, prefixLen) == 0)
+        {
+            if(list->numOfPaths == INITRD_MAX_FILES)
+            {
+                Log(LL_WARNING, 0, "More than %d initrds, the kernel reads them itself", INITRD_MAX_FILES);
+                FreeInitrdPaths(list);
+                return FALSE;
+            }
+            memcpy(nextPath, arg + prefixLen, argLen - prefixLen);
+            nextPath[argLen - prefixLen] = CHAR_NULL;
+            list->paths[list->numOfPaths++] = nextPath;
+            nextPath += argLen - prefixLen + 1;
+        }
+        arg = argEnd;
+    }
+    if(list->numOfPaths == 0)
+    {
+        FreeInitrdPaths(list);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void FreeInitrdPaths(initrd_list_s* list)
+{
+    free(list->pathsBuffer);
+    memset(list, 0, sizeof(initrd_list_s));
+}
+
+/*
+* Read the initrds (from the volume of the kernel, like the stub does) and serve them until UninstallInitrd
+* returns FALSE if they aren't served, then the kernel reads them itself
+*/
+boolean_t InstallInitrd(const initrd_list_s* list, efi_handle_t volumeHandle)
+{
+    boot_phase_t phase = BeginBootPhase("initrd", NULL);
+    initrdData = ReadInitrds(list, volumeHandle, 0, &initrdSize);
+    boolean_t installed = initrdData != NULL && InstallInitrdProtocols();
+    EndBootPhase(phase);
+    if(!installed)
+    {
+        UninstallInitrd();
+        return FALSE;
+    }
+    Log(LL_INFO, 0, "Serving %d initrds (%d bytes) from memory", list->numOfPaths, initrdSize);
+    return TRUE;
+}
+
+// Remove the protocols and free the initrds, nothing happens if they aren't installed
+void UninstallInitrd(void)
+{
+    if(initrdHandle != NULL)
+    {
+        efi_guid_t devPathGuid = EFI_DEVICE_PATH_PROTOCOL_GUID;
+        efi_guid_t loadFile2Guid = EFI_LOAD_FILE2_PROTOCOL_GUID;
+        efi_uninstall_protocol_interface_t uninstall =
+            *(efi_uninstall_protocol_interface_t*)&BS->UninstallProtocolInterface;
+        uninstall(initrdHandle, &loadFile2Guid, &initrdLoadFile);
+        uninstall(initrdHandle, &devPathGuid, initrdDevicePath);
+        initrdHandle = NULL;
+    }
+    if(initrdData != NULL)
+    {
+        BS->FreePages((efi_physical_address_t)(uintn_t)initrdData, EFI_SIZE_TO_PAGES(initrdSize));
+        initrdData = NULL;
+    }
+    initrdSize = 0;
+}
+
+/*
+* Read every initrd into new pages, each one starts on an INITRD_ALIGNMENT boundary (padded with zeros)
+* The prefetched ones are copied, the others are read together
+* The pages end below maxAddress (anywhere if it is 0), they are freed with FreePages
+* returns the initrds and their size, NULL on failure
+*/
+char_t* ReadInitrds(const initrd_list_s* list, efi_handle_t volumeHandle, efi_physical_address_t maxAddress,
+    uint64_t* size)
+{
+    char_t* prefetched[INITRD_MAX_FILES] = { NULL };
+    efi_file_handle_t* files[INITRD_MAX_FILES] = { NULL };
+    uint64_t sizes[INITRD_MAX_FILES];
+    uint64_t offsets[INITRD_MAX_FILES];
+    boolean_t failed = FALSE;
+
+    uint64_t totalSize = 0;
+    for(int32_t i = 0; i < list->numOfPaths && !failed; i++)
+    {
+        prefetched[i] = TakePrefetchedFile(list->paths[i], &sizes[i], NULL);
+        if(prefetched[i] == NULL)
+        {
+            efi_file_info_t info;
+            files[i] = OpenVolumeFile(volumeHandle, list->paths[i]);
+            failed = (files[i] == NULL || EFI_ERROR(GetFileInfo(files[i], &info)));
+            if(failed)
+            {
+                Log(LL_ERROR, 0, "Failed to open the initrd '%s'", list->paths[i]);
+                break;
+            }
+            sizes[i] = info.FileSize;
+        }
+        offsets[i] = ALIGN_UP(totalSize, INITRD_ALIGNMENT);
+        totalSize = offsets[i] + sizes[i];
+    }
+
+    if(!failed && totalSize == 0)
+    {
+        Log(LL_WARNING, 0, "The initrds are empty");
+        failed = TRUE;
+    }
+    efi_physical_address_t address = maxAddress;
+    char_t* data = NULL;
+    if(!failed)
+    {
+        // the stub copies the initrd out of these pages, they are page aligned so it is a plain page copy
+        efi_allocate_type_t allocateType = (maxAddress != 0) ? AllocateMaxAddress : AllocateAnyPages;
+        efi_status_t status = BS->AllocatePages(allocateType, EfiLoaderData, EFI_SIZE_TO_PAGES(totalSize), &address);
+        failed = EFI_ERROR(status);
+        if(failed)
+        {
+            Log(LL_ERROR, status, "Failed to allocate %d bytes for the initrds", totalSize);
+        }
+    }
+    if(!failed)
+    {
+        data = (char_t*)(uintn_t)address;
+        async_read_s reads[INITRD_MAX_FILES];
+        async_read_s* readPtrs[INITRD_MAX_FILES];
+        const char_t* readPaths[INITRD_MAX_FILES];
+        int32_t numOfReads = 0;
+        for(int32_t i = 0; i < list->numOfPaths; i++)
+        {
+            uint64_t end = offsets[i] + sizes[i];
+            uint64_t paddingEnd = (i + 1 < list->numOfPaths) ? offsets[i + 1] : end;
+            memset(data + end, 0, paddingEnd - end);
+            if(prefetched[i] != NULL)
+            {
+                memcpy(data + offsets[i], prefetched[i], sizes[i]);
+                continue;
+            }
+            BeginAsyncRead(&reads[numOfReads], files[i], data + offsets[i], sizes[i]);
+            SetAsyncReadVolume(&reads[numOfReads], volumeHandle);
+            readPtrs[numOfReads] = &reads[numOfReads];
+            readPaths[numOfReads] = list->paths[i];
+            numOfReads++;
+        }
+        efi_status_t status = FinishAsyncReads(readPtrs, numOfReads);
+        if(EFI_ERROR(status))
+        {
+            Log(LL_ERROR, status, "Failed to read the initrds");
+            BS->FreePages(address, EFI_SIZE_TO_PAGES(totalSize));
+            failed = TRUE;
+        }
+        for(int32_t i = 0; i < numOfReads && !failed; i++)
+        {
+            LogAsyncRead(readPtrs[i], readPaths[i]);
+        }
+    }
+
+    for(int32_t i = 0; i < list->numOfPaths; i++)
+    {
+        ReleaseImage(prefetched[i]);
+        if(files[i] != NULL)
+        {
+            files[i]->Close(files[i]);
+        }
+    }
+    if(failed)
+    {
+        return NULL;
+    }
+    *size = totalSize;
+    return data;
+}
+
+/*
+* Put the vendor media device path and LoadFile2 on a new handle
+* The stub finds it with LocateDevicePath, so there can't be another handle with that path
+*/
+static boolean_t InstallInitrdProtocols(void)
+{
+    efi_device_path_t* vendorNode = (efi_device_path_t*)initrdDevicePath;
+    vendorNode->Type = MEDIA_DEVICE_PATH_TYPE;
+    vendorNode->SubType = MEDIA_VENDOR_SUBTYPE;
+    SetDevicePathNodeLength(vendorNode, VENDOR_NODE_LENGTH);
+    efi_guid_t initrdMediaGuid = LINUX_EFI_INITRD_MEDIA_GUID;
+    memcpy(vendorNode + 1, &initrdMediaGuid, sizeof(efi_guid_t));
+    efi_device_path_t* endNode = NextDevicePathNode(vendorNode);
+    SetDevicePathEndNode(endNode);
+
+    efi_guid_t devPathGuid = EFI_DEVICE_PATH_PROTOCOL_GUID;
+    efi_guid_t loadFile2Guid = EFI_LOAD_FILE2_PROTOCOL_GUID;
+    efi_device_path_t* remainingPath = vendorNode;
+    efi_handle_t existingHandle = NULL;
+    if(!EFI_ERROR(BS->LocateDevicePath(&loadFile2Guid, &remainingPath, &existingHandle)) &&
+        IsDevicePathEnd(remainingPath))
+    {
+        Log(LL_WARNING, 0, "Another initrd is already served by the firmware, the kernel reads the initrds itself");
+        return FALSE;
+    }
+
+    efi_install_protocol_interface_t install = *(efi_install_protocol_interface_t*)&BS->InstallProtocolInterface;
+    efi_status_t status = install(&initrdHandle, &devPathGuid, EFI_NATIVE_INTERFACE, initrdDevicePath);
+    if(!EFI_ERROR(status))
+    {
+        status = install(&initrdHandle, &loadFile2Guid, EFI_NATIVE_INTERFACE, &initrdLoadFile);
+    }
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to install the initrd protocols");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// LoadFile2 of the initrd, the stub asks for the size first (with no buffer)
+static efi_status_t EFIAPI LoadInitrd(efi_load_file2_protocol_t* this, efi_device_path_t* filePath,
+    boolean_t bootPolicy, uintn_t* bufferSize, void* buffer)
+{
+    if(bufferSize == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+    if(bootPolicy)
+    {
+        return EFI_UNSUPPORTED; // LoadFile2 isn't used for boot options
+    }
+    if(initrdData == NULL)
+    {
+        return EFI_NOT_FOUND;
+    }
+    if(buffer == NULL || *bufferSize < initrdSize)
+    {
+        *bufferSize = initrdSize;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    memcpy(buffer, initrdData, initrdSize);
+    *bufferSize = initrdSize;
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,303 @@
+#include "kernelindex.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "ErrorCodes.h"
+
+#define LINUX_KERNEL_IDENTIFIER_STR ("vmlinuz")
+
+#define MIN_NAME_CAPACITY (8)
+
+// Growable list of file names (in the arena of the index that is being built)
+typedef struct name_list_s{
+    char_t** names;
+    int32_t count;
+    int32_t capacity;
+} name_list_s;
+
+static const char_t* initrdPrefixes[] = { "initrd", "initramfs" };
+
+// Every index that was built, an index is replaced (and freed) when its directory is modified
+static kernel_index_s* kernelIndexes = NULL;
+
+static kernel_index_s* BuildKernelIndex(const char_t* directoryPath, uint64_t modificationTime);
+static boolean_t PushName(arena_s* arena, name_list_s* list, const char_t* name);
+static void FillKernelImage(arena_s* arena, kernel_image_s* kernel, const name_list_s* initrds);
+static const char_t* FindInitrd(const name_list_s* initrds, const char_t* release);
+static void SortKernels(kernel_image_s* kernels, int32_t numOfKernels);
+static boolean_t IsInitrdName(const char_t* name);
+static inline boolean_t IsDigit(char_t c);
+
+/*
+* Get the index of the kernels in a directory
+* A directory is read again only if its modification time changed since it was indexed
+* (or if the filesystem doesn't keep modification times for directories)
+*/
+const kernel_index_s* GetKernelIndex(const char_t* directoryPath)
+{
+    struct stat st;
+    if (stat(directoryPath, &st) != 0)
+    {
+        Log(LL_ERROR, 0, "Failed to open directory '%s', to kernel: '%s'", directoryPath,
+        GetCommandErrorInfo(errno));
+        return NULL;
+    }
+
+    kernel_index_s** link = &kernelIndexes;
+    while (*link != NULL && strcmp((*link)->directory, directoryPath) != 0)
+    {
+        link = &(*link)->next;
+    }
+    kernel_index_s* index = *link;
+    if (index != NULL)
+    {
+        if (st.st_mtime != 0 && index->modificationTime == st.st_mtime)
+        {
+            return index;
+        }
+        // The index is in its own arena, so copy the arena before freeing it
+        *link = index->next;
+        arena_s arena = index->arena;
+        ArenaFree(&arena);
+    }
+
+    index = BuildKernelIndex(directoryPath, st.st_mtime);
+    if (index != NULL)
+    {
+        index->next = kernelIndexes;
+        kernelIndexes = index;
+    }
+    return index;
+}
+
+/*
+* Natural comparison of two version strings (6.10.1 is newer than 6.9.12)
+* Runs of digits are compared by their value and everything else char by char
+* Returns a positive number if lhs is newer, negative if rhs is newer and 0 if they are equal
+* A missing version (NULL) is older than any version
+*/
+int32_t CompareVersions(const char_t* lhs, const char_t* rhs)
+{
+    if (lhs == NULL || rhs == NULL)
+    {
+        return (lhs != NULL) - (rhs != NULL);
+    }
+    while (*lhs != CHAR_NULL && *rhs != CHAR_NULL)
+    {
+        if (IsDigit(*lhs) && IsDigit(*rhs))
+        {
+            while (*lhs == '0')
+            {
+                lhs++;
+            }
+            while (*rhs == '0')
+            {
+                rhs++;
+            }
+            // without leading zeros, the longer number is the bigger one
+            size_t lhsDigits = 0;
+            size_t rhsDigits = 0;
+            while (IsDigit(lhs[lhsDigits]))
+            {
+                lhsDigits++;
+            }
+            while (IsDigit(rhs[rhsDigits]))
+            {
+                rhsDigits++;
+            }
+            if (lhsDigits != rhsDigits)
+            {
+                return (lhsDigits > rhsDigits) ? 1 : -1;
+            }
+            int32_t diff = strncmp(lhs, rhs, lhsDigits);
+            if (diff != 0)
+            {
+                return diff;
+            }
+            lhs += lhsDigits;
+            rhs += rhsDigits;
+            continue;
+        }
+        if (*lhs != *rhs)
+        {
+            return (uint8_t)*lhs - (uint8_t)*rhs;
+        }
+        lhs++;
+        rhs++;
+    }
+    return (*lhs != CHAR_NULL) - (*rhs != CHAR_NULL);
+}
+
+/*
+* Read the directory once, collect the kernels and the initrds, pair them up by their version
+* and sort the kernels newest first
+*/
+static kernel_index_s* BuildKernelIndex(const char_t* directoryPath, uint64_t modificationTime)
+{
+    DIR* dir = opendir(directoryPath);
+    if (dir == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to open directory '%s', to kernel: '%s'", directoryPath,
+        GetCommandErrorInfo(errno));
+        return NULL;
+    }
+
+    arena_s arena = ARENA_INIT;
+    name_list_s kernelNames = { NULL, 0, 0 };
+    name_list_s initrdNames = { NULL, 0, 0 };
+    boolean_t failed = FALSE;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL && !failed)
+    {
+        if (de->d_type == DT_DIR)
+        {
+            continue;
+        }
+        if (strstr(de->d_name, LINUX_KERNEL_IDENTIFIER_STR) != NULL)
+        {
+            failed = !PushName(&arena, &kernelNames, de->d_name);
+        }
+        else if (IsInitrdName(de->d_name))
+        {
+            failed = !PushName(&arena, &initrdNames, de->d_name);
+        }
+    }
+    closedir(dir);
+
+    kernel_index_s* index = failed ? NULL : ArenaAlloc(&arena, sizeof(kernel_index_s));
+    if (index != NULL)
+    {
+        index->kernels = ArenaAlloc(&arena, sizeof(kernel_image_s) * kernelNames.count);
+        index->directory = ArenaStoreString(&arena, directoryPath, strlen(directoryPath));
+    }
+    if (index == NULL || index->kernels == NULL || index->directory == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the kernel index of '%s'", directoryPath);
+        ArenaFree(&arena);
+        return NULL;
+    }
+
+    for (int32_t i = 0; i < kernelNames.count; i++)
+    {
+        index->kernels[i].fileName = kernelNames.names[i];
+        FillKernelImage(&arena, index->kernels + i, &initrdNames);
+    }
+    SortKernels(index->kernels, kernelNames.count);
+
+    index->numOfKernels = kernelNames.count;
+    index->modificationTime = modificationTime;
+    index->next = NULL;
+    index->arena = arena;
+    Log(LL_INFO, 0, "Indexed %d kernels in '%s'", index->numOfKernels, directoryPath);
+    return index;
+}
+
+static boolean_t PushName(arena_s* arena, name_list_s* list, const char_t* name)
+{
+    if (list->count == list->capacity)
+    {
+        int32_t newCapacity = (list->capacity == 0) ? MIN_NAME_CAPACITY : list->capacity * 2;
+        char_t** newNames = ArenaAlloc(arena, sizeof(char_t*) * newCapacity);
+        if (newNames == NULL)
+        {
+            return FALSE;
+        }
+        memcpy(newNames, list->names, sizeof(char_t*) * list->count);
+        list->names = newNames;
+        list->capacity = newCapacity;
+    }
+    list->names[list->count] = ArenaStoreString(arena, name, strlen(name));
+    return list->names[list->count++] != NULL;
+}
+
+/*
+* Get the version of the kernel from its file name and find its initrd
+* the char after "vmlinuz" seperates the version, "vmlinuz-6.5.2-arch1" has the version
+* "6.5.2" (up to the next seperator, for the %v substitution) and the release "6.5.2-arch1"
+* (everything after it, used to sort the kernels and to find the initrd)
+*/
+static void FillKernelImage(arena_s* arena, kernel_image_s* kernel, const name_list_s* initrds)
+{
+    kernel->version = NULL;
+    kernel->release = NULL;
+    kernel->initrdName = NULL;
+
+    const char_t* release = strstr(kernel->fileName, LINUX_KERNEL_IDENTIFIER_STR) + strlen(LINUX_KERNEL_IDENTIFIER_STR);
+    char_t versionDelimiter = *release;
+    if (versionDelimiter == CHAR_NULL || release[1] == CHAR_NULL)
+    {
+        return;
+    }
+    release++;
+
+    const char_t* versionEnd = release;
+    while (*versionEnd != versionDelimiter && *versionEnd != CHAR_NULL)
+    {
+        versionEnd++;
+    }
+    kernel->version = ArenaStoreString(arena, release, versionEnd - release);
+    kernel->release = (char_t*)release;
+    kernel->initrdName = (char_t*)FindInitrd(initrds, release);
+}
+
+/*
+* Find the initrd of a kernel release, the release has to be a whole part of the name
+* (so 6.5.2 doesnt match initrd-6.5.21.img), if there are a few (like a fallback initramfs)
+* the shortest name is used
+*/
+static const char_t* FindInitrd(const name_list_s* initrds, const char_t* release)
+{
+    const char_t* found = NULL;
+    size_t releaseLen = strlen(release);
+    for (int32_t i = 0; i < initrds->count; i++)
+    {
+        const char_t* name = initrds->names[i];
+        for (const char_t* match = strstr(name, release); match != NULL; match = strstr(match + 1, release))
+        {
+            const char_t* after = match + releaseLen;
+            boolean_t startsPart = (match != name) && !IsDigit(match[-1]);
+            boolean_t endsPart = !IsDigit(*after) && !(*after == '.' && IsDigit(after[1]));
+            if (startsPart && endsPart)
+            {
+                if (found == NULL || strlen(name) < strlen(found))
+                {
+                    found = name;
+                }
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+// Newest kernel first, there are only a few kernels in a directory so insertion sort is enough
+static void SortKernels(kernel_image_s* kernels, int32_t numOfKernels)
+{
+    for (int32_t i = 1; i < numOfKernels; i++)
+    {
+        kernel_image_s kernel = kernels[i];
+        int32_t at = i;
+        while (at > 0 && CompareVersions(kernel.release, kernels[at - 1].release) > 0)
+        {
+            kernels[at] = kernels[at - 1];
+            at--;
+        }
+        kernels[at] = kernel;
+    }
+}
+
+static boolean_t IsInitrdName(const char_t* name)
+{
+    for (size_t i = 0; i < sizeof(initrdPrefixes) / sizeof(initrdPrefixes[0]); i++)
+    {
+        if (strncmp(name, initrdPrefixes[i], strlen(initrdPrefixes[i])) == 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static inline boolean_t IsDigit(char_t c)
+{
+    return c >= '0' && c <= '9';
+}
@@ -0,0 +1,705 @@
+#include "linuxboot.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "bootphase.h"
+#include "volumes.h"
+#include "asyncread.h"
+#include "prefetch.h"
+#include "initrd.h"
+#include "decompress.h"
+#include "blockcache.h"
+#include "fileview.h"
+#include "imagecheck.h"
+#include "imagecache.h"
+
+#ifdef __x86_64__
+
+// Setup header fields, at the same offsets in the bzImage and in boot_params (the fields are read by offset)
+#define SETUP_SECTS_OFFSET (0x1f1)
+#define BOOT_FLAG_OFFSET (0x1fe)
+#define SETUP_JUMP_OFFSET (0x201) // the setup header ends 0x202 + this byte
+#define HEADER_MAGIC_OFFSET (0x202)
+#define VERSION_OFFSET (0x206)
+#define TYPE_OF_LOADER_OFFSET (0x210)
+#define CODE32_START_OFFSET (0x214)
+#define RAMDISK_IMAGE_OFFSET (0x218)
+#define RAMDISK_SIZE_OFFSET (0x21c)
+#define CMD_LINE_PTR_OFFSET (0x228)
+#define INITRD_ADDR_MAX_OFFSET (0x22c)
+#define KERNEL_ALIGNMENT_OFFSET (0x230)
+#define RELOCATABLE_KERNEL_OFFSET (0x234)
+#define XLOADFLAGS_OFFSET (0x236)
+#define CMDLINE_SIZE_OFFSET (0x238)
+#define PREF_ADDRESS_OFFSET (0x258)
+#define INIT_SIZE_OFFSET (0x260)
+
+// boot_params fields (Documentation/arch/x86/zero-page.rst)
+#define SCREEN_INFO_OFFSET (0x000)
+#define ACPI_RSDP_ADDR_OFFSET (0x070)
+#define EXT_RAMDISK_IMAGE_OFFSET (0x0c0)
+#define EXT_RAMDISK_SIZE_OFFSET (0x0c4)
+#define EXT_CMD_LINE_PTR_OFFSET (0x0c8)
+#define EFI_INFO_OFFSET (0x1c0)
+#define E820_ENTRIES_OFFSET (0x1e8)
+#define E820_TABLE_OFFSET (0x2d0)
+#define E820_ENTRY_SIZE (20) // address, size, type (packed)
+
+// screen_info fields, relative to SCREEN_INFO_OFFSET
+#define VIDEO_TYPE_OFFSET (0x0f)
+#define LFB_WIDTH_OFFSET (0x12)
+#define LFB_HEIGHT_OFFSET (0x14)
+#define LFB_DEPTH_OFFSET (0x16)
+#define LFB_BASE_OFFSET (0x18)
+#define LFB_SIZE_OFFSET (0x1c)
+#define LFB_LINELENGTH_OFFSET (0x24)
+#define LFB_COLORS_OFFSET (0x26) // size and position of red, green, blue and reserved (a byte each)
+#define CAPABILITIES_OFFSET (0x36)
+#define EXT_LFB_BASE_OFFSET (0x3a)
+
+// efi_info fields, relative to EFI_INFO_OFFSET
+#define EFI_LOADER_SIGNATURE_OFFSET (0x00)
+#define EFI_SYSTAB_OFFSET (0x04)
+#define EFI_MEMDESC_SIZE_OFFSET (0x08)
+#define EFI_MEMDESC_VERSION_OFFSET (0x0c)
+#define EFI_MEMMAP_OFFSET (0x10)
+#define EFI_MEMMAP_SIZE_OFFSET (0x14)
+#define EFI_SYSTAB_HI_OFFSET (0x18)
+#define EFI_MEMMAP_HI_OFFSET (0x1c)
+
+#define SECTOR_SIZE (512)
+#define DEFAULT_SETUP_SECTS (4) // a setup_sects of 0 means 4
+#define BOOT_FLAG (0xAA55)
+#define HEADER_MAGIC (0x53726448) // "HdrS"
+#define XLF_KERNEL_64 (1 << 0)
+#define XLF_CAN_BE_LOADED_ABOVE_4G (1 << 1)
+#define LOADER_TYPE_UNDEFINED (0xff)
+#define KERNEL_64_ENTRY_OFFSET (0x200) // startup_64 is 512 bytes into the protected mode kernel
+#define EFI_LOADER_SIGNATURE ("EL64")
+#define VIDEO_TYPE_EFI (0x70)
+#define VIDEO_CAPABILITY_64BIT_BASE (1 << 1)
+
+#define E820_TYPE_RAM (1)
+#define E820_TYPE_RESERVED (2)
+#define E820_TYPE_ACPI (3)
+#define E820_TYPE_NVS (4)
+#define E820_TYPE_PMEM (7)
+
+#define BELOW_4G (0xffffffffULL)
+#define MEMORY_MAP_SLACK (8) // descriptors, the map grows when its own buffer is allocated
+
+// The segments the kernel expects: __BOOT_CS (0x10) and __BOOT_DS (0x18), flat
+#define BOOT_CS (0x10)
+static const uint64_t bootGdt[] = { 0, 0, 0x00af9a000000ffffULL, 0x00cf92000000ffffULL };
+
+typedef struct linux_kernel_s{
+    uint8_t header[LINUX_SETUP_HEADER_READ_SIZE]; // the first sectors of the bzImage
+    uint64_t setupSize; // the real mode part, the protected mode kernel is right after it
+    uint64_t kernelSize;
+    efi_physical_address_t address; // of the protected mode kernel
+    uint64_t pages;
+} linux_kernel_s;
+
+static boolean_t IsKernelCompressed(file_view_s* view);
+static boolean_t ReadSetupHeader(linux_kernel_s* kernel, file_view_s* view, const char_t* prefetched,
+    uint64_t fileSize, const char_t* path);
+static boolean_t AllocateKernel(linux_kernel_s* kernel);
+static boolean_t ReadKernel(linux_kernel_s* kernel, efi_file_handle_t* file, efi_handle_t volume,
+    const char_t* prefetched, const char_t* path);
+static uint8_t* SetupBootParams(const linux_kernel_s* kernel, const char_t* args, uint64_t* pages);
+static void SetupFramebuffer(uint8_t* bootParams);
+static void SetupAcpi(uint8_t* bootParams);
+static efi_status_t ExitToKernel(const linux_kernel_s* kernel, uint8_t* bootParams);
+static void ConvertMemoryMap(uint8_t* bootParams, const uint8_t* memoryMap, uintn_t mapSize, uintn_t descSize);
+static uint32_t GetE820Type(uint32_t efiType);
+static void JumpToKernel(uint64_t entry, uint8_t* bootParams);
+
+static inline uint16_t Get16(const uint8_t* at);
+static inline uint32_t Get32(const uint8_t* at);
+static inline uint64_t Get64(const uint8_t* at);
+static inline void Put16(uint8_t* at, uint16_t value);
+static inline void Put32(uint8_t* at, uint32_t value);
+static inline void Put64(uint8_t* at, uint64_t value);
+
+/*
+* Boot a bzImage without the firmware loader, the function only returns if the kernel can't be booted
+* The kernel is read straight to its preferred address (an aligned one if that is taken and it is relocatable),
+* the initrd= files of args are read below the address limit of the kernel
+* A kernel the menu prefetched is copied from memory, a compressed one is decompressed first
+* (and kept in the image cache, like a prefetched one, so a boot of it again in the session doesn't read it)
+* A kernel pinned to a digest (sha256 isn't NULL) is read whole and verified first, it isn't booted unless it matches
+*/
+void BootLinux(const char_t* path, const char_t* args, const char_t* volume, const char_t* sha256)
+{
+    linux_kernel_s kernel;
+    memset(&kernel, 0, sizeof(linux_kernel_s));
+    efi_file_handle_t* file = NULL;
+    file_view_s headerView; // the first window of the file, for the checks of its header
+    memset(&headerView, 0, sizeof(file_view_s));
+    uint8_t* bootParams = NULL;
+    uint64_t bootParamsPages = 0;
+    char_t* initrd = NULL;
+    uint64_t initrdSize = 0;
+    initrd_list_s initrds;
+    memset(&initrds, 0, sizeof(initrd_list_s));
+
+    efi_handle_t volumeHandle = GetFileDeviceHandle((char_t*)path, volume);
+    if(volumeHandle == NULL)
+    {
+        Log(LL_ERROR, 0, "Unable to find the volume of the kernel '%s'.", path);
+        CancelPrefetch();
+        return;
+    }
+
+    uint64_t fileSize = 0;
+    image_key_s imageKey;
+    char_t* prefetched = TakePrefetchedFile(path, &fileSize, sha256);
+    if(prefetched == NULL)
+    {
+        efi_file_info_t info;
+        file = OpenVolumeFile(volumeHandle, path);
+        if(file == NULL || EFI_ERROR(GetFileInfo(file, &info)))
+        {
+            Log(LL_ERROR, 0, "Failed to open the kernel '%s'.", path);
+            goto cleanup;
+        }
+        fileSize = info.FileSize;
+        SetImageKey(&imageKey, volumeHandle, path, &info, sha256);
+        prefetched = AcquireCachedImage(&imageKey, &fileSize);
+    }
+    if(prefetched == NULL)
+    {
+        AttachFileView(&headerView, file, fileSize);
+        // a broken kernel is rejected before any of the rest of it is read (a pinned or compressed one is read whole)
+        char_t reason[IMAGE_CHECK_REASON_LEN];
+        if(!CheckImageHeaders(&headerView, TRUE, reason))
+        {
+            Log(LL_ERROR, 0, "'%s' can't be booted: %s.", path, reason);
+            goto cleanup;
+        }
+        // it is then booted like a prefetched one
+        if(sha256 != NULL || IsKernelCompressed(&headerView))
+        {
+            image_verify_s verify;
+            if(sha256 != NULL && !BeginImageVerify(&verify, sha256, volume, path, file))
+            {
+                goto cleanup;
+            }
+            prefetched = ReadImageFile(file, volumeHandle, fileSize, &fileSize, path,
+                (sha256 != NULL) ? &verify : NULL);
+            if(prefetched == NULL)
+            {
+                goto cleanup;
+            }
+            CacheImage(&imageKey, prefetched, fileSize);
+        }
+    }
+
+    boot_phase_t phase = BeginBootPhase("load", path);
+    boolean_t loaded = ReadSetupHeader(&kernel, &headerView, prefetched, fileSize, path);
+    ReleaseFileView(&headerView);
+    loaded = loaded && AllocateKernel(&kernel) && ReadKernel(&kernel, file, volumeHandle, prefetched, path);
+    EndBootPhase(phase);
+    if(!loaded)
+    {
+        goto cleanup;
+    }
+
+    uint16_t xloadflags = Get16(kernel.header + XLOADFLAGS_OFFSET);
+    if(GetInitrdPaths(args, &initrds))
+    {
+        // the kernel can't read the initrd= files itself without its EFI stub
+        efi_physical_address_t maxAddress = (xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G) ?
+            0 : Get32(kernel.header + INITRD_ADDR_MAX_OFFSET);
+        phase = BeginBootPhase("initrd", NULL);
+        initrd = ReadInitrds(&initrds, volumeHandle, maxAddress, &initrdSize);
+        EndBootPhase(phase);
+        if(initrd == NULL)
+        {
+            Log(LL_ERROR, 0, "Failed to read the initrds of '%s'.", path);
+            goto cleanup;
+        }
+    }
+    else if(args != NULL && strstr(args, INITRD_ARG_PREFIX) != NULL)
+    {
+        Log(LL_ERROR, 0, "The initrds of '%s' can't be read (up to %d are supported).", path, INITRD_MAX_FILES);
+        goto cleanup;
+    }
+
+    bootParams = SetupBootParams(&kernel, (args != NULL) ? args : "", &bootParamsPages);
+    if(bootParams == NULL)
+    {
+        goto cleanup;
+    }
+    uint64_t initrdAddress = (uint64_t)(uintn_t)initrd;
+    Put32(bootParams + RAMDISK_IMAGE_OFFSET, (uint32_t)initrdAddress);
+    Put32(bootParams + RAMDISK_SIZE_OFFSET, (uint32_t)initrdSize);
+    Put32(bootParams + EXT_RAMDISK_IMAGE_OFFSET, (uint32_t)(initrdAddress >> 32));
+    Put32(bootParams + EXT_RAMDISK_SIZE_OFFSET, (uint32_t)(initrdSize >> 32));
+
+    // nothing can be freed after ExitBootServices
+    ReleaseImage(prefetched);
+    prefetched = NULL;
+    TrimImageCache();
+    if(file != NULL)
+    {
+        file->Close(file);
+        file = NULL;
+    }
+    FreeInitrdPaths(&initrds);
+    CancelPrefetch();
+
+    Log(LL_INFO, 0, "Booting the kernel '%s' at 0x%x (%d bytes, %d bytes of initrds)", path, kernel.address,
+        kernel.kernelSize, initrdSize);
+    LogBootTimeline();
+    LogBlockCacheStats();
+    LogImageCacheStats();
+    FlushLog();
+    MarkBootPhase("exit-boot-services");
+    efi_status_t status = ExitToKernel(&kernel, bootParams);
+    Log(LL_ERROR, status, "Failed to exit boot services for the kernel '%s'.", path);
+
+cleanup:
+    if(bootParams != NULL)
+    {
+        BS->FreePages((efi_physical_address_t)(uintn_t)bootParams, bootParamsPages);
+    }
+    if(initrd != NULL)
+    {
+        BS->FreePages((efi_physical_address_t)(uintn_t)initrd, EFI_SIZE_TO_PAGES(initrdSize));
+    }
+    if(kernel.pages != 0)
+    {
+        BS->FreePages(kernel.address, kernel.pages);
+    }
+    CloseFileView(&headerView);
+    if(file != NULL)
+    {
+        file->Close(file);
+    }
+    FreeInitrdPaths(&initrds);
+    ReleaseImage(prefetched);
+    CancelPrefetch();
+}
+
+// The kernel is a gzip, zstd or LZ4 stream (a bzImage starts with its setup sectors)
+static boolean_t IsKernelCompressed(file_view_s* view)
+{
+    uint64_t size = 0;
+    const char_t* header = MapFileView(view, 0, &size);
+    compressed_stream_s source;
+    return header != NULL && DetectCompression((const uint8_t*)header, size, view->fileSize, &source);
+}
+
+// Read the first sectors of the bzImage and check it can be booted with the 64-bit boot protocol
+static boolean_t ReadSetupHeader(linux_kernel_s* kernel, file_view_s* view, const char_t* prefetched,
+    uint64_t fileSize, const char_t* path)
+{
+    if(fileSize < LINUX_SETUP_HEADER_READ_SIZE)
+    {
+        Log(LL_ERROR, 0, "'%s' is too small to be a bzImage.", path);
+        return FALSE;
+    }
+    if(prefetched != NULL)
+    {
+        memcpy(kernel->header, prefetched, LINUX_SETUP_HEADER_READ_SIZE);
+    }
+    else if(ReadFileView(view, 0, kernel->header, LINUX_SETUP_HEADER_READ_SIZE) != LINUX_SETUP_HEADER_READ_SIZE)
+    {
+        Log(LL_ERROR, 0, "Failed to read the setup header of '%s'.", path);
+        return FALSE;
+    }
+
+    if(Get16(kernel->header + BOOT_FLAG_OFFSET) != BOOT_FLAG || Get32(kernel->header + HEADER_MAGIC_OFFSET) != HEADER_MAGIC)
+    {
+        Log(LL_ERROR, 0, "'%s' is not a bzImage.", path);
+        return FALSE;
+    }
+    uint16_t version = Get16(kernel->header + VERSION_OFFSET);
+    if(version < LINUX_MIN_BOOT_PROTOCOL || !(Get16(kernel->header + XLOADFLAGS_OFFSET) & XLF_KERNEL_64))
+    {
+        Log(LL_ERROR, 0, "'%s' has no 64-bit entry point (boot protocol 0x%x).", path, version);
+        return FALSE;
+    }
+
+    uint64_t setupSects = kernel->header[SETUP_SECTS_OFFSET];
+    if(setupSects == 0)
+    {
+        setupSects = DEFAULT_SETUP_SECTS;
+    }
+    kernel->setupSize = (setupSects + 1) * SECTOR_SIZE;
+    if(kernel->setupSize >= fileSize)
+    {
+        Log(LL_ERROR, 0, "'%s' has no protected mode kernel.", path);
+        return FALSE;
+    }
+    kernel->kernelSize = fileSize - kernel->setupSize;
+    return TRUE;
+}
+
+/*
+* Get the pages of the kernel, at its preferred address if they are free
+* A relocatable kernel goes anywhere on its alignment otherwise (below 4G, unless it can be loaded above it)
+*/
+static boolean_t AllocateKernel(linux_kernel_s* kernel)
+{
+    uint64_t initSize = Get32(kernel->header + INIT_SIZE_OFFSET);
+    uint64_t size = (initSize > kernel->kernelSize) ? initSize : kernel->kernelSize;
+    kernel->pages = EFI_SIZE_TO_PAGES(size);
+
+    kernel->address = Get64(kernel->header + PREF_ADDRESS_OFFSET);
+    efi_status_t status = BS->AllocatePages(AllocateAddress, EfiLoaderData, kernel->pages, &kernel->address);
+    if(!EFI_ERROR(status))
+    {
+        return TRUE;
+    }
+    if(!kernel->header[RELOCATABLE_KERNEL_OFFSET])
+    {
+        Log(LL_ERROR, status, "The preferred address 0x%x of the kernel is taken.", kernel->address);
+        kernel->pages = 0;
+        return FALSE;
+    }
+
+    // allocate an alignment more than needed, and free what is before and after the aligned kernel
+    uint64_t alignment = Get32(kernel->header + KERNEL_ALIGNMENT_OFFSET);
+    if(alignment < EFI_PAGE_SIZE)
+    {
+        alignment = EFI_PAGE_SIZE;
+    }
+    uint64_t alignmentPages = EFI_SIZE_TO_PAGES(alignment);
+    boolean_t above4G = (Get16(kernel->header + XLOADFLAGS_OFFSET) & XLF_CAN_BE_LOADED_ABOVE_4G) != 0;
+    efi_physical_address_t address = BELOW_4G;
+    status = BS->AllocatePages(above4G ? AllocateAnyPages : AllocateMaxAddress, EfiLoaderData,
+        kernel->pages + alignmentPages, &address);
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to allocate %d bytes for the kernel.", size);
+        kernel->pages = 0;
+        return FALSE;
+    }
+    kernel->address = (address + alignment - 1) & ~(alignment - 1);
+    uint64_t headPages = (kernel->address - address) / EFI_PAGE_SIZE;
+    if(headPages != 0)
+    {
+        BS->FreePages(address, headPages);
+    }
+    if(alignmentPages - headPages != 0)
+    {
+        BS->FreePages(kernel->address + kernel->pages * EFI_PAGE_SIZE, alignmentPages - headPages);
+    }
+    return TRUE;
+}
+
+// Read the protected mode kernel into its pages
+static boolean_t ReadKernel(linux_kernel_s* kernel, efi_file_handle_t* file, efi_handle_t volume,
+    const char_t* prefetched, const char_t* path)
+{
+    char_t* destination = (char_t*)(uintn_t)kernel->address;
+    if(prefetched != NULL)
+    {
+        memcpy(destination, prefetched + kernel->setupSize, kernel->kernelSize);
+        return TRUE;
+    }
+    async_read_s read;
+    BeginAsyncReadAt(&read, file, kernel->setupSize, destination, kernel->kernelSize);
+    SetAsyncReadVolume(&read, volume);
+    efi_status_t status = FinishAsyncRead(&read);
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to read the kernel.");
+        return FALSE;
+    }
+    LogAsyncRead(&read, path);
+    return TRUE;
+}
+
+/*
+* Build the zero page: the setup header of the kernel, the command line (right after the page), the framebuffer
+* and the ACPI tables, below 4G since the command line pointer is 32-bit for older kernels
+* The initrd and the memory map are filled in by the caller
+*/
+static uint8_t* SetupBootParams(const linux_kernel_s* kernel, const char_t* args, uint64_t* pages)
+{
+    size_t argsLen = strlen(args);
+    uint32_t cmdlineSize = Get32(kernel->header + CMDLINE_SIZE_OFFSET);
+    if(argsLen > cmdlineSize)
+    {
+        Log(LL_ERROR, 0, "The command line is %d chars long, the kernel takes up to %d.", argsLen, cmdlineSize);
+        return NULL;
+    }
+
+    efi_physical_address_t address = BELOW_4G;
+    *pages = EFI_SIZE_TO_PAGES(LINUX_BOOT_PARAMS_SIZE + argsLen + 1);
+    efi_status_t status = BS->AllocatePages(AllocateMaxAddress, EfiLoaderData, *pages, &address);
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Failed to allocate the boot params.");
+        return NULL;
+    }
+    uint8_t* bootParams = (uint8_t*)(uintn_t)address;
+    memset(bootParams, 0, LINUX_BOOT_PARAMS_SIZE);
+    uint64_t headerEnd = HEADER_MAGIC_OFFSET + kernel->header[SETUP_JUMP_OFFSET];
+    memcpy(bootParams + SETUP_SECTS_OFFSET, kernel->header + SETUP_SECTS_OFFSET, headerEnd - SETUP_SECTS_OFFSET);
+
+    char_t* cmdline = (char_t*)bootParams + LINUX_BOOT_PARAMS_SIZE;
+    memcpy(cmdline, args, argsLen);
+    cmdline[argsLen] = CHAR_NULL;
+
+    bootParams[TYPE_OF_LOADER_OFFSET] = LOADER_TYPE_UNDEFINED;
+    Put32(bootParams + CODE32_START_OFFSET, (uint32_t)kernel->address);
+    Put32(bootParams + CMD_LINE_PTR_OFFSET, (uint32_t)(uintn_t)cmdline);
+    Put32(bootParams + EXT_CMD_LINE_PTR_OFFSET, 0);
+    SetupFramebuffer(bootParams);
+    SetupAcpi(bootParams);
+    return bootParams;
+}
+
+// Pass the GOP framebuffer as an EFI framebuffer, the kernel has no console without it until its drivers load
+static void SetupFramebuffer(uint8_t* bootParams)
+{
+    efi_guid_t gopGuid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+    efi_gop_t* gop = NULL;
+    if(EFI_ERROR(BS->LocateProtocol(&gopGuid, NULL, (void**)&gop)) || gop->Mode == NULL || gop->Mode->Information == NULL)
+    {
+        return;
+    }
+    efi_gop_mode_info_t* info = gop->Mode->Information;
+    uint8_t redPosition, bluePosition;
+    if(info->PixelFormat == PixelRedGreenBlueReserved8BitPerColor)
+    {
+        redPosition = 0;
+        bluePosition = 16;
+    }
+    else if(info->PixelFormat == PixelBlueGreenRedReserved8BitPerColor)
+    {
+        redPosition = 16;
+        bluePosition = 0;
+    }
+    else
+    {
+        Log(LL_WARNING, 0, "The framebuffer has no 32-bit pixel format, it isn't passed to the kernel");
+        return;
+    }
+
+    uint8_t* screenInfo = bootParams + SCREEN_INFO_OFFSET;
+    uint64_t base = gop->Mode->FrameBufferBase;
+    const uint8_t colors[8] = { 8, redPosition, 8, 8, 8, bluePosition, 8, 24 };
+    screenInfo[VIDEO_TYPE_OFFSET] = VIDEO_TYPE_EFI;
+    Put16(screenInfo + LFB_WIDTH_OFFSET, (uint16_t)info->HorizontalResolution);
+    Put16(screenInfo + LFB_HEIGHT_OFFSET, (uint16_t)info->VerticalResolution);
+    Put16(screenInfo + LFB_DEPTH_OFFSET, 32);
+    Put32(screenInfo + LFB_BASE_OFFSET, (uint32_t)base);
+    Put32(screenInfo + LFB_SIZE_OFFSET, (uint32_t)gop->Mode->FrameBufferSize);
+    Put16(screenInfo + LFB_LINELENGTH_OFFSET, (uint16_t)(info->PixelsPerScanLine * 4));
+    memcpy(screenInfo + LFB_COLORS_OFFSET, colors, sizeof(colors));
+    if((base >> 32) != 0)
+    {
+        Put32(screenInfo + CAPABILITIES_OFFSET, VIDEO_CAPABILITY_64BIT_BASE);
+        Put32(screenInfo + EXT_LFB_BASE_OFFSET, (uint32_t)(base >> 32));
+    }
+}
+
+// The kernel finds the RSDP itself through the system table, this saves it the search
+static void SetupAcpi(uint8_t* bootParams)
+{
+    efi_guid_t acpiGuid = ACPI_20_TABLE_GUID;
+    for(uintn_t i = 0; i < ST->NumberOfTableEntries; i++)
+    {
+        if(memcmp(&ST->ConfigurationTable[i].VendorGuid, &acpiGuid, sizeof(efi_guid_t)) == 0)
+        {
+            Put64(bootParams + ACPI_RSDP_ADDR_OFFSET, (uint64_t)(uintn_t)ST->ConfigurationTable[i].VendorTable);
+            return;
+        }
+    }
+}
+
+/*
+* Exit boot services with the final memory map, pass it to the kernel (as e820 and as the EFI memory map) and jump
+* Only returns if boot services couldn't be exited, the map key is retried once (it changes if an event allocated)
+*/
+static efi_status_t ExitToKernel(const linux_kernel_s* kernel, uint8_t* bootParams)
+{
+    uintn_t mapSize = 0;
+    uintn_t mapKey = 0;
+    uintn_t descSize = 0;
+    uint32_t descVersion = 0;
+    efi_status_t status = BS->GetMemoryMap(&mapSize, NULL, &mapKey, &descSize, &descVersion);
+    if(status != EFI_BUFFER_TOO_SMALL)
+    {
+        return status;
+    }
+    uint64_t bufferSize = mapSize + MEMORY_MAP_SLACK * descSize;
+    efi_physical_address_t address = 0;
+    status = BS->AllocatePages(AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(bufferSize), &address);
+    if(EFI_ERROR(status))
+    {
+        return status;
+    }
+    uint8_t* memoryMap = (uint8_t*)(uintn_t)address;
+
+    // nothing that allocates can be called between GetMemoryMap and ExitBootServices
+    for(int32_t attempt = 0; attempt < 2; attempt++)
+    {
+        mapSize = bufferSize;
+        status = BS->GetMemoryMap(&mapSize, (efi_memory_descriptor_t*)memoryMap, &mapKey, &descSize, &descVersion);
+        if(EFI_ERROR(status))
+        {
+            break;
+        }
+        status = BS->ExitBootServices(IM, mapKey);
+        if(!EFI_ERROR(status))
+        {
+            break;
+        }
+    }
+    if(EFI_ERROR(status))
+    {
+        BS->FreePages(address, EFI_SIZE_TO_PAGES(bufferSize));
+        return status;
+    }
+
+    ConvertMemoryMap(bootParams, memoryMap, mapSize, descSize);
+    uint8_t* efiInfo = bootParams + EFI_INFO_OFFSET;
+    memcpy(efiInfo + EFI_LOADER_SIGNATURE_OFFSET, EFI_LOADER_SIGNATURE, 4);
+    Put32(efiInfo + EFI_SYSTAB_OFFSET, (uint32_t)(uintn_t)ST);
+    Put32(efiInfo + EFI_SYSTAB_HI_OFFSET, (uint32_t)((uint64_t)(uintn_t)ST >> 32));
+    Put32(efiInfo + EFI_MEMDESC_SIZE_OFFSET, (uint32_t)descSize);
+    Put32(efiInfo + EFI_MEMDESC_VERSION_OFFSET, descVersion);
+    Put32(efiInfo + EFI_MEMMAP_OFFSET, (uint32_t)address);
+    Put32(efiInfo + EFI_MEMMAP_HI_OFFSET, (uint32_t)(address >> 32));
+    Put32(efiInfo + EFI_MEMMAP_SIZE_OFFSET, (uint32_t)mapSize);
+
+    JumpToKernel(kernel->address + KERNEL_64_ENTRY_OFFSET, bootParams);
+    return EFI_SUCCESS; // never gets here
+}
+
+/*
+* Fill the e820 table from the EFI memory map, ranges of the same type that follow each other are merged
+* (the way the EFI stub of the kernel maps the types), ranges past the end of the table are dropped
+*/
+static void ConvertMemoryMap(uint8_t* bootParams, const uint8_t* memoryMap, uintn_t mapSize, uintn_t descSize)
+{
+    uint8_t* table = bootParams + E820_TABLE_OFFSET;
+    int32_t numOfEntries = 0;
+    uint64_t lastEnd = 0;
+    uint32_t lastType = 0;
+    for(uintn_t offset = 0; offset + descSize <= mapSize; offset += descSize)
+    {
+        const efi_memory_descriptor_t* desc = (const efi_memory_descriptor_t*)(memoryMap + offset);
+        uint32_t type = GetE820Type(desc->Type);
+        uint64_t size = desc->NumberOfPages * EFI_PAGE_SIZE;
+        if(numOfEntries > 0 && type == lastType && desc->PhysicalStart == lastEnd)
+        {
+            uint8_t* entry = table + (numOfEntries - 1) * E820_ENTRY_SIZE;
+            Put64(entry + 8, Get64(entry + 8) + size);
+        }
+        else if(numOfEntries < LINUX_E820_MAX_ENTRIES)
+        {
+            uint8_t* entry = table + numOfEntries * E820_ENTRY_SIZE;
+            Put64(entry, desc->PhysicalStart);
+            Put64(entry + 8, size);
+            Put32(entry + 16, type);
+            numOfEntries++;
+        }
+        else
+        {
+            continue;
+        }
+        lastEnd = desc->PhysicalStart + size;
+        lastType = type;
+    }
+    bootParams[E820_ENTRIES_OFFSET] = (uint8_t)numOfEntries;
+}
+
+static uint32_t GetE820Type(uint32_t efiType)
+{
+    switch (efiType)
+    {
+    case EfiLoaderCode:
+    case EfiLoaderData:
+    case EfiBootServicesCode:
+    case EfiBootServicesData:
+    case EfiConventionalMemory:
+        return E820_TYPE_RAM;
+    case EfiACPIReclaimMemory:
+        return E820_TYPE_ACPI;
+    case EfiACPIMemoryNVS:
+        return E820_TYPE_NVS;
+    case EfiPersistentMemory:
+        return E820_TYPE_PMEM;
+    default:
+        return E820_TYPE_RESERVED;
+    }
+}
+
+/*
+* The 64-bit entry of the boot protocol: the identity mapping of the firmware, a GDT with __BOOT_CS and __BOOT_DS,
+* interrupts off and boot_params in rsi
+*/
+static void JumpToKernel(uint64_t entry, uint8_t* bootParams)
+{
+    uint8_t gdtr[10]; // limit and base
+    Put16(gdtr, sizeof(bootGdt) - 1);
+    Put64(gdtr + 2, (uint64_t)(uintn_t)bootGdt);
+    __asm__ __volatile__(
+        "cli\n\t"
+        "lgdt (%0)\n\t"
+        "movl $0x18, %%eax\n\t"
+        "movl %%eax, %%ds\n\t"
+        "movl %%eax, %%es\n\t"
+        "movl %%eax, %%ss\n\t"
+        "movl %%eax, %%fs\n\t"
+        "movl %%eax, %%gs\n\t"
+        "pushq %1\n\t"
+        "pushq %2\n\t"
+        "lretq\n\t"
+        :
+        : "r"(gdtr), "i"(BOOT_CS), "r"(entry), "S"(bootParams)
+        : "rax", "memory");
+    __builtin_unreachable();
+}
+
+static inline uint16_t Get16(const uint8_t* at)
+{
+    uint16_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static inline uint32_t Get32(const uint8_t* at)
+{
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Get64(const uint8_t* at)
+{
+    uint64_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static inline void Put16(uint8_t* at, uint16_t value)
+{
+    memcpy(at, &value, sizeof(value));
+}
+
+static inline void Put32(uint8_t* at, uint32_t value)
+{
+    memcpy(at, &value, sizeof(value));
+}
+
+static inline void Put64(uint8_t* at, uint64_t value)
+{
+    memcpy(at, &value, sizeof(value));
+}
+
+#else
+
+void BootLinux(const char_t* path, const char_t* args, const char_t* volume, const char_t* sha256)
+{
+    Log(LL_ERROR, 0, "'%s' can't be booted, the linux boot protocol is only supported on x86_64.", path);
+    CancelPrefetch();
+}
+
+#endif
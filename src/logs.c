@@ -1,20 +1,35 @@
 #include "logs.h"
 #include "shellutils.h"
+#include "bootutils.h"
+#include "clock.h"
+#include "console.h"
 
 #define THAT_LOADER_NAME_STR "ThatLoader"
 
 #define LOG_PATH ("\\EFI\\thatloader\\log.txt")
 #define OLD_LOG_PATH ("\\EFI\\thatloader\\log.txt.old")
 
-#define SECONDS_IN_DAY (86400)
-#define SECONDS_IN_HOUR (3600)
-#define SECONDS_IN_MINUTE (60)
+#define MICROSECONDS_IN_SECOND (1000000)
+#define MICROSECONDS_IN_MILLISECOND (1000)
+
+#define LOG_MAX_LINE_LEN (512) // longer messages are truncated
+#define LOG_DROPPED_FMT ("[%d bytes of the log were dropped, the log buffer was full]\n")
 
 static efi_time_t timeSinceInit = {0};
 
+// Messages are formatted into a ring buffer and written to the log file in one batch by FlushLog
+// logWritten and logFlushed count every byte since init, so the buffer position is (count % LOG_BUFFER_SIZE)
+static char_t logBuffer[LOG_BUFFER_SIZE];
+static uint64_t logWritten = 0;
+static uint64_t logFlushed = 0;
+static boolean_t logFileAvailable = FALSE;
+
+static void AppendToLogBuffer(const char_t* str, uint64_t len);
+static void WriteLogBuffer(FILE* file, uint64_t from, uint64_t to);
+
 // Init log file
 // create an empty logfile, and init timeSinceInit var
-// return 1 on success, 0 on failure
+// return 1 on success, 0 on failure (the messages are still kept in memory)
 int8_t InitLogger(void){
     // if a logfile already exists, save it as old log
     FILE* fp = fopen(LOG_PATH, "r");
@@ -23,18 +38,19 @@ int8_t InitLogger(void){
         fclose(fp);
         CopyFile(LOG_PATH, OLD_LOG_PATH);
     }
+    RT->GetTime(&timeSinceInit, NULL);
+
+    // Print the date of the log and boot maganger's name
+    Log(LL_INFO, 0, "Starting %s", THAT_LOADER_NAME_STR);
+    Log(LL_INFO, 0, "Log date: %02d/%02d/%04d %02d:%02d:%02d",
+    timeSinceInit.Day, timeSinceInit.Month, timeSinceInit.Year, 
+    timeSinceInit.Hour, timeSinceInit.Minute, timeSinceInit.Second);
+
     fp = fopen(LOG_PATH, "w");
     if (fp != NULL)
     {
         fclose(fp);
-        RT->GetTime(&timeSinceInit, NULL);
-
-        // Print the date of the log and boot maganger's name
-        Log(LL_INFO, 0, "Starting %s", THAT_LOADER_NAME_STR);
-        Log(LL_INFO, 0, "Log date: %02d/%02d/%04d %02d:%02d:%02d",
-        timeSinceInit.Day, timeSinceInit.Month, timeSinceInit.Year, 
-        timeSinceInit.Hour, timeSinceInit.Minute, timeSinceInit.Second);
-
+        logFileAvailable = TRUE;
         return 1;
     }
 
@@ -44,61 +60,129 @@ int8_t InitLogger(void){
 
 /*
 
-*   Log (write logs) to log file  
+*   Log (write logs) to the log buffer, it gets to the log file on the next FlushLog
     va_args (the ...) are for string formatting
     status parameter is optinal and can be set to 0
 */
 void Log(log_level_t loglevel, efi_status_t status, const char_t* fmtMessage, ...)
 {
-    FILE* log = fopen(LOG_PATH, "a"); // append to file
-    // Dont write to file if the logger has not been initialized or is unaccessible
-    if( log == NULL || timeSinceInit.Day == 0)
+    // Dont log if the logger has not been initialized
+    if(timeSinceInit.Day == 0)
     {
         return;
     }
-    fprintf(log, "[%04ds] [%s] ", GetSecondsSinceInit(), LogLevelString(loglevel));
-    
+    char_t line[LOG_MAX_LINE_LEN];
+    uint64_t timeUs = GetMicrosecondsSinceInit();
+    snprintf(line, LOG_MAX_LINE_LEN, "[%04d.%03ds] [%s] ", (int32_t)(timeUs / MICROSECONDS_IN_SECOND),
+        (int32_t)(timeUs % MICROSECONDS_IN_SECOND / MICROSECONDS_IN_MILLISECOND), LogLevelString(loglevel));
+    size_t len = strlen(line);
 
     // print the string and add formatting (if there is any)
     va_list args;
     va_start(args, fmtMessage);
-    vfprintf(log, fmtMessage, args);
+    vsnprintf(line + len, LOG_MAX_LINE_LEN - len, fmtMessage, args);
     va_end(args);
+    len += strlen(line + len);
 
     // Append UEFI error message if the status argument is an error status
     if (EFI_ERROR(status))
     {
-        fprintf(log, " (EFI Error: %s)\n", EfiErrorString(status));
+        snprintf(line + len, LOG_MAX_LINE_LEN - len, " (EFI Error: %s)", EfiErrorString(status));
+        len += strlen(line + len);
+    }
+    AppendToLogBuffer(line, len);
+    AppendToLogBuffer("\n", 1);
+}
+
+/*
+* Write the messages that were logged since the last flush to the log file
+* Called before control leaves the boot manager (StartImage, reset) and where the user may leave
+* the machine (fail menu, shell exit), messages that were dropped because the buffer was full are noted
+*/
+void FlushLog(void)
+{
+    if(!logFileAvailable || logFlushed == logWritten)
+    {
+        return;
+    }
+    FILE* log = fopen(LOG_PATH, "a");
+    if(log == NULL)
+    {
+        return;
+    }
+    if(logWritten - logFlushed > LOG_BUFFER_SIZE)
+    {
+        fprintf(log, LOG_DROPPED_FMT, (int32_t)(logWritten - logFlushed - LOG_BUFFER_SIZE));
+        logFlushed = logWritten - LOG_BUFFER_SIZE;
     }
+    WriteLogBuffer(log, logFlushed, logWritten);
     fclose(log);
-    
+    logFlushed = logWritten;
 }
 
-// literally just get the seconds since the initation
-time_t GetSecondsSinceInit(void)
+// Copy to the ring buffer, overwriting the oldest bytes when it is full
+static void AppendToLogBuffer(const char_t* str, uint64_t len)
+{
+    while(len > 0)
+    {
+        uint64_t pos = logWritten % LOG_BUFFER_SIZE;
+        uint64_t chunk = LOG_BUFFER_SIZE - pos;
+        if(chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(logBuffer + pos, str, chunk);
+        logWritten += chunk;
+        str += chunk;
+        len -= chunk;
+    }
+}
+
+// Write the bytes [from, to) of the log (still in the buffer) to a file, it takes two writes if they wrap around
+static void WriteLogBuffer(FILE* file, uint64_t from, uint64_t to)
 {
-    efi_time_t currTime = {0};
-    efi_status_t status = RT->GetTime(&currTime, NULL);
-    if(EFI_ERROR(status))
+    while(from < to)
     {
-        return 0;
+        uint64_t pos = from % LOG_BUFFER_SIZE;
+        uint64_t chunk = LOG_BUFFER_SIZE - pos;
+        if(chunk > to - from)
+        {
+            chunk = to - from;
+        }
+        fwrite(logBuffer + pos, 1, chunk, file);
+        from += chunk;
     }
-    time_t seconds = 0;
-    seconds += (currTime.Day - timeSinceInit.Day) * SECONDS_IN_DAY;
-    seconds += (currTime.Hour - timeSinceInit.Hour) * SECONDS_IN_HOUR;
-    seconds += (currTime.Minute - timeSinceInit.Minute) * SECONDS_IN_MINUTE;
-    seconds += currTime.Second - timeSinceInit.Second;   
-    return seconds;
 }
 
-// Print the log file
+// Seconds since the clock was initialized (monotonic, see clock.h)
+time_t GetSecondsSinceInit(void)
+{
+    return GetMicrosecondsSinceInit() / MICROSECONDS_IN_SECOND;
+}
+
+// Print the log of this boot, straight from the log buffer
 void PrintLogFile(void)
 {
-    uint8_t res = PrintFileContent(LOG_PATH);
-    if (res != 0)
+    uint64_t from = 0;
+    if(logWritten > LOG_BUFFER_SIZE)
+    {
+        from = logWritten - LOG_BUFFER_SIZE;
+        printf("[Showing the last %d bytes of the log, see %s for the rest]\n", LOG_BUFFER_SIZE, LOG_PATH);
+    }
+    BeginConsoleFrame();
+    while(from < logWritten)
     {
-        printf("Failed to open log file\n");
+        uint64_t pos = from % LOG_BUFFER_SIZE;
+        uint64_t chunk = LOG_BUFFER_SIZE - pos;
+        if(chunk > logWritten - from)
+        {
+            chunk = logWritten - from;
+        }
+        ConsoleWrite(logBuffer + pos, chunk);
+        from += chunk;
     }
+    ConsoleWrite("\n", 1);
+    EndConsoleFrame();
 }
 
 const char_t* LogLevelString(log_level_t loglevel)
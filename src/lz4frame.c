@@ -0,0 +1,248 @@
+#include "decoders.h"
+#include "bootutils.h"
+
+// LZ4 frame format (lz4_Frame_format.md)
+#define LZ4_FRAME_MAGIC (0x184D2204)
+#define LZ4_LEGACY_MAGIC (0x184C2102)
+#define LZ4_MAGIC_SIZE (4)
+#define LZ4_FLAG_VERSION_MASK (0xC0)
+#define LZ4_FLAG_VERSION (0x40)
+#define LZ4_FLAG_BLOCK_CHECKSUM (1 << 4)
+#define LZ4_FLAG_CONTENT_SIZE (1 << 3)
+#define LZ4_FLAG_CONTENT_CHECKSUM (1 << 2)
+#define LZ4_FLAG_DICT_ID (1 << 0)
+#define LZ4_BLOCK_UNCOMPRESSED (0x80000000)
+#define LZ4_CHECKSUM_SIZE (4)
+
+#define LZ4_LEGACY_BLOCK_SIZE (8 * 1024 * 1024) // the output of a block of the legacy format
+#define LZ4_MIN_MATCH (4)
+
+static decode_status_t ReadLz4Header(lz4_state_s* state, decode_stream_s* stream);
+static decode_status_t DecodeLz4Block(const uint8_t* block, uint64_t blockSize, decode_stream_s* stream);
+static inline uint32_t Load32(const uint8_t* at);
+
+void InitLz4(lz4_state_s* state)
+{
+    memset(state, 0, sizeof(lz4_state_s));
+}
+
+/*
+* Decode the blocks of an LZ4 frame (or of a legacy stream) that are in the input
+* A legacy stream has no end mark, it ends with the input (the kernel appends the decompressed size to it)
+*/
+decode_status_t Lz4Decode(lz4_state_s* state, decode_stream_s* stream)
+{
+    decode_status_t missing = stream->inputComplete ? DECODE_ERROR : DECODE_NEED_INPUT;
+    if(!state->headerRead)
+    {
+        decode_status_t status = ReadLz4Header(state, stream);
+        if(status != DECODE_DONE)
+        {
+            return status;
+        }
+        state->headerRead = TRUE;
+    }
+
+    while(TRUE)
+    {
+        uint64_t available = stream->inputSize - stream->inputPos;
+        if(state->legacy && stream->inputComplete && (available == 0 || available == sizeof(uint32_t)))
+        {
+            stream->inputPos += available;
+            return DECODE_DONE;
+        }
+        if(available < sizeof(uint32_t))
+        {
+            return missing;
+        }
+        const uint8_t* at = stream->input + stream->inputPos;
+        uint32_t blockSize = Load32(at);
+        if(state->legacy && blockSize == LZ4_LEGACY_MAGIC)
+        {
+            // streams that were concatenated
+            stream->inputPos += sizeof(uint32_t);
+            continue;
+        }
+        if(!state->legacy && blockSize == 0)
+        {
+            // the end mark, and the checksum of the content
+            uint64_t endSize = sizeof(uint32_t) + (state->contentChecksum ? LZ4_CHECKSUM_SIZE : 0);
+            if(available < endSize)
+            {
+                return missing;
+            }
+            stream->inputPos += endSize;
+            return DECODE_DONE;
+        }
+
+        boolean_t uncompressed = !state->legacy && (blockSize & LZ4_BLOCK_UNCOMPRESSED);
+        blockSize &= ~LZ4_BLOCK_UNCOMPRESSED;
+        uint64_t size = sizeof(uint32_t) + blockSize + (state->blockChecksums ? LZ4_CHECKSUM_SIZE : 0);
+        if(available < size)
+        {
+            return missing;
+        }
+        const uint8_t* block = at + sizeof(uint32_t);
+        if(uncompressed)
+        {
+            if(stream->outputSize - stream->outputPos < blockSize)
+            {
+                return DECODE_NEED_OUTPUT;
+            }
+            memcpy(stream->output + stream->outputPos, block, blockSize);
+            stream->outputPos += blockSize;
+        }
+        else
+        {
+            decode_status_t status = DecodeLz4Block(block, blockSize, stream);
+            if(status != DECODE_DONE)
+            {
+                return status;
+            }
+        }
+        stream->inputPos += size;
+    }
+}
+
+// The decompressed size from the frame header, 0 if it isn't there (or it is a legacy stream)
+uint64_t GetLz4Size(const uint8_t* input, uint64_t inputSize)
+{
+    if(inputSize < LZ4_MAGIC_SIZE + 2 + sizeof(uint64_t) || Load32(input) != LZ4_FRAME_MAGIC ||
+        !(input[LZ4_MAGIC_SIZE] & LZ4_FLAG_CONTENT_SIZE))
+    {
+        return 0;
+    }
+    uint64_t size = 0;
+    memcpy(&size, input + LZ4_MAGIC_SIZE + 2, sizeof(size));
+    return size;
+}
+
+static decode_status_t ReadLz4Header(lz4_state_s* state, decode_stream_s* stream)
+{
+    decode_status_t missing = stream->inputComplete ? DECODE_ERROR : DECODE_NEED_INPUT;
+    const uint8_t* header = stream->input + stream->inputPos;
+    uint64_t available = stream->inputSize - stream->inputPos;
+    if(available < LZ4_MAGIC_SIZE)
+    {
+        return missing;
+    }
+    uint32_t magic = Load32(header);
+    if(magic == LZ4_LEGACY_MAGIC)
+    {
+        state->legacy = TRUE;
+        stream->inputPos += LZ4_MAGIC_SIZE;
+        return DECODE_DONE;
+    }
+    if(magic != LZ4_FRAME_MAGIC)
+    {
+        return DECODE_ERROR;
+    }
+
+    // magic, flags, block descriptor, the optional fields and the header checksum
+    if(available < LZ4_MAGIC_SIZE + 3)
+    {
+        return missing;
+    }
+    uint8_t flags = header[LZ4_MAGIC_SIZE];
+    if((flags & LZ4_FLAG_VERSION_MASK) != LZ4_FLAG_VERSION || (flags & LZ4_FLAG_DICT_ID))
+    {
+        return DECODE_ERROR;
+    }
+    uint64_t size = LZ4_MAGIC_SIZE + 3 + ((flags & LZ4_FLAG_CONTENT_SIZE) ? sizeof(uint64_t) : 0);
+    if(available < size)
+    {
+        return missing;
+    }
+    state->blockChecksums = (flags & LZ4_FLAG_BLOCK_CHECKSUM) != 0;
+    state->contentChecksum = (flags & LZ4_FLAG_CONTENT_CHECKSUM) != 0;
+    state->contentSize = GetLz4Size(header, available);
+    stream->inputPos += size;
+    return DECODE_DONE;
+}
+
+/*
+* Decode one block: sequences of literals and a match, the last sequence only has literals
+* The output position only moves if the whole block was decoded
+*/
+static decode_status_t DecodeLz4Block(const uint8_t* block, uint64_t blockSize, decode_stream_s* stream)
+{
+    const uint8_t* in = block;
+    const uint8_t* inEnd = block + blockSize;
+    uint8_t* output = stream->output;
+    uint64_t outputPos = stream->outputPos;
+    uint64_t outputSize = stream->outputSize;
+    while(in < inEnd)
+    {
+        uint8_t token = *in++;
+        uint64_t literals = token >> 4;
+        if(literals == 15)
+        {
+            uint8_t extra;
+            do
+            {
+                if(in == inEnd)
+                {
+                    return DECODE_ERROR;
+                }
+                extra = *in++;
+                literals += extra;
+            } while(extra == 255);
+        }
+        if(literals > (uint64_t)(inEnd - in))
+        {
+            return DECODE_ERROR;
+        }
+        if(literals > outputSize - outputPos)
+        {
+            return DECODE_NEED_OUTPUT;
+        }
+        memcpy(output + outputPos, in, literals);
+        in += literals;
+        outputPos += literals;
+        if(in == inEnd)
+        {
+            break;
+        }
+
+        if(inEnd - in < 2)
+        {
+            return DECODE_ERROR;
+        }
+        uint64_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        uint64_t matchLen = token & 15;
+        if(matchLen == 15)
+        {
+            uint8_t extra;
+            do
+            {
+                if(in == inEnd)
+                {
+                    return DECODE_ERROR;
+                }
+                extra = *in++;
+                matchLen += extra;
+            } while(extra == 255);
+        }
+        matchLen += LZ4_MIN_MATCH;
+        if(offset == 0 || offset > outputPos)
+        {
+            return DECODE_ERROR;
+        }
+        if(matchLen > outputSize - outputPos)
+        {
+            return DECODE_NEED_OUTPUT;
+        }
+        CopyMatch(output + outputPos, offset, matchLen);
+        outputPos += matchLen;
+    }
+    stream->outputPos = outputPos;
+    return DECODE_DONE;
+}
+
+static inline uint32_t Load32(const uint8_t* at)
+{
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
@@ -1,16 +1,23 @@
 #include "bootmenu.h"
 #include "logs.h"
 #include "display.h"
+#include "bootphase.h"
+#include "clock.h"
 
 int main(int argc, char **argv)
 {
+    InitClock();
+    MarkBootPhase("entry");
     ST->ConOut->ClearScreen(ST->ConOut);
+    boot_phase_t phase = BeginBootPhase("logger-init", NULL);
     if(!InitLogger())
     {
         printf("Failed to initialize logs, guess logs are now disabled\n");
     }
+    EndBootPhase(phase);
 
     // set max console size and store as global vars
+    phase = BeginBootPhase("console-size", NULL);
     if(!SetMaxConsoleSize())
     {
         if(!QueryCurrentConsoleSize())
@@ -18,6 +25,7 @@ int main(int argc, char **argv)
             Log(LL_WARNING, 0, "Failed to set console size, Clearing screen and redrawing screen.");
         }
     }
+    EndBootPhase(phase);
 
     StartBootManager();
 
@@ -0,0 +1,378 @@
+#include "prefetch.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "bootphase.h"
+#include "volumes.h"
+#include "asyncread.h"
+#include "decompress.h"
+#include "imageverify.h"
+#include "imagecache.h"
+
+typedef struct prefetch_file_s{
+    char_t* path; // NULL if the slot is free
+    efi_file_handle_t* file; // open until the whole file was read
+    char_t* buffer;
+    uint64_t size; // of the buffer, the image once it was decompressed
+    async_read_s read;
+    boolean_t detected; // the image was checked for compression
+    decompress_s* decompress; // NULL if the image isn't compressed (or it was decompressed already)
+    boolean_t failed; // the file couldn't be opened or read, it is read normally when it is booted
+    boolean_t verifying; // the image is pinned to a digest, it is hashed as it is read
+    image_verify_s verify;
+    image_key_s key; // of the image, it is kept in the image cache when it is taken
+    boot_phase_t phase;
+} prefetch_file_s;
+
+// The files are read together, the first slot is the image of the highlighted entry
+static prefetch_file_s prefetchFiles[PREFETCH_MAX_FILES];
+// The files are on the volume of the image, like the initrds the kernel would read itself
+static char_t* prefetchVolumeName = NULL;
+static efi_handle_t prefetchVolume = NULL;
+static char_t* prefetchSha256 = NULL; // the digest the image is pinned to, NULL if it isn't
+
+static boolean_t StartFileRead(prefetch_file_s* prefetch);
+static void EndFileRead(prefetch_file_s* prefetch);
+static void FinishPrefetch(void);
+static void StepImageHash(prefetch_file_s* prefetch);
+static void StepImageDecompress(prefetch_file_s* prefetch);
+static void FinishImageDecompress(prefetch_file_s* prefetch);
+static boolean_t TakeCachedImage(prefetch_file_s* prefetch, const efi_file_info_t* info);
+static void FreePrefetchFile(prefetch_file_s* prefetch);
+static inline boolean_t IsPrefetchDone(const prefetch_file_s* prefetch);
+
+/*
+* Prefetch the files of the highlighted entry, its image first and then its initrds
+* (volumeName is the volume key of the entry, imageSha256 the digest its image is pinned to, either may be NULL)
+* Nothing changes if they are already prefetched, other files that are being prefetched are dropped
+*/
+void PrefetchFiles(const char_t* const* paths, int32_t numOfPaths, const char_t* volumeName,
+    const char_t* imageSha256)
+{
+    if(numOfPaths > PREFETCH_MAX_FILES)
+    {
+        numOfPaths = PREFETCH_MAX_FILES;
+    }
+    boolean_t samePaths = (imageSha256 == NULL || prefetchSha256 == NULL) ? (imageSha256 == prefetchSha256) :
+        (strcmp(imageSha256, prefetchSha256) == 0);
+    for(int32_t i = 0; i < PREFETCH_MAX_FILES && samePaths; i++)
+    {
+        const char_t* path = (i < numOfPaths) ? paths[i] : NULL;
+        const char_t* prefetched = prefetchFiles[i].path;
+        samePaths = (path == NULL || prefetched == NULL) ? (path == prefetched) : (strcmp(path, prefetched) == 0);
+    }
+    if(samePaths)
+    {
+        return;
+    }
+
+    CancelPrefetch();
+    prefetchVolumeName = (volumeName != NULL) ? strdup(volumeName) : NULL;
+    prefetchSha256 = (imageSha256 != NULL) ? strdup(imageSha256) : NULL;
+    for(int32_t i = 0; i < numOfPaths; i++)
+    {
+        prefetchFiles[i].path = strdup(paths[i]);
+        if(prefetchFiles[i].path == NULL || (volumeName != NULL && prefetchVolumeName == NULL) ||
+            (imageSha256 != NULL && prefetchSha256 == NULL))
+        {
+            CancelPrefetch();
+            return;
+        }
+    }
+}
+
+/*
+* Do one step of prefetching (open the files, then request their next chunks and collect the completed ones)
+* A compressed image is decompressed a step at a time, from the chunks that are there (a pinned one is hashed too)
+* returns FALSE when there is nothing left to prefetch
+*/
+boolean_t PrefetchStep(void)
+{
+    boolean_t pending = FALSE;
+    for(int32_t i = 0; i < PREFETCH_MAX_FILES; i++)
+    {
+        prefetch_file_s* prefetch = prefetchFiles + i;
+        if(prefetch->path == NULL || IsPrefetchDone(prefetch))
+        {
+            continue;
+        }
+        if(prefetch->buffer == NULL)
+        {
+            StartFileRead(prefetch);
+        }
+        else if(prefetch->file != NULL && PollAsyncRead(&prefetch->read))
+        {
+            EndFileRead(prefetch);
+        }
+        StepImageHash(prefetch);
+        StepImageDecompress(prefetch);
+        pending = TRUE;
+    }
+    return pending;
+}
+
+void CancelPrefetch(void)
+{
+    for(int32_t i = 0; i < PREFETCH_MAX_FILES; i++)
+    {
+        FreePrefetchFile(prefetchFiles + i);
+    }
+    free(prefetchVolumeName);
+    free(prefetchSha256);
+    prefetchVolumeName = NULL;
+    prefetchSha256 = NULL;
+    prefetchVolume = NULL;
+}
+
+/*
+* Get the prefetched content of a file
+* The files that are still being prefetched are finished together first (so the image and the initrds are
+* read at the same time), a compressed image is returned decompressed
+* sha256 is the digest the file is pinned to, or NULL, a pinned file is only taken if it was verified against it
+* The buffer is the caller's to release with ReleaseImage, NULL if the file wasn't prefetched (or prefetching failed)
+* The image is kept in the image cache, for the next boot of it
+* The other files are kept until CancelPrefetch
+*/
+char_t* TakePrefetchedFile(const char_t* path, uint64_t* outFileSize, const char_t* sha256)
+{
+    FinishPrefetch();
+    for(int32_t i = 0; i < PREFETCH_MAX_FILES; i++)
+    {
+        prefetch_file_s* prefetch = prefetchFiles + i;
+        if(prefetch->path == NULL || strcmp(prefetch->path, path) != 0)
+        {
+            continue;
+        }
+        if(sha256 != NULL && (!prefetch->verifying || strcmp(prefetchSha256, sha256) != 0))
+        {
+            return NULL;
+        }
+        char_t* buffer = NULL;
+        if(!prefetch->failed)
+        {
+            buffer = prefetch->buffer;
+            *outFileSize = prefetch->size;
+            prefetch->buffer = NULL;
+            CacheImage(&prefetch->key, buffer, prefetch->size);
+        }
+        FreePrefetchFile(prefetch);
+        return buffer;
+    }
+    return NULL;
+}
+
+// Read the rest of the files that are being prefetched
+static void FinishPrefetch(void)
+{
+    async_read_s* reads[PREFETCH_MAX_FILES];
+    prefetch_file_s* readFiles[PREFETCH_MAX_FILES];
+    int32_t numOfReads = 0;
+    for(int32_t i = 0; i < PREFETCH_MAX_FILES; i++)
+    {
+        prefetch_file_s* prefetch = prefetchFiles + i;
+        if(prefetch->path != NULL && prefetch->file == NULL && !prefetch->failed && prefetch->buffer == NULL)
+        {
+            StartFileRead(prefetch);
+        }
+        if(prefetch->file != NULL)
+        {
+            readFiles[numOfReads] = prefetch;
+            reads[numOfReads++] = &prefetch->read;
+        }
+    }
+    FinishAsyncReads(reads, numOfReads);
+    for(int32_t i = 0; i < numOfReads; i++)
+    {
+        EndFileRead(readFiles[i]);
+    }
+    FinishImageDecompress(prefetchFiles);
+}
+
+// Hash the chunks of a pinned image that arrived, PREFETCH_VERIFY_STEP at a time (the rest when the read ends)
+static void StepImageHash(prefetch_file_s* prefetch)
+{
+    if(!prefetch->verifying || prefetch->failed || prefetch->file == NULL)
+    {
+        return;
+    }
+    uint64_t bytesRead = GetAsyncReadPrefix(&prefetch->read);
+    uint64_t stepEnd = prefetch->verify.hashed + PREFETCH_VERIFY_STEP;
+    StepImageVerify(&prefetch->verify, prefetch->buffer, (bytesRead < stepEnd) ? bytesRead : stepEnd);
+}
+
+// Decode the chunks of the image that arrived, PREFETCH_DECOMPRESS_STEP of the stream at a time
+static void StepImageDecompress(prefetch_file_s* prefetch)
+{
+    // the initrds are left compressed, the kernel unpacks them
+    if(prefetch != prefetchFiles || prefetch->failed || prefetch->buffer == NULL)
+    {
+        return;
+    }
+    uint64_t bytesRead = (prefetch->file != NULL) ? GetAsyncReadPrefix(&prefetch->read) : prefetch->size;
+    if(!prefetch->detected)
+    {
+        if(bytesRead < DECOMPRESS_HEADER_SIZE && prefetch->file != NULL)
+        {
+            return;
+        }
+        prefetch->detected = TRUE;
+        prefetch->decompress = BeginDecompress(prefetch->buffer, prefetch->read.size, bytesRead);
+    }
+    decompress_s* decompress = prefetch->decompress;
+    if(decompress == NULL)
+    {
+        return;
+    }
+    uint64_t stepEnd = decompress->source.offset + decompress->stream.inputPos + PREFETCH_DECOMPRESS_STEP;
+    StepDecompress(decompress, (bytesRead < stepEnd) ? bytesRead : stepEnd);
+    if(prefetch->file == NULL && decompress->status != DECODE_NEED_INPUT)
+    {
+        FinishImageDecompress(prefetch);
+    }
+}
+
+// Decompress the rest of the image that was read, and swap the file for it
+static void FinishImageDecompress(prefetch_file_s* prefetch)
+{
+    if(prefetch != prefetchFiles || prefetch->failed || prefetch->buffer == NULL || prefetch->file != NULL)
+    {
+        return;
+    }
+    if(!prefetch->detected)
+    {
+        prefetch->detected = TRUE;
+        prefetch->decompress = BeginDecompress(prefetch->buffer, prefetch->size, prefetch->size);
+    }
+    if(prefetch->decompress == NULL)
+    {
+        return;
+    }
+    boot_phase_t phase = BeginBootPhase("decompress", prefetch->path);
+    StepDecompress(prefetch->decompress, prefetch->size);
+    prefetch->buffer = EndDecompress(prefetch->decompress, prefetch->buffer, &prefetch->size, prefetch->path);
+    prefetch->decompress = NULL;
+    EndBootPhase(phase);
+}
+
+static boolean_t StartFileRead(prefetch_file_s* prefetch)
+{
+    prefetch->phase = BeginBootPhase("prefetch", prefetch->path);
+    if(prefetchVolume == NULL && prefetchFiles[0].path != NULL)
+    {
+        prefetchVolume = FindFileVolume(prefetchFiles[0].path, prefetchVolumeName);
+    }
+    if(prefetchVolume != NULL)
+    {
+        prefetch->file = OpenVolumeFile(prefetchVolume, prefetch->path);
+    }
+    efi_file_info_t info;
+    if(prefetch->file == NULL || EFI_ERROR(GetFileInfo(prefetch->file, &info)))
+    {
+        Log(LL_WARNING, 0, "Failed to open '%s' for prefetching", prefetch->path);
+    }
+    else if(prefetch == prefetchFiles && TakeCachedImage(prefetch, &info))
+    {
+        return TRUE;
+    }
+    else
+    {
+        prefetch->buffer = AllocateFileBuffer(info.FileSize + 1);
+        if(prefetch->buffer == NULL)
+        {
+            Log(LL_WARNING, 0, "Failed to allocate %d bytes for prefetching '%s'", (int32_t)info.FileSize, prefetch->path);
+        }
+    }
+    if(prefetch->buffer == NULL)
+    {
+        if(prefetch->file != NULL)
+        {
+            prefetch->file->Close(prefetch->file);
+            prefetch->file = NULL;
+        }
+        prefetch->failed = TRUE;
+        EndBootPhase(prefetch->phase);
+        return FALSE;
+    }
+    // a pinned image that can't be verified is read normally when it is booted, and refused then
+    if(prefetch == prefetchFiles && prefetchSha256 != NULL)
+    {
+        prefetch->verifying = BeginImageVerify(&prefetch->verify, prefetchSha256, prefetchVolumeName, prefetch->path,
+            prefetch->file);
+        if(!prefetch->verifying)
+        {
+            prefetch->file->Close(prefetch->file);
+            prefetch->file = NULL;
+            prefetch->failed = TRUE;
+            EndBootPhase(prefetch->phase);
+            return FALSE;
+        }
+    }
+    BeginAsyncRead(&prefetch->read, prefetch->file, prefetch->buffer, info.FileSize);
+    SetAsyncReadVolume(&prefetch->read, prefetchVolume);
+    return TRUE;
+}
+
+/*
+* Take the image from the image cache if it was booted before in the session, it isn't read then
+* (a pinned one was verified against the digest already)
+*/
+static boolean_t TakeCachedImage(prefetch_file_s* prefetch, const efi_file_info_t* info)
+{
+    SetImageKey(&prefetch->key, prefetchVolume, prefetch->path, info, prefetchSha256);
+    prefetch->buffer = AcquireCachedImage(&prefetch->key, &prefetch->size);
+    if(prefetch->buffer == NULL)
+    {
+        return FALSE;
+    }
+    prefetch->file->Close(prefetch->file);
+    prefetch->file = NULL;
+    prefetch->detected = TRUE;
+    prefetch->verifying = prefetchSha256 != NULL;
+    EndBootPhase(prefetch->phase);
+    return TRUE;
+}
+
+// The read is done (or failed), close the file
+static void EndFileRead(prefetch_file_s* prefetch)
+{
+    prefetch->file->Close(prefetch->file);
+    prefetch->file = NULL;
+    EndBootPhase(prefetch->phase);
+    if(EFI_ERROR(prefetch->read.status))
+    {
+        Log(LL_WARNING, prefetch->read.status, "Failed to read '%s' for prefetching", prefetch->path);
+        prefetch->failed = TRUE;
+        return;
+    }
+    prefetch->size = prefetch->read.size;
+    prefetch->buffer[prefetch->size] = CHAR_NULL;
+    // the time includes the key polls of the menu in between the steps
+    LogAsyncRead(&prefetch->read, prefetch->path);
+    if(prefetch->verifying && !EndImageVerify(&prefetch->verify, prefetch->buffer, prefetch->path))
+    {
+        prefetch->failed = TRUE;
+    }
+}
+
+static void FreePrefetchFile(prefetch_file_s* prefetch)
+{
+    if(prefetch->file != NULL)
+    {
+        // the firmware may still be writing to the buffer
+        CancelAsyncRead(&prefetch->read);
+        prefetch->file->Close(prefetch->file);
+    }
+    if(prefetch->decompress != NULL)
+    {
+        CancelDecompress(prefetch->decompress);
+    }
+    free(prefetch->path);
+    ReleaseImage(prefetch->buffer);
+    memset(prefetch, 0, sizeof(prefetch_file_s));
+}
+
+// The whole file was read (and decompressed), or prefetching it failed
+static inline boolean_t IsPrefetchDone(const prefetch_file_s* prefetch)
+{
+    return prefetch->failed || (prefetch->buffer != NULL && prefetch->file == NULL && prefetch->decompress == NULL &&
+        (prefetch != prefetchFiles || prefetch->detected));
+}
@@ -0,0 +1,307 @@
+#include "sha256.h"
+#include "bootutils.h"
+
+#ifdef __x86_64__
+#include <cpuid.h>
+// keep the intrinsics headers from including the stdlib.h of the system (for _mm_malloc)
+#define _MM_MALLOC_H_INCLUDED
+#define __MM_MALLOC_H
+#include <immintrin.h>
+
+// CPUID feature bits
+#define CPUID_SSSE3 (1 << 9) // leaf 1, ecx
+#define CPUID_SSE41 (1 << 19) // leaf 1, ecx
+#define CPUID_SHA (1 << 29) // leaf 7, ebx
+#endif
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define SIGMA0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define SIGMA1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define GAMMA0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define GAMMA1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+// the words of the rounds, from the block for the first 16 and made from the words before them after that
+#define LOADED_WORD(i) (w[i])
+#define SCHEDULED_WORD(i) (w[(i) & 15] += GAMMA1(w[((i) - 2) & 15]) + w[((i) - 7) & 15] + GAMMA0(w[((i) - 15) & 15]))
+#define ROUND(a, b, c, d, e, f, g, h, i, word) \
+    do { \
+        uint32_t t1 = (h) + SIGMA1(e) + CH(e, f, g) + roundConstants[i] + (word); \
+        (d) += t1; \
+        (h) = t1 + SIGMA0(a) + MAJ(a, b, c); \
+    } while(0)
+// eight rounds rotate the variables back to where they were
+#define EIGHT_ROUNDS(i, WORD) \
+    do { \
+        ROUND(a, b, c, d, e, f, g, h, (i) + 0, WORD((i) + 0)); \
+        ROUND(h, a, b, c, d, e, f, g, (i) + 1, WORD((i) + 1)); \
+        ROUND(g, h, a, b, c, d, e, f, (i) + 2, WORD((i) + 2)); \
+        ROUND(f, g, h, a, b, c, d, e, (i) + 3, WORD((i) + 3)); \
+        ROUND(e, f, g, h, a, b, c, d, (i) + 4, WORD((i) + 4)); \
+        ROUND(d, e, f, g, h, a, b, c, (i) + 5, WORD((i) + 5)); \
+        ROUND(c, d, e, f, g, h, a, b, (i) + 6, WORD((i) + 6)); \
+        ROUND(b, c, d, e, f, g, h, a, (i) + 7, WORD((i) + 7)); \
+    } while(0)
+
+#define SHA256_LENGTH_SIZE (8) // the message length at the end of the last block, in bits
+
+typedef void (*sha256_compress_t)(uint32_t* state, const uint8_t* data, uint64_t numOfBlocks);
+
+static const uint32_t initialState[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Picked by the first Sha256Init
+static sha256_compress_t compressBlocks = NULL;
+static const char_t* implementationName = NULL;
+
+static void SelectImplementation(void);
+static void CompressBlocksPortable(uint32_t* state, const uint8_t* data, uint64_t numOfBlocks);
+#ifdef __x86_64__
+static void CompressBlocksShaNi(uint32_t* state, const uint8_t* data, uint64_t numOfBlocks);
+#endif
+static inline int32_t HexDigitValue(char_t c);
+static inline uint32_t LoadBigEndian32(const uint8_t* at);
+static inline void StoreBigEndian32(uint8_t* at, uint32_t value);
+
+void Sha256Init(sha256_s* sha)
+{
+    if(compressBlocks == NULL)
+    {
+        SelectImplementation();
+    }
+    memcpy(sha->state, initialState, sizeof(initialState));
+    sha->blockSize = 0;
+    sha->length = 0;
+}
+
+// The whole blocks of the data are compressed where they are, only the partial ones are copied
+void Sha256Update(sha256_s* sha, const void* data, uint64_t size)
+{
+    const uint8_t* bytes = data;
+    sha->length += size;
+    if(sha->blockSize > 0)
+    {
+        uint64_t fill = SHA256_BLOCK_SIZE - sha->blockSize;
+        if(fill > size)
+        {
+            fill = size;
+        }
+        memcpy(sha->block + sha->blockSize, bytes, fill);
+        sha->blockSize += fill;
+        bytes += fill;
+        size -= fill;
+        if(sha->blockSize < SHA256_BLOCK_SIZE)
+        {
+            return;
+        }
+        compressBlocks(sha->state, sha->block, 1);
+        sha->blockSize = 0;
+    }
+    uint64_t numOfBlocks = size / SHA256_BLOCK_SIZE;
+    if(numOfBlocks > 0)
+    {
+        compressBlocks(sha->state, bytes, numOfBlocks);
+        bytes += numOfBlocks * SHA256_BLOCK_SIZE;
+        size -= numOfBlocks * SHA256_BLOCK_SIZE;
+    }
+    memcpy(sha->block, bytes, size);
+    sha->blockSize = size;
+}
+
+void Sha256Final(sha256_s* sha, uint8_t* digest)
+{
+    uint64_t bitLength = sha->length * 8;
+    sha->block[sha->blockSize++] = 0x80;
+    if(sha->blockSize > SHA256_BLOCK_SIZE - SHA256_LENGTH_SIZE)
+    {
+        memset(sha->block + sha->blockSize, 0, SHA256_BLOCK_SIZE - sha->blockSize);
+        compressBlocks(sha->state, sha->block, 1);
+        sha->blockSize = 0;
+    }
+    memset(sha->block + sha->blockSize, 0, SHA256_BLOCK_SIZE - SHA256_LENGTH_SIZE - sha->blockSize);
+    StoreBigEndian32(sha->block + SHA256_BLOCK_SIZE - 8, (uint32_t)(bitLength >> 32));
+    StoreBigEndian32(sha->block + SHA256_BLOCK_SIZE - 4, (uint32_t)bitLength);
+    compressBlocks(sha->state, sha->block, 1);
+    for(int32_t i = 0; i < 8; i++)
+    {
+        StoreBigEndian32(digest + i * 4, sha->state[i]);
+    }
+}
+
+// "sha-ni" or "portable"
+const char_t* GetSha256Implementation(void)
+{
+    if(compressBlocks == NULL)
+    {
+        SelectImplementation();
+    }
+    return implementationName;
+}
+
+// A digest written as 64 hex digits (either case), FALSE if it isn't one
+boolean_t ParseSha256(const char_t* hex, uint8_t* digest)
+{
+    if(strlen(hex) != SHA256_HEX_LEN)
+    {
+        return FALSE;
+    }
+    for(int32_t i = 0; i < SHA256_DIGEST_SIZE; i++)
+    {
+        int32_t high = HexDigitValue(hex[i * 2]);
+        int32_t low = HexDigitValue(hex[i * 2 + 1]);
+        if(high < 0 || low < 0)
+        {
+            return FALSE;
+        }
+        digest[i] = (uint8_t)(high << 4 | low);
+    }
+    return TRUE;
+}
+
+static void SelectImplementation(void)
+{
+    compressBlocks = CompressBlocksPortable;
+    implementationName = "portable";
+#ifdef __x86_64__
+    uint32_t eax = 0;
+    uint32_t ebx = 0;
+    uint32_t ecx = 0;
+    uint32_t edx = 0;
+    if(__get_cpuid_max(0, NULL) < 7)
+    {
+        return;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    uint32_t leaf1Ecx = ecx;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if((leaf1Ecx & CPUID_SSSE3) && (leaf1Ecx & CPUID_SSE41) && (ebx & CPUID_SHA))
+    {
+        compressBlocks = CompressBlocksShaNi;
+        implementationName = "sha-ni";
+    }
+#endif
+}
+
+// The variables rotate through the rounds instead of being moved, the message schedule is a ring of 16 words
+static void CompressBlocksPortable(uint32_t* state, const uint8_t* data, uint64_t numOfBlocks)
+{
+    uint32_t w[16];
+    for(uint64_t block = 0; block < numOfBlocks; block++, data += SHA256_BLOCK_SIZE)
+    {
+        uint32_t a = state[0];
+        uint32_t b = state[1];
+        uint32_t c = state[2];
+        uint32_t d = state[3];
+        uint32_t e = state[4];
+        uint32_t f = state[5];
+        uint32_t g = state[6];
+        uint32_t h = state[7];
+        for(int32_t i = 0; i < 16; i++)
+        {
+            w[i] = LoadBigEndian32(data + i * 4);
+        }
+        EIGHT_ROUNDS(0, LOADED_WORD);
+        EIGHT_ROUNDS(8, LOADED_WORD);
+        for(int32_t i = 16; i < 64; i += 8)
+        {
+            EIGHT_ROUNDS(i, SCHEDULED_WORD);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef __x86_64__
+/*
+* Four rounds per step with the SHA extensions, the state is kept as ABEF and CDGH like sha256rnds2 wants it
+* The message words of a step are in msg[step % 4], they are replaced by the words 16 rounds later
+*/
+__attribute__((target("sha,sse4.1")))
+static void CompressBlocksShaNi(uint32_t* state, const uint8_t* data, uint64_t numOfBlocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for(uint64_t block = 0; block < numOfBlocks; block++, data += SHA256_BLOCK_SIZE)
+    {
+        __m128i abefSaved = abef;
+        __m128i cdghSaved = cdgh;
+        __m128i msg[4];
+        for(int32_t i = 0; i < 4; i++)
+        {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), byteSwap);
+        }
+        #pragma GCC unroll 16
+        for(int32_t step = 0; step < 16; step++)
+        {
+            __m128i words = _mm_add_epi32(msg[step & 3], _mm_loadu_si128((const __m128i*)&roundConstants[step * 4]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+            if(step < 12)
+            {
+                __m128i next = _mm_sha256msg1_epu32(msg[step & 3], msg[(step + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(msg[(step + 3) & 3], msg[(step + 2) & 3], 4));
+                msg[step & 3] = _mm_sha256msg2_epu32(next, msg[(step + 3) & 3]);
+            }
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abefSaved);
+        cdgh = _mm_add_epi32(cdgh, cdghSaved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static inline int32_t HexDigitValue(char_t c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static inline uint32_t LoadBigEndian32(const uint8_t* at)
+{
+    return (uint32_t)at[0] << 24 | (uint32_t)at[1] << 16 | (uint32_t)at[2] << 8 | at[3];
+}
+
+static inline void StoreBigEndian32(uint8_t* at, uint32_t value)
+{
+    at[0] = (uint8_t)(value >> 24);
+    at[1] = (uint8_t)(value >> 16);
+    at[2] = (uint8_t)(value >> 8);
+    at[3] = (uint8_t)value;
+}
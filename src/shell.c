@@ -20,11 +20,9 @@ static int8_t ProcessCommand(char_t buffer[], char_t** currPathPtr);
 
 // Command and arguments processing
 static char_t* GetCommandFromBuffer(char_t buffer[]);
-static int8_t ParseArgs(char_t* inputArgs, cmd_args_s** outputArgs);
 static int8_t SplitArgsString(char_t buffer[], cmd_args_s** outputArgs);
 static cmd_args_s* InitializeArgsNode(void);
 static void AppendArgsNode(cmd_args_s* head, cmd_args_s* node);
-static void FreeArgs(cmd_args_s* args);
 
 
 
@@ -59,11 +57,13 @@ int8_t StartShell(void)
 
     if(ShellLoop(&currPath) == 1)
     {
+        FlushLog();
         return CMD_OUT_OF_MEMORY;
     }
 
     // cleanup
     Log(LL_INFO, 0, "Closing shell.");
+    FlushLog();
     free(currPath);
     ST->ConOut->EnableCursor(ST->ConOut, FALSE);
     ST->ConOut->ClearScreen(ST->ConOut);
@@ -178,7 +178,7 @@ static char_t* GetCommandFromBuffer(char_t buffer[])
 * loads input args to a buffer, and reads through it
 * splits arguments when reading a space char
 */
-static int8_t ParseArgs(char_t* inputArgs, cmd_args_s** outputArgs)
+int8_t ParseArgs(char_t* inputArgs, cmd_args_s** outputArgs)
 {
     if(inputArgs == NULL)
     {
@@ -331,7 +331,7 @@ static void AppendArgsNode(cmd_args_s* head, cmd_args_s* node)
 /*
 * Free argument list (non-recurvively)
 */
-static void FreeArgs(cmd_args_s* args)
+void FreeArgs(cmd_args_s* args)
 {
     while(args != NULL)
     {
@@ -3,6 +3,8 @@
 #include "bootutils.h"
 #include "ErrorCodes.h"
 #include "display.h"
+#include "fileview.h"
+#include "console.h"
 
 #define DIRECTORY_DELIM ('\\')
 #define DIRECTORY_DELIM_STR ("\\")
@@ -264,24 +266,24 @@ void GetInputString(char_t buffer[], const uint32_t maxInputSize, boolean_t hide
 // check if a char is a whitespace character
 boolean_t IsSpace(const char_t c)
 {
-    return (c == ' ' || c == CHAR_TAB);
+    return (c == ' ' || c == CHAR_TAB || c == CHAR_CARRIAGE_RETURN);
 }
 
 
 /*
 * Trim accidental spaces form input
+* The string is trimmed in place, the returned pointer points inside of str
 */
 char_t* TrimSpaces(char_t* str)
 {
     size_t stringLen = strlen(str);
-    char_t* originalString = str;
 
     // remove trailing spaces (end of the string)
-    char_t* end = originalString + stringLen - 1;
-    while(end > originalString && IsSpace(*end)) // check if if end of string is space
+    while(stringLen > 0 && IsSpace(str[stringLen - 1])) // check if if end of string is space
     {
-        end--; // if it is, then go one char back
+        stringLen--; // if it is, then go one char back
     }
+    str[stringLen] = CHAR_NULL; // cut the trailing spaces off
 
     // remove leading whitespace (in the start of the string)
     while (IsSpace(*str))
@@ -386,24 +388,30 @@ cmd_args_s* GetLastArg(cmd_args_s* head)
 }
 /*
 * This func recieves a file path, and prints its contents
+* The file is read a window at a time (see fileview.h), so a large file doesn't have to fit in memory
 */
 int32_t PrintFileContent(char_t* path)
 {
-    uint64_t fileSize = 0;
-    char_t* buffer = GetFileContent(path, &fileSize);
-    if (buffer == NULL)
+    file_view_s view;
+    if (!OpenFileView(&view, path))
     {
         return errno;
     }
 
-    // Printing this in order to prevent issues when printing binary files
-    for(uint64_t i =0; i <fileSize; i++)
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    const char_t* data = NULL;
+    // Written byte by byte (not as UTF-8) in order to prevent issues when printing binary files
+    BeginConsoleFrame();
+    while ((data = MapFileView(&view, offset, &size)) != NULL)
     {
-        putchar(buffer[i]);
+        ConsoleWrite(data, size);
+        offset += size;
     }
-    putchar('\n');
+    ConsoleWrite("\n", 1);
+    EndConsoleFrame();
 
-    free(buffer);
+    CloseFileView(&view);
     return 0;
 }
 
@@ -542,64 +550,6 @@ char_t* StringReplace(const char_t* orig, const char_t* pattern, const char_t* r
 }
 
 
-/*
-* Prints space characters to fill and entire screen row, used
-* to overwrite dead text
-* this is purly chatGPT
-*/
-void PrintEmptyLine(void)
-{
-    if (!screenModeSet)
-    {
-        putchar('\n');
-        return;
-    }
-
-    const int32_t amount = screenCols + 1;
-    char_t *buf = (char_t*)malloc(amount * sizeof(char_t));
-    if (buf == NULL)
-    {
-        Log(LL_ERROR, 0, "Failed to allocate memory for a cute little buffer...");
-        return;
-    }
-
-    memset(buf, ' ', amount - 1);
-    buf[screenCols] = CHAR_NULL;
-    printf("%s", buf);
-
-    // Don't forget to free the buffer when you're done with it
-    free(buf);
-
-}
-
-// Prints space characters to fill the row. Used to overwrite dead text.
-void PadRow(void)
-{
-    // Find the amount of spaces left to print, and add 1 for the null char
-    const int32_t amount = screenCols - ST->ConOut->Mode->CursorColumn + 1;
-    // Prevent creating a negative sized array
-    if (amount < 1 || !screenModeSet)
-    {
-        putchar('\n');
-        return;
-    }
-
-    char_t *buf = (char_t*)malloc(amount * sizeof(char_t));
-    if (buf == NULL)
-    {
-        Log(LL_ERROR, 0, "Failed to allocate memory for a cute little buffer...");
-        return;
-    }   
-
-    memset(buf, ' ', amount);
-    buf[amount - 1] = CHAR_NULL;
-    printf("%s", buf);
-
-    // Don't forget to free the buffer when you're done with it
-    free(buf);
-}
-
-
 
 
 
@@ -0,0 +1,382 @@
+#include "volumes.h"
+#include "logs.h"
+#include "bootutils.h"
+#include "ext4.h"
+
+// Hard drive media device path node (UEFI spec 10.3.5.1), the fields are read by offset since the node is packed
+#define MEDIA_DEVICE_PATH_TYPE (0x04)
+#define MEDIA_HARDDRIVE_SUBTYPE (0x01)
+#define HARDDRIVE_SIGNATURE_OFFSET (24)
+#define HARDDRIVE_SIGNATURE_TYPE_OFFSET (41)
+#define HARDDRIVE_SIGNATURE_TYPE_GUID (0x02)
+
+#define GUID_SIZE (16)
+#define GUID_STRING_LEN (36) // XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX
+
+#define EFI_FILE_SYSTEM_VOLUME_LABEL_GUID { 0xdb47d7d3, 0xfe81, 0x11d3, {0x9a, 0x35, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d} }
+
+typedef struct volume_s{
+    efi_handle_t handle;
+    efi_simple_file_system_protocol_t* fileSystem;
+    boolean_t hasPartitionGuid;
+    uint8_t partitionGuid[GUID_SIZE]; // as it is stored on the disk (mixed endian)
+    boolean_t labelRead; // the label is read only when a volume is looked up by label
+    char_t label[VOLUME_LABEL_LEN];
+} volume_s;
+
+// The volume a path was found on
+typedef struct volume_path_s{
+    char_t* path;
+    int32_t volume;
+} volume_path_s;
+
+static volume_s* volumes = NULL;
+static int32_t numOfVolumes = 0;
+static boolean_t volumesScanned = FALSE;
+
+static volume_path_s pathCache[VOLUME_PATH_CACHE_SIZE];
+static int32_t nextPathCacheSlot = 0; // the oldest path is replaced when the cache is full
+
+static boolean_t ScanVolumes(void);
+static int32_t FindNamedVolume(const char_t* volumeName);
+static int32_t ProbeVolumes(const char_t* path);
+static boolean_t FileExistsOnVolume(volume_s* volume, const char_t* path);
+static efi_file_handle_t* OpenFileSystemFile(efi_simple_file_system_protocol_t* fileSystem, const char_t* path);
+static void ReadPartitionGuid(volume_s* volume);
+static const char_t* GetVolumeLabel(volume_s* volume);
+static boolean_t ParseGuid(const char_t* str, uint8_t guid[GUID_SIZE]);
+static int32_t HexDigitValue(char_t c);
+static void CachePath(const char_t* path, int32_t volume);
+
+/*
+* Get the handle of the volume a file is on
+* volumeName (optional) names the volume by its label or partition GUID, then nothing is probed
+* otherwise the volume is taken from the path cache, or the volumes are probed for the file
+* (the volume of the loader first), when more than one volume has the file the first one wins
+*/
+efi_handle_t FindFileVolume(const char_t* path, const char_t* volumeName)
+{
+    if(!volumesScanned && !ScanVolumes())
+    {
+        return NULL;
+    }
+
+    if(volumeName != NULL)
+    {
+        int32_t volume = FindNamedVolume(volumeName);
+        if(volume < 0)
+        {
+            Log(LL_ERROR, 0, "Volume '%s' was not found (for '%s')", volumeName, path);
+            return NULL;
+        }
+        return volumes[volume].handle;
+    }
+
+    for(int32_t i = 0; i < VOLUME_PATH_CACHE_SIZE; i++)
+    {
+        if(pathCache[i].path != NULL && strcmp(pathCache[i].path, path) == 0)
+        {
+            return volumes[pathCache[i].volume].handle;
+        }
+    }
+
+    int32_t volume = ProbeVolumes(path);
+    if(volume < 0)
+    {
+        // A volume may have been connected since the scan (a USB drive)
+        if(!ScanVolumes())
+        {
+            return NULL;
+        }
+        volume = ProbeVolumes(path);
+    }
+    if(volume < 0)
+    {
+        Log(LL_ERROR, 0, "Unable to find the file '%s' on the machine.", path);
+        return NULL;
+    }
+    CachePath(path, volume);
+    return volumes[volume].handle;
+}
+
+void FreeVolumes(void)
+{
+    for(int32_t i = 0; i < VOLUME_PATH_CACHE_SIZE; i++)
+    {
+        free(pathCache[i].path);
+        pathCache[i].path = NULL;
+    }
+    nextPathCacheSlot = 0;
+    free(volumes);
+    volumes = NULL;
+    numOfVolumes = 0;
+    volumesScanned = FALSE;
+}
+
+// (Re)build the registry, the path cache is dropped since the volume indexes change
+static boolean_t ScanVolumes(void)
+{
+    FreeVolumes();
+    // the ext4 partitions get their file system protocol first, so they are volumes like the others
+    MountExt4Volumes();
+
+    efi_guid_t sfsGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    uintn_t bufSize = 0;
+    efi_status_t status = BS->LocateHandle(ByProtocol, &sfsGuid, NULL, &bufSize, NULL);
+    if(status != EFI_BUFFER_TOO_SMALL)
+    {
+        Log(LL_ERROR, status, "Inital location of the simple file system protocol handle failed");
+        return FALSE;
+    }
+    efi_handle_t* handles = malloc(bufSize);
+    if(handles == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for handles");
+        return FALSE;
+    }
+    status = BS->LocateHandle(ByProtocol, &sfsGuid, NULL, &bufSize, handles);
+    if(EFI_ERROR(status))
+    {
+        Log(LL_ERROR, status, "Unable to locate the simple file system protocol handles");
+        free(handles);
+        return FALSE;
+    }
+    uintn_t numHandles = bufSize / sizeof(efi_handle_t);
+
+    volumes = malloc(numHandles * sizeof(volume_s));
+    if(volumes == NULL)
+    {
+        Log(LL_ERROR, 0, "Failed to allocate memory for the volumes");
+        free(handles);
+        return FALSE;
+    }
+
+    // The volume of the loader goes first, so it is probed first
+    efi_handle_t loaderDevice = (LIP != NULL) ? LIP->DeviceHandle : NULL;
+    for(uintn_t i = 0; i < numHandles; i++)
+    {
+        if(handles[i] == loaderDevice && i > 0)
+        {
+            handles[i] = handles[0];
+            handles[0] = loaderDevice;
+        }
+    }
+
+    for(uintn_t i = 0; i < numHandles; i++)
+    {
+        volume_s* volume = volumes + numOfVolumes;
+        memset(volume, 0, sizeof(volume_s));
+        volume->handle = handles[i];
+        status = BS->HandleProtocol(handles[i], &sfsGuid, (void**)&volume->fileSystem);
+        if(EFI_ERROR(status))
+        {
+            continue;
+        }
+        ReadPartitionGuid(volume);
+        numOfVolumes++;
+    }
+    free(handles);
+    volumesScanned = TRUE;
+    Log(LL_INFO, 0, "Found %d volumes", numOfVolumes);
+    return TRUE;
+}
+
+static int32_t FindNamedVolume(const char_t* volumeName)
+{
+    uint8_t guid[GUID_SIZE];
+    if(ParseGuid(volumeName, guid))
+    {
+        for(int32_t i = 0; i < numOfVolumes; i++)
+        {
+            if(volumes[i].hasPartitionGuid && memcmp(volumes[i].partitionGuid, guid, GUID_SIZE) == 0)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+    for(int32_t i = 0; i < numOfVolumes; i++)
+    {
+        const char_t* label = GetVolumeLabel(volumes + i);
+        if(label != NULL && strcmp(label, volumeName) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int32_t ProbeVolumes(const char_t* path)
+{
+    for(int32_t i = 0; i < numOfVolumes; i++)
+    {
+        if(FileExistsOnVolume(volumes + i, path))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+* Open a file for reading on a volume (a handle FindFileVolume returned), NULL if it can't be opened
+* The file is closed with its Close function
+*/
+efi_file_handle_t* OpenVolumeFile(efi_handle_t volumeHandle, const char_t* path)
+{
+    efi_guid_t sfsGuid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    efi_simple_file_system_protocol_t* fileSystem = NULL;
+    if(EFI_ERROR(BS->HandleProtocol(volumeHandle, &sfsGuid, (void**)&fileSystem)))
+    {
+        return NULL;
+    }
+    return OpenFileSystemFile(fileSystem, path);
+}
+
+static efi_file_handle_t* OpenFileSystemFile(efi_simple_file_system_protocol_t* fileSystem, const char_t* path)
+{
+    efi_file_handle_t* rootDir = NULL;
+    efi_status_t status = fileSystem->OpenVolume(fileSystem, &rootDir);
+    if(EFI_ERROR(status))
+    {
+        return NULL;
+    }
+    wchar_t* wpath = StringToWideString((char_t*)path);
+    if(wpath == NULL)
+    {
+        rootDir->Close(rootDir);
+        return NULL;
+    }
+    efi_file_handle_t* fileHandle = NULL;
+    status = rootDir->Open(rootDir, &fileHandle, wpath, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+    free(wpath);
+    rootDir->Close(rootDir);
+    return EFI_ERROR(status) ? NULL : fileHandle;
+}
+
+static boolean_t FileExistsOnVolume(volume_s* volume, const char_t* path)
+{
+    efi_file_handle_t* fileHandle = OpenFileSystemFile(volume->fileSystem, path);
+    if(fileHandle == NULL)
+    {
+        return FALSE;
+    }
+    fileHandle->Close(fileHandle);
+    return TRUE;
+}
+
+// The partition GUID is taken from the hard drive node of the device path (GPT partitions only)
+static void ReadPartitionGuid(volume_s* volume)
+{
+    efi_guid_t devPathGuid = EFI_DEVICE_PATH_PROTOCOL_GUID;
+    efi_device_path_t* devPath = NULL;
+    if(EFI_ERROR(BS->HandleProtocol(volume->handle, &devPathGuid, (void**)&devPath)) || devPath == NULL)
+    {
+        return;
+    }
+    for(; !IsDevicePathEnd(devPath); devPath = NextDevicePathNode(devPath))
+    {
+        uint8_t* node = (uint8_t*)devPath;
+        if(DevicePathType(devPath) == MEDIA_DEVICE_PATH_TYPE && DevicePathSubType(devPath) == MEDIA_HARDDRIVE_SUBTYPE &&
+            DevicePathNodeLength(devPath) > HARDDRIVE_SIGNATURE_TYPE_OFFSET &&
+            node[HARDDRIVE_SIGNATURE_TYPE_OFFSET] == HARDDRIVE_SIGNATURE_TYPE_GUID)
+        {
+            memcpy(volume->partitionGuid, node + HARDDRIVE_SIGNATURE_OFFSET, GUID_SIZE);
+            volume->hasPartitionGuid = TRUE;
+            return;
+        }
+    }
+}
+
+static const char_t* GetVolumeLabel(volume_s* volume)
+{
+    if(volume->labelRead)
+    {
+        return volume->label[0] != CHAR_NULL ? volume->label : NULL;
+    }
+    volume->labelRead = TRUE;
+
+    efi_file_handle_t* rootDir = NULL;
+    if(EFI_ERROR(volume->fileSystem->OpenVolume(volume->fileSystem, &rootDir)))
+    {
+        return NULL;
+    }
+    efi_guid_t labelGuid = EFI_FILE_SYSTEM_VOLUME_LABEL_GUID;
+    wchar_t wlabel[VOLUME_LABEL_LEN] = {0};
+    uintn_t size = sizeof(wlabel) - sizeof(wchar_t); // keep the terminator if the label is cut
+    efi_status_t status = rootDir->GetInfo(rootDir, &labelGuid, &size, wlabel);
+    rootDir->Close(rootDir);
+    if(EFI_ERROR(status) && status != EFI_BUFFER_TOO_SMALL)
+    {
+        return NULL;
+    }
+    wcstombs(volume->label, wlabel, VOLUME_LABEL_LEN);
+    return volume->label[0] != CHAR_NULL ? volume->label : NULL;
+}
+
+/*
+* Parse a GUID string (XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX) to the byte order it has on the disk
+* (the first three fields are little endian)
+*/
+static boolean_t ParseGuid(const char_t* str, uint8_t guid[GUID_SIZE])
+{
+    // Byte of the GUID that every pair of hex digits goes to
+    static const int32_t byteOrder[GUID_SIZE] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    if(strlen(str) != GUID_STRING_LEN)
+    {
+        return FALSE;
+    }
+    int32_t byte = 0;
+    for(int32_t i = 0; i < GUID_STRING_LEN; )
+    {
+        if(i == 8 || i == 13 || i == 18 || i == 23)
+        {
+            if(str[i] != '-')
+            {
+                return FALSE;
+            }
+            i++;
+            continue;
+        }
+        int32_t high = HexDigitValue(str[i]);
+        int32_t low = HexDigitValue(str[i + 1]);
+        if(high < 0 || low < 0)
+        {
+            return FALSE;
+        }
+        guid[byteOrder[byte++]] = (uint8_t)((high << 4) | low);
+        i += 2;
+    }
+    return TRUE;
+}
+
+static int32_t HexDigitValue(char_t c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static void CachePath(const char_t* path, int32_t volume)
+{
+    char_t* pathCopy = strdup(path);
+    if(pathCopy == NULL)
+    {
+        return;
+    }
+    volume_path_s* slot = pathCache + nextPathCacheSlot;
+    free(slot->path);
+    slot->path = pathCopy;
+    slot->volume = volume;
+    nextPathCacheSlot = (nextPathCacheSlot + 1) % VOLUME_PATH_CACHE_SIZE;
+}
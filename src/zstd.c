@@ -0,0 +1,1079 @@
+#include "decoders.h"
+#include "bootutils.h"
+
+// zstd frames (RFC 8878 3.1)
+#define ZSTD_MAGIC (0xFD2FB528)
+#define ZSTD_SKIPPABLE_MAGIC (0x184D2A50)
+#define ZSTD_SKIPPABLE_MASK (0xFFFFFFF0)
+#define ZSTD_MAGIC_SIZE (4)
+#define ZSTD_SKIPPABLE_HEADER_SIZE (8)
+#define ZSTD_BLOCK_HEADER_SIZE (3)
+#define ZSTD_CHECKSUM_SIZE (4)
+#define ZSTD_SIZE_APPEND (4) // the kernel build appends the decompressed size to the frame
+
+#define ZSTD_BLOCK_RAW (0)
+#define ZSTD_BLOCK_RLE (1)
+#define ZSTD_BLOCK_COMPRESSED (2)
+
+#define ZSTD_LITERALS_RAW (0)
+#define ZSTD_LITERALS_RLE (1)
+#define ZSTD_LITERALS_COMPRESSED (2)
+#define ZSTD_LITERALS_TREELESS (3)
+#define ZSTD_JUMP_TABLE_SIZE (6)
+
+#define ZSTD_MODE_PREDEFINED (0)
+#define ZSTD_MODE_RLE (1)
+#define ZSTD_MODE_FSE (2)
+#define ZSTD_MODE_REPEAT (3)
+
+#define ZSTD_MAX_LITLEN_CODE (35)
+#define ZSTD_MAX_MATCHLEN_CODE (52)
+#define ZSTD_MAX_OFFSET_CODE (31)
+#define ZSTD_HUFFMAN_WEIGHT_LOG (6)
+#define ZSTD_MAX_HUFFMAN_SYMBOLS (256)
+
+/*
+* The entropy coded bitstreams are read backwards, from the bit under the end mark of the last byte to the first bit
+* container has the 8 bytes at at, the bits that weren't read are at its top
+* consumed goes past 64 once the stream was overread, the bits past its start read as zeros
+*/
+typedef struct zstd_bits_s{
+    const uint8_t* start;
+    const uint8_t* at;
+    uint64_t container;
+    uint32_t consumed;
+} zstd_bits_s;
+
+typedef struct zstd_frame_header_s{
+    uint64_t size;
+    uint64_t contentSize;
+    boolean_t contentChecksum;
+} zstd_frame_header_s;
+
+// The codes of a sequence field, and their predefined distribution (RFC 8878 3.1.1.3.2.2)
+typedef struct zstd_code_s{
+    const int16_t* defaultCounts;
+    int32_t numOfDefaults;
+    int32_t defaultLog;
+    int32_t maxLog;
+    int32_t maxSymbol;
+} zstd_code_s;
+
+static const int16_t litlenDefaultCounts[36] = { 4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1 };
+static const int16_t matchlenDefaultCounts[53] = { 1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1 };
+static const int16_t offsetDefaultCounts[29] = { 1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, -1, -1, -1, -1, -1 };
+
+static const zstd_code_s litlenCode = { litlenDefaultCounts, 36, 6, ZSTD_LITLEN_MAX_LOG, ZSTD_MAX_LITLEN_CODE };
+static const zstd_code_s matchlenCode = { matchlenDefaultCounts, 53, 6, ZSTD_MATCHLEN_MAX_LOG, ZSTD_MAX_MATCHLEN_CODE };
+static const zstd_code_s offsetCode = { offsetDefaultCounts, 29, 5, ZSTD_OFFSET_MAX_LOG, ZSTD_MAX_OFFSET_CODE };
+
+static const uint32_t litlenBase[ZSTD_MAX_LITLEN_CODE + 1] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536 };
+static const uint8_t litlenExtra[ZSTD_MAX_LITLEN_CODE + 1] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+    1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+static const uint32_t matchlenBase[ZSTD_MAX_MATCHLEN_CODE + 1] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+    17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 37, 39, 41, 43, 47, 51, 59, 67, 83,
+    99, 131, 259, 515, 1027, 2051, 4099, 8195, 16387, 32771, 65539 };
+static const uint8_t matchlenExtra[ZSTD_MAX_MATCHLEN_CODE + 1] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16 };
+
+static decode_status_t ParseFrameHeader(const uint8_t* src, uint64_t size, zstd_frame_header_s* header);
+static boolean_t DecodeCompressedBlock(zstd_state_s* state, const uint8_t* src, uint64_t size,
+    decode_stream_s* stream, uint64_t outputEnd);
+static uint64_t ReadLiterals(zstd_state_s* state, const uint8_t* src, uint64_t size, const uint8_t** literals,
+    uint64_t* numOfLiterals);
+static boolean_t DecodeLiteralStreams(zstd_state_s* state, const uint8_t* src, uint64_t size, uint64_t numOfLiterals,
+    boolean_t fourStreams);
+static boolean_t DecodeHuffmanStream(const zstd_state_s* state, const uint8_t* src, uint64_t size, uint8_t* out,
+    uint64_t count);
+static uint64_t ReadHuffmanTable(zstd_state_s* state, const uint8_t* src, uint64_t size);
+static int32_t DecodeHuffmanWeights(const uint8_t* src, uint64_t size, uint8_t* weights);
+static boolean_t BuildHuffmanTable(zstd_state_s* state, uint8_t* weights, int32_t numOfWeights);
+static boolean_t DecodeSequences(zstd_state_s* state, const uint8_t* src, uint64_t size, const uint8_t* literals,
+    uint64_t numOfLiterals, decode_stream_s* stream, uint64_t outputEnd);
+static boolean_t ReadSequenceTable(zstd_fse_table_s* table, const zstd_code_s* code, uint8_t mode,
+    const uint8_t* src, uint64_t size, uint64_t* pos);
+static uint64_t ResolveOffset(zstd_state_s* state, uint64_t offsetValue, uint64_t litLen);
+static uint64_t ReadFseCounts(const uint8_t* src, uint64_t size, int32_t maxLog, int32_t maxSymbol, int16_t* counts,
+    int32_t* accuracyLog, int32_t* numOfSymbols);
+static boolean_t BuildFseTable(zstd_fse_table_s* table, const int16_t* counts, int32_t numOfSymbols,
+    int32_t accuracyLog);
+
+static boolean_t InitBits(zstd_bits_s* bits, const uint8_t* src, uint64_t size);
+static inline uint64_t PeekBits(const zstd_bits_s* bits, int32_t count);
+static inline uint64_t ReadBits(zstd_bits_s* bits, int32_t count);
+static inline void ReloadBits(zstd_bits_s* bits);
+static inline boolean_t BitsOverflowed(const zstd_bits_s* bits);
+static inline boolean_t BitsFinished(const zstd_bits_s* bits);
+static inline uint32_t ForwardBits(const uint8_t* src, uint64_t size, uint64_t bitPos);
+static inline int32_t HighBit(uint32_t value);
+static inline uint32_t Load32(const uint8_t* at);
+static inline uint64_t Load64(const uint8_t* at);
+
+boolean_t InitZstd(zstd_state_s* state)
+{
+    memset(state, 0, sizeof(zstd_state_s));
+    state->literals = malloc(ZSTD_BLOCK_MAX_SIZE);
+    return state->literals != NULL;
+}
+
+void FreeZstd(zstd_state_s* state)
+{
+    free(state->literals);
+    state->literals = NULL;
+}
+
+/*
+* Decode the blocks of the zstd frames that are in the input
+* Skippable frames are skipped, the stream can end after a frame (or with the size the kernel build appends)
+*/
+decode_status_t ZstdDecode(zstd_state_s* state, decode_stream_s* stream)
+{
+    decode_status_t missing = stream->inputComplete ? DECODE_ERROR : DECODE_NEED_INPUT;
+    while(TRUE)
+    {
+        const uint8_t* at = stream->input + stream->inputPos;
+        uint64_t available = stream->inputSize - stream->inputPos;
+        if(!state->inFrame)
+        {
+            if(state->frameDecoded && available <= ZSTD_SIZE_APPEND)
+            {
+                if(!stream->inputComplete)
+                {
+                    return DECODE_NEED_INPUT;
+                }
+                if(available != 0 && available != ZSTD_SIZE_APPEND)
+                {
+                    return DECODE_ERROR;
+                }
+                stream->inputPos += available;
+                return DECODE_DONE;
+            }
+            if(available < ZSTD_MAGIC_SIZE)
+            {
+                return missing;
+            }
+            if((Load32(at) & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC)
+            {
+                if(available < ZSTD_SKIPPABLE_HEADER_SIZE ||
+                    available - ZSTD_SKIPPABLE_HEADER_SIZE < Load32(at + ZSTD_MAGIC_SIZE))
+                {
+                    return missing;
+                }
+                stream->inputPos += ZSTD_SKIPPABLE_HEADER_SIZE + Load32(at + ZSTD_MAGIC_SIZE);
+                continue;
+            }
+
+            zstd_frame_header_s header;
+            decode_status_t status = ParseFrameHeader(at, available, &header);
+            if(status != DECODE_DONE)
+            {
+                return (status == DECODE_NEED_INPUT) ? missing : status;
+            }
+            state->inFrame = TRUE;
+            state->contentSize = header.contentSize;
+            state->contentChecksum = header.contentChecksum;
+            state->frameStart = stream->outputPos;
+            state->repeatOffsets[0] = 1;
+            state->repeatOffsets[1] = 4;
+            state->repeatOffsets[2] = 8;
+            state->hasHuffman = FALSE;
+            stream->inputPos += header.size;
+            continue;
+        }
+
+        if(state->lastBlock)
+        {
+            uint64_t checksumSize = state->contentChecksum ? ZSTD_CHECKSUM_SIZE : 0;
+            if(available < checksumSize)
+            {
+                return missing;
+            }
+            if(state->contentSize != ZSTD_UNKNOWN_SIZE && stream->outputPos - state->frameStart != state->contentSize)
+            {
+                return DECODE_ERROR;
+            }
+            stream->inputPos += checksumSize;
+            state->inFrame = FALSE;
+            state->lastBlock = FALSE;
+            state->frameDecoded = TRUE;
+            continue;
+        }
+
+        if(available < ZSTD_BLOCK_HEADER_SIZE)
+        {
+            return missing;
+        }
+        uint32_t blockHeader = at[0] | (at[1] << 8) | (at[2] << 16);
+        uint32_t blockType = (blockHeader >> 1) & 3;
+        uint64_t blockSize = blockHeader >> 3;
+        uint64_t inputSize = ZSTD_BLOCK_HEADER_SIZE + ((blockType == ZSTD_BLOCK_RLE) ? 1 : blockSize);
+        if(blockSize > ZSTD_BLOCK_MAX_SIZE)
+        {
+            return DECODE_ERROR;
+        }
+        if(available < inputSize)
+        {
+            return missing;
+        }
+
+        const uint8_t* block = at + ZSTD_BLOCK_HEADER_SIZE;
+        uint64_t outputSpace = stream->outputSize - stream->outputPos;
+        if(blockType == ZSTD_BLOCK_RAW || blockType == ZSTD_BLOCK_RLE)
+        {
+            if(outputSpace < blockSize)
+            {
+                return DECODE_NEED_OUTPUT;
+            }
+            if(blockType == ZSTD_BLOCK_RAW)
+            {
+                memcpy(stream->output + stream->outputPos, block, blockSize);
+            }
+            else
+            {
+                memset(stream->output + stream->outputPos, block[0], blockSize);
+            }
+            stream->outputPos += blockSize;
+        }
+        else if(blockType == ZSTD_BLOCK_COMPRESSED)
+        {
+            // the output of a block isn't in its header, it is at most a full block (or what is left of the frame)
+            uint64_t maxOutput = ZSTD_BLOCK_MAX_SIZE;
+            if(state->contentSize != ZSTD_UNKNOWN_SIZE)
+            {
+                uint64_t written = stream->outputPos - state->frameStart;
+                if(written > state->contentSize)
+                {
+                    return DECODE_ERROR;
+                }
+                if(state->contentSize - written < maxOutput)
+                {
+                    maxOutput = state->contentSize - written;
+                }
+            }
+            if(outputSpace < maxOutput)
+            {
+                return DECODE_NEED_OUTPUT;
+            }
+            if(!DecodeCompressedBlock(state, block, blockSize, stream, stream->outputPos + maxOutput))
+            {
+                return DECODE_ERROR;
+            }
+        }
+        else
+        {
+            return DECODE_ERROR;
+        }
+        stream->inputPos += inputSize;
+        state->lastBlock = blockHeader & 1;
+    }
+}
+
+// The decompressed size from the frame header, 0 if it isn't there
+uint64_t GetZstdSize(const uint8_t* input, uint64_t inputSize)
+{
+    zstd_frame_header_s header;
+    if(ParseFrameHeader(input, inputSize, &header) != DECODE_DONE || header.contentSize == ZSTD_UNKNOWN_SIZE)
+    {
+        return 0;
+    }
+    return header.contentSize;
+}
+
+// DECODE_NEED_INPUT if the header isn't all in src
+static decode_status_t ParseFrameHeader(const uint8_t* src, uint64_t size, zstd_frame_header_s* header)
+{
+    static const uint8_t dictIdSizes[4] = { 0, 1, 2, 4 };
+    static const uint8_t contentSizeSizes[4] = { 0, 2, 4, 8 };
+    if(size < ZSTD_MAGIC_SIZE + 1)
+    {
+        return DECODE_NEED_INPUT;
+    }
+    if(Load32(src) != ZSTD_MAGIC)
+    {
+        return DECODE_ERROR;
+    }
+    uint8_t descriptor = src[ZSTD_MAGIC_SIZE];
+    uint8_t sizeFlag = descriptor >> 6;
+    boolean_t singleSegment = (descriptor >> 5) & 1;
+    uint8_t dictIdFlag = descriptor & 3;
+    if(descriptor & (1 << 3))
+    {
+        return DECODE_ERROR;
+    }
+    // the window descriptor is only there without the single segment flag, the output is flat here anyway
+    uint64_t at = ZSTD_MAGIC_SIZE + 1 + (singleSegment ? 0 : 1);
+    uint64_t contentSizeSize = (sizeFlag == 0 && singleSegment) ? 1 : contentSizeSizes[sizeFlag];
+    header->size = at + dictIdSizes[dictIdFlag] + contentSizeSize;
+    if(size < header->size)
+    {
+        return DECODE_NEED_INPUT;
+    }
+    uint32_t dictId = 0;
+    memcpy(&dictId, src + at, dictIdSizes[dictIdFlag]);
+    if(dictId != 0)
+    {
+        return DECODE_ERROR;
+    }
+    at += dictIdSizes[dictIdFlag];
+
+    header->contentSize = ZSTD_UNKNOWN_SIZE;
+    if(contentSizeSize != 0)
+    {
+        header->contentSize = 0;
+        memcpy(&header->contentSize, src + at, contentSizeSize);
+        if(contentSizeSize == 2)
+        {
+            header->contentSize += 256;
+        }
+    }
+    header->contentChecksum = (descriptor >> 2) & 1;
+    return DECODE_DONE;
+}
+
+// The literals, then the sequences that interleave them with matches, FALSE if the block is corrupt
+static boolean_t DecodeCompressedBlock(zstd_state_s* state, const uint8_t* src, uint64_t size,
+    decode_stream_s* stream, uint64_t outputEnd)
+{
+    const uint8_t* literals = NULL;
+    uint64_t numOfLiterals = 0;
+    uint64_t literalsSize = ReadLiterals(state, src, size, &literals, &numOfLiterals);
+    if(literalsSize == 0)
+    {
+        return FALSE;
+    }
+    return DecodeSequences(state, src + literalsSize, size - literalsSize, literals, numOfLiterals, stream,
+        outputEnd);
+}
+
+// Read the literals section of a block (RFC 8878 3.1.1.3.1), the number of bytes it took or 0
+static uint64_t ReadLiterals(zstd_state_s* state, const uint8_t* src, uint64_t size, const uint8_t** literals,
+    uint64_t* numOfLiterals)
+{
+    if(size == 0)
+    {
+        return 0;
+    }
+    uint8_t type = src[0] & 3;
+    uint8_t sizeFormat = (src[0] >> 2) & 3;
+    if(type == ZSTD_LITERALS_RAW || type == ZSTD_LITERALS_RLE)
+    {
+        uint64_t headerSize = (sizeFormat == 1) ? 2 : ((sizeFormat == 3) ? 3 : 1);
+        if(size < headerSize)
+        {
+            return 0;
+        }
+        uint64_t regenerated = src[0] >> 3;
+        if(headerSize == 2)
+        {
+            regenerated = (src[0] >> 4) + (src[1] << 4);
+        }
+        else if(headerSize == 3)
+        {
+            regenerated = (src[0] >> 4) + (src[1] << 4) + (src[2] << 12);
+        }
+        if(regenerated > ZSTD_BLOCK_MAX_SIZE)
+        {
+            return 0;
+        }
+        *numOfLiterals = regenerated;
+        if(type == ZSTD_LITERALS_RAW)
+        {
+            // the literals are used straight from the input
+            if(size - headerSize < regenerated)
+            {
+                return 0;
+            }
+            *literals = src + headerSize;
+            return headerSize + regenerated;
+        }
+        if(size - headerSize < 1)
+        {
+            return 0;
+        }
+        memset(state->literals, src[headerSize], regenerated);
+        *literals = state->literals;
+        return headerSize + 1;
+    }
+
+    // huffman coded, in one stream or in four
+    uint64_t headerSize = (sizeFormat < 2) ? 3 : sizeFormat + 2;
+    uint64_t sizeBits = (sizeFormat < 2) ? 10 : ((sizeFormat == 2) ? 14 : 18);
+    if(size < headerSize)
+    {
+        return 0;
+    }
+    uint64_t header = 0;
+    memcpy(&header, src, headerSize);
+    uint64_t regenerated = (header >> 4) & ((1 << sizeBits) - 1);
+    uint64_t compressed = (header >> (4 + sizeBits)) & ((1 << sizeBits) - 1);
+    if(regenerated > ZSTD_BLOCK_MAX_SIZE || compressed > size - headerSize)
+    {
+        return 0;
+    }
+    const uint8_t* streams = src + headerSize;
+    uint64_t streamsSize = compressed;
+    if(type == ZSTD_LITERALS_COMPRESSED)
+    {
+        uint64_t tableSize = ReadHuffmanTable(state, streams, streamsSize);
+        if(tableSize == 0)
+        {
+            return 0;
+        }
+        streams += tableSize;
+        streamsSize -= tableSize;
+    }
+    else if(!state->hasHuffman)
+    {
+        return 0;
+    }
+    if(!DecodeLiteralStreams(state, streams, streamsSize, regenerated, sizeFormat != 0))
+    {
+        return 0;
+    }
+    *literals = state->literals;
+    *numOfLiterals = regenerated;
+    return headerSize + compressed;
+}
+
+// Four streams start with a jump table of the sizes of the first three, each has a quarter of the literals
+static boolean_t DecodeLiteralStreams(zstd_state_s* state, const uint8_t* src, uint64_t size, uint64_t numOfLiterals,
+    boolean_t fourStreams)
+{
+    if(!fourStreams)
+    {
+        return DecodeHuffmanStream(state, src, size, state->literals, numOfLiterals);
+    }
+    if(size < ZSTD_JUMP_TABLE_SIZE)
+    {
+        return FALSE;
+    }
+    uint64_t sizes[4];
+    uint64_t total = 0;
+    for(int32_t i = 0; i < 3; i++)
+    {
+        sizes[i] = src[i * 2] | (src[i * 2 + 1] << 8);
+        total += sizes[i];
+    }
+    if(total > size - ZSTD_JUMP_TABLE_SIZE)
+    {
+        return FALSE;
+    }
+    sizes[3] = size - ZSTD_JUMP_TABLE_SIZE - total;
+    uint64_t segment = (numOfLiterals + 3) / 4;
+    if(segment * 3 > numOfLiterals)
+    {
+        return FALSE;
+    }
+
+    const uint8_t* stream = src + ZSTD_JUMP_TABLE_SIZE;
+    uint8_t* out = state->literals;
+    for(int32_t i = 0; i < 4; i++)
+    {
+        uint64_t count = (i < 3) ? segment : numOfLiterals - segment * 3;
+        if(!DecodeHuffmanStream(state, stream, sizes[i], out, count))
+        {
+            return FALSE;
+        }
+        stream += sizes[i];
+        out += count;
+    }
+    return TRUE;
+}
+
+// The stream has to end exactly with the last symbol
+static boolean_t DecodeHuffmanStream(const zstd_state_s* state, const uint8_t* src, uint64_t size, uint8_t* out,
+    uint64_t count)
+{
+    zstd_bits_s bits;
+    if(!InitBits(&bits, src, size))
+    {
+        return FALSE;
+    }
+    int32_t maxBits = state->huffmanBits;
+    uint64_t i = 0;
+    // four symbols take at most 44 bits, the container has at least 57 after a reload
+    while(count - i >= 4)
+    {
+        for(int32_t j = 0; j < 4; j++)
+        {
+            uint16_t entry = state->huffmanTable[PeekBits(&bits, maxBits)];
+            out[i++] = entry >> 8;
+            bits.consumed += entry & 0xff;
+        }
+        ReloadBits(&bits);
+    }
+    while(i < count)
+    {
+        uint16_t entry = state->huffmanTable[PeekBits(&bits, maxBits)];
+        out[i++] = entry >> 8;
+        bits.consumed += entry & 0xff;
+        ReloadBits(&bits);
+    }
+    return BitsFinished(&bits);
+}
+
+/*
+* Read the huffman tree description of the literals (RFC 8878 4.2.1), the number of bytes it took or 0
+* The weights are FSE compressed, or 4 bits each, the weight of the last symbol is implied
+*/
+static uint64_t ReadHuffmanTable(zstd_state_s* state, const uint8_t* src, uint64_t size)
+{
+    uint8_t weights[ZSTD_MAX_HUFFMAN_SYMBOLS];
+    int32_t numOfWeights = 0;
+    uint64_t used = 0;
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(src[0] < 128)
+    {
+        used = 1 + src[0];
+        if(used > size)
+        {
+            return 0;
+        }
+        numOfWeights = DecodeHuffmanWeights(src + 1, src[0], weights);
+        if(numOfWeights <= 0)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        numOfWeights = src[0] - 127;
+        used = 1 + (numOfWeights + 1) / 2;
+        if(used > size)
+        {
+            return 0;
+        }
+        for(int32_t i = 0; i < numOfWeights; i++)
+        {
+            uint8_t byte = src[1 + i / 2];
+            weights[i] = (i & 1) ? (byte & 15) : (byte >> 4);
+        }
+    }
+    return BuildHuffmanTable(state, weights, numOfWeights) ? used : 0;
+}
+
+// The weights are decoded with two interleaved FSE states, until the bitstream was overread, -1 if it is corrupt
+static int32_t DecodeHuffmanWeights(const uint8_t* src, uint64_t size, uint8_t* weights)
+{
+    int16_t counts[ZSTD_MAX_HUFFMAN_SYMBOLS];
+    zstd_fse_table_s table;
+    int32_t accuracyLog = 0;
+    int32_t numOfSymbols = 0;
+    uint64_t descriptionSize = ReadFseCounts(src, size, ZSTD_HUFFMAN_WEIGHT_LOG, ZSTD_MAX_HUFFMAN_SYMBOLS - 1,
+        counts, &accuracyLog, &numOfSymbols);
+    if(descriptionSize == 0 || !BuildFseTable(&table, counts, numOfSymbols, accuracyLog))
+    {
+        return -1;
+    }
+    zstd_bits_s bits;
+    if(!InitBits(&bits, src + descriptionSize, size - descriptionSize))
+    {
+        return -1;
+    }
+    uint32_t states[2];
+    states[0] = (uint32_t)ReadBits(&bits, accuracyLog);
+    states[1] = (uint32_t)ReadBits(&bits, accuracyLog);
+    ReloadBits(&bits);
+
+    int32_t numOfWeights = 0;
+    int32_t current = 0;
+    while(TRUE)
+    {
+        // the weight of the last symbol is implied
+        if(numOfWeights == ZSTD_MAX_HUFFMAN_SYMBOLS - 1)
+        {
+            return -1;
+        }
+        zstd_fse_entry_s entry = table.entries[states[current]];
+        weights[numOfWeights++] = entry.symbol;
+        states[current] = entry.newState + (uint32_t)ReadBits(&bits, entry.numOfBits);
+        ReloadBits(&bits);
+        current ^= 1;
+        if(BitsOverflowed(&bits))
+        {
+            if(numOfWeights == ZSTD_MAX_HUFFMAN_SYMBOLS - 1)
+            {
+                return -1;
+            }
+            weights[numOfWeights++] = table.entries[states[current]].symbol;
+            return numOfWeights;
+        }
+    }
+}
+
+/*
+* The table is indexed by the next huffmanBits bits of the stream
+* The codes of the lowest weights come first, in the order of their symbols (RFC 8878 4.2.1.3)
+*/
+static boolean_t BuildHuffmanTable(zstd_state_s* state, uint8_t* weights, int32_t numOfWeights)
+{
+    uint32_t weightSum = 0;
+    for(int32_t i = 0; i < numOfWeights; i++)
+    {
+        if(weights[i] > ZSTD_MAX_HUFFMAN_BITS)
+        {
+            return FALSE;
+        }
+        weightSum += weights[i] ? (1 << (weights[i] - 1)) : 0;
+    }
+    if(weightSum == 0)
+    {
+        return FALSE;
+    }
+    int32_t maxBits = HighBit(weightSum) + 1;
+    uint32_t left = (1 << maxBits) - weightSum;
+    if(maxBits > ZSTD_MAX_HUFFMAN_BITS || (left & (left - 1)) != 0)
+    {
+        return FALSE;
+    }
+    weights[numOfWeights] = (uint8_t)(HighBit(left) + 1);
+    int32_t numOfSymbols = numOfWeights + 1;
+
+    uint32_t position = 0;
+    for(int32_t weight = 1; weight <= maxBits; weight++)
+    {
+        for(int32_t symbol = 0; symbol < numOfSymbols; symbol++)
+        {
+            if(weights[symbol] != weight)
+            {
+                continue;
+            }
+            uint16_t entry = (uint16_t)((symbol << 8) | (maxBits + 1 - weight));
+            for(uint32_t i = 0; i < (1U << (weight - 1)); i++)
+            {
+                state->huffmanTable[position++] = entry;
+            }
+        }
+    }
+    state->huffmanBits = maxBits;
+    state->hasHuffman = TRUE;
+    return position == (1U << maxBits);
+}
+
+/*
+* Execute the sequences of a block (RFC 8878 3.1.1.3.2): copy their literals, then their match
+* The literals that are left after the last sequence are copied at the end
+*/
+static boolean_t DecodeSequences(zstd_state_s* state, const uint8_t* src, uint64_t size, const uint8_t* literals,
+    uint64_t numOfLiterals, decode_stream_s* stream, uint64_t outputEnd)
+{
+    if(size == 0)
+    {
+        return FALSE;
+    }
+    uint64_t numOfSequences = src[0];
+    uint64_t pos = 1;
+    if(src[0] == 255)
+    {
+        if(size < 3)
+        {
+            return FALSE;
+        }
+        numOfSequences = src[1] + (src[2] << 8) + 0x7f00;
+        pos = 3;
+    }
+    else if(src[0] >= 128)
+    {
+        if(size < 2)
+        {
+            return FALSE;
+        }
+        numOfSequences = ((src[0] - 128) << 8) + src[1];
+        pos = 2;
+    }
+
+    uint8_t* output = stream->output;
+    uint64_t outputPos = stream->outputPos;
+    const uint8_t* literalsEnd = literals + numOfLiterals;
+    if(numOfSequences != 0)
+    {
+        if(pos >= size)
+        {
+            return FALSE;
+        }
+        uint8_t modes = src[pos++];
+        if((modes & 3) != 0 ||
+            !ReadSequenceTable(&state->litlenTable, &litlenCode, modes >> 6, src, size, &pos) ||
+            !ReadSequenceTable(&state->offsetTable, &offsetCode, (modes >> 4) & 3, src, size, &pos) ||
+            !ReadSequenceTable(&state->matchlenTable, &matchlenCode, (modes >> 2) & 3, src, size, &pos))
+        {
+            return FALSE;
+        }
+
+        zstd_bits_s bits;
+        if(!InitBits(&bits, src + pos, size - pos))
+        {
+            return FALSE;
+        }
+        uint32_t litlenState = (uint32_t)ReadBits(&bits, state->litlenTable.accuracyLog);
+        uint32_t offsetState = (uint32_t)ReadBits(&bits, state->offsetTable.accuracyLog);
+        uint32_t matchlenState = (uint32_t)ReadBits(&bits, state->matchlenTable.accuracyLog);
+        ReloadBits(&bits);
+
+        for(uint64_t i = 0; i < numOfSequences; i++)
+        {
+            zstd_fse_entry_s litlen = state->litlenTable.entries[litlenState];
+            zstd_fse_entry_s offset = state->offsetTable.entries[offsetState];
+            zstd_fse_entry_s matchlen = state->matchlenTable.entries[matchlenState];
+            if(litlen.symbol > ZSTD_MAX_LITLEN_CODE || matchlen.symbol > ZSTD_MAX_MATCHLEN_CODE ||
+                offset.symbol > ZSTD_MAX_OFFSET_CODE)
+            {
+                return FALSE;
+            }
+            // the offset takes up to 31 bits, the lengths up to 32 together
+            uint64_t offsetValue = (1ULL << offset.symbol) + ReadBits(&bits, offset.symbol);
+            ReloadBits(&bits);
+            uint64_t matchLen = matchlenBase[matchlen.symbol] + ReadBits(&bits, matchlenExtra[matchlen.symbol]);
+            uint64_t litLen = litlenBase[litlen.symbol] + ReadBits(&bits, litlenExtra[litlen.symbol]);
+            ReloadBits(&bits);
+
+            uint64_t distance = ResolveOffset(state, offsetValue, litLen);
+            if(litLen > (uint64_t)(literalsEnd - literals) || litLen > outputEnd - outputPos)
+            {
+                return FALSE;
+            }
+            memcpy(output + outputPos, literals, litLen);
+            literals += litLen;
+            outputPos += litLen;
+            if(distance == 0 || distance > outputPos - state->frameStart || matchLen > outputEnd - outputPos)
+            {
+                return FALSE;
+            }
+            CopyMatch(output + outputPos, distance, matchLen);
+            outputPos += matchLen;
+
+            if(i + 1 < numOfSequences)
+            {
+                litlenState = litlen.newState + (uint32_t)ReadBits(&bits, litlen.numOfBits);
+                matchlenState = matchlen.newState + (uint32_t)ReadBits(&bits, matchlen.numOfBits);
+                offsetState = offset.newState + (uint32_t)ReadBits(&bits, offset.numOfBits);
+                ReloadBits(&bits);
+            }
+        }
+        if(!BitsFinished(&bits))
+        {
+            return FALSE;
+        }
+    }
+
+    uint64_t lastLiterals = literalsEnd - literals;
+    if(lastLiterals > outputEnd - outputPos)
+    {
+        return FALSE;
+    }
+    memcpy(output + outputPos, literals, lastLiterals);
+    stream->outputPos = outputPos + lastLiterals;
+    return TRUE;
+}
+
+// The table of one of the sequence fields, the repeat mode keeps the table of the previous block
+static boolean_t ReadSequenceTable(zstd_fse_table_s* table, const zstd_code_s* code, uint8_t mode,
+    const uint8_t* src, uint64_t size, uint64_t* pos)
+{
+    int16_t counts[ZSTD_MAX_MATCHLEN_CODE + 1];
+    int32_t accuracyLog = 0;
+    int32_t numOfSymbols = 0;
+    switch (mode)
+    {
+    case ZSTD_MODE_PREDEFINED:
+        return BuildFseTable(table, code->defaultCounts, code->numOfDefaults, code->defaultLog);
+    case ZSTD_MODE_RLE:
+        if(*pos >= size || src[*pos] > code->maxSymbol)
+        {
+            return FALSE;
+        }
+        table->entries[0].symbol = src[(*pos)++];
+        table->entries[0].numOfBits = 0;
+        table->entries[0].newState = 0;
+        table->accuracyLog = 0;
+        return TRUE;
+    case ZSTD_MODE_FSE:
+    {
+        uint64_t used = ReadFseCounts(src + *pos, size - *pos, code->maxLog, code->maxSymbol, counts, &accuracyLog,
+            &numOfSymbols);
+        if(used == 0)
+        {
+            return FALSE;
+        }
+        *pos += used;
+        return BuildFseTable(table, counts, numOfSymbols, accuracyLog);
+    }
+    default:
+        return TRUE;
+    }
+}
+
+// An offset value of 1 to 3 picks one of the repeated offsets, shifted by one when the sequence has no literals
+static uint64_t ResolveOffset(zstd_state_s* state, uint64_t offsetValue, uint64_t litLen)
+{
+    uint32_t* repeat = state->repeatOffsets;
+    if(offsetValue > 3)
+    {
+        repeat[2] = repeat[1];
+        repeat[1] = repeat[0];
+        repeat[0] = (uint32_t)(offsetValue - 3);
+        return repeat[0];
+    }
+    uint64_t index = offsetValue - 1 + (litLen == 0);
+    if(index == 0)
+    {
+        return repeat[0];
+    }
+    uint32_t offset = (index == 3) ? repeat[0] - 1 : repeat[index];
+    if(index != 1)
+    {
+        repeat[2] = repeat[1];
+    }
+    repeat[1] = repeat[0];
+    repeat[0] = offset;
+    return offset;
+}
+
+/*
+* Read an FSE table description (RFC 8878 4.1.1), the number of bytes it took or 0
+* The counts are read forwards, a count of -1 is a symbol with less than one slot
+*/
+static uint64_t ReadFseCounts(const uint8_t* src, uint64_t size, int32_t maxLog, int32_t maxSymbol, int16_t* counts,
+    int32_t* accuracyLog, int32_t* numOfSymbols)
+{
+    if(size == 0)
+    {
+        return 0;
+    }
+    int32_t log = (src[0] & 15) + 5;
+    if(log > maxLog)
+    {
+        return 0;
+    }
+    uint64_t bitPos = 4;
+    int32_t remaining = (1 << log) + 1;
+    int32_t threshold = 1 << log;
+    int32_t numOfBits = log + 1;
+    int32_t symbol = 0;
+    boolean_t previousZero = FALSE;
+    while(remaining > 1 && symbol <= maxSymbol)
+    {
+        if(previousZero)
+        {
+            // runs of zero counts are 2 bit repeat flags, 3 means another flag follows
+            uint32_t repeat;
+            do
+            {
+                repeat = ForwardBits(src, size, bitPos) & 3;
+                bitPos += 2;
+                if(symbol + (int32_t)repeat > maxSymbol + 1)
+                {
+                    return 0;
+                }
+                for(uint32_t i = 0; i < repeat; i++)
+                {
+                    counts[symbol++] = 0;
+                }
+            } while(repeat == 3);
+            if(symbol > maxSymbol)
+            {
+                return 0;
+            }
+        }
+
+        uint32_t value = ForwardBits(src, size, bitPos);
+        int32_t max = (2 * threshold - 1) - remaining;
+        int32_t count;
+        if((int32_t)(value & (threshold - 1)) < max)
+        {
+            count = value & (threshold - 1);
+            bitPos += numOfBits - 1;
+        }
+        else
+        {
+            count = value & (2 * threshold - 1);
+            if(count >= threshold)
+            {
+                count -= max;
+            }
+            bitPos += numOfBits;
+        }
+        count--;
+        remaining -= (count < 0) ? -count : count;
+        counts[symbol++] = (int16_t)count;
+        previousZero = (count == 0);
+        if(remaining < 1)
+        {
+            return 0;
+        }
+        while(remaining < threshold)
+        {
+            numOfBits--;
+            threshold >>= 1;
+        }
+    }
+    if(remaining != 1 || bitPos > size * 8)
+    {
+        return 0;
+    }
+    *accuracyLog = log;
+    *numOfSymbols = symbol;
+    return (bitPos + 7) / 8;
+}
+
+/*
+* Spread the symbols over the states, the symbols of a -1 count take the last states
+* Each state then gets the bits to read and the base of the next state
+*/
+static boolean_t BuildFseTable(zstd_fse_table_s* table, const int16_t* counts, int32_t numOfSymbols,
+    int32_t accuracyLog)
+{
+    uint16_t next[ZSTD_MAX_HUFFMAN_SYMBOLS];
+    uint32_t size = 1 << accuracyLog;
+    uint32_t mask = size - 1;
+    uint32_t highThreshold = size - 1;
+    for(int32_t symbol = 0; symbol < numOfSymbols; symbol++)
+    {
+        if(counts[symbol] == -1)
+        {
+            table->entries[highThreshold--].symbol = (uint8_t)symbol;
+            next[symbol] = 1;
+        }
+        else
+        {
+            next[symbol] = (uint16_t)counts[symbol];
+        }
+    }
+
+    uint32_t step = (size >> 1) + (size >> 3) + 3;
+    uint32_t position = 0;
+    for(int32_t symbol = 0; symbol < numOfSymbols; symbol++)
+    {
+        for(int32_t i = 0; i < counts[symbol]; i++)
+        {
+            table->entries[position].symbol = (uint8_t)symbol;
+            do
+            {
+                position = (position + step) & mask;
+            } while(position > highThreshold);
+        }
+    }
+    if(position != 0)
+    {
+        return FALSE;
+    }
+
+    for(uint32_t state = 0; state < size; state++)
+    {
+        zstd_fse_entry_s* entry = &table->entries[state];
+        uint32_t nextState = next[entry->symbol]++;
+        int32_t numOfBits = accuracyLog - HighBit(nextState);
+        entry->numOfBits = (uint8_t)numOfBits;
+        entry->newState = (uint16_t)((nextState << numOfBits) - size);
+    }
+    table->accuracyLog = accuracyLog;
+    return TRUE;
+}
+
+// The last byte has the end mark, the highest set bit, FALSE if there isn't one
+static boolean_t InitBits(zstd_bits_s* bits, const uint8_t* src, uint64_t size)
+{
+    if(size == 0 || src[size - 1] == 0)
+    {
+        return FALSE;
+    }
+    bits->start = src;
+    if(size >= sizeof(uint64_t))
+    {
+        bits->at = src + size - sizeof(uint64_t);
+        bits->container = Load64(bits->at);
+        bits->consumed = 0;
+    }
+    else
+    {
+        // a short stream is at the bottom of the container, the empty bytes count as read
+        bits->at = src;
+        bits->container = 0;
+        memcpy(&bits->container, src, size);
+        bits->consumed = (uint32_t)(sizeof(uint64_t) - size) * 8;
+    }
+    bits->consumed += 8 - HighBit(src[size - 1]);
+    return TRUE;
+}
+
+static inline uint64_t PeekBits(const zstd_bits_s* bits, int32_t count)
+{
+    if(bits->consumed >= 64)
+    {
+        return 0;
+    }
+    return ((bits->container << bits->consumed) >> 1) >> (63 - count);
+}
+
+static inline uint64_t ReadBits(zstd_bits_s* bits, int32_t count)
+{
+    uint64_t value = PeekBits(bits, count);
+    bits->consumed += count;
+    return value;
+}
+
+// Move the container back by the whole bytes that were read, it has at least 57 bits to read after this
+static inline void ReloadBits(zstd_bits_s* bits)
+{
+    uint64_t bytes = bits->consumed >> 3;
+    if(bytes > (uint64_t)(bits->at - bits->start))
+    {
+        bytes = bits->at - bits->start;
+    }
+    if(bytes == 0)
+    {
+        return;
+    }
+    bits->at -= bytes;
+    bits->consumed -= (uint32_t)bytes * 8;
+    bits->container = Load64(bits->at);
+}
+
+static inline boolean_t BitsOverflowed(const zstd_bits_s* bits)
+{
+    return bits->consumed > 64;
+}
+
+static inline boolean_t BitsFinished(const zstd_bits_s* bits)
+{
+    return bits->at == bits->start && bits->consumed == 64;
+}
+
+// The 32 bits from bitPos of a forward bitstream, zeros past its end
+static inline uint32_t ForwardBits(const uint8_t* src, uint64_t size, uint64_t bitPos)
+{
+    uint64_t value = 0;
+    uint64_t byte = bitPos >> 3;
+    for(uint64_t i = 0; i < 5 && byte + i < size; i++)
+    {
+        value |= (uint64_t)src[byte + i] << (i * 8);
+    }
+    return (uint32_t)(value >> (bitPos & 7));
+}
+
+static inline int32_t HighBit(uint32_t value)
+{
+    return 31 - __builtin_clz(value);
+}
+
+static inline uint32_t Load32(const uint8_t* at)
+{
+    uint32_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static inline uint64_t Load64(const uint8_t* at)
+{
+    uint64_t value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}